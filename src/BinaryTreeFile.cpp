@@ -12,7 +12,9 @@
 // ==========================================
 namespace {
     constexpr char FILE_MAGIC[4] = {'T','R','E','E'}; // NOSONAR
-    constexpr std::uint32_t FILE_VERSION = 1;
+    // v2: lineCount листа — число '\n' (в v1 хранилось '\n' + 1)
+    constexpr std::uint32_t FILE_VERSION = 2;
+    constexpr std::uint32_t FILE_VERSION_V1 = 1;
     constexpr std::int64_t OFFSET_NONE = -1;
 }
 
@@ -51,7 +53,7 @@ bool BinaryTreeFile::openFile(const char* filename) {
 
 // --- Сохранение ---
 
-std::int64_t BinaryTreeFile::writeNodeRecursive(Node* node) {
+std::int64_t BinaryTreeFile::writeNodeRecursive(const Tree& tree, Node* node) {
     if (!node) return OFFSET_NONE;
 
     // Сначала рекурсивно сохраняем детей (Post-order traversal)
@@ -60,8 +62,8 @@ std::int64_t BinaryTreeFile::writeNodeRecursive(Node* node) {
 
     if (node->getType() == NodeType::NODE_INTERNAL) {
         auto inner = static_cast<InternalNode*>(node);
-        leftOff = writeNodeRecursive(inner->left);
-        rightOff = writeNodeRecursive(inner->right);
+        leftOff = writeNodeRecursive(tree, inner->left);
+        rightOff = writeNodeRecursive(tree, inner->right);
     }
 
     // Запоминаем текущую позицию для смещения
@@ -85,7 +87,7 @@ std::int64_t BinaryTreeFile::writeNodeRecursive(Node* node) {
 
         // payload (raw bytes)
         if (leaf->length > 0) {
-            write(leaf->data, leaf->length);
+            write(tree.leafBytes(leaf), leaf->length); // сжатый лист пишется распакованным
             if (!good()) throw BinaryTreeFileError("I/O error writing leaf data");
         }
     } else {
@@ -121,7 +123,7 @@ void BinaryTreeFile::saveTree(const Tree& tree) {
     write_le_int64(OFFSET_NONE);
 
     // Пишем узлы (post-order), получаем смещение корня
-    std::int64_t rootOffset = writeNodeRecursive(tree.getRoot());
+    std::int64_t rootOffset = writeNodeRecursive(tree, tree.getRoot());
 
     // Обновляем реальный rootOffset в заголовок
     seekp(4 + 4, std::ios::beg); // magic(4) + version(4)
@@ -167,8 +169,9 @@ Node* BinaryTreeFile::readLeafNodeAt(std::int64_t offset, std::int64_t fileSize)
     // Создаём лист — предполагается, что конструктор LeafNode копирует буфер
     LeafNode* leaf = new LeafNode(buf, len); // NOSONAR
 
-    // Устанавливаем явно сохранённый lineCount (перезапишет, если конструктор сам считал)
-    leaf->lineCount = lines;
+    // Устанавливаем явно сохранённый lineCount (перезапишет, если конструктор сам считал).
+    // Для файлов v1 оставляем посчитанное конструктором — там хранилось '\n' + 1.
+    if (m_loadedVersion != FILE_VERSION_V1) leaf->lineCount = lines;
 
     // Освобождаем временный буфер (если он был скопирован в LeafNode)
     if (buf) { delete[] buf; buf = nullptr; } //NOSONAR
@@ -249,7 +252,8 @@ void BinaryTreeFile::loadTree(Tree& tree) {
     if (std::memcmp(magic, FILE_MAGIC, 4) != 0) 
         throw BinaryTreeFileError("Bad file magic - not a tree file");
 
-    if (read_le_uint32() != FILE_VERSION) 
+    m_loadedVersion = read_le_uint32();
+    if (m_loadedVersion != FILE_VERSION && m_loadedVersion != FILE_VERSION_V1)
         throw BinaryTreeFileError("Unsupported file version");
 
     std::int64_t rootOffset = read_le_int64();
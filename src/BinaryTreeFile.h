@@ -8,7 +8,7 @@
 // Формат узла (leaf):
 // [1 byte type == NODE_LEAF]
 // [int32 length]        -- количество байт данных
-// [int32 lineCount]     -- целый счётчик (кол-во строк / кэш)
+// [int32 lineCount]     -- количество '\n' в листе (v2; в v1 было '\n' + 1)
 // [length bytes]        -- данные (без '\0')
 //
 // Формат internal:
@@ -24,9 +24,11 @@ class BinaryTreeFile : public std::fstream {
 private:
     // Имя файла, чтобы можно было усечь/переоткрыть при сохранении
     std::string m_filename; 
+    // Версия формата загружаемого файла (v1 читается с пересчётом lineCount)
+    std::uint32_t m_loadedVersion = 0;
 
     // Рекурсивные методы I/O, работающие с узлами (Node*)
-    std::int64_t  writeNodeRecursive(Node* node);
+    std::int64_t  writeNodeRecursive(const Tree& tree, Node* node);
 
     Node* readLeafNodeAt(std::int64_t offset, std::int64_t fileSize);
     Node* readInternalNodeAt(std::int64_t offset, std::int64_t fileSize);
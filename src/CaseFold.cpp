@@ -0,0 +1,111 @@
+#include "CaseFold.h"
+#include <algorithm>
+#include <utility>
+
+namespace {
+    // Пары «заглавная на чётной позиции, строчная — следующая»
+    inline std::uint32_t evenUpper(std::uint32_t cp) { return cp | 1u; }
+    // Пары «заглавная на нечётной позиции»
+    inline std::uint32_t oddUpper(std::uint32_t cp) { return (cp & 1u) ? cp + 1 : cp; }
+
+    // Блоки, где вообще бывает регистр: по ним строится обратная таблица
+    const std::pair<std::uint32_t, std::uint32_t> CASED_BLOCKS[] = {
+        {0x41, 0x5A}, {0x61, 0x7A}, {0xB5, 0xB5}, {0xC0, 0x24F}, {0x370, 0x3FF},
+        {0x400, 0x52F}, {0x531, 0x586}, {0x1E00, 0x1EFF}, {0x2126, 0x2126},
+        {0x212A, 0x212B}, {0xFF21, 0xFF3A}, {0xFF41, 0xFF5A},
+    };
+
+    // (свёртка, кодовая точка) по возрастанию свёртки
+    const std::vector<std::pair<std::uint32_t, std::uint32_t>>& foldIndex() {
+        static const std::vector<std::pair<std::uint32_t, std::uint32_t>> index = [] {
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> v;
+            for (const auto& [lo, hi] : CASED_BLOCKS) {
+                for (std::uint32_t cp = lo; cp <= hi; ++cp) v.emplace_back(CaseFold::fold(cp), cp);
+            }
+            std::sort(v.begin(), v.end());
+            return v;
+        }();
+        return index;
+    }
+}
+
+std::uint32_t CaseFold::fold(std::uint32_t cp) {
+    if (cp < 0x80) return (cp >= 'A' && cp <= 'Z') ? cp + 0x20 : cp;
+    if (cp < 0x100) {
+        if (cp == 0xB5) return 0x3BC; // µ -> μ
+        return (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) ? cp + 0x20 : cp;
+    }
+    if (cp < 0x180) {
+        if (cp == 0x130 || cp == 0x131 || cp == 0x138 || cp == 0x149) return cp; // без простой свёртки
+        if (cp == 0x178) return 0xFF;  // Ÿ
+        if (cp == 0x17F) return 's';   // ſ
+        if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E)) return oddUpper(cp);
+        return evenUpper(cp);
+    }
+    if (cp < 0x250) {
+        // Латиница-B: регулярные пары
+        if (cp >= 0x1CD && cp <= 0x1DC) return oddUpper(cp);
+        if ((cp >= 0x1DE && cp <= 0x1EF) || (cp >= 0x1F8 && cp <= 0x21F) || (cp >= 0x222 && cp <= 0x233) ||
+            (cp >= 0x246 && cp <= 0x24F)) {
+            return evenUpper(cp);
+        }
+        return cp;
+    }
+    if (cp >= 0x370 && cp < 0x400) {
+        if (cp == 0x386) return 0x3AC;
+        if (cp >= 0x388 && cp <= 0x38A) return cp + 37;
+        if (cp == 0x38C) return 0x3CC;
+        if (cp == 0x38E || cp == 0x38F) return cp + 63;
+        if ((cp >= 0x391 && cp <= 0x3A1) || (cp >= 0x3A3 && cp <= 0x3AB)) return cp + 0x20;
+        switch (cp) {
+            case 0x3C2: return 0x3C3; // ς
+            case 0x3D0: return 0x3B2; // ϐ
+            case 0x3D1: return 0x3B8; // ϑ
+            case 0x3D5: return 0x3C6; // ϕ
+            case 0x3D6: return 0x3C0; // ϖ
+            case 0x3F0: return 0x3BA; // ϰ
+            case 0x3F1: return 0x3C1; // ϱ
+            case 0x3F5: return 0x3B5; // ϵ
+            default: break;
+        }
+        if (cp >= 0x3D8 && cp <= 0x3EF) return evenUpper(cp);
+        return cp;
+    }
+    if (cp >= 0x400 && cp < 0x530) {
+        if (cp <= 0x40F) return cp + 0x50;               // Ѐ..Џ
+        if (cp <= 0x42F) return cp + 0x20;               // А..Я
+        if (cp < 0x460) return cp;                       // строчные
+        if (cp <= 0x481 || (cp >= 0x48A && cp <= 0x4BF)) return evenUpper(cp);
+        if (cp == 0x4C0) return 0x4CF;                   // Ӏ
+        if (cp >= 0x4C1 && cp <= 0x4CE) return oddUpper(cp);
+        if (cp >= 0x4D0) return evenUpper(cp);
+        return cp;
+    }
+    if (cp >= 0x531 && cp <= 0x556) return cp + 0x30;   // армянский
+    if (cp >= 0x1E00 && cp <= 0x1EFF) {
+        if (cp == 0x1E9E) return 0xDF;                   // ẞ
+        if (cp <= 0x1E95 || cp >= 0x1EA0) return evenUpper(cp);
+        return cp;
+    }
+    switch (cp) {
+        case 0x2126: return 0x3C9; // Ω (Ом)
+        case 0x212A: return 'k';   // K (Кельвин)
+        case 0x212B: return 0xE5;  // Å (Ангстрем)
+        default: break;
+    }
+    if (cp >= 0xFF21 && cp <= 0xFF3A) return cp + 0x20;
+    return cp;
+}
+
+void CaseFold::variants(std::uint32_t cp, std::vector<std::uint32_t>& out) {
+    const auto& index = foldIndex();
+    std::uint32_t key = fold(cp);
+    auto range = std::equal_range(index.begin(), index.end(), std::make_pair(key, 0u),
+                                  [](const auto& a, const auto& b) { return a.first < b.first; });
+    bool self = false;
+    for (auto it = range.first; it != range.second; ++it) {
+        out.push_back(it->second);
+        if (it->second == cp) self = true;
+    }
+    if (!self) out.push_back(cp);
+}
@@ -0,0 +1,16 @@
+#ifndef CASE_FOLD_H
+#define CASE_FOLD_H
+
+#include <cstdint>
+#include <vector>
+
+// Простая свёртка регистра Unicode (CaseFolding.txt, статусы C и S) для
+// латиницы с расширениями, греческого, кириллицы, армянского и полноширинных
+// латинских букв. Остальные кодовые точки свёртываются сами в себя.
+struct CaseFold {
+    static std::uint32_t fold(std::uint32_t cp); // O(1)
+    // Все кодовые точки с той же свёрткой, что у cp, включая саму cp
+    static void variants(std::uint32_t cp, std::vector<std::uint32_t>& out); // O(log T)
+};
+
+#endif // CASE_FOLD_H
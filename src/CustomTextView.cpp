@@ -1,5 +1,6 @@
 // CustomTextView.cpp
 #include "CustomTextView.h"
+#include "PatternSet.h"
 #include <gdk/gdk.h>
 #include <glib.h>
 #include <pango/pangocairo.h>
@@ -36,7 +37,7 @@ CustomTextView::CustomTextView() {
 
     // ensure flags initial state
     m_mouse_selecting = false;
-    m_sel_anchor = -1;
+    m_has_anchor = false;
 
     // Motion controller
     auto motion = Gtk::EventControllerMotion::create();
@@ -64,13 +65,23 @@ CustomTextView::~CustomTextView() {
 // === public API ============================================================
 void CustomTextView::set_tree(Tree* tree) {
     m_tree = tree;
+    m_has_selection = false;
+    m_has_anchor = false;
+    if (m_tree) {
+        m_cursor_marker = m_tree->createMarker(0, MarkerGravity::RIGHT);
+        m_sel_start_marker = m_tree->createMarker(0, MarkerGravity::RIGHT);
+        m_sel_end_marker = m_tree->createMarker(0, MarkerGravity::LEFT);
+        m_sel_anchor_marker = m_tree->createMarker(0, MarkerGravity::LEFT);
+    }
     reload_from_tree();
 }
 
 void CustomTextView::reload_from_tree() {
     m_line_cache.clear(); // инвалидация кэша при смене дерева
+    m_line_cache_bytes = 0;
     update_size_request();
     queue_draw();
+    m_signal_state_changed.emit();
 }
 
 void CustomTextView::set_cursor_byte_offset(int offset) {
@@ -86,42 +97,56 @@ void CustomTextView::set_cursor_byte_offset(int offset) {
     if (offset < 0) offset = 0;
     if (offset > maxLen) offset = maxLen;
     
-    m_cursor_byte_offset = offset;
+    m_tree->setMarkerOffset(m_cursor_marker, offset);
     m_show_caret = true; 
     queue_draw();
+    m_signal_state_changed.emit();
 }
-// Нам нужно найти, в какой строке находится курсор.
-// Так как в Tree.h нет метода getLineIndexByOffset, мы используем бинарный поиск
-// по номерам строк, используя быстрый m_tree->getOffsetForLine().
+// Номер строки по байтовому оффсету: один спуск по дереву (или ноль — рядом с пальцем)
 int CustomTextView::find_line_index_by_byte_offset(int targetOffset) const {
     if (!m_tree || m_tree->isEmpty()) return 0;
+    return m_tree->getLineForOffset(targetOffset);
+}
 
-    int low = 0;
-    int high = m_tree->getTotalLineCount() - 1;
-    int result = 0;
+int CustomTextView::get_cursor_byte_offset() const {
+    if (!m_tree) return 0;
+    return m_tree->getMarkerOffset(m_cursor_marker);
+}
 
-    while (low <= high) {
-        int mid = low + (high - low) / 2;
-        int midOffset = m_tree->getOffsetForLine(mid);
+int CustomTextView::get_cursor_line_index() const {
+    return find_line_index_by_byte_offset(get_cursor_byte_offset());
+}
 
-        if (midOffset <= targetOffset) {
-            result = mid; // запоминаем как кандидата
-            low = mid + 1;
-        } else {
-            high = mid - 1;
-        }
+void CustomTextView::set_highlight_terms(const std::vector<std::string>& terms, bool ignoreCase) {
+    std::vector<std::string> nonEmpty;
+    for (const auto& t : terms) {
+        if (!t.empty()) nonEmpty.push_back(t);
     }
-    return result;
+    if (nonEmpty.empty()) {
+        m_highlight.reset();
+    } else {
+        m_highlight = std::make_unique<PatternSet>(nonEmpty, ignoreCase);
+    }
+    queue_draw();
 }
 
-int CustomTextView::get_cursor_line_index() const {
-    return find_line_index_by_byte_offset(m_cursor_byte_offset);
+bool CustomTextView::get_selection(int& start, int& len) const {
+    if (!m_tree || !m_has_selection) return false;
+    start = m_tree->getMarkerOffset(m_sel_start_marker);
+    len = m_tree->getMarkerOffset(m_sel_end_marker) - start;
+    return len > 0;
 }
 
 // === controllers handlers ================================================
-bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::ModifierType /*state*/) {
+bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::ModifierType state) {
     if (!m_tree) return false;
 
+    // Маркер курсора сдвигается деревом при любой правке — здесь только читаем его
+    int cursor = get_cursor_byte_offset();
+    int selStart = 0;
+    int selLen = 0;
+    bool hasSel = get_selection(selStart, selLen);
+
     // Вспомогательная лямбда для удаления диапазона и обновления UI
     auto perform_erase = [&](int start, int len) {
         try {
@@ -135,20 +160,32 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
         }
     };
 
+    // 0. Свёртки: Ctrl+[ — свернуть строки выделения, Ctrl+] — развернуть у курсора
+    if ((state & Gdk::ModifierType::CONTROL_MASK) == Gdk::ModifierType::CONTROL_MASK) {
+        if (keyval == GDK_KEY_bracketleft) {
+            fold_selection();
+            return true;
+        }
+        if (keyval == GDK_KEY_bracketright) {
+            unfold_at_cursor();
+            return true;
+        }
+    }
+
     // 1. Обработка BACKSPACE
     if (keyval == GDK_KEY_BackSpace) {
         // Если есть выделение - удаляем его
-        if (m_sel_start >= 0 && m_sel_len > 0) {
-            perform_erase(m_sel_start, m_sel_len);
+        if (hasSel) {
+            perform_erase(selStart, selLen);
             return true;
         }
 
         // Удаление символа слева
-        if (m_cursor_byte_offset > 0) {
+        if (cursor > 0) {
             // Находим строку, в которой курсор
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
+            int lineIdx = find_line_index_by_byte_offset(cursor);
             int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
+            int localOffset = cursor - lineStart;
 
             int lenToDelete = 1; // По умолчанию (например, удаляем \n на границе)
 
@@ -166,23 +203,23 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
                 // Оставляем lenToDelete = 1
             }
             
-            perform_erase(m_cursor_byte_offset - lenToDelete, lenToDelete);
+            perform_erase(cursor - lenToDelete, lenToDelete);
         }
         return true;
     } 
     
     // 2. Обработка DELETE
     else if (keyval == GDK_KEY_Delete) {
-        if (m_sel_start >= 0 && m_sel_len > 0) {
-            perform_erase(m_sel_start, m_sel_len);
+        if (hasSel) {
+            perform_erase(selStart, selLen);
             return true;
         }
 
         int maxLen = m_tree->getRoot() ? m_tree->getRoot()->getLength() : 0;
-        if (m_cursor_byte_offset < maxLen) {
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
+        if (cursor < maxLen) {
+            int lineIdx = find_line_index_by_byte_offset(cursor);
             int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
+            int localOffset = cursor - lineStart;
 
             int lenToDelete = 1;
 
@@ -201,17 +238,17 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
                 // Иначе удаляем 1 байт (это \n)
             }
             
-            perform_erase(m_cursor_byte_offset, lenToDelete);
+            perform_erase(cursor, lenToDelete);
         }
         return true;
     } 
     
     // 3. Стрелка ВЛЕВО
     else if (keyval == GDK_KEY_Left) {
-        if (m_cursor_byte_offset > 0) {
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
+        if (cursor > 0) {
+            int lineIdx = find_line_index_by_byte_offset(cursor);
             int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
+            int localOffset = cursor - lineStart;
             
             int step = 1;
             if (localOffset > 0) {
@@ -223,7 +260,7 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
                     step = static_cast<int>(curPtr - prevPtr);
                 }
             }
-            set_cursor_byte_offset(m_cursor_byte_offset - step);
+            set_cursor_byte_offset(cursor - step);
         }
         clear_selection();
         return true;
@@ -232,10 +269,10 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
     // 4. Стрелка ВПРАВО
     else if (keyval == GDK_KEY_Right) {
         int maxLen = m_tree->getRoot() ? m_tree->getRoot()->getLength() : 0;
-        if (m_cursor_byte_offset < maxLen) {
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
+        if (cursor < maxLen) {
+            int lineIdx = find_line_index_by_byte_offset(cursor);
             int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
+            int localOffset = cursor - lineStart;
             
             int step = 1;
             char* rawLine = m_tree->getLine(lineIdx);
@@ -248,7 +285,7 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
                     step = static_cast<int>(nextPtr - curPtr);
                 }
             }
-            set_cursor_byte_offset(m_cursor_byte_offset + step);
+            set_cursor_byte_offset(cursor + step);
         }
         clear_selection();
         return true;
@@ -258,12 +295,12 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
     else if (keyval == GDK_KEY_Return || keyval == GDK_KEY_KP_Enter) {
         char ch = '\n';
         try {
-            m_tree->insert(m_cursor_byte_offset, &ch, 1);
+            m_tree->insert(cursor, &ch, 1);
         } catch (const std::exception& e) {
             std::cerr << "Tree::insert error: " << e.what() << '\n';
         }
         reload_from_tree();
-        set_cursor_byte_offset(m_cursor_byte_offset + 1);
+        set_cursor_byte_offset(get_cursor_byte_offset()); // маркер уже за '\n'
         clear_selection(); // Обычно Enter сбрасывает выделение
         return true;
     }
@@ -275,20 +312,21 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
         int bytes = g_unichar_to_utf8(uc, buf);
         
         // Если текст выделен - заменяем его
-        if (m_sel_start >= 0 && m_sel_len > 0) {
-            try { m_tree->erase(m_sel_start, m_sel_len); } catch(...) {}
-            m_cursor_byte_offset = m_sel_start;
+        if (hasSel) {
+            try { m_tree->erase(selStart, selLen); } catch(...) {}
+            cursor = selStart;
+            m_tree->setMarkerOffset(m_cursor_marker, cursor);
             clear_selection();
         }
         
         try {
-            m_tree->insert(m_cursor_byte_offset, buf, bytes);
+            m_tree->insert(cursor, buf, bytes);
         } catch (const std::exception& e) {
             std::cerr << "Tree::insert error: " << e.what() << '\n';
         }
-        // Инвалидация кэша и обновление UI
+        // Инвалидация кэша и обновление UI; курсор уже сдвинут деревом
         reload_from_tree();
-        set_cursor_byte_offset(m_cursor_byte_offset + bytes);
+        set_cursor_byte_offset(get_cursor_byte_offset());
         return true;
     }
 
@@ -302,11 +340,13 @@ void CustomTextView::on_gesture_released(int /*n_press*/, double /*x*/, double /
     m_mouse_selecting = false;
 
     // Если ничего не выделено — сбросили якорь
-    if (m_sel_start < 0 || m_sel_len == 0) {
-        m_sel_anchor = -1;
+    int selStart = 0;
+    int selLen = 0;
+    if (!get_selection(selStart, selLen)) {
+        m_has_anchor = false;
     } else {
         // оставляем текущее выделение и курсор в его конце
-        set_cursor_byte_offset(m_sel_start + m_sel_len);
+        set_cursor_byte_offset(selStart + selLen);
     }
 }
 
@@ -320,7 +360,8 @@ void CustomTextView::on_gesture_pressed(int /*n_press*/, double x, double y) {
     int newOffset = get_byte_offset_at_xy(x, y);
 
     m_mouse_selecting = true;
-    m_sel_anchor = newOffset;
+    m_tree->setMarkerOffset(m_sel_anchor_marker, newOffset);
+    m_has_anchor = true;
     
     select_range_bytes(newOffset, 0);
     set_cursor_byte_offset(newOffset);
@@ -334,12 +375,14 @@ void CustomTextView::on_motion(double x, double y) {
     int currentOffset = get_byte_offset_at_xy(x, y);
 
     // Обновляем выделение между якорем и текущей позицией
-    if (m_sel_anchor < 0) {
-        m_sel_anchor = currentOffset;
+    if (!m_has_anchor) {
+        m_tree->setMarkerOffset(m_sel_anchor_marker, currentOffset);
+        m_has_anchor = true;
     }
+    int anchor = m_tree->getMarkerOffset(m_sel_anchor_marker);
     
-    int selBeg = std::min(m_sel_anchor, currentOffset);
-    int selEnd = std::max(m_sel_anchor, currentOffset);
+    int selBeg = std::min(anchor, currentOffset);
+    int selEnd = std::max(anchor, currentOffset);
     
     select_range_bytes(selBeg, selEnd - selBeg);
 
@@ -363,10 +406,11 @@ void CustomTextView::update_size_request() {
         return;
     }
 
-    int total_lines = m_tree->getTotalLineCount(); 
-    if (total_lines == 0) total_lines = 1;
+    // Высота — по видимым рядам: свёрнутые строки не занимают места в прокрутке
+    int total_rows = m_tree->getVisibleLineCount();
+    if (total_rows == 0) total_rows = 1;
     
-    int h = total_lines * m_line_height + (TOP_MARGIN * 2);
+    int h = total_rows * m_line_height + (TOP_MARGIN * 2);
     set_size_request(-1, h);
 }
 
@@ -385,9 +429,22 @@ const std::string& CustomTextView::get_cached_line(int line) {
     
     std::unique_ptr<char[]> guard(raw);  // гарантированное освобождение
     auto result = m_line_cache.emplace(line, std::string(raw));
+    m_line_cache_bytes += LINE_CACHE_ENTRY_OVERHEAD + result.first->second.capacity();
     return result.first->second;
 }
 
+std::size_t CustomTextView::get_cache_bytes() const {
+    return m_line_cache_bytes + m_line_cache.bucket_count() * sizeof(void*);
+}
+
+void CustomTextView::trim_caches() {
+    // Строки перечитаются из дерева при следующей отрисовке
+    std::unordered_map<int, std::string>().swap(m_line_cache);
+    m_line_cache_bytes = 0;
+    m_layout->set_text("");
+    queue_draw();
+}
+
 // === ОТРИСОВКА  ===
 void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, int width, int height) {
     if (!m_tree) {
@@ -408,36 +465,46 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
     double clip_x1, clip_y1, clip_x2, clip_y2;
     cr->get_clip_extents(clip_x1, clip_y1, clip_x2, clip_y2);
 
+    // Отрисовка идёт по визуальным рядам; ряд -> строка документа через сводку свёрток
     int total_lines = m_tree->getTotalLineCount();
-    int first_line = static_cast<int>((clip_y1 - TOP_MARGIN) / m_line_height);
+    int total_rows = m_tree->getVisibleLineCount();
+    int first_row = static_cast<int>((clip_y1 - TOP_MARGIN) / m_line_height);
 
-    int last_line = static_cast<int>((clip_y2 - TOP_MARGIN) / m_line_height) + 1;
-    first_line = std::clamp(first_line, 0, std::max(0, total_lines - 1));
-    last_line = std::clamp(last_line, 0, total_lines);
-    if (last_line <= first_line) last_line = first_line + 1;
+    int last_row = static_cast<int>((clip_y2 - TOP_MARGIN) / m_line_height) + 1;
+    first_row = std::clamp(first_row, 0, std::max(0, total_rows - 1));
+    last_row = std::clamp(last_row, 0, total_rows);
+    if (last_row <= first_row) last_row = first_row + 1;
 
     Gdk::RGBA text_color("white");
     Gdk::RGBA sel_bg(0.2, 0.4, 0.8, 0.6);
+    // Цвета терминов подсветки по номеру в наборе
+    static const Gdk::RGBA highlight_bg[] = {
+        Gdk::RGBA(0.9, 0.7, 0.1, 0.5), Gdk::RGBA(0.2, 0.8, 0.3, 0.5),
+        Gdk::RGBA(0.9, 0.3, 0.6, 0.5), Gdk::RGBA(0.3, 0.7, 0.9, 0.5)
+    };
+    const int highlight_colors = static_cast<int>(sizeof(highlight_bg) / sizeof(highlight_bg[0]));
 
     // Подготовка для вычисления позиции курсора один раз
     int cursorLineIdx = -1;
     int cursor_cx = -1;
     int cursor_cy = -1;
-    if (m_show_caret && m_cursor_byte_offset >= 0) {
-        cursorLineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
+    int cursor = get_cursor_byte_offset();
+    if (m_show_caret && cursor >= 0) {
+        cursorLineIdx = find_line_index_by_byte_offset(cursor);
     }
+    int selStart = 0;
+    int selLen = 0;
+    bool hasSel = get_selection(selStart, selLen);
     
-    // ОПТИМИЗАЦИЯ: Вычисляем offset только для первой видимой строки (O(log M))
-    // Затем кумулятивно прибавляем длины строк + 1 байт за \n (для не-последних строк)
-    int current_offset = (first_line > 0) ? m_tree->getOffsetForLine(first_line) : 0;  // Для line 0 offset всегда 0
-    
-    // Цикл ТОЛЬКО по видимым строкам
-    for (int i = first_line; i < last_line; ++i) {
+    // Цикл ТОЛЬКО по видимым рядам
+    for (int row = first_row; row < last_row; ++row) {
+        // Соседние ряды идут подряд, пока между ними нет свёртки — палец дерева
+        // делает оба запроса O(1) для строк из одного листа
+        int i = m_tree->visibleRowToLine(row);
         const std::string& fullLine = get_cached_line(i);
         int lineLen = static_cast<int>(fullLine.size());  // Длина в байтах, БЕЗ trailing '\n'
         
-        // Используем current_offset как lineStartOffset (глобальный байтовый offset начала строки)
-        int lineStartOffset = current_offset;
+        int lineStartOffset = (i > 0) ? m_tree->getOffsetForLine(i) : 0;
         int lineEndOffset = lineStartOffset + lineLen;  // Конец строки, позиция ПЕРЕД '\n' (или конец файла)
         
         // Готовим текст для отрисовки: копируем fullLine и убираем trailing '\n' (если есть, хотя по логике не должно быть)
@@ -447,17 +514,35 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
         }
         int display_len = static_cast<int>(line_text.length());  // Длина видимого текста
         
-        // Y-позиция строки 
-        int y_pos = TOP_MARGIN + i * m_line_height;
+        // Y-позиция ряда
+        int y_pos = TOP_MARGIN + row * m_line_height;
+        bool foldHeader = (i + 1 < total_lines) && m_tree->isLineHidden(i + 1);
         
         try {
             // Устанавливаем текст в layout ОДИН РАЗ на строку (только видимый текст)
             m_layout->set_text(Glib::ustring(line_text));
             
+            // Подсветка терминов: видимая строка одним проходом автомата (вхождения через '\n' не видны)
+            if (m_highlight) {
+                int state = PatternSet::START;
+                m_highlight->feed(state, line_text.data(), display_len, [&](int pattern, int end) {
+                    Pango::Rectangle rect_start, rect_end;
+                    m_layout->get_cursor_pos(end - m_highlight->length(pattern), rect_start, rect_start);
+                    m_layout->get_cursor_pos(end, rect_end, rect_end);
+                    int x1 = LEFT_MARGIN + rect_start.get_x() / PANGO_SCALE;
+                    int x2 = LEFT_MARGIN + rect_end.get_x() / PANGO_SCALE;
+                    const Gdk::RGBA& bg = highlight_bg[pattern % highlight_colors];
+                    cr->set_source_rgba(bg.get_red(), bg.get_green(), bg.get_blue(), bg.get_alpha());
+                    cr->rectangle(x1, y_pos, x2 - x1, m_line_height);
+                    cr->fill();
+                    return true;
+                });
+            }
+
             // Отрисовка выделения (Selection) — логика сохранена: пересечение с глобальными offsets (до '\n')
-            if (m_sel_len > 0) {
-                int sel_start_global = m_sel_start;
-                int sel_end_global = m_sel_start + m_sel_len;
+            if (hasSel) {
+                int sel_start_global = selStart;
+                int sel_end_global = selStart + selLen;
                 // Проверяем пересечение выделения с текущей строкой (до позиции '\n')
                 if (sel_start_global < lineEndOffset && sel_end_global > lineStartOffset) {
                     // Локальные границы выделения: относительно начала, clamped к видимому тексту
@@ -482,10 +567,20 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
             cr->move_to(LEFT_MARGIN, y_pos);
             cr->set_source_rgb(text_color.get_red(), text_color.get_green(), text_color.get_blue());
             pango_cairo_show_layout(cr->cobj(), m_layout->gobj());
+
+            // Заголовок свёртки: рамка-заглушка после текста
+            if (foldHeader) {
+                Pango::Rectangle end_pos;
+                m_layout->get_cursor_pos(display_len, end_pos, end_pos);
+                int fx = LEFT_MARGIN + end_pos.get_x() / PANGO_SCALE + m_char_width;
+                cr->set_source_rgb(0.7, 0.7, 0.7);
+                cr->rectangle(fx, y_pos + 2, m_char_width * 3, m_line_height - 4);
+                cr->stroke();
+            }
             
             // Вычисление позиции курсора, если он на этой строке — логика сохранена
             if (cursorLineIdx == i) {
-                int offsetInLine_bytes = m_cursor_byte_offset - lineStartOffset;  // Относительно начала строки (до '\n')
+                int offsetInLine_bytes = cursor - lineStartOffset;  // Относительно начала строки (до '\n')
                 // Clamp к видимому: если курсор на '\n' (offsetInLine == lineLen), станет display_len (конец строки)
                 int cursor_index_for_pango = std::clamp(offsetInLine_bytes, 0, display_len);
                 try {
@@ -504,16 +599,10 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
             cr->rectangle(LEFT_MARGIN, y_pos, width - LEFT_MARGIN, m_line_height);
             cr->stroke();
         }
-        
-        // offset для следующей строки: прибавляем длину + 1 байт за '\n' (только если это не последняя строка в документе)
-        current_offset += lineLen;
-        if (i < total_lines - 1) {
-            current_offset += 1;  // Учёт байта '\n' после строки
-        }
     }
     
     // Отрисовка курсора 
-    if (m_show_caret && m_cursor_byte_offset >= 0 && cursor_cx >= 0) {
+    if (m_show_caret && cursor >= 0 && cursor_cx >= 0) {
         cr->set_source_rgb(0, 0, 0);
         cr->rectangle(cursor_cx, cursor_cy, 1.5, m_line_height);
         cr->fill();
@@ -523,10 +612,11 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
 int CustomTextView::get_byte_offset_at_xy(double x, double y) {
     if (!m_tree || m_tree->isEmpty()) return 0;
    
-    int lineIdx = static_cast<int>((y - TOP_MARGIN) / m_line_height);
-    int total = m_tree->getTotalLineCount();
-    if (lineIdx < 0) lineIdx = 0;
-    if (lineIdx >= total) lineIdx = total - 1;
+    int row = static_cast<int>((y - TOP_MARGIN) / m_line_height);
+    int total = m_tree->getVisibleLineCount();
+    if (row < 0) row = 0;
+    if (row >= total) row = total - 1;
+    int lineIdx = m_tree->visibleRowToLine(row);
    
     int lineStartOffset = m_tree->getOffsetForLine(lineIdx);
    
@@ -569,9 +659,9 @@ void CustomTextView::select_range_bytes(int startByte, int lengthBytes) {
     if (startByte > maxLen) startByte = maxLen;
 
     if (lengthBytes <= 0) {
-        m_sel_start = -1;
-        m_sel_len = 0;
+        m_has_selection = false;
         queue_draw();
+        m_signal_state_changed.emit();
         return;
     }
 
@@ -584,19 +674,45 @@ void CustomTextView::select_range_bytes(int startByte, int lengthBytes) {
     // так как пришлось бы склеивать фрагменты листьев дерева.
     
     if (endByte <= startByte) {
-        m_sel_start = -1;
-        m_sel_len = 0;
+        m_has_selection = false;
     } else {
-        m_sel_start = startByte;
-        m_sel_len = endByte - startByte;
+        m_tree->setMarkerOffset(m_sel_start_marker, startByte);
+        m_tree->setMarkerOffset(m_sel_end_marker, endByte);
+        m_has_selection = true;
     }
     
     queue_draw();
+    m_signal_state_changed.emit();
 }
 
 void CustomTextView::clear_selection() {
-    m_sel_start = -1;
-    m_sel_len = 0;
+    m_has_selection = false;
+    queue_draw();
+    m_signal_state_changed.emit();
+}
+
+void CustomTextView::fold_selection() {
+    int selStart = 0;
+    int selLen = 0;
+    if (!get_selection(selStart, selLen)) return;
+
+    int firstLine = find_line_index_by_byte_offset(selStart);
+    int lastLine = find_line_index_by_byte_offset(selStart + selLen);
+    if (m_tree->foldLines(firstLine, lastLine) < 0) return;
+
+    // Курсор не должен остаться в скрытой строке
+    clear_selection();
+    set_cursor_byte_offset(m_tree->getOffsetForLine(firstLine));
+    update_size_request();
+    queue_draw();
+}
+
+void CustomTextView::unfold_at_cursor() {
+    if (!m_tree) return;
+    int foldId = m_tree->getFoldForLine(get_cursor_line_index());
+    if (foldId < 0) return;
+    m_tree->unfold(foldId);
+    update_size_request();
     queue_draw();
 }
 
@@ -612,8 +728,8 @@ void CustomTextView::scroll_to_byte_offset(int byteOffset) {
     // Используем тот же алгоритм, что и в get_cursor_line_index
     int lineIndex = find_line_index_by_byte_offset(byteOffset);
 
-    // 3. Вычисляем целевую Y координату
-    int y = lineIndex * m_line_height; // Используем TOP_MARGIN если нужно точное позиционирование: + TOP_MARGIN
+    // 3. Вычисляем целевую Y координату (по визуальному ряду; скрытая строка — ряд заголовка свёртки)
+    int y = m_tree->lineToVisibleRow(lineIndex) * m_line_height; // Используем TOP_MARGIN если нужно точное позиционирование: + TOP_MARGIN
 
     // 4. Стандартная логика GTK для поиска ScrolledWindow и прокрутки
     Gtk::Widget* w = this;
@@ -2,8 +2,13 @@
 #define CUSTOM_TEXT_VIEW_H
 
 #include <gtkmm.h>
+#include <memory>
+#include <string>
+#include <vector>
 #include "Tree.h"
 
+class PatternSet; // PatternSet.h
+
 class CustomTextView : public Gtk::DrawingArea {
 public:
     CustomTextView();
@@ -12,7 +17,7 @@ public:
     void set_tree(Tree* tree);
     void reload_from_tree();
 
-    int get_cursor_byte_offset() const { return m_cursor_byte_offset; }
+    int get_cursor_byte_offset() const;
     void set_cursor_byte_offset(int offset);
 
     // helper for EditorWindow scrolling/status
@@ -22,10 +27,26 @@ public:
     // selection API
     void select_range_bytes(int startByte, int lengthBytes); // выделить диапазон
     void clear_selection();                                   // снять выделение
+    // Текущее выделение по маркерам дерева; false — выделения нет
+    bool get_selection(int& start, int& len) const;
+
+    // Правка, сдвиг курсора или смена выделения (для строки состояния)
+    sigc::signal<void()>& signal_state_changed() { return m_signal_state_changed; }
 
     // helper: прокрутить так, чтобы байтовый оффсет оказался вверху/в центре
     void scroll_to_byte_offset(int byteOffset);
 
+    // Память кэшей отрисовки (для MemoryGovernor) и их сброс
+    std::size_t get_cache_bytes() const;
+    void trim_caches();
+
+    // Подсветка всех вхождений набора терминов в видимых строках; пустой набор — выключить
+    void set_highlight_terms(const std::vector<std::string>& terms, bool ignoreCase);
+
+    // свёртки: свернуть строки выделения (первая остаётся заголовком) / развернуть у курсора
+    void fold_selection();
+    void unfold_at_cursor();
+
 
 protected:
     // handlers attached to controllers (gtkmm4 style)
@@ -50,8 +71,7 @@ private:
     // Получает текст конкретной строки из дерева и измеряет X
     int get_byte_offset_at_xy(double x, double y);
     
-    // Вспомогательная функция для бинарного поиска строки по байтовому оффсету
-    // (так как в Tree нет прямого метода getLineByOffset, но есть getOffsetForLine)
+    // Номер строки по байтовому оффсету (Tree::getLineForOffset)
     int find_line_index_by_byte_offset(int byteOffset) const;
 
     // Получить кешированую строку
@@ -63,19 +83,30 @@ private:
     Glib::RefPtr<Pango::Layout> m_layout;
     // Кеш видимых строк
     std::unordered_map<int, std::string> m_line_cache;
+    std::size_t m_line_cache_bytes = 0;
+    // Узел unordered_map: ключ, std::string, указатель на следующий, хэш
+    static constexpr std::size_t LINE_CACHE_ENTRY_OVERHEAD = sizeof(std::string) + 4 * sizeof(void*);
 
     Pango::FontDescription m_font_desc;
     int m_line_height{16};
     int m_char_width{8};
 
-    int m_cursor_byte_offset{0};
+    // Курсор и выделение — маркеры дерева: Tree сам сдвигает их при правках
+    int m_cursor_marker{-1};          // RIGHT: уезжает за вставленный текст
     bool m_show_caret{true};
     sigc::connection m_caret_timer;
 
-    int m_sel_start = -1; // -1 => нет выделения
-    int m_sel_len = 0;
+    bool m_has_selection = false;
+    int m_sel_start_marker{-1};       // RIGHT: вставка перед выделением его не расширяет
+    int m_sel_end_marker{-1};         // LEFT: вставка после выделения его не расширяет
 
     bool m_mouse_selecting = false;   // true когда идёт drag-selection
-    int m_sel_anchor = -1;            // байтовый оффсет начала выделения (якорь)
+    bool m_has_anchor = false;
+    int m_sel_anchor_marker{-1};      // якорь drag-selection
+
+    sigc::signal<void()> m_signal_state_changed;
+
+    // Автомат подсветки терминов (Ахо–Корасик): один проход по строке на все термины
+    std::unique_ptr<PatternSet> m_highlight;
 };
 #endif // CUSTOM_TEXT_VIEW_H
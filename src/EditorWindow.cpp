@@ -1,20 +1,39 @@
 #include "EditorWindow.h"
 #include "CustomTextView.h"
 #include "BinaryTreeFile.h"
+#include "Regex.h"
+#include "PatternSet.h"
+#include <algorithm>
+#include <climits>
 #include <fstream>
 #include <glib.h>
 #include <iostream>
 #include <sstream>
 #include <string>
-
-// Определение вспомогательной функции
-static size_t count_words(const std::string& s) {
-    std::istringstream iss(s);
-    size_t cnt = 0;
-    std::string w;
-    while (iss >> w) ++cnt;
-    return cnt;
-}
+#include <vector>
+
+// Состояние квантованного поиска. Вперёд: проход [pos, limit) до конца документа, затем
+// по кругу с начала до точки старта. Назад: проход [limit, pos) от точки старта к началу,
+// затем от конца документа обратно к ней. Каждый вызов idle съедает один кусок.
+struct EditorWindow::SearchRun {
+    static constexpr int SLICE_BYTES = 4 * 1024 * 1024; // кусок за вызов idle: единицы мс
+
+    std::string query;
+    std::unique_ptr<Regex> re; // nullptr — поиск текста
+    SearchCase mode = SearchCase::EXACT;
+    bool forward = true;
+    bool focus = false;
+    bool wrapped = false;
+    int origin = 0;
+    int pos = 0;
+    int limit = 0;
+    long long scanned = 0;
+    unsigned long version = 0;
+
+    // Совпадения регулярного выражения и UNICODE не пересекают '\n' — куски режутся по строкам;
+    // точный текст — внахлёст на длину шаблона без байта, куски любой длины
+    bool lineAligned() const { return re || mode == SearchCase::UNICODE; }
+};
 
 EditorWindow::EditorWindow() {
     
@@ -31,6 +50,25 @@ EditorWindow::EditorWindow() {
     m_search.set_hexpand(false);
     m_search.set_placeholder_text("Line number or text...");
     m_search.signal_activate().connect(sigc::mem_fun(*this, &EditorWindow::on_search_activate));
+    m_search.signal_search_changed().connect(sigc::mem_fun(*this, &EditorWindow::on_search_changed));
+    m_search.signal_next_match().connect(sigc::mem_fun(*this, &EditorWindow::on_search_next));
+    m_search.signal_previous_match().connect(sigc::mem_fun(*this, &EditorWindow::on_search_previous));
+    m_search.signal_stop_search().connect(sigc::mem_fun(*this, &EditorWindow::cancel_search));
+
+    // режим регулярных выражений для поиска (слева от поля)
+    m_btn_regex.set_tooltip_text("Search with a regular expression");
+    m_btn_match_case.set_tooltip_text("Match case (off: Unicode case-insensitive)");
+    m_btn_match_case.set_active(true);
+    m_btn_highlight.set_tooltip_text("Highlight all comma-separated terms (ASCII case-insensitive when match case is off)");
+    m_btn_highlight.signal_toggled().connect(sigc::mem_fun(*this, &EditorWindow::on_highlight_toggled));
+
+    // замена: поле и кнопки слева от переключателей поиска
+    m_replace.set_hexpand(false);
+    m_replace.set_placeholder_text("Replace with...");
+    m_btn_replace.set_tooltip_text("Replace the next match and select the one after it");
+    m_btn_replace_all.set_tooltip_text("Replace all matches in one edit");
+    m_btn_replace.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_replace_clicked));
+    m_btn_replace_all.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_replace_all_clicked));
 
     // кнопка для показа нумерации (справа от поиска)
     m_btn_show_numbers.set_tooltip_text("Show numbered lines in a separate window");
@@ -39,6 +77,12 @@ EditorWindow::EditorWindow() {
 
     m_header_bar.pack_end(m_btn_show_numbers);
     m_header_bar.pack_end(m_search);
+    m_header_bar.pack_end(m_btn_regex);
+    m_header_bar.pack_end(m_btn_match_case);
+    m_header_bar.pack_end(m_btn_highlight);
+    m_header_bar.pack_end(m_btn_replace_all);
+    m_header_bar.pack_end(m_btn_replace);
+    m_header_bar.pack_end(m_replace);
 
     set_titlebar(m_header_bar);
 
@@ -70,22 +114,26 @@ EditorWindow::EditorWindow() {
     m_btn_save_bin.set_label("Save Binary");
     m_btn_load_txt.set_label("Load Text");
     m_btn_save_txt.set_label("Save Text");
+    m_btn_compare.set_label("Compare");
 
     // CSS классы сохранены, чтобы системная тема их подхватила
     m_btn_load_bin.get_style_context()->add_class("suggested-action");
     m_btn_save_bin.get_style_context()->add_class("secondary");
     m_btn_load_txt.get_style_context()->add_class("secondary");
     m_btn_save_txt.get_style_context()->add_class("secondary");
+    m_btn_compare.get_style_context()->add_class("secondary");
 
     m_btn_load_bin.set_tooltip_text("Load .bin tree file into the editor");
     m_btn_save_bin.set_tooltip_text("Serialize current text into .bin");
     m_btn_load_txt.set_tooltip_text("Load plain text into editor");
     m_btn_save_txt.set_tooltip_text("Save editor text to a plain file");
+    m_btn_compare.set_tooltip_text("Show differences between the editor and a .bin tree file");
 
     file_box.append(m_btn_load_bin);
     file_box.append(m_btn_save_bin);
     file_box.append(m_btn_load_txt);
     file_box.append(m_btn_save_txt);
+    file_box.append(m_btn_compare);
 
     // --- Карточка текста (Frame) ---
     auto text_card = Gtk::Frame();
@@ -125,13 +173,25 @@ EditorWindow::EditorWindow() {
 
     m_status.set_text("Ready");
     status_box.append(m_status);
+
+    // Счётчики справа: берутся из кэшей узлов дерева, без toText
+    m_stats.set_hexpand(true);
+    m_stats.set_halign(Gtk::Align::END);
+    status_box.append(m_stats);
     m_root.append(status_box);
 
+    m_custom_view.signal_state_changed().connect(sigc::mem_fun(*this, &EditorWindow::update_stats));
+    m_custom_view.signal_state_changed().connect(sigc::mem_fun(*this, &EditorWindow::schedule_compaction));
+    m_saved_text_version = m_tree.getTextVersion(); // пустой документ не изменён
+    update_stats();
+    setup_memory_governor();
+
     // Signals (НЕ ИЗМЕНЯЛИСЬ)
     m_btn_load_bin.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_load_binary));
     m_btn_save_bin.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_save_binary));
     m_btn_load_txt.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_load_text));
     m_btn_save_txt.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_save_text));
+    m_btn_compare.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_compare_binary));
 
     m_file_entry.signal_changed().connect(sigc::mem_fun(*this, &EditorWindow::on_path_entry_changed));
     on_path_entry_changed(); 
@@ -146,13 +206,131 @@ EditorWindow::EditorWindow() {
 
 }
 
-EditorWindow::~EditorWindow()=default;
+EditorWindow::~EditorWindow() {
+    m_compact_timer.disconnect();
+    m_rebuild_poll.disconnect();
+    m_low_memory.disconnect();
+    m_search_idle.disconnect();
+    m_hash_idle.disconnect();
+}
 
 
 void EditorWindow::set_status(const std::string& s) {
     m_status.set_text(s);
 }
 
+void EditorWindow::update_stats() {
+    TextStats doc = m_tree.getStats();
+    std::ostringstream oss;
+    oss << "Lines: " << m_tree.getTotalLineCount()
+        << "  Words: " << doc.words
+        << "  Chars: " << doc.chars
+        << "  Non-space: " << doc.nonSpace;
+
+    int selStart = 0;
+    int selLen = 0;
+    if (m_custom_view.get_selection(selStart, selLen)) {
+        TextStats sel = m_tree.getStatsForRange(selStart, selLen);
+        oss << "  |  Selected: " << sel.words << " words, " << sel.chars << " chars";
+    }
+    m_stats.set_text(oss.str());
+    update_title();
+}
+
+void EditorWindow::mark_saved(const std::string& path) {
+    // Только что загруженный документ ещё без хэшей: полный проход по многогигабайтному
+    // тексту здесь заморозил бы окно, поэтому он идёт кусками в простое (on_hash_slice).
+    // До тех пор "не изменён" определяется версией текста.
+    m_saved_text_version = m_tree.getTextVersion();
+    m_saved_length = m_tree.getRoot() ? m_tree.getRoot()->getLength() : 0;
+    m_saved_hash_known = m_tree.isContentHashReady();
+    if (m_saved_hash_known) m_saved_hash = m_tree.getContentHash();
+    m_hash_idle.disconnect();
+    if (!m_saved_hash_known) {
+        m_hash_idle = Glib::signal_idle().connect(sigc::mem_fun(*this, &EditorWindow::on_hash_slice));
+    }
+    m_doc_name = Glib::path_get_basename(path);
+    update_title();
+}
+
+bool EditorWindow::on_hash_slice() {
+    const int HASH_SLICE_BYTES = 4 << 20; // несколько миллисекунд на кусок
+    if (!m_tree.prepareContentHash(HASH_SLICE_BYTES)) return true;
+    // Текст правили до готовности хэша — сохранённое содержимое по хэшу уже не узнать,
+    // но досчитанные хэши всё равно делают дальнейшие сравнения дешёвыми
+    if (m_tree.getTextVersion() == m_saved_text_version) {
+        m_saved_hash = m_tree.getContentHash();
+        m_saved_hash_known = true;
+    }
+    update_title();
+    return false;
+}
+
+void EditorWindow::schedule_compaction() {
+    // Каждое событие откладывает уплотнение; без правок с прошлого раза startRebuild() ничего не делает.
+    // Сборка идёт в рабочем потоке, правки во время неё журналируются деревом;
+    // здесь только опрашиваем готовность и подменяем корень в GTK-потоке.
+    const unsigned COMPACT_IDLE_MS = 2000;
+    const unsigned REBUILD_POLL_MS = 50;
+    m_compact_timer.disconnect();
+    m_compact_timer = Glib::signal_timeout().connect([this]() {
+        if (m_tree.isRebuilding() || m_tree.startRebuild()) {
+            m_rebuild_poll.disconnect();
+            m_rebuild_poll = Glib::signal_timeout().connect([this]() {
+                if (!m_tree.finishRebuild()) return true;
+                m_memory.enforce();
+                return false;
+            }, REBUILD_POLL_MS);
+        } else {
+            m_memory.enforce();
+        }
+        return false;
+    }, COMPACT_IDLE_MS);
+}
+
+void EditorWindow::setup_memory_governor() {
+    // Порядок сброса: строки виджета перечитываются из дерева дёшево, распакованные
+    // листья и триграммный индекс — чуть дороже, сжатие холодных листьев стоит проход по тексту.
+    m_memory.addConsumer("view", MemoryGovernor::SHED_VIEW_CACHES,
+                         [this]() { return m_custom_view.get_cache_bytes(); },
+                         [this]() { m_custom_view.trim_caches(); });
+    m_memory.addConsumer("tree-cache", MemoryGovernor::SHED_TREE_CACHES,
+                         [this]() {
+                             TreeMemoryUsage u = m_tree.getMemoryUsage();
+                             return u.unpackedCache + u.trigramIndex;
+                         },
+                         [this]() { m_tree.releaseCaches(); });
+    m_memory.addConsumer("tree", MemoryGovernor::SHED_TREE_PACK,
+                         [this]() {
+                             TreeMemoryUsage u = m_tree.getMemoryUsage();
+                             return u.total() - u.unpackedCache - u.trigramIndex;
+                         },
+                         [this]() { m_tree.releaseMemory(); });
+
+    // Система сообщает о нехватке памяти раньше, чем GNOME предложит закрыть окно
+    m_memory_monitor = Gio::MemoryMonitor::dup_default();
+    if (m_memory_monitor) {
+        m_low_memory = m_memory_monitor->signal_low_memory_warning().connect(
+            [this](Gio::MemoryMonitor::WarningLevel level) {
+                int shed = m_memory.onLowMemory(static_cast<int>(level));
+                if (shed > 0) set_status("Low memory: released editor caches");
+            });
+    }
+}
+
+bool EditorWindow::is_modified() const {
+    if (m_tree.getTextVersion() == m_saved_text_version) return false;
+    if (!m_saved_hash_known) return true;
+    // Правка длину почти всегда меняет; хэш нужен только, чтобы заметить возврат к сохранённому
+    int length = m_tree.getRoot() ? m_tree.getRoot()->getLength() : 0;
+    if (length != m_saved_length) return true;
+    return m_tree.getContentHash() != m_saved_hash; // O(log M + L): остальные хэши уже в узлах
+}
+
+void EditorWindow::update_title() {
+    set_title(is_modified() ? "* " + m_doc_name : m_doc_name);
+}
+
 
 void EditorWindow::on_path_entry_changed() {
     auto path = m_file_entry.get_text();
@@ -161,6 +339,7 @@ void EditorWindow::on_path_entry_changed() {
     m_btn_save_bin.set_sensitive(ok);
     m_btn_load_txt.set_sensitive(ok);
     m_btn_save_txt.set_sensitive(ok);
+    m_btn_compare.set_sensitive(ok);
 }
 
 void EditorWindow::on_file_entry_activate() {
@@ -185,6 +364,7 @@ void EditorWindow::on_load_binary() {
         m_custom_view.grab_focus();
 
         bf.close();
+        mark_saved(path);
         set_status("Loaded binary: " + path);
     } catch (const std::ios_base::failure& e) {
         set_status(std::string("File I/O error: ") + e.what());
@@ -204,6 +384,7 @@ void EditorWindow::on_save_binary() {
         if (!bf.openFile(path.c_str())) { set_status("Err open: " + path); return; }
         bf.saveTree(m_tree);
         bf.close();
+        mark_saved(path);
         set_status("Saved binary: " + path);
     } catch (const std::ios_base::failure& e) {
         set_status(std::string("File I/O error: ") + e.what());
@@ -252,10 +433,16 @@ void EditorWindow::on_load_text() {
             current_pos += static_cast<int>(read_bytes); // обновляем позицию
         }
 
+        // Большие документы (логи) ищут много раз: триграммный индекс соберётся
+        // при первом поиске, дальше проверяются только листья-кандидаты
+        const int TRIGRAM_INDEX_MIN_BYTES = 64 << 20;
+        m_tree.setTrigramIndex(current_pos >= TRIGRAM_INDEX_MIN_BYTES);
+
         m_custom_view.reload_from_tree();
         m_custom_view.grab_focus();
         m_syncing = false;
 
+        mark_saved(path);
         set_status("Loaded txt: " + path);
     } catch (const std::ios_base::failure& e) {
         set_status(std::string("File I/O error: ") + e.what());
@@ -275,6 +462,7 @@ void EditorWindow::on_save_text() {
         if (!m_tree.getRoot()) {
             // пустое дерево → создаём пустой файл
             out.close();
+            mark_saved(path);
             set_status("Saved txt (empty): " + path);
             return;
         }
@@ -289,6 +477,7 @@ void EditorWindow::on_save_text() {
             delete[] buf;//NOSONAR  // освобождаем память
         }
 
+        mark_saved(path);
         set_status("Saved txt: " + path);
 
     } catch (const std::ios_base::failure& e) {
@@ -299,7 +488,212 @@ void EditorWindow::on_save_text() {
 }
 
 
+void EditorWindow::on_compare_binary() {
+    std::string path = m_file_entry.get_text();
+    if (path.empty()) { set_status("Provide path..."); return; }
+
+    try {
+        BinaryTreeFile bf;
+        if (!bf.openFile(path.c_str())) { set_status("Cannot open binary: " + path); return; }
+        Tree other;
+        bf.loadTree(other);
+        bf.close();
+
+        // Совпадающие поддеревья отсекаются по хэшам, текст читается только вокруг расхождений
+        std::vector<DiffHunk> hunks = Tree::diff(other, m_tree);
+        if (hunks.empty()) { set_status("No differences with " + path); return; }
+
+        // Показываем не больше MAX_SHOWN байт каждой стороны расхождения
+        static const int MAX_SHOWN = 4096;
+        auto append_side = [](std::ostringstream& out, const Tree& tree, int offset, int len, char sign) {
+            int shown = std::min(len, MAX_SHOWN);
+            char* buf = tree.getTextRange(offset, shown);
+            std::istringstream lines(std::string(buf, static_cast<size_t>(shown)));
+            delete[] buf; //NOSONAR
+            std::string line;
+            while (std::getline(lines, line)) out << sign << line << '\n';
+            if (shown < len) out << sign << "...\n";
+        };
+
+        std::ostringstream report;
+        for (const DiffHunk& h : hunks) {
+            report << "@@ -" << (other.getLineForOffset(h.offsetA) + 1)
+                   << " +" << (m_tree.getLineForOffset(h.offsetB) + 1) << " @@\n";
+            if (h.lengthA > 0) append_side(report, other, h.offsetA, h.lengthA, '-');
+            if (h.lengthB > 0) append_side(report, m_tree, h.offsetB, h.lengthB, '+');
+        }
+
+        auto win = new Gtk::Window(); //NOSONAR
+        win->set_default_size(700, 450);
+        win->set_transient_for(*this);
+        win->set_title("Differences: " + Glib::path_get_basename(path));
+
+        auto sc = Gtk::make_managed<Gtk::ScrolledWindow>();
+        sc->set_policy(Gtk::PolicyType::AUTOMATIC, Gtk::PolicyType::AUTOMATIC);
+
+        auto tv = Gtk::make_managed<Gtk::TextView>();
+        tv->set_editable(false);
+        tv->set_wrap_mode(Gtk::WrapMode::NONE);
+        tv->get_style_context()->add_class("monospace");
+        sc->set_child(*tv);
+        win->set_child(*sc);
+
+        tv->get_buffer()->set_text(report.str());
+
+        win->signal_hide().connect([win]() { delete win; }); //NOSONAR
+        win->present();
+        set_status(std::to_string(hunks.size()) + " difference(s) with " + path);
+    } catch (const std::ios_base::failure& e) {
+        set_status(std::string("File I/O error: ") + e.what());
+    } catch (const std::invalid_argument& e) {
+        set_status(std::string("Invalid argument: ") + e.what());
+    } catch (const std::bad_alloc&) {
+        set_status("Memory allocation failed");
+    }
+}
+
+
 // --- Поиск и навигация  ---
+// Подсветка терминов: запрос режется по запятым, все термины ищутся одним проходом по дереву
+void EditorWindow::on_highlight_toggled() {
+    if (!m_btn_highlight.get_active()) {
+        m_custom_view.set_highlight_terms({}, false);
+        set_status("Highlight off");
+        return;
+    }
+    std::vector<std::string> terms;
+    std::stringstream query(static_cast<std::string>(m_search.get_text()));
+    std::string term;
+    while (std::getline(query, term, ',')) {
+        auto first = term.find_first_not_of(' ');
+        if (first == std::string::npos) continue;
+        terms.push_back(term.substr(first, term.find_last_not_of(' ') - first + 1));
+    }
+    if (terms.empty()) {
+        m_btn_highlight.set_active(false); // снова зовёт этот обработчик
+        set_status("Highlight: enter comma-separated terms");
+        return;
+    }
+
+    bool ignoreCase = !m_btn_match_case.get_active();
+    m_custom_view.set_highlight_terms(terms, ignoreCase);
+    PatternSet set(terms, ignoreCase);
+    std::vector<int> counts(terms.size(), 0);
+    m_tree.findAllMulti(set, 0, INT_MAX, [&counts](int pattern, const SearchMatch&) {
+        ++counts[static_cast<size_t>(pattern)];
+        return true;
+    });
+    std::ostringstream status;
+    status << "Highlight:";
+    for (size_t i = 0; i < terms.size(); ++i) {
+        status << (i ? ", " : " ") << '"' << terms[i] << "\" " << counts[i];
+    }
+    set_status(status.str());
+}
+
+// Замена: только текстовый поиск (регулярное выражение не заменяется)
+void EditorWindow::on_replace_clicked() {
+    auto query = static_cast<std::string>(m_search.get_text());
+    auto with = static_cast<std::string>(m_replace.get_text());
+    if (query.empty() || m_btn_regex.get_active()) {
+        set_status(query.empty() ? "Replace: empty query" : "Replace: regular expressions are not supported");
+        return;
+    }
+    SearchCase mode = m_btn_match_case.get_active() ? SearchCase::EXACT : SearchCase::UNICODE;
+
+    // С начала выделения (найденное совпадение выделено) или от курсора
+    int selStart = 0;
+    int selLen = 0;
+    int from = m_custom_view.get_selection(selStart, selLen) ? selStart : m_custom_view.get_cursor_byte_offset();
+    int at = m_tree.replaceNext(query.c_str(), static_cast<int>(query.size()), with.c_str(),
+                                static_cast<int>(with.size()), from, mode);
+    if (at < 0) {
+        set_status("Not found: \"" + query + "\"");
+        return;
+    }
+    m_custom_view.reload_from_tree();
+
+    // Следующее совпадение — после вставленного текста
+    SearchMatch found{-1, -1, 0};
+    m_tree.findAll(query.c_str(), static_cast<int>(query.size()), at + static_cast<int>(with.size()), INT_MAX,
+                   [&found](const SearchMatch& m) {
+                       found = m;
+                       return false;
+                   }, mode);
+    if (found.offset >= 0) {
+        m_custom_view.set_cursor_byte_offset(found.offset);
+        m_custom_view.select_range_bytes(found.offset, found.length);
+        m_custom_view.scroll_to_byte_offset(found.offset);
+        set_status("Replaced; next at line " + std::to_string(found.line + 1));
+    } else {
+        m_custom_view.clear_selection();
+        m_custom_view.set_cursor_byte_offset(at + static_cast<int>(with.size()));
+        set_status("Replaced; no more matches");
+    }
+}
+
+void EditorWindow::on_replace_all_clicked() {
+    auto query = static_cast<std::string>(m_search.get_text());
+    auto with = static_cast<std::string>(m_replace.get_text());
+    if (query.empty() || m_btn_regex.get_active()) {
+        set_status(query.empty() ? "Replace: empty query" : "Replace: regular expressions are not supported");
+        return;
+    }
+    SearchCase mode = m_btn_match_case.get_active() ? SearchCase::EXACT : SearchCase::UNICODE;
+    try {
+        int n = m_tree.replaceAll(query.c_str(), static_cast<int>(query.size()), with.c_str(),
+                                  static_cast<int>(with.size()), 0, INT_MAX, mode);
+        m_custom_view.clear_selection();
+        m_custom_view.reload_from_tree();
+        set_status("Replaced " + std::to_string(n) + " occurrence(s)");
+    } catch (const std::bad_alloc&) {
+        set_status("Memory allocation failed while replacing");
+    }
+}
+
+namespace {
+
+// Начало строки, в которой лежит offset
+int lineStartOf(const Tree& tree, int offset) {
+    return tree.getOffsetForLine(tree.getLineForOffset(offset));
+}
+
+// Начало следующей строки после offset или конец документа
+int lineEndOf(const Tree& tree, int offset, int docLen) {
+    int next = tree.getLineForOffset(offset) + 1;
+    return next < tree.getTotalLineCount() ? tree.getOffsetForLine(next) : docLen;
+}
+
+} // namespace
+
+// Поиск по мере набора. SearchEntry сам откладывает сигнал до паузы в наборе;
+// каждый новый запрос отменяет идущий поиск.
+void EditorWindow::on_search_changed() {
+    cancel_search();
+    auto query = static_cast<std::string>(m_search.get_text());
+    bool regex = m_btn_regex.get_active();
+    // Пустой запрос и номер строки ждут Enter
+    bool is_number = !regex && std::all_of(query.begin(), query.end(), [](char c) {
+        return std::isdigit(static_cast<unsigned char>(c)) != 0;
+    });
+    if (query.empty() || is_number) {
+        m_search_last.clear();
+        return;
+    }
+
+    // Запрос дописан: совпадение нового начинается с совпадения прошлого. Прошлый не нашёлся
+    // во всём документе — новый не найдётся тоже. Если нашёлся, он выделен, и поиск
+    // и так начнётся с него.
+    bool exact = !regex && m_btn_match_case.get_active();
+    if (exact && !m_search_last_found && !m_search_last.empty() && m_search_last_version == m_tree.getVersion() &&
+        query.compare(0, m_search_last.size(), m_search_last) == 0) {
+        m_search_last = query;
+        set_status("Not found: \"" + query + "\"");
+        return;
+    }
+    start_search(query, search_origin(false), true, false);
+}
+
 void EditorWindow::on_search_activate() {
     auto queryStr = static_cast<std::string>(m_search.get_text());
     if (queryStr.empty()) {
@@ -308,7 +702,7 @@ void EditorWindow::on_search_activate() {
     }
 
     // --- Поиск по номеру строки (1-based) ---
-    bool is_number = true;
+    bool is_number = !m_btn_regex.get_active();
     for (char c : queryStr) {
         if (!std::isdigit(static_cast<unsigned char>(c))) {
             is_number = false;
@@ -317,6 +711,7 @@ void EditorWindow::on_search_activate() {
     }
 
     if (is_number) {
+        cancel_search();
         try {
             long val = std::stol(queryStr);
             if (val <= 0) {
@@ -332,40 +727,173 @@ void EditorWindow::on_search_activate() {
         return;
     }
 
-    // --- Текстовый поиск через дерево (возвращает номер строки) ---
-    const char* pattern = queryStr.c_str();
-    auto patternLen = static_cast<int>(queryStr.size());
+    // --- Следующее совпадение после выделенного (текст или регулярное выражение) ---
+    start_search(queryStr, search_origin(true), true, true);
+}
 
-    // Ищем номер строки (0-based), где начинается совпадение
-    int lineNumber = m_tree.findSubstringLine(pattern, patternLen);
-    if (lineNumber == -1) {
-        set_status("Not found: \"" + queryStr + "\"");
+void EditorWindow::on_search_next() {
+    auto query = static_cast<std::string>(m_search.get_text());
+    if (query.empty()) {
+        set_status("Search: empty");
         return;
     }
+    start_search(query, search_origin(true), true, false);
+}
 
-    // Получаем строку из дерева (char* — нужно delete[])
-    char* lineBuf = m_tree.getLine(lineNumber);
-    if (!lineBuf) {
-        set_status("Found line but failed to get its text");
+void EditorWindow::on_search_previous() {
+    auto query = static_cast<std::string>(m_search.get_text());
+    if (query.empty()) {
+        set_status("Search: empty");
         return;
     }
-    std::string lineStr(lineBuf);
-    delete[] lineBuf; // NOSONAR
+    start_search(query, search_origin(false), false, false);
+}
 
-    // Найдём байтовую позицию совпадения внутри строки (байтовый поиск корректен для UTF-8)
-    std::size_t localBytePos = lineStr.find(queryStr);
-    if (localBytePos == std::string::npos) {
-        set_status("Found line, but substring not found inside it (unexpected)");
-        return;
+int EditorWindow::search_origin(bool pastSelection) const {
+    // Выделено — найденное совпадение: следующее ищется с байта после его начала
+    int selStart = 0;
+    int selLen = 0;
+    if (m_custom_view.get_selection(selStart, selLen)) return pastSelection ? selStart + 1 : selStart;
+    return m_custom_view.get_cursor_byte_offset();
+}
+
+void EditorWindow::cancel_search() {
+    m_search_idle.disconnect();
+    m_search_run.reset();
+}
+
+void EditorWindow::start_search(const std::string& query, int origin, bool forward, bool focus) {
+    cancel_search();
+    auto run = std::make_unique<SearchRun>();
+    run->query = query;
+    run->mode = m_btn_match_case.get_active() ? SearchCase::EXACT : SearchCase::UNICODE;
+    if (m_btn_regex.get_active()) {
+        try {
+            run->re = std::make_unique<Regex>(query, run->mode != SearchCase::EXACT);
+        } catch (const std::invalid_argument& e) {
+            set_status(e.what());
+            return;
+        }
+    }
+    int docLen = m_tree.getStats().bytes;
+    run->forward = forward;
+    run->focus = focus;
+    run->origin = std::clamp(origin, 0, docLen);
+    run->pos = run->origin;
+    run->limit = forward ? docLen : 0;
+    run->version = m_tree.getVersion();
+    m_search_run = std::move(run);
+
+    // Первый кусок сразу: обычно совпадение рядом, и ответ приходит без круга через idle.
+    // Остальные — с приоритетом idle, ввод и отрисовка идут раньше них.
+    if (on_search_slice()) {
+        m_search_idle = Glib::signal_idle().connect(sigc::mem_fun(*this, &EditorWindow::on_search_slice));
+    }
+}
+
+bool EditorWindow::on_search_slice() {
+    SearchRun& run = *m_search_run;
+    int docLen = m_tree.getStats().bytes;
+
+    // Документ правили между кусками: смещения устарели, поиск заново от точки старта
+    if (run.version != m_tree.getVersion()) {
+        run.version = m_tree.getVersion();
+        run.origin = std::min(run.origin, docLen);
+        run.pos = run.origin;
+        run.limit = run.forward ? docLen : 0;
+        run.wrapped = false;
+        run.scanned = 0;
+    }
+
+    const char* pattern = run.query.c_str();
+    auto len = static_cast<int>(run.query.size());
+    SearchMatch found{-1, -1, 0};
+    int next = run.limit; // pos следующего куска
+    if (run.forward) {
+        int hi = run.limit;
+        if (run.limit - run.pos > SearchRun::SLICE_BYTES) {
+            hi = run.pos + SearchRun::SLICE_BYTES;
+            if (run.lineAligned()) hi = std::min(run.limit, lineEndOf(m_tree, hi, docLen));
+            if (hi < run.limit) next = run.lineAligned() ? hi : std::max(run.pos + 1, hi - len + 1);
+        }
+        auto takeFirst = [&found](const SearchMatch& m) {
+            found = m;
+            return false;
+        };
+        if (run.re) {
+            m_tree.findAllRegex(*run.re, run.pos, hi, takeFirst);
+        } else {
+            m_tree.findAll(pattern, len, run.pos, hi, takeFirst, run.mode);
+        }
+        run.scanned += hi - run.pos;
+    } else {
+        int lo = run.limit;
+        if (run.pos - run.limit > SearchRun::SLICE_BYTES) {
+            lo = run.pos - SearchRun::SLICE_BYTES;
+            if (run.lineAligned()) lo = std::max(run.limit, lineStartOf(m_tree, lo));
+            if (lo > run.limit) next = run.lineAligned() ? lo : std::min(run.pos - 1, lo + len - 1);
+        }
+        // Назад — без прохода от начала: текст ищет Tree::findLast, регулярное
+        // выражение — последнее совпадение в куске
+        if (run.re) {
+            m_tree.findAllRegex(*run.re, lo, run.pos, [&found](const SearchMatch& m) {
+                found = m;
+                return true;
+            });
+        } else {
+            m_tree.findLast(pattern, len, lo, run.pos, run.mode, &found);
+        }
+        run.scanned += run.pos - lo;
     }
 
+    bool done = found.offset >= 0;
+    if (!done) {
+        run.pos = next;
+        if (run.pos != run.limit) {
+            set_status("Searching \"" + run.query + "\"... " +
+                       std::to_string(std::min<long long>(99, run.scanned * 100 / std::max(1, docLen))) + "%");
+            return true;
+        }
+        // Проход кончился: второй — по кругу до точки старта, с нахлёстом на неё
+        if (!run.wrapped && run.origin != (run.forward ? 0 : docLen)) {
+            run.wrapped = true;
+            if (run.forward) {
+                run.pos = 0;
+                run.limit = run.lineAligned() ? lineEndOf(m_tree, run.origin, docLen) : std::min(docLen, run.origin + len - 1);
+            } else {
+                run.pos = docLen;
+                run.limit = run.lineAligned() ? lineStartOf(m_tree, run.origin) : std::max(0, run.origin - len + 1);
+            }
+            return true;
+        }
+        done = true;
+    }
+
+    // Итог точного поиска — для запроса, который продолжат набирать
+    if (!run.re && run.mode == SearchCase::EXACT) {
+        m_search_last = run.query;
+        m_search_last_found = found.offset >= 0;
+        m_search_last_version = run.version;
+    } else {
+        m_search_last.clear();
+    }
+    if (found.offset >= 0) {
+        show_match(found, run.focus);
+    } else {
+        set_status("Not found: \"" + run.query + "\"");
+    }
+    m_search_run.reset();
+    return false;
+}
+
+void EditorWindow::show_match(const SearchMatch& m, bool focus) {
+    int lineNumber = m.line;
+
     // Устанавливаем курсор в CustomTextView на позицию начала совпадения
-    int lineStart = m_tree.getOffsetForLine(lineNumber);
-    int bytePos = lineStart + static_cast<int>(localBytePos);
-    m_custom_view.set_cursor_byte_offset(bytePos);
-    m_custom_view.select_range_bytes(bytePos, patternLen);
-    m_custom_view.scroll_to_byte_offset(bytePos);
-    m_custom_view.grab_focus(); // не обязательно, но удобно
+    m_custom_view.set_cursor_byte_offset(m.offset);
+    m_custom_view.select_range_bytes(m.offset, m.length);
+    m_custom_view.scroll_to_byte_offset(m.offset);
+    if (focus) m_custom_view.grab_focus(); // при наборе фокус остаётся в поле поиска
     
     // Прокрутка: установим вертикальную позицию ScrolledWindow по номеру строки
     if (auto vadj = m_scrolled.get_vadjustment()) {
@@ -397,7 +925,8 @@ void EditorWindow::go_to_line_index(int lineIndex0Based) {
 
     // Скроллим ScrolledWindow к нужной строке
     if (auto vadj = m_scrolled.get_vadjustment()) {
-        int y = lineIndex0Based * m_custom_view.get_line_height_for_ui();
+        // ряд на экране, а не номер строки: свёрнутые строки места не занимают
+        int y = m_tree.lineToVisibleRow(lineIndex0Based) * m_custom_view.get_line_height_for_ui();
         auto maxv = static_cast<int>(vadj->get_upper() - vadj->get_page_size());
         if (y < 0) y = 0;
         if (y > maxv) y = maxv;
@@ -441,12 +970,12 @@ void EditorWindow::on_show_numbers_clicked() {
 
     std::ostringstream numbered;
 
-    for (size_t i = 0; i < total_lines; ++i) {
-        int start = m_tree.getOffsetForLine(static_cast<int>(i));
-        int end   = (i + 1 < total_lines) ? m_tree.getOffsetForLine(static_cast<int>(i) + 1) : total_len;
-        int len = end - start;
+    // Границы всех строк за один проход по листам (без спуска на каждую строку)
+    std::vector<LineSpan> spans = m_tree.getLineSpans(0, static_cast<int>(total_lines));
+    for (size_t i = 0; i < spans.size(); ++i) {
         // безопасно создаём строку из байт (не предполагаем \0)
-        numbered << (i + 1) << ": " << std::string(all + start, static_cast<size_t>(len));
+        numbered << (i + 1) << ": " << std::string(all + spans[i].offset, static_cast<size_t>(spans[i].length));
+        if (i + 1 < spans.size()) numbered << '\n';
     }
     delete[] all; //NOSONAR
 
@@ -2,13 +2,11 @@
 #define EDITORWINDOW_H
 
 #include <gtkmm.h>
+#include <memory>
 #include <string>
 #include "Tree.h"
 #include "CustomTextView.h"
-
-// Вспомогательная функция для подсчета слов, объявленная здесь, 
-// но определенная в .cpp для инкапсуляции.
-static size_t count_words(const std::string& s);
+#include "MemoryGovernor.h"
 
 // глубокая иерархия унаследована от GTK
 class EditorWindow : public Gtk::ApplicationWindow { // NOSONAR cpp:S110
@@ -20,6 +18,13 @@ protected:
     // Вспомогательные методы
     void apply_system_theme();
     void set_status(const std::string& s);
+    void update_stats(); // счётчики документа/выделения из сводок дерева: O(log n)
+    void mark_saved(const std::string& path); // запомнить версию и хэш сохранённого/загруженного документа
+    void update_title();  // "*" в заголовке, если документ изменён с сохранения
+    bool is_modified() const; // по версии текста и длине; хэши — только при равной длине
+    bool on_hash_slice(); // первый хэш документа кусками в простое; false — готов
+    void schedule_compaction(); // уплотнить остывшие листья, когда правки затихнут
+    void setup_memory_governor(); // потребители бюджета памяти и сигнал GMemoryMonitor
 
     // Обработчики сигналов
     void on_path_entry_changed();
@@ -31,9 +36,24 @@ protected:
     void on_save_binary();
     void on_load_text();
     void on_save_text();
+    void on_compare_binary(); // расхождения с .bin по хэшам поддеревьев
 
     // Поиск и навигация
     void on_search_activate();
+    void on_search_changed();  // поиск по мере набора
+    void on_search_next();     // от курсора вперёд (Enter, Ctrl+G)
+    void on_search_previous(); // от курсора назад (Shift+Ctrl+G)
+    // Квантованный поиск: кусок текста за вызов idle, между кусками GTK обрабатывает ввод.
+    // Новый запуск отменяет идущий.
+    // focus — после находки перевести фокус в текст (Enter); при наборе фокус остаётся в поле.
+    void start_search(const std::string& query, int origin, bool forward, bool focus);
+    bool on_search_slice(); // false — поиск окончен
+    void cancel_search();
+    int search_origin(bool pastSelection) const; // начало выделения (+1) или курсор
+    void show_match(const SearchMatch& m, bool focus); // выделить, прокрутить, строка в статусе
+    void on_highlight_toggled();
+    void on_replace_clicked();     // заменить выделенное совпадение и перейти к следующему
+    void on_replace_all_clicked(); // все совпадения одной правкой дерева
     void on_show_numbers_clicked();
     void go_to_line_index(int lineIndex0Based);
 
@@ -43,6 +63,26 @@ private:
     std::string m_last_text;      // байтовая копия текста (UTF-8 bytes)
     bool m_syncing = false;       // если true — игнорировать изменения буфера (программные обновления)
     int m_edit_ops_count = 0;     // счетчик операций (для ребаланса)
+    ContentHash m_saved_hash;     // хэш содержимого на момент загрузки/сохранения
+    bool m_saved_hash_known = true; // false — хэш ещё считается (или текст правили раньше, чем он досчитался)
+    unsigned long m_saved_text_version = 0;
+    int m_saved_length = 0;
+    sigc::connection m_hash_idle;
+    std::string m_doc_name = "Untitled";
+    sigc::connection m_compact_timer;
+    sigc::connection m_rebuild_poll; // ожидание фоновой перестройки дерева
+    MemoryGovernor m_memory;
+    Glib::RefPtr<Gio::MemoryMonitor> m_memory_monitor;
+    sigc::connection m_low_memory;
+
+    // Идущий поиск в заголовке (nullptr — нет) и итог последнего завершённого точного
+    // поиска: если прошлый запрос не нашёлся нигде, его продолжение не ищется вовсе
+    struct SearchRun;
+    std::unique_ptr<SearchRun> m_search_run;
+    sigc::connection m_search_idle;
+    std::string m_search_last;
+    bool m_search_last_found = false;
+    unsigned long m_search_last_version = 0;
 
 
     // Элементы пользовательского интерфейса
@@ -53,11 +93,19 @@ private:
     Gtk::Button m_btn_save_bin;
     Gtk::Button m_btn_load_txt;
     Gtk::Button m_btn_save_txt;
+    Gtk::Button m_btn_compare;
     Gtk::SearchEntry m_search;                 
+    Gtk::ToggleButton m_btn_regex{".*"};        // поиск регулярным выражением
+    Gtk::ToggleButton m_btn_match_case{"Aa"};   // учитывать регистр
+    Gtk::ToggleButton m_btn_highlight{"Hi"};    // подсветить все термины запроса через запятую
+    Gtk::Entry m_replace;                       // текст замены
+    Gtk::Button m_btn_replace{"Replace"};
+    Gtk::Button m_btn_replace_all{"All"};
     Gtk::Button m_btn_show_numbers{"#️Lines"};
     Gtk::ScrolledWindow m_scrolled;
     CustomTextView m_custom_view;
     Gtk::Label m_status;
+    Gtk::Label m_stats;
 };
 
 #endif // EDITORWINDOW_H
\ No newline at end of file
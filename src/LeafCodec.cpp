@@ -0,0 +1,172 @@
+#include "LeafCodec.h"
+#include "Tree.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    const int MIN_MATCH = 4;
+    const int HASH_BITS = 12;
+    const int MAX_OFFSET = 65535;
+
+    inline std::uint32_t read32(const char* p) {
+        std::uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline unsigned hashOf(std::uint32_t seq) {
+        return (seq * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    // Длина >= 15 продолжается байтами по 255 и остатком
+    inline bool putLength(int value, char* dst, int& pos, int cap) {
+        for (value -= 15; value >= 255; value -= 255) {
+            if (pos >= cap) return false;
+            dst[pos++] = static_cast<char>(255);
+        }
+        if (pos >= cap) return false;
+        dst[pos++] = static_cast<char>(value);
+        return true;
+    }
+
+    inline bool getLength(const unsigned char*& ip, const unsigned char* end, int& value) {
+        unsigned char b;
+        do {
+            if (ip >= end) return false;
+            b = *ip++;
+            value += b;
+            if (value < 0) return false;
+        } while (b == 255);
+        return true;
+    }
+
+    std::atomic<unsigned long> g_nextPackId{1};
+}
+
+unsigned long LeafCodec::nextPackId() {
+    return g_nextPackId.fetch_add(1, std::memory_order_relaxed);
+}
+
+int LeafCodec::compress(const char* src, int len, char* dst, int cap) {
+    int table[1 << HASH_BITS];
+    std::memset(table, -1, sizeof(table));
+
+    int out = 0;
+    int anchor = 0;
+    int i = 0;
+    // Последовательность: токен, [длина литералов], литералы, [смещение, длина совпадения]
+    auto emit = [&](int matchOffset, int matchLen) {
+        int litLen = i - anchor;
+        if (out >= cap) return false;
+        int token = out++;
+        int litCode = litLen < 15 ? litLen : 15;
+        int matchCode = 0;
+        if (matchLen > 0) matchCode = (matchLen - MIN_MATCH) < 15 ? matchLen - MIN_MATCH : 15;
+        dst[token] = static_cast<char>((litCode << 4) | matchCode);
+        if (litCode == 15 && !putLength(litLen, dst, out, cap)) return false;
+        if (out + litLen > cap) return false;
+        std::memcpy(dst + out, src + anchor, static_cast<size_t>(litLen));
+        out += litLen;
+        if (matchLen == 0) return true;
+        if (out + 2 > cap) return false;
+        dst[out++] = static_cast<char>(matchOffset & 0xFF);
+        dst[out++] = static_cast<char>(matchOffset >> 8);
+        return matchCode < 15 || putLength(matchLen - MIN_MATCH, dst, out, cap);
+    };
+
+    while (i + MIN_MATCH <= len) {
+        std::uint32_t seq = read32(src + i);
+        unsigned h = hashOf(seq);
+        int cand = table[h];
+        table[h] = i;
+        if (cand < 0 || i - cand > MAX_OFFSET || read32(src + cand) != seq) {
+            ++i;
+            continue;
+        }
+        int m = MIN_MATCH;
+        while (i + m < len && src[cand + m] == src[i + m]) ++m;
+        if (!emit(i - cand, m)) return 0;
+        i += m;
+        anchor = i;
+    }
+    i = len;
+    if (!emit(0, 0)) return 0;
+    return out;
+}
+
+bool LeafCodec::decompress(const char* src, int srcLen, char* dst, int dstLen) {
+    auto ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = ip + srcLen;
+    int op = 0;
+    while (ip < end) {
+        unsigned token = *ip++;
+        int litLen = static_cast<int>(token >> 4);
+        if (litLen == 15 && !getLength(ip, end, litLen)) return false;
+        if (litLen > end - ip || litLen > dstLen - op) return false;
+        std::memcpy(dst + op, ip, static_cast<size_t>(litLen));
+        ip += litLen;
+        op += litLen;
+        if (ip == end) break; // последняя последовательность — только литералы
+
+        if (end - ip < 2) return false;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int matchLen = static_cast<int>(token & 15);
+        if (matchLen == 15 && !getLength(ip, end, matchLen)) return false;
+        matchLen += MIN_MATCH;
+        if (offset == 0 || offset > op || matchLen > dstLen - op) return false;
+        // Совпадение может перекрывать само себя — копируем побайтно
+        const char* from = dst + op - offset;
+        for (int k = 0; k < matchLen; ++k) dst[op + k] = from[k];
+        op += matchLen;
+    }
+    return op == dstLen;
+}
+
+// ==========================================
+// Кэш распакованных листьев
+// ==========================================
+
+UnpackedLeafCache::~UnpackedLeafCache() {
+    clear();
+}
+
+void UnpackedLeafCache::clear() {
+    for (Entry& e : m_entries) {
+        delete[] e.bytes; // NOSONAR
+        e = Entry();
+    }
+}
+
+std::size_t UnpackedLeafCache::residentBytes() const {
+    std::size_t total = 0;
+    for (const Entry& e : m_entries) {
+        if (e.bytes) total += static_cast<std::size_t>(e.length);
+    }
+    return total;
+}
+
+const char* UnpackedLeafCache::get(const LeafNode* leaf) {
+    Entry* victim = &m_entries[0];
+    for (Entry& e : m_entries) {
+        if (e.bytes && e.id == leaf->packId) {
+            e.used = ++m_tick;
+            return e.bytes;
+        }
+        if (!e.bytes || (victim->bytes && e.used < victim->used)) victim = &e;
+    }
+
+    auto bytes = new char[leaf->length > 0 ? leaf->length : 1]; // NOSONAR
+    if (!LeafCodec::decompress(leaf->packed, leaf->packedLength, bytes, leaf->length)) {
+        delete[] bytes; // NOSONAR
+        throw std::runtime_error("Corrupted packed leaf");
+    }
+    delete[] victim->bytes; // NOSONAR
+    victim->id = leaf->packId;
+    victim->bytes = bytes;
+    victim->length = leaf->length;
+    victim->used = ++m_tick;
+    return bytes;
+}
@@ -0,0 +1,49 @@
+#ifndef LEAF_CODEC_H
+#define LEAF_CODEC_H
+
+#include <cstddef>
+
+struct LeafNode;
+
+// Быстрый блочный LZ-кодек для холодных листьев (формат в духе LZ4: токен
+// «литералы + совпадение», смещение до 64 КБ). Текст и логи сжимаются в разы,
+// распаковка — копирование байтов без энтропийного кодирования.
+struct LeafCodec {
+    // Сжать src в dst (ёмкость cap); 0 — не поместилось
+    static int compress(const char* src, int len, char* dst, int cap); // O(len)
+    // Распаковать ровно dstLen байт; false — повреждённый поток
+    static bool decompress(const char* src, int srcLen, char* dst, int dstLen); // O(dstLen)
+    // Уникальный ключ сжатого листа для кэша (потокобезопасно: листья сжимает и рабочий поток)
+    static unsigned long nextPackId();
+};
+
+// Кэш распакованных листьев: несколько последних, вытесняется самый давний.
+// Ключ — packId листа, а не адрес: удалённый лист просто устаревает в кэше,
+// даже если его удалил поток NodeReclaimer, а адрес занял новый лист.
+// Указатель от get() живёт, пока не случится CAPACITY - 1 промахов.
+class UnpackedLeafCache {
+public:
+    static const int CAPACITY = 16;
+
+    UnpackedLeafCache() = default;
+    ~UnpackedLeafCache();
+
+    UnpackedLeafCache(const UnpackedLeafCache&) = delete;
+    UnpackedLeafCache& operator=(const UnpackedLeafCache&) = delete;
+
+    const char* get(const LeafNode* leaf); // O(CAPACITY); промах — O(length) на распаковку
+    void clear();                          // O(CAPACITY)
+    std::size_t residentBytes() const;     // O(CAPACITY)
+
+private:
+    struct Entry {
+        unsigned long id = 0;
+        char* bytes = nullptr;
+        int length = 0;
+        unsigned long used = 0;
+    };
+    Entry m_entries[CAPACITY];
+    unsigned long m_tick = 0;
+};
+
+#endif // LEAF_CODEC_H
@@ -0,0 +1,334 @@
+#include "MarkerSet.h"
+#include <algorithm>
+
+// ==========================================
+// Вспомогательные операции декартова дерева
+// ==========================================
+
+unsigned MarkerSet::nextPriority() {
+    // xorshift32 — достаточно для балансировки
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    return m_seed;
+}
+
+void MarkerSet::applyZero(MarkerNode* n) {
+    if (!n) return;
+    n->gap = 0;
+    n->sum = 0;
+    n->zeroTag = true;
+}
+
+void MarkerSet::push(MarkerNode* n) {
+    if (n && n->zeroTag) {
+        applyZero(n->left);
+        applyZero(n->right);
+        n->zeroTag = false;
+    }
+}
+
+void MarkerSet::pull(MarkerNode* n) {
+    if (!n) return;
+    n->sum = n->gap + sumOf(n->left) + sumOf(n->right);
+    if (n->left) n->left->parent = n;
+    if (n->right) n->right->parent = n;
+}
+
+MarkerNode* MarkerSet::merge(MarkerNode* a, MarkerNode* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        push(a);
+        a->right = merge(a->right, b);
+        pull(a);
+        return a;
+    }
+    push(b);
+    b->left = merge(a, b->left);
+    pull(b);
+    return b;
+}
+
+void MarkerSet::split(MarkerNode* t, int base, int limit, bool inclusive,
+                      MarkerNode*& l, MarkerNode*& r) {
+    if (!t) {
+        l = r = nullptr;
+        return;
+    }
+    push(t);
+    int pos = base + sumOf(t->left) + t->gap;
+    if (inclusive ? pos <= limit : pos < limit) {
+        split(t->right, pos, limit, inclusive, t->right, r);
+        l = t;
+        pull(t);
+    } else {
+        split(t->left, base, limit, inclusive, l, t->left);
+        r = t;
+        pull(t);
+    }
+    if (l) l->parent = nullptr;
+    if (r) r->parent = nullptr;
+}
+
+// Сдвинуть первый (самый левый) маркер поддерева, а с ним и все последующие
+void MarkerSet::addToFirst(MarkerNode* t, int delta) {
+    if (!t || delta == 0) return;
+    std::vector<MarkerNode*> spine;
+    MarkerNode* n = t;
+    while (n) {
+        push(n);
+        spine.push_back(n);
+        n = n->left;
+    }
+    spine.back()->gap += delta;
+    for (auto it = spine.rbegin(); it != spine.rend(); ++it) pull(*it);
+}
+
+// Протолкнуть отложенные обнуления от корня до n
+void MarkerSet::pushPath(MarkerNode* n) {
+    std::vector<MarkerNode*> path;
+    for (MarkerNode* p = n; p; p = p->parent) path.push_back(p);
+    for (auto it = path.rbegin(); it != path.rend(); ++it) push(*it);
+}
+
+void MarkerSet::destroy(MarkerNode* t) {
+    std::vector<MarkerNode*> stack;
+    if (t) stack.push_back(t);
+    while (!stack.empty()) {
+        MarkerNode* n = stack.back();
+        stack.pop_back();
+        if (n->left) stack.push_back(n->left);
+        if (n->right) stack.push_back(n->right);
+        delete n; // NOSONAR
+    }
+}
+
+MarkerSet::~MarkerSet() {
+    destroy(m_roots[0]);
+    destroy(m_roots[1]);
+}
+
+// ==========================================
+// Вставка/удаление отдельных маркеров
+// ==========================================
+
+void MarkerSet::insertNode(MarkerNode* node, int offset) {
+    if (offset < 0) offset = 0;
+    MarkerNode*& root = rootFor(node->gravity);
+
+    MarkerNode* l = nullptr;
+    MarkerNode* r = nullptr;
+    split(root, 0, offset, true, l, r);
+
+    node->left = node->right = node->parent = nullptr;
+    node->zeroTag = false;
+    node->gap = offset - sumOf(l);
+    node->sum = node->gap;
+    // следующий маркер теперь отсчитывается от нового
+    addToFirst(r, -node->gap);
+
+    root = merge(merge(l, node), r);
+    root->parent = nullptr;
+}
+
+void MarkerSet::detachNode(MarkerNode* node) {
+    pushPath(node);
+    MarkerNode*& root = rootFor(node->gravity);
+
+    int g = node->gap;
+    MarkerNode* parent = node->parent;
+    if (node->right) {
+        addToFirst(node->right, g); // преемник внутри правого поддерева
+    } else {
+        // преемник — первый предок, в левом поддереве которого лежит node
+        MarkerNode* child = node;
+        MarkerNode* p = parent;
+        while (p && p->right == child) {
+            child = p;
+            p = p->parent;
+        }
+        if (p) p->gap += g;
+    }
+
+    MarkerNode* sub = merge(node->left, node->right);
+    if (!parent) {
+        root = sub;
+    } else if (parent->left == node) {
+        parent->left = sub;
+    } else {
+        parent->right = sub;
+    }
+    if (sub) sub->parent = parent;
+    for (MarkerNode* p = parent; p; p = p->parent) pull(p);
+    if (root) root->parent = nullptr;
+}
+
+// ==========================================
+// Публичный интерфейс
+// ==========================================
+
+int MarkerSet::create(int offset, MarkerGravity gravity) {
+    auto node = new MarkerNode(); // NOSONAR
+    node->priority = nextPriority();
+    node->gravity = gravity;
+
+    if (!m_freeIds.empty()) {
+        node->id = m_freeIds.back();
+        m_freeIds.pop_back();
+        m_byId[node->id] = node;
+    } else {
+        node->id = static_cast<int>(m_byId.size());
+        m_byId.push_back(node);
+    }
+
+    insertNode(node, offset);
+    ++m_count;
+    return node->id;
+}
+
+void MarkerSet::remove(int id) {
+    if (id < 0 || id >= static_cast<int>(m_byId.size()) || !m_byId[id]) return;
+    MarkerNode* node = m_byId[id];
+    detachNode(node);
+    m_byId[id] = nullptr;
+    m_freeIds.push_back(id);
+    --m_count;
+    delete node; // NOSONAR
+}
+
+int MarkerSet::offsetOf(int id) const {
+    if (id < 0 || id >= static_cast<int>(m_byId.size()) || !m_byId[id]) return -1;
+    MarkerNode* node = m_byId[id];
+    pushPath(node);
+
+    int pos = sumOf(node->left) + node->gap;
+    for (MarkerNode* n = node; n->parent; n = n->parent) {
+        if (n->parent->right == n) pos += sumOf(n->parent->left) + n->parent->gap;
+    }
+    return pos;
+}
+
+void MarkerSet::move(int id, int offset) {
+    if (id < 0 || id >= static_cast<int>(m_byId.size()) || !m_byId[id]) return;
+    MarkerNode* node = m_byId[id];
+    detachNode(node);
+    insertNode(node, offset);
+}
+
+int MarkerSet::count() const { return m_count; }
+
+void MarkerSet::onInsert(int pos, int len) {
+    if (len <= 0) return;
+    for (int g = 0; g < 2; ++g) {
+        // LEFT-маркеры в pos остаются на месте, RIGHT — уезжают вместе с текстом
+        bool inclusive = (g == static_cast<int>(MarkerGravity::LEFT));
+        MarkerNode* l = nullptr;
+        MarkerNode* r = nullptr;
+        split(m_roots[g], 0, pos, inclusive, l, r);
+        addToFirst(r, len);
+        m_roots[g] = merge(l, r);
+        if (m_roots[g]) m_roots[g]->parent = nullptr;
+    }
+}
+
+void MarkerSet::onErase(int pos, int len) {
+    if (len <= 0) return;
+    for (auto& root : m_roots) {
+        MarkerNode* a = nullptr;
+        MarkerNode* rest = nullptr;
+        MarkerNode* b = nullptr;
+        MarkerNode* c = nullptr;
+        split(root, 0, pos, true, a, rest);           // a: позиция <= pos
+        int sumA = sumOf(a);
+        split(rest, sumA, pos + len, true, b, c);     // b: pos < позиция <= pos+len
+        int sumB = sumOf(b);
+
+        int pred = sumA;
+        if (b) {
+            // все маркеры удалённого диапазона схлопываются в pos
+            applyZero(b);
+            addToFirst(b, pos - sumA);
+            pred = pos;
+        }
+        // первый маркер справа сдвигается на -len относительно нового предшественника
+        addToFirst(c, sumA + sumB - len - pred);
+
+        root = merge(merge(a, b), c);
+        if (root) root->parent = nullptr;
+    }
+}
+
+void MarkerSet::collapseAll() {
+    for (MarkerNode* root : m_roots) applyZero(root);
+}
+
+void MarkerSet::onSwap(int p, int q, int r) {
+    if (p >= q || q >= r) return;
+    for (auto& root : m_roots) {
+        // a: < p, u: [p, q), v: [q, r), c: >= r
+        MarkerNode* a = nullptr;
+        MarkerNode* u = nullptr;
+        MarkerNode* v = nullptr;
+        MarkerNode* c = nullptr;
+        MarkerNode* afterA = nullptr;
+        MarkerNode* afterU = nullptr;
+        split(root, 0, p, false, a, afterA);
+        int lastA = sumOf(a);
+        split(afterA, lastA, q, false, u, afterU);
+        int lastU = lastA + sumOf(u);
+        split(afterU, lastU, r, false, v, c);
+        int lastV = lastU + sumOf(v);
+
+        // Позиции считаются от предыдущего маркера: после перестановки a, v, u, c
+        // поправляем первый gap каждого куска под его нового предшественника
+        addToFirst(v, lastU - lastA - (q - p));
+        int newLastV = v ? lastV - (q - p) : lastA;
+        addToFirst(u, lastA + (r - q) - newLastV);
+        int newLastU = u ? lastU + (r - q) : newLastV;
+        addToFirst(c, lastV - newLastU);
+
+        root = merge(merge(merge(a, v), u), c);
+        if (root) root->parent = nullptr;
+    }
+}
+
+void MarkerSet::remap(const std::function<int(int, MarkerGravity)>& map) {
+    for (int g = 0; g < 2; ++g) {
+        // Симметричный обход: позиция — сумма gap предшественников по порядку
+        std::vector<MarkerNode*> order;
+        std::vector<MarkerNode*> stack;
+        MarkerNode* n = m_roots[g];
+        while (n || !stack.empty()) {
+            while (n) {
+                push(n);
+                stack.push_back(n);
+                n = n->left;
+            }
+            n = stack.back();
+            stack.pop_back();
+            order.push_back(n);
+            n = n->right;
+        }
+        int oldPos = 0;
+        int newPos = 0;
+        for (MarkerNode* node : order) {
+            oldPos += node->gap;
+            int mapped = std::max(map(oldPos, static_cast<MarkerGravity>(g)), newPos);
+            node->gap = mapped - newPos;
+            newPos = mapped;
+        }
+        // Суммы снизу вверх: дети раньше родителей
+        stack.clear();
+        order.clear();
+        if (m_roots[g]) stack.push_back(m_roots[g]);
+        while (!stack.empty()) {
+            MarkerNode* node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            if (node->left) stack.push_back(node->left);
+            if (node->right) stack.push_back(node->right);
+        }
+        for (auto it = order.rbegin(); it != order.rend(); ++it) pull(*it);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef MARKER_SET_H
+#define MARKER_SET_H
+
+#include <functional>
+#include <vector>
+
+// Гравитация маркера: что происходит при вставке текста ровно в его позицию
+enum class MarkerGravity : char {
+    LEFT = 0,  // остаётся перед вставленным текстом (якорь, начало диапазона)
+    RIGHT = 1  // уезжает за вставленный текст (курсор)
+};
+
+// Узел декартова дерева маркеров. Позиция хранится относительно предыдущего
+// маркера (gap), поэтому сдвиг всех маркеров правее точки правки — это
+// изменение одного gap, а не обход всех маркеров.
+struct MarkerNode {
+    MarkerNode* left = nullptr;
+    MarkerNode* right = nullptr;
+    MarkerNode* parent = nullptr;
+    unsigned priority = 0;
+    int gap = 0;         // расстояние от предыдущего маркера (по порядку)
+    int sum = 0;         // сумма gap в поддереве
+    bool zeroTag = false; // отложенное обнуление gap у потомков
+    MarkerGravity gravity = MarkerGravity::LEFT;
+    int id = -1;
+};
+
+// Набор маркеров документа: позиции автоматически сдвигаются при insert/erase.
+// Все операции O(log K), где K — количество маркеров, независимо от того,
+// сколько маркеров сдвигается правкой.
+class MarkerSet {
+public:
+    MarkerSet() = default;
+    ~MarkerSet();
+
+    MarkerSet(const MarkerSet&) = delete;
+    MarkerSet& operator=(const MarkerSet&) = delete;
+
+    int create(int offset, MarkerGravity gravity); // O(log K) - возвращает id
+    void remove(int id);                            // O(log K)
+    int offsetOf(int id) const;                     // O(log K); -1 для неизвестного id
+    void move(int id, int offset);                  // O(log K)
+    int count() const;                              // O(1)
+
+    // Реакция на правки документа
+    void onInsert(int pos, int len); // O(log K)
+    void onErase(int pos, int len);  // O(log K) - маркеры внутри диапазона схлопываются в pos
+    void collapseAll();              // O(1) - документ заменён целиком: все маркеры в 0
+    // Соседние диапазоны [p, q) и [q, r) поменялись местами; маркеры едут со своим текстом
+    void onSwap(int p, int q, int r); // O(log K)
+    // Много правок разом: новая позиция каждого маркера — map(старая, гравитация).
+    // map не убывает по позиции (порядок маркеров сохраняется), иначе результат поджимается.
+    void remap(const std::function<int(int, MarkerGravity)>& map); // O(K)
+
+private:
+    MarkerNode* m_roots[2] = {nullptr, nullptr}; // по дереву на гравитацию
+    std::vector<MarkerNode*> m_byId;
+    std::vector<int> m_freeIds;
+    int m_count = 0;
+    unsigned m_seed = 2463534242u;
+
+    unsigned nextPriority();
+    MarkerNode*& rootFor(MarkerGravity g) { return m_roots[static_cast<int>(g)]; }
+
+    static int sumOf(const MarkerNode* n) { return n ? n->sum : 0; }
+    static void applyZero(MarkerNode* n);
+    static void push(MarkerNode* n);
+    static void pull(MarkerNode* n);
+    static MarkerNode* merge(MarkerNode* a, MarkerNode* b);
+    // Разрезать t: в l — маркеры с позицией <= limit (inclusive) или < limit
+    static void split(MarkerNode* t, int base, int limit, bool inclusive,
+                      MarkerNode*& l, MarkerNode*& r);
+    static void addToFirst(MarkerNode* t, int delta);
+    static void pushPath(MarkerNode* n);
+    static void destroy(MarkerNode* t);
+
+    void insertNode(MarkerNode* node, int offset);
+    void detachNode(MarkerNode* node);
+};
+
+#endif // MARKER_SET_H
@@ -0,0 +1,57 @@
+#include "MemoryGovernor.h"
+#include <algorithm>
+
+MemoryGovernor::MemoryGovernor(std::size_t budget) : m_budget(budget) {}
+
+int MemoryGovernor::addConsumer(const std::string& name, int priority, UsageFn usage, ShedFn shed) {
+    Consumer c{m_nextId++, name, priority, std::move(usage), std::move(shed)};
+    // Стабильно: равные приоритеты сбрасываются в порядке регистрации
+    auto at = std::upper_bound(m_consumers.begin(), m_consumers.end(), priority,
+                               [](int p, const Consumer& other) { return p < other.priority; });
+    int id = c.id;
+    m_consumers.insert(at, std::move(c));
+    return id;
+}
+
+void MemoryGovernor::removeConsumer(int id) {
+    m_consumers.erase(std::remove_if(m_consumers.begin(), m_consumers.end(),
+                                     [id](const Consumer& c) { return c.id == id; }),
+                      m_consumers.end());
+}
+
+std::size_t MemoryGovernor::budget() const { return m_budget; }
+void MemoryGovernor::setBudget(std::size_t budget) { m_budget = budget; }
+
+std::size_t MemoryGovernor::usage() const {
+    std::size_t total = 0;
+    for (const Consumer& c : m_consumers) total += c.usage();
+    return total;
+}
+
+std::size_t MemoryGovernor::usageOf(const std::string& name) const {
+    for (const Consumer& c : m_consumers) {
+        if (c.name == name) return c.usage();
+    }
+    return 0;
+}
+
+int MemoryGovernor::shedTo(std::size_t target) {
+    int shed = 0;
+    for (const Consumer& c : m_consumers) {
+        if (usage() <= target) break;
+        if (c.usage() == 0) continue;
+        c.shed();
+        ++shed;
+    }
+    return shed;
+}
+
+int MemoryGovernor::enforce() {
+    return shedTo(m_budget);
+}
+
+int MemoryGovernor::onLowMemory(int level) {
+    if (level >= LOW_MEMORY_CRITICAL) return shedTo(0);
+    if (level >= LOW_MEMORY_MEDIUM) return shedTo(m_budget / 2);
+    return shedTo(m_budget - m_budget / 4);
+}
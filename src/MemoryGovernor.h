@@ -0,0 +1,70 @@
+#ifndef MEMORY_GOVERNOR_H
+#define MEMORY_GOVERNOR_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Общий бюджет памяти редактора. Каждый крупный потребитель (текст дерева,
+// кэши виджета, история правок) регистрирует оценку своего объёма и способ
+// освободить то, что можно восстановить. При превышении бюджета или по
+// сигналу системы о нехватке памяти потребители сбрасываются по приоритету:
+// сначала самое дешёвое для восстановления.
+class MemoryGovernor {
+public:
+    static const std::size_t DEFAULT_BUDGET = 150u * 1024u * 1024u; // обещание README
+
+    // Порядок сброса (меньше — раньше)
+    enum Priority : int {
+        SHED_VIEW_CACHES = 0, // кэши отрисовки: строки, раскладки
+        SHED_TREE_CACHES = 1, // распакованные сжатые листья
+        SHED_TREE_PACK = 2,   // сжатие холодных листьев
+        SHED_HISTORY = 3      // усечение истории правок
+    };
+
+    // Уровни сигнала нехватки памяти (как GMemoryMonitorWarningLevel)
+    static const int LOW_MEMORY_LOW = 50;
+    static const int LOW_MEMORY_MEDIUM = 100;
+    static const int LOW_MEMORY_CRITICAL = 255;
+
+    using UsageFn = std::function<std::size_t()>;
+    using ShedFn = std::function<void()>;
+
+    explicit MemoryGovernor(std::size_t budget = DEFAULT_BUDGET);
+
+    MemoryGovernor(const MemoryGovernor&) = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+    // Зарегистрировать потребителя; возвращает id для removeConsumer
+    int addConsumer(const std::string& name, int priority, UsageFn usage, ShedFn shed); // O(C)
+    void removeConsumer(int id);                                                        // O(C)
+
+    std::size_t budget() const;
+    void setBudget(std::size_t budget);
+    std::size_t usage() const; // O(C) - сумма оценок потребителей
+    // Оценка одного потребителя по имени (0 — не зарегистрирован)
+    std::size_t usageOf(const std::string& name) const;
+
+    // Уложиться в бюджет; возвращает, сколько потребителей пришлось сбросить
+    int enforce();
+    // Сигнал системы: low — до 3/4 бюджета, medium — до половины, critical — сбросить всё
+    int onLowMemory(int level);
+
+private:
+    struct Consumer {
+        int id;
+        std::string name;
+        int priority;
+        UsageFn usage;
+        ShedFn shed;
+    };
+
+    std::vector<Consumer> m_consumers; // по возрастанию приоритета
+    std::size_t m_budget;
+    int m_nextId = 1;
+
+    int shedTo(std::size_t target);
+};
+
+#endif // MEMORY_GOVERNOR_H
@@ -0,0 +1,117 @@
+#include "NodeReclaimer.h"
+#include <atomic>
+
+namespace {
+    // 0 - ещё не создан, 1 - работает, 2 - уже разрушен (завершение программы).
+    // Деревья, разрушаемые после статического деструктора реклеймера,
+    // освобождают узлы синхронно.
+    std::atomic<int> g_reclaimerState{0};
+}
+
+NodeReclaimer& NodeReclaimer::instance() {
+    static NodeReclaimer reclaimer;
+    return reclaimer;
+}
+
+NodeReclaimer::NodeReclaimer() {
+    m_thread = std::thread(&NodeReclaimer::workerLoop, this);
+    g_reclaimerState.store(1);
+}
+
+NodeReclaimer::~NodeReclaimer() {
+    g_reclaimerState.store(2);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+
+    // Всё, что не успел забрать поток, удаляем здесь
+    for (Node* n : m_queue) destroySubtree(n);
+    m_queue.clear();
+    for (Node* n : m_singles) delete n; // NOSONAR
+    m_singles.clear();
+}
+
+void NodeReclaimer::retire(Node* subtree) {
+    if (!subtree) return;
+
+    if (subtree->getType() == NodeType::NODE_LEAF || g_reclaimerState.load() == 2) {
+        destroySubtree(subtree);
+        return;
+    }
+
+    NodeReclaimer& self = instance();
+    {
+        std::lock_guard<std::mutex> lock(self.m_mutex);
+        self.m_queue.push_back(subtree);
+    }
+    self.m_wake.notify_one();
+}
+
+void NodeReclaimer::retireNodes(std::vector<Node*> nodes) {
+    if (nodes.empty()) return;
+
+    if (g_reclaimerState.load() == 2) {
+        for (Node* n : nodes) delete n; // NOSONAR
+        return;
+    }
+
+    NodeReclaimer& self = instance();
+    {
+        std::lock_guard<std::mutex> lock(self.m_mutex);
+        if (self.m_singles.empty()) {
+            self.m_singles.swap(nodes);
+        } else {
+            self.m_singles.insert(self.m_singles.end(), nodes.begin(), nodes.end());
+        }
+    }
+    self.m_wake.notify_one();
+}
+
+void NodeReclaimer::drain() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this]() { return m_queue.empty() && m_singles.empty() && !m_busy; });
+}
+
+void NodeReclaimer::destroySubtree(Node* node) {
+    if (!node) return;
+
+    std::vector<Node*> stack;
+    stack.push_back(node);
+    while (!stack.empty()) {
+        Node* cur = stack.back();
+        stack.pop_back();
+        if (cur->getType() == NodeType::NODE_INTERNAL) {
+            auto inner = static_cast<InternalNode*>(cur);
+            if (inner->left)  stack.push_back(inner->left);
+            if (inner->right) stack.push_back(inner->right);
+        }
+        delete cur; // NOSONAR // деструктор InternalNode детей не трогает
+    }
+}
+
+void NodeReclaimer::workerLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this]() { return m_stop || !m_queue.empty() || !m_singles.empty(); });
+        if (m_stop) break;
+
+        std::vector<Node*> batch;
+        std::vector<Node*> singles;
+        batch.swap(m_queue);
+        singles.swap(m_singles);
+        m_busy = true;
+        lock.unlock();
+
+        for (Node* n : batch) destroySubtree(n);
+        for (Node* n : singles) delete n; // NOSONAR
+
+        lock.lock();
+        m_busy = false;
+        if (m_queue.empty() && m_singles.empty()) m_idle.notify_all();
+    }
+    m_busy = false;
+    m_idle.notify_all();
+}
@@ -0,0 +1,51 @@
+#ifndef NODE_RECLAIMER_H
+#define NODE_RECLAIMER_H
+
+#include "Tree.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Фоновое освобождение отсоединённых поддеревьев.
+// Tree::clear() и удаление больших диапазонов не удаляют узлы сами,
+// а передают корень поддерева сюда — GTK-поток возвращается сразу,
+// а удаление выполняется итеративно (без рекурсии) в отдельном потоке.
+class NodeReclaimer {
+public:
+    static NodeReclaimer& instance();
+
+    // Забрать поддерево во владение и удалить его в фоне. O(1) для вызывающего.
+    // Одиночный лист удаляется сразу — передавать его в поток дороже, чем удалить.
+    static void retire(Node* subtree);
+
+    // Удалить в фоне отдельные узлы (без детей): узлы старого каркаса после
+    // подмены корня, чьи листья частично перешли в новое дерево. O(1) для вызывающего.
+    static void retireNodes(std::vector<Node*> nodes);
+
+    // Дождаться, пока очередь опустеет (тесты, освобождение памяти по требованию)
+    void drain();
+
+    // Итеративное удаление поддерева (явный стек вместо рекурсии) — O(N)
+    static void destroySubtree(Node* node);
+
+    NodeReclaimer(const NodeReclaimer&) = delete;
+    NodeReclaimer& operator=(const NodeReclaimer&) = delete;
+
+private:
+    NodeReclaimer();
+    ~NodeReclaimer();
+
+    void workerLoop();
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;   // появилась работа / остановка
+    std::condition_variable m_idle;   // очередь опустела
+    std::vector<Node*> m_queue;
+    std::vector<Node*> m_singles;     // узлы из retireNodes — удаляются без детей
+    bool m_busy = false;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+#endif // NODE_RECLAIMER_H
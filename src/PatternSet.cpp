@@ -0,0 +1,114 @@
+#include "PatternSet.h"
+#include "SearchKernel.h"
+#include <algorithm>
+#include <stdexcept>
+
+PatternSet::PatternSet(const std::vector<std::string>& patterns, bool ignoreCase)
+    : m_patterns(patterns), m_ignoreCase(ignoreCase) {
+    if (m_patterns.empty()) throw std::invalid_argument("PatternSet: no patterns");
+    for (const auto& p : m_patterns) {
+        if (p.empty()) throw std::invalid_argument("PatternSet: empty pattern");
+        m_newlines.push_back(static_cast<int>(std::count(p.begin(), p.end(), '\n')));
+    }
+
+    // Классы байтов: свой у каждого байта из шаблонов, без учёта регистра A и a — один класс
+    auto fold = [ignoreCase](char c) {
+        return static_cast<unsigned char>(ignoreCase ? SearchKernel::asciiLower(c) : c);
+    };
+    std::fill(std::begin(m_class), std::end(m_class), 0);
+    for (const auto& p : m_patterns) {
+        for (char c : p) {
+            unsigned char b = fold(c);
+            if (m_class[b] == 0) m_class[b] = static_cast<std::uint16_t>(m_classes++);
+        }
+    }
+    if (ignoreCase) {
+        for (int c = 'A'; c <= 'Z'; ++c) m_class[c] = m_class[c | 0x20];
+    }
+    const auto classes = static_cast<size_t>(m_classes);
+
+    // Бор: -1 — перехода пока нет
+    m_next.assign(classes, -1);
+    m_outFirst.assign(1, -1);
+    m_outNext.assign(m_patterns.size(), -1);
+    for (size_t i = 0; i < m_patterns.size(); ++i) {
+        int state = START;
+        for (char c : m_patterns[i]) {
+            size_t slot = static_cast<size_t>(state) * classes + m_class[static_cast<unsigned char>(c)];
+            if (m_next[slot] < 0) {
+                m_next[slot] = static_cast<int>(m_outFirst.size());
+                m_next.resize(m_next.size() + classes, -1);
+                m_outFirst.push_back(-1);
+            }
+            state = m_next[slot];
+        }
+        // Цепочка одинаковых шаблонов в порядке набора
+        auto& first = m_outFirst[static_cast<size_t>(state)];
+        if (first < 0) {
+            first = static_cast<int>(i);
+        } else {
+            int last = first;
+            while (m_outNext[static_cast<size_t>(last)] >= 0) last = m_outNext[static_cast<size_t>(last)];
+            m_outNext[static_cast<size_t>(last)] = static_cast<int>(i);
+        }
+    }
+
+    // Суффиксные ссылки обходом в ширину; недостающие переходы берутся у суффикса,
+    // и бор становится полным ДКА
+    const size_t states = m_outFirst.size();
+    std::vector<int> fail(states, START);
+    m_report.assign(states, -1);
+    m_outLink.assign(states, -1);
+    m_report[START] = m_outFirst[START] >= 0 ? START : -1;
+    std::vector<int> queue;
+    queue.reserve(states);
+    for (size_t c = 0; c < classes; ++c) {
+        int& t = m_next[c];
+        if (t < 0) {
+            t = START;
+        } else {
+            queue.push_back(t);
+        }
+    }
+    for (size_t head = 0; head < queue.size(); ++head) {
+        auto s = static_cast<size_t>(queue[head]);
+        auto f = static_cast<size_t>(fail[s]);
+        m_outLink[s] = m_report[f];
+        m_report[s] = m_outFirst[s] >= 0 ? static_cast<int>(s) : m_report[f];
+        for (size_t c = 0; c < classes; ++c) {
+            int& t = m_next[s * classes + c];
+            int viaFail = m_next[f * classes + c];
+            if (t < 0) {
+                t = viaFail;
+            } else {
+                fail[static_cast<size_t>(t)] = viaFail;
+                queue.push_back(t);
+            }
+        }
+    }
+
+    // Для feed: переход хранит смещение строки цели в m_next, сдвинутое на бит,
+    // а младший бит — есть ли у цели выход. Горячий цикл без умножения и без m_report.
+    for (auto& t : m_next) {
+        auto target = static_cast<size_t>(t);
+        t = static_cast<int>(target * classes) << 1 | (m_report[target] >= 0 ? 1 : 0);
+    }
+}
+
+bool PatternSet::feed(int& state, const char* text, int len, const std::function<bool(int, int)>& onMatch) const {
+    const int* next = m_next.data();
+    const std::uint16_t* cls = m_class;
+    int row = state * m_classes;
+    for (int i = 0; i < len; ++i) {
+        int t = next[row + cls[static_cast<unsigned char>(text[i])]];
+        row = t >> 1;
+        if (!(t & 1)) continue;
+        for (int r = m_report[static_cast<size_t>(row / m_classes)]; r >= 0; r = m_outLink[static_cast<size_t>(r)]) {
+            for (int p = m_outFirst[static_cast<size_t>(r)]; p >= 0; p = m_outNext[static_cast<size_t>(p)]) {
+                if (!onMatch(p, i + 1)) return false;
+            }
+        }
+    }
+    state = row / m_classes;
+    return true;
+}
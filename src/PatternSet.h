@@ -0,0 +1,51 @@
+#ifndef PATTERN_SET_H
+#define PATTERN_SET_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Набор литералов для одновременного поиска (автомат Ахо–Корасик).
+// Строится один раз; текст проходит через автомат за один проход независимо
+// от числа шаблонов. Сообщаются все вхождения, в том числе перекрывающиеся
+// и вложенные (he и she в "ushers"). Переходы — плотная таблица над классами
+// байтов: байты, которых нет в шаблонах, делят один класс.
+//
+// Автомат неизменяем после построения, поэтому один PatternSet можно
+// использовать из нескольких потоков одновременно (в отличие от Regex).
+class PatternSet {
+public:
+    // ignoreCase — без учёта регистра ASCII; std::invalid_argument при пустом наборе или пустом шаблоне
+    explicit PatternSet(const std::vector<std::string>& patterns, bool ignoreCase = false); // O(P * C) - P - сумма длин, C - число классов байтов
+
+    int size() const { return static_cast<int>(m_patterns.size()); }
+    const std::string& pattern(int index) const { return m_patterns[static_cast<size_t>(index)]; }
+    int length(int index) const { return static_cast<int>(m_patterns[static_cast<size_t>(index)].size()); }
+    int newlines(int index) const { return m_newlines[static_cast<size_t>(index)]; } // '\n' в шаблоне
+    bool ignoreCase() const { return m_ignoreCase; }
+
+    // Состояние до первого байта текста
+    static constexpr int START = 0;
+
+    // Прогоняет кусок текста, продолжая с state (между кусками состояние переносится,
+    // так совпадения на стыках не теряются). onMatch(pattern, end) — end — смещение
+    // конца совпадения в куске (исключительно); для одного конца длинные шаблоны раньше.
+    // onMatch == false останавливает прогон; тогда возвращается false, state не определён.
+    bool feed(int& state, const char* text, int len, const std::function<bool(int, int)>& onMatch) const; // O(len + совпадения)
+
+private:
+    std::vector<std::string> m_patterns;
+    std::vector<int> m_newlines;
+    bool m_ignoreCase;
+
+    std::uint16_t m_class[256];          // байт -> класс; 0 — байты вне шаблонов
+    int m_classes = 1;
+    std::vector<int> m_next;             // [state * m_classes + class] -> (цель * m_classes) << 1 | есть выход
+    std::vector<int> m_outFirst;         // state -> первый шаблон, кончающийся здесь, или -1
+    std::vector<int> m_outNext;          // шаблон -> следующий с тем же концом (одинаковые шаблоны)
+    std::vector<int> m_report;           // state -> первое на суффиксной цепочке (включая себя) состояние с выходом, или -1
+    std::vector<int> m_outLink;          // state с выходом -> следующее такое на его суффиксной цепочке, или -1
+};
+
+#endif // PATTERN_SET_H
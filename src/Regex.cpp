@@ -0,0 +1,802 @@
+#include "Regex.h"
+#include "SearchKernel.h"
+#include "CaseFold.h"
+#include "TreeCounters.h"
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+    using ByteSet = std::bitset<256>;
+    using CodeRange = std::pair<std::uint32_t, std::uint32_t>; // [lo, hi] кодовых точек
+
+    const std::uint32_t MAX_CODE_POINT = 0x10FFFF;
+    const int MAX_REPEAT = 1000;       // верхняя граница {n,m}
+    const int MAX_NFA_STATES = 200000; // защита от взрыва {n,m} вложенных групп
+    const size_t MAX_DFA_STATES = 4096; // кэш DFA сбрасывается целиком при переполнении
+    const std::uint32_t LAST_CASED = 0xFF5A;  // дальше CaseFold регистра не знает
+
+    // --- Дерево разбора ---
+
+    struct Ast {
+        enum Kind { BYTES, CONCAT, ALT, REPEAT, BOL, EOL, EMPTY };
+        Kind kind = EMPTY;
+        ByteSet set;                           // BYTES: один байт из множества
+        std::vector<std::unique_ptr<Ast>> kids;
+        int min = 0;
+        int max = -1;                          // REPEAT: -1 — без ограничения
+    };
+    using AstPtr = std::unique_ptr<Ast>;
+
+    AstPtr makeNode(Ast::Kind kind) {
+        auto node = std::make_unique<Ast>();
+        node->kind = kind;
+        return node;
+    }
+
+    AstPtr makeBytes(unsigned lo, unsigned hi) {
+        AstPtr node = makeNode(Ast::BYTES);
+        for (unsigned b = lo; b <= hi; ++b) node->set.set(b);
+        return node;
+    }
+
+    int utf8Length(std::uint32_t cp) {
+        if (cp < 0x80) return 1;
+        if (cp < 0x800) return 2;
+        if (cp < 0x10000) return 3;
+        return 4;
+    }
+
+    void encodeUtf8(std::uint32_t cp, int n, unsigned char* out) {
+        static const unsigned char lead[] = {0, 0, 0xC0, 0xE0, 0xF0};
+        for (int i = n - 1; i > 0; --i) {
+            out[i] = static_cast<unsigned char>(0x80 | (cp & 0x3F));
+            cp >>= 6;
+        }
+        out[0] = static_cast<unsigned char>(lead[n] | cp);
+        if (n == 1) out[0] = static_cast<unsigned char>(cp);
+    }
+
+    // Диапазон кодовых точек -> последовательности диапазонов байтов UTF-8.
+    // Режем, пока все байты продолжения, кроме первого различающегося, не станут полными.
+    void utf8Sequences(std::uint32_t lo, std::uint32_t hi, std::vector<std::vector<std::pair<int, int>>>& out) {
+        static const std::uint32_t lastOfLength[] = {0x7F, 0x7FF, 0xFFFF};
+        for (std::uint32_t last : lastOfLength) {
+            if (lo <= last && hi > last) {
+                utf8Sequences(lo, last, out);
+                utf8Sequences(last + 1, hi, out);
+                return;
+            }
+        }
+        int n = utf8Length(lo);
+        for (int i = 1; i < n; ++i) {
+            std::uint32_t m = (1u << (6 * i)) - 1;
+            if ((lo & ~m) != (hi & ~m)) {
+                if ((lo & m) != 0) {
+                    utf8Sequences(lo, lo | m, out);
+                    utf8Sequences((lo | m) + 1, hi, out);
+                    return;
+                }
+                if ((hi & m) != m) {
+                    utf8Sequences(lo, (hi & ~m) - 1, out);
+                    utf8Sequences(hi & ~m, hi, out);
+                    return;
+                }
+            }
+        }
+        unsigned char a[4] = {};
+        unsigned char b[4] = {};
+        encodeUtf8(lo, n, a);
+        encodeUtf8(hi, n, b);
+        std::vector<std::pair<int, int>> seq;
+        for (int i = 0; i < n; ++i) seq.emplace_back(a[i], b[i]);
+        out.push_back(std::move(seq));
+    }
+
+    // Добавить к диапазонам все варианты регистра их символов
+    void addCaseVariants(std::vector<CodeRange>& ranges) {
+        std::vector<std::uint32_t> vars;
+        size_t n = ranges.size();
+        for (size_t i = 0; i < n; ++i) {
+            std::uint32_t hi = std::min(ranges[i].second, LAST_CASED);
+            for (std::uint32_t cp = ranges[i].first; cp <= hi; ++cp) {
+                vars.clear();
+                CaseFold::variants(cp, vars);
+                for (std::uint32_t v : vars) {
+                    if (v != cp) ranges.emplace_back(v, v);
+                }
+            }
+        }
+    }
+
+    // Класс символов: объединение диапазонов (или его дополнение), без '\n'
+    AstPtr makeClass(std::vector<CodeRange> ranges, bool negate, bool ignoreCase = false) {
+        if (ignoreCase) addCaseVariants(ranges);
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<CodeRange> merged;
+        for (const CodeRange& r : ranges) {
+            if (!merged.empty() && r.first <= merged.back().second + 1) {
+                merged.back().second = std::max(merged.back().second, r.second);
+            } else {
+                merged.push_back(r);
+            }
+        }
+        if (negate) {
+            std::vector<CodeRange> complement;
+            std::uint32_t next = 0;
+            for (const CodeRange& r : merged) {
+                if (r.first > next) complement.emplace_back(next, r.first - 1);
+                next = r.second + 1;
+            }
+            if (next <= MAX_CODE_POINT) complement.emplace_back(next, MAX_CODE_POINT);
+            merged.swap(complement);
+        }
+
+        AstPtr alt = makeNode(Ast::ALT);
+        AstPtr ascii = makeNode(Ast::BYTES);
+        for (const CodeRange& r : merged) {
+            std::vector<std::vector<std::pair<int, int>>> seqs;
+            utf8Sequences(r.first, r.second, seqs);
+            for (const auto& seq : seqs) {
+                if (seq.size() == 1) {
+                    for (int b = seq[0].first; b <= seq[0].second; ++b) ascii->set.set(static_cast<size_t>(b));
+                    continue;
+                }
+                AstPtr concat = makeNode(Ast::CONCAT);
+                for (const auto& [blo, bhi] : seq) {
+                    concat->kids.push_back(makeBytes(static_cast<unsigned>(blo), static_cast<unsigned>(bhi)));
+                }
+                alt->kids.push_back(std::move(concat));
+            }
+        }
+        ascii->set.reset('\n');
+        if (ascii->set.any()) alt->kids.insert(alt->kids.begin(), std::move(ascii));
+        if (alt->kids.empty()) return makeNode(Ast::BYTES); // пустое множество — не совпадает ни с чем
+        if (alt->kids.size() == 1) return std::move(alt->kids[0]);
+        return alt;
+    }
+
+    // --- Разбор ---
+
+    class Parser {
+    public:
+        Parser(const std::string& pattern, bool ignoreCase) : m_p(pattern), m_ignoreCase(ignoreCase) {}
+
+        AstPtr parse() {
+            AstPtr node = parseAlt();
+            if (m_pos < m_p.size()) fail("unmatched ')'");
+            return node;
+        }
+
+    private:
+        const std::string& m_p;
+        bool m_ignoreCase;
+        size_t m_pos = 0;
+
+        [[noreturn]] void fail(const std::string& what) const {
+            throw std::invalid_argument("Regex: " + what + " at " + std::to_string(m_pos));
+        }
+
+        bool atEnd() const { return m_pos >= m_p.size(); }
+        unsigned char peek() const { return static_cast<unsigned char>(m_p[m_pos]); }
+
+        AstPtr parseAlt() {
+            AstPtr first = parseConcat();
+            if (atEnd() || peek() != '|') return first;
+            AstPtr alt = makeNode(Ast::ALT);
+            alt->kids.push_back(std::move(first));
+            while (!atEnd() && peek() == '|') {
+                ++m_pos;
+                alt->kids.push_back(parseConcat());
+            }
+            return alt;
+        }
+
+        AstPtr parseConcat() {
+            AstPtr concat = makeNode(Ast::CONCAT);
+            while (!atEnd() && peek() != '|' && peek() != ')') {
+                concat->kids.push_back(parseRepeat(parseAtom()));
+            }
+            if (concat->kids.empty()) return makeNode(Ast::EMPTY);
+            if (concat->kids.size() == 1) return std::move(concat->kids[0]);
+            return concat;
+        }
+
+        bool readNumber(int& value) {
+            size_t start = m_pos;
+            value = 0;
+            while (!atEnd() && peek() >= '0' && peek() <= '9') {
+                value = value * 10 + (peek() - '0');
+                if (value > MAX_REPEAT) fail("repeat count too large");
+                ++m_pos;
+            }
+            return m_pos > start;
+        }
+
+        AstPtr parseRepeat(AstPtr atom) {
+            while (!atEnd()) {
+                int min = 0;
+                int max = -1;
+                unsigned char c = peek();
+                if (c == '*') {
+                    ++m_pos;
+                } else if (c == '+') {
+                    min = 1;
+                    ++m_pos;
+                } else if (c == '?') {
+                    max = 1;
+                    ++m_pos;
+                } else if (c == '{') {
+                    size_t save = m_pos++;
+                    if (!readNumber(min)) {
+                        m_pos = save; // не интервал — '{' остаётся литералом
+                        return atom;
+                    }
+                    max = min;
+                    if (!atEnd() && peek() == ',') {
+                        ++m_pos;
+                        if (!readNumber(max)) max = -1;
+                    }
+                    if (atEnd() || peek() != '}') fail("unterminated '{'");
+                    ++m_pos;
+                    if (max != -1 && max < min) fail("bad repeat range");
+                } else {
+                    return atom;
+                }
+                if (atom->kind == Ast::BOL || atom->kind == Ast::EOL) fail("nothing to repeat");
+                AstPtr rep = makeNode(Ast::REPEAT);
+                rep->min = min;
+                rep->max = max;
+                rep->kids.push_back(std::move(atom));
+                atom = std::move(rep);
+            }
+            return atom;
+        }
+
+        // Символ UTF-8 с текущей позиции: кодовая точка (некорректный байт — он сам)
+        std::uint32_t readCodePoint() {
+            auto lead = peek();
+            if ((lead >= 0x80 && lead < 0xC0) || lead >= 0xF8) fail("invalid UTF-8");
+            int n = 1;
+            std::uint32_t cp = lead;
+            if (lead >= 0xF0) {
+                n = 4;
+                cp = lead & 0x07;
+            } else if (lead >= 0xE0) {
+                n = 3;
+                cp = lead & 0x0F;
+            } else if (lead >= 0xC0) {
+                n = 2;
+                cp = lead & 0x1F;
+            }
+            if (m_pos + static_cast<size_t>(n) > m_p.size()) fail("truncated UTF-8");
+            for (int i = 1; i < n; ++i) {
+                auto b = static_cast<unsigned char>(m_p[m_pos + static_cast<size_t>(i)]);
+                if ((b & 0xC0) != 0x80) fail("invalid UTF-8");
+                cp = (cp << 6) | (b & 0x3F);
+            }
+            m_pos += static_cast<size_t>(n);
+            return cp;
+        }
+
+        static void shorthand(char c, std::vector<CodeRange>& out) {
+            switch (c) {
+                case 'd':
+                    out.emplace_back('0', '9');
+                    break;
+                case 'w':
+                    out.emplace_back('0', '9');
+                    out.emplace_back('A', 'Z');
+                    out.emplace_back('a', 'z');
+                    out.emplace_back('_', '_');
+                    break;
+                default: // 's'
+                    out.emplace_back('\t', '\t');
+                    out.emplace_back('\v', '\r');
+                    out.emplace_back(' ', ' ');
+                    break;
+            }
+        }
+
+        static bool isShorthand(char c) {
+            return c == 'd' || c == 'w' || c == 's' || c == 'D' || c == 'W' || c == 'S';
+        }
+
+        // Экранированный литерал после '\'
+        std::uint32_t escapedLiteral() {
+            if (atEnd()) fail("trailing '\\'");
+            unsigned char c = peek();
+            switch (c) {
+                case 'n': ++m_pos; return '\n';
+                case 't': ++m_pos; return '\t';
+                case 'r': ++m_pos; return '\r';
+                case 'f': ++m_pos; return '\f';
+                case 'v': ++m_pos; return '\v';
+                default: break;
+            }
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                fail(std::string("unknown escape '\\") + static_cast<char>(c) + "'");
+            }
+            return readCodePoint();
+        }
+
+        AstPtr literal(std::uint32_t cp) {
+            if (m_ignoreCase) {
+                std::vector<std::uint32_t> vars;
+                CaseFold::variants(cp, vars);
+                if (vars.size() > 1) return makeClass({{cp, cp}}, false, true);
+            }
+            if (cp < 0x80) return makeBytes(cp, cp);
+            unsigned char bytes[4];
+            int n = utf8Length(cp);
+            encodeUtf8(cp, n, bytes);
+            AstPtr concat = makeNode(Ast::CONCAT);
+            for (int i = 0; i < n; ++i) concat->kids.push_back(makeBytes(bytes[i], bytes[i]));
+            return concat;
+        }
+
+        AstPtr parseAtom() {
+            unsigned char c = peek();
+            switch (c) {
+                case '(': {
+                    ++m_pos;
+                    if (m_p.compare(m_pos, 2, "?:") == 0) m_pos += 2;
+                    AstPtr inner = parseAlt();
+                    if (atEnd() || peek() != ')') fail("missing ')'");
+                    ++m_pos;
+                    return inner;
+                }
+                case '[':
+                    ++m_pos;
+                    return parseClass();
+                case '.':
+                    ++m_pos;
+                    return makeClass({}, true);
+                case '^':
+                    ++m_pos;
+                    return makeNode(Ast::BOL);
+                case '$':
+                    ++m_pos;
+                    return makeNode(Ast::EOL);
+                case '*':
+                case '+':
+                case '?':
+                    fail("nothing to repeat");
+                case '\\': {
+                    ++m_pos;
+                    if (!atEnd() && isShorthand(static_cast<char>(peek()))) {
+                        auto s = static_cast<char>(peek());
+                        ++m_pos;
+                        std::vector<CodeRange> ranges;
+                        shorthand(static_cast<char>(s | 0x20), ranges);
+                        return makeClass(ranges, s >= 'A' && s <= 'Z');
+                    }
+                    return literal(escapedLiteral());
+                }
+                default:
+                    return literal(readCodePoint());
+            }
+        }
+
+        AstPtr parseClass() {
+            bool negate = false;
+            if (!atEnd() && peek() == '^') {
+                negate = true;
+                ++m_pos;
+            }
+            std::vector<CodeRange> ranges;
+            bool first = true;
+            while (true) {
+                if (atEnd()) fail("missing ']'");
+                if (peek() == ']' && !first) {
+                    ++m_pos;
+                    break;
+                }
+                first = false;
+
+                std::uint32_t lo;
+                if (peek() == '\\') {
+                    ++m_pos;
+                    if (!atEnd() && isShorthand(static_cast<char>(peek()))) {
+                        auto s = static_cast<char>(peek());
+                        ++m_pos;
+                        std::vector<CodeRange> sub;
+                        shorthand(static_cast<char>(s | 0x20), sub);
+                        if (s >= 'A' && s <= 'Z') {
+                            // \D \W \S внутри класса: дополнение до всех кодовых точек
+                            std::sort(sub.begin(), sub.end());
+                            std::uint32_t next = 0;
+                            for (const CodeRange& r : sub) {
+                                if (r.first > next) ranges.emplace_back(next, r.first - 1);
+                                next = r.second + 1;
+                            }
+                            ranges.emplace_back(next, MAX_CODE_POINT);
+                        } else {
+                            ranges.insert(ranges.end(), sub.begin(), sub.end());
+                        }
+                        continue;
+                    }
+                    lo = escapedLiteral();
+                } else {
+                    lo = readCodePoint();
+                }
+
+                std::uint32_t hi = lo;
+                if (m_pos + 1 < m_p.size() && peek() == '-' && m_p[m_pos + 1] != ']') {
+                    ++m_pos;
+                    if (peek() == '\\') {
+                        ++m_pos;
+                        hi = escapedLiteral();
+                    } else {
+                        hi = readCodePoint();
+                    }
+                    if (hi < lo) fail("bad class range");
+                }
+                ranges.emplace_back(lo, hi);
+            }
+            return makeClass(ranges, negate, m_ignoreCase);
+        }
+    };
+
+    // Самый длинный литерал, без которого совпадения нет: строки без него
+    // отсекает SearchKernel, не запуская DFA
+    void requiredLiteral(const Ast& node, std::string& run, std::string& best) {
+        if (node.kind == Ast::CONCAT) {
+            for (const AstPtr& kid : node.kids) requiredLiteral(*kid, run, best);
+            return;
+        }
+        if (node.kind == Ast::BYTES && node.set.count() == 1) {
+            for (size_t b = 0; b < 256; ++b) {
+                if (node.set.test(b)) run += static_cast<char>(b);
+            }
+            return;
+        }
+        // Пара регистров ASCII без иных вариантов ({a, A}): литерал ищется без учёта регистра
+        if (node.kind == Ast::BYTES && node.set.count() == 2) {
+            for (size_t b = 'a'; b <= 'z'; ++b) {
+                if (node.set.test(b) && node.set.test(b ^ 0x20)) {
+                    run += static_cast<char>(b);
+                    return;
+                }
+            }
+        }
+        // x+ и x{n,}: одно вхождение x примыкает к литералу слева, дальше неизвестно
+        if (node.kind == Ast::REPEAT && node.min >= 1) requiredLiteral(*node.kids[0], run, best);
+        if (run.size() > best.size()) best = run;
+        run.clear();
+    }
+
+    // Шаблон для текста, прочитанного задом наперёд: конкатенации разворачиваются,
+    // ^ и $ меняются местами (последовательности байтов UTF-8 — тоже конкатенации)
+    void reverseAst(Ast& node) {
+        if (node.kind == Ast::CONCAT) std::reverse(node.kids.begin(), node.kids.end());
+        if (node.kind == Ast::BOL) node.kind = Ast::EOL;
+        else if (node.kind == Ast::EOL) node.kind = Ast::BOL;
+        for (AstPtr& kid : node.kids) reverseAst(*kid);
+    }
+
+    // --- NFA Томпсона ---
+
+    struct NfaState {
+        enum Op : char { BYTE, SPLIT, BOL, EOL, MATCH };
+        Op op = MATCH;
+        int set = -1; // BYTE: индекс множества байтов
+        int out = -1;
+        int out1 = -1; // SPLIT: вторая ветка
+    };
+
+    class NfaBuilder {
+    public:
+        std::vector<NfaState> states;
+        std::vector<ByteSet> sets;
+
+        int add(NfaState::Op op, int out, int out1 = -1) {
+            if (static_cast<int>(states.size()) >= MAX_NFA_STATES) {
+                throw std::invalid_argument("Regex: pattern is too large");
+            }
+            NfaState s;
+            s.op = op;
+            s.out = out;
+            s.out1 = out1;
+            states.push_back(s);
+            return static_cast<int>(states.size()) - 1;
+        }
+
+        // Вход во фрагмент node, продолжающийся в next (строится с конца)
+        int compile(const Ast& node, int next) {
+            switch (node.kind) {
+                case Ast::EMPTY:
+                    return next;
+                case Ast::BOL:
+                    return add(NfaState::BOL, next);
+                case Ast::EOL:
+                    return add(NfaState::EOL, next);
+                case Ast::BYTES: {
+                    int s = add(NfaState::BYTE, next);
+                    states[static_cast<size_t>(s)].set = static_cast<int>(sets.size());
+                    sets.push_back(node.set);
+                    return s;
+                }
+                case Ast::CONCAT:
+                    for (auto it = node.kids.rbegin(); it != node.kids.rend(); ++it) next = compile(**it, next);
+                    return next;
+                case Ast::ALT: {
+                    int entry = compile(*node.kids.back(), next);
+                    for (auto it = node.kids.rbegin() + 1; it != node.kids.rend(); ++it) {
+                        entry = add(NfaState::SPLIT, compile(**it, next), entry);
+                    }
+                    return entry;
+                }
+                case Ast::REPEAT:
+                    break;
+            }
+
+            const Ast& kid = *node.kids[0];
+            int cur = next;
+            if (node.max == -1) {
+                int loop = add(NfaState::SPLIT, -1, next);
+                states[static_cast<size_t>(loop)].out = compile(kid, loop);
+                cur = loop;
+            } else {
+                for (int i = node.min; i < node.max; ++i) cur = add(NfaState::SPLIT, compile(kid, cur), next);
+            }
+            for (int i = 0; i < node.min; ++i) cur = compile(kid, cur);
+            return cur;
+        }
+    };
+
+    // --- Ленивый DFA ---
+
+    struct DfaState {
+        std::vector<int> nfa;      // BYTE/EOL/MATCH-состояния NFA, по возрастанию
+        bool match = false;        // совпадение кончается перед текущим байтом
+        bool matchAtEol = false;   // ... если здесь конец строки
+        std::array<int, 256> next; // -1 — переход ещё не построен
+
+        DfaState() { next.fill(-1); }
+    };
+
+    struct Dfa {
+        std::vector<DfaState> states;
+        std::map<std::vector<int>, int> index;
+        int start[2] = {-1, -1}; // [atLineStart]
+        unsigned long generation = 0; // растёт при сбросе кэша
+    };
+}
+
+struct Regex::Program {
+    std::vector<NfaState> nfa;
+    std::vector<ByteSet> sets;
+    int start = -1;
+    std::string required; // литерал, который есть в любом совпадении (может быть пуст)
+    bool requiredFolded = false; // required — в нижнем регистре, сравнение без учёта регистра ASCII
+    // anchored — совпадение с заданной позиции; unanchored — фильтр «есть ли где-то в строке»
+    Dfa anchored;
+    Dfa unanchored;
+    std::vector<int> stack; // рабочие буферы замыкания
+    std::vector<char> seen;
+    std::vector<std::uint64_t> starts; // forEachInLine: начала совпадений строки
+
+    // ε-замыкание: BOL проходится только при bol, EOL — только при eol
+    void closure(int from, bool bol, bool eol, std::vector<int>& out) {
+        stack.clear();
+        stack.push_back(from);
+        while (!stack.empty()) {
+            int s = stack.back();
+            stack.pop_back();
+            if (s < 0 || seen[static_cast<size_t>(s)]) continue;
+            seen[static_cast<size_t>(s)] = 1;
+            const NfaState& st = nfa[static_cast<size_t>(s)];
+            switch (st.op) {
+                case NfaState::SPLIT:
+                    stack.push_back(st.out1);
+                    stack.push_back(st.out);
+                    break;
+                case NfaState::BOL:
+                    if (bol) stack.push_back(st.out);
+                    break;
+                case NfaState::EOL:
+                    out.push_back(s);
+                    if (eol) stack.push_back(st.out);
+                    break;
+                default:
+                    out.push_back(s);
+                    break;
+            }
+        }
+    }
+
+    int intern(Dfa& dfa, std::vector<int> set) {
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        auto it = dfa.index.find(set);
+        if (it != dfa.index.end()) return it->second;
+        if (dfa.states.size() >= MAX_DFA_STATES) {
+            dfa.states.clear();
+            dfa.index.clear();
+            dfa.start[0] = dfa.start[1] = -1;
+            ++dfa.generation;
+        }
+
+        DfaState st;
+        std::vector<int> atEol;
+        for (int s : set) {
+            const NfaState& n = nfa[static_cast<size_t>(s)];
+            if (n.op == NfaState::MATCH) st.match = true;
+            if (n.op == NfaState::EOL) closure(n.out, false, true, atEol);
+        }
+        std::fill(seen.begin(), seen.end(), 0);
+        st.matchAtEol = st.match;
+        for (int s : atEol) {
+            if (nfa[static_cast<size_t>(s)].op == NfaState::MATCH) st.matchAtEol = true;
+        }
+        st.nfa = set;
+        dfa.states.push_back(std::move(st));
+        auto id = static_cast<int>(dfa.states.size()) - 1;
+        dfa.index.emplace(std::move(set), id);
+        return id;
+    }
+
+    int startState(Dfa& dfa, bool bol) {
+        int& cached = dfa.start[bol ? 1 : 0];
+        if (cached >= 0) return cached;
+        std::vector<int> set;
+        closure(start, bol, false, set);
+        std::fill(seen.begin(), seen.end(), 0);
+        int id = intern(dfa, std::move(set));
+        dfa.start[bol ? 1 : 0] = id;
+        return id;
+    }
+
+    int step(Dfa& dfa, bool unanchoredSearch, int from, unsigned char byte) {
+        int known = dfa.states[static_cast<size_t>(from)].next[byte];
+        if (known >= 0) return known;
+
+        std::vector<int> set;
+        for (int s : dfa.states[static_cast<size_t>(from)].nfa) {
+            const NfaState& n = nfa[static_cast<size_t>(s)];
+            if (n.op == NfaState::BYTE && sets[static_cast<size_t>(n.set)].test(byte)) closure(n.out, false, false, set);
+        }
+        // Без якоря совпадение может начаться с любого следующего байта
+        if (unanchoredSearch) closure(start, false, false, set);
+        std::fill(seen.begin(), seen.end(), 0);
+
+        unsigned long generation = dfa.generation;
+        int id = intern(dfa, std::move(set));
+        // Если intern сбросил кэш, from больше не существует
+        if (dfa.generation == generation) dfa.states[static_cast<size_t>(from)].next[byte] = id;
+        return id;
+    }
+
+    // Конец самого длинного непустого совпадения от s или -1
+    int longestAt(const char* line, int len, int s, bool bol, bool eol) {
+        int st = startState(anchored, bol);
+        int end = -1;
+        int i = s;
+        for (; i < len; ++i) {
+            auto byte = static_cast<unsigned char>(line[i]);
+            int known = anchored.states[static_cast<size_t>(st)].next[byte];
+            st = known >= 0 ? known : step(anchored, false, st, byte);
+            const DfaState& d = anchored.states[static_cast<size_t>(st)];
+            if (d.nfa.empty()) break;
+            if (d.match) end = i + 1;
+        }
+        TREE_COUNT(DFA_STEPS, i - s);
+        if (i == len && eol && len > s && anchored.states[static_cast<size_t>(st)].matchAtEol) end = len;
+        return end;
+    }
+
+    // Для программы развёрнутого шаблона: один проход строки от конца к началу.
+    // Бит i в starts — с i начинается непустое совпадение исходного шаблона.
+    // bol/eol — края строки исходного текста (для развёрнутого они меняются местами).
+    void matchStarts(const char* line, int len, bool bol, bool eol, std::vector<std::uint64_t>& starts) {
+        starts.assign(static_cast<size_t>(len + 63) / 64, 0);
+        int st = startState(unanchored, eol);
+        for (int i = len - 1; i >= 0; --i) {
+            auto byte = static_cast<unsigned char>(line[i]);
+            int known = unanchored.states[static_cast<size_t>(st)].next[byte];
+            st = known >= 0 ? known : step(unanchored, true, st, byte);
+            const DfaState& d = unanchored.states[static_cast<size_t>(st)];
+            if (d.match || (i == 0 && bol && d.matchAtEol)) {
+                starts[static_cast<size_t>(i) >> 6] |= std::uint64_t(1) << (i & 63);
+            }
+        }
+        TREE_COUNT(DFA_STEPS, len);
+    }
+
+    // Фильтр: false — в строке точно нет совпадения
+    bool mayMatch(const char* line, int len, bool bol, bool eol) {
+        int st = startState(unanchored, bol);
+        const DfaState* d = &unanchored.states[static_cast<size_t>(st)];
+        for (int i = 0; i < len; ++i) {
+            // Горячий цикл: готовый переход — одно чтение таблицы
+            auto byte = static_cast<unsigned char>(line[i]);
+            st = d->next[byte];
+            if (st < 0) st = step(unanchored, true, static_cast<int>(d - unanchored.states.data()), byte);
+            d = &unanchored.states[static_cast<size_t>(st)];
+            if (d->match) {
+                TREE_COUNT(DFA_STEPS, i + 1);
+                return true;
+            }
+        }
+        TREE_COUNT(DFA_STEPS, len);
+        return eol && unanchored.states[static_cast<size_t>(st)].matchAtEol;
+    }
+};
+
+Regex::Regex(const std::string& pattern, bool ignoreCase)
+    : m_pattern(pattern), m_program(std::make_unique<Program>()) {
+    AstPtr ast = Parser(pattern, ignoreCase).parse();
+    std::string run;
+    requiredLiteral(*ast, run, m_program->required);
+    if (run.size() > m_program->required.size()) m_program->required = run;
+    if (ignoreCase) {
+        m_program->requiredFolded = true;
+        for (char& c : m_program->required) c = SearchKernel::asciiLower(c);
+    }
+    auto compile = [](const Ast& node, Program& program) {
+        NfaBuilder builder;
+        int match = builder.add(NfaState::MATCH, -1);
+        program.start = builder.compile(node, match);
+        program.nfa = std::move(builder.states);
+        program.sets = std::move(builder.sets);
+        program.seen.assign(program.nfa.size(), 0);
+    };
+    compile(*ast, *m_program);
+    reverseAst(*ast);
+    m_reverse = std::make_unique<Program>();
+    compile(*ast, *m_reverse);
+}
+
+Regex::~Regex() = default;
+
+std::string Regex::escape(const std::string& literal) {
+    static const std::string special = "\\.^$|?*+()[]{}";
+    std::string out;
+    out.reserve(literal.size());
+    for (char c : literal) {
+        if (special.find(c) != std::string::npos) out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+bool Regex::forEachInLine(const char* line, int len, bool atLineStart, bool atLineEnd,
+                          const std::function<bool(int, int)>& onMatch) const {
+    Program& p = *m_program;
+    if (len <= 0) return true;
+    if (!p.required.empty()) {
+        auto requiredLen = static_cast<int>(p.required.size());
+        int hit = p.requiredFolded ? SearchKernel::findAsciiFolded(line, len, 0, p.required.data(), requiredLen)
+                                   : SearchKernel::find(line, len, 0, p.required.data(), requiredLen);
+        if (hit < 0) return true;
+    }
+    if (!p.mayMatch(line, len, atLineStart, atLineEnd)) return true;
+
+    // Строка с совпадением. Начала всех совпадений — одним обратным проходом развёрнутого
+    // шаблона (перебор начал с longestAt от каждого был бы O(len^2) на длинной строке);
+    // от самого левого начала после прошлого совпадения — самый длинный конец
+    std::vector<std::uint64_t>& starts = p.starts;
+    m_reverse->matchStarts(line, len, atLineStart, atLineEnd, starts);
+    int pos = 0;
+    while (pos < len) {
+        auto word = static_cast<size_t>(pos) >> 6;
+        std::uint64_t bits = starts[word] & (~std::uint64_t(0) << (pos & 63));
+        while (bits == 0 && ++word < starts.size()) bits = starts[word];
+        if (bits == 0) break;
+        int start = static_cast<int>(word << 6) + __builtin_ctzll(bits);
+        int end = p.longestAt(line, len, start, atLineStart && start == 0, atLineEnd);
+        if (end <= start) { // обратный проход видел совпадение — не бывает
+            pos = start + 1;
+            continue;
+        }
+        if (!onMatch(start, end)) return false;
+        pos = end;
+    }
+    return true;
+}
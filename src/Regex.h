@@ -0,0 +1,46 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <functional>
+#include <memory>
+#include <string>
+
+// Регулярное выражение для поиска по дереву без сборки текста. Синтаксис:
+// литералы, . [...] [^...] \d \w \s \D \W \S, группы (...) и (?:...), |,
+// * + ? {n} {n,} {n,m}, якоря строки ^ и $. Совпадения не пересекают '\n'
+// (как в grep); из совпадений с самым левым началом берётся самое длинное.
+// '.', классы и отрицания работают по символам UTF-8, а не по байтам.
+//
+// Исполняется DFA, лениво строящимся над NFA Томпсона: состояние DFA
+// появляется, когда его впервые встречает текст, и живёт в кэше объекта.
+// Поэтому один Regex нельзя использовать из нескольких потоков одновременно.
+// Начала совпадений в строке находит DFA развёрнутого шаблона за один проход
+// от конца строки, так что длинная строка не перебирается с каждого байта.
+class Regex {
+public:
+    // ignoreCase — простая свёртка регистра Unicode (CaseFold) для литералов и классов
+    explicit Regex(const std::string& pattern, bool ignoreCase = false); // O(P); std::invalid_argument при ошибке синтаксиса
+    ~Regex();
+
+    Regex(const Regex&) = delete;
+    Regex& operator=(const Regex&) = delete;
+
+    const std::string& pattern() const { return m_pattern; }
+    // Литерал как шаблон: метасимволы экранируются
+    static std::string escape(const std::string& literal); // O(len)
+
+    // Непустые неперекрывающиеся совпадения в куске строки (без '\n') слева направо.
+    // atLineStart/atLineEnd — края куска совпадают с краями строки (для ^ и $).
+    // onMatch(start, end) == false останавливает перебор; тогда возвращается false.
+    bool forEachInLine(const char* line, int len, bool atLineStart, bool atLineEnd,
+                       const std::function<bool(int, int)>& onMatch) const; // O(len + S) - S - байты, пройденные от начал совпадений до гибели DFA
+
+private:
+    struct Program;
+
+    std::string m_pattern;
+    std::unique_ptr<Program> m_program;
+    std::unique_ptr<Program> m_reverse; // развёрнутый шаблон: начала совпадений
+};
+
+#endif // REGEX_H
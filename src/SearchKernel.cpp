@@ -0,0 +1,106 @@
+#include "SearchKernel.h"
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+int SearchKernel::find(const char* hay, int hayLen, int start, const char* needle, int needleLen) {
+    if (needleLen <= 0 || start < 0 || hayLen - start < needleLen) return -1;
+    if (needleLen == 1) {
+        auto hit = static_cast<const char*>(std::memchr(hay + start, needle[0], static_cast<size_t>(hayLen - start)));
+        return hit ? static_cast<int>(hit - hay) : -1;
+    }
+
+    const int lastStart = hayLen - needleLen; // последняя допустимая позиция начала
+    const char first = needle[0];
+    const char last = needle[needleLen - 1];
+    const auto middle = static_cast<size_t>(needleLen - 2);
+    int i = start;
+
+#if defined(__SSE2__)
+    const __m128i firstVec = _mm_set1_epi8(first);
+    const __m128i lastVec = _mm_set1_epi8(last);
+    for (; i + 15 <= lastStart; i += 16) {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i));
+        __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i + needleLen - 1));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, firstVec), _mm_cmpeq_epi8(tail, lastVec))));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (std::memcmp(hay + i + bit + 1, needle + 1, middle) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i <= lastStart) {
+        auto hit = static_cast<const char*>(std::memchr(hay + i, first, static_cast<size_t>(lastStart - i + 1)));
+        if (!hit) return -1;
+        i = static_cast<int>(hit - hay);
+        if (hay[i + needleLen - 1] == last && std::memcmp(hay + i + 1, needle + 1, middle) == 0) return i;
+        ++i;
+    }
+    return -1;
+}
+
+namespace {
+    inline bool isAsciiLetter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+    bool equalsFolded(const char* text, const char* lowerNeedle, int len) {
+        for (int i = 0; i < len; ++i) {
+            if (SearchKernel::asciiLower(text[i]) != lowerNeedle[i]) return false;
+        }
+        return true;
+    }
+}
+
+int SearchKernel::findAsciiFolded(const char* hay, int hayLen, int start, const char* needle, int needleLen) {
+    if (needleLen <= 0 || start < 0 || hayLen - start < needleLen) return -1;
+
+    const int lastStart = hayLen - needleLen;
+    const char first = needle[0];
+    const char last = needle[needleLen - 1];
+    int i = start;
+
+#if defined(__SSE2__)
+    // Для букв бит 0x20 у текста поднимается: 'A' и 'a' дают одно и то же.
+    // Лишние совпадения ('@' и '`') отсекает проверка.
+    const __m128i firstVec = _mm_set1_epi8(first);
+    const __m128i lastVec = _mm_set1_epi8(last);
+    const __m128i firstCase = _mm_set1_epi8(isAsciiLetter(first) ? 0x20 : 0);
+    const __m128i lastCase = _mm_set1_epi8(isAsciiLetter(last) ? 0x20 : 0);
+    for (; i + 15 <= lastStart; i += 16) {
+        __m128i head = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i)), firstCase);
+        __m128i tail = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i + needleLen - 1)), lastCase);
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, firstVec), _mm_cmpeq_epi8(tail, lastVec))));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (equalsFolded(hay + i + bit, needle, needleLen)) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= lastStart; ++i) {
+        if (asciiLower(hay[i]) == first && equalsFolded(hay + i, needle, needleLen)) return i;
+    }
+    return -1;
+}
+
+int SearchKernel::countNewlines(const char* p, int len) {
+    int count = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        count += __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl))));
+    }
+#endif
+    for (; i < len; ++i) {
+        if (p[i] == '\n') ++count;
+    }
+    return count;
+}
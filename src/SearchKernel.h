@@ -0,0 +1,19 @@
+#ifndef SEARCH_KERNEL_H
+#define SEARCH_KERNEL_H
+
+// Ядро поиска подстроки в непрерывном буфере. Кандидаты отбираются фильтром
+// по первому и последнему байту шаблона сразу для 16 позиций (SSE2), затем
+// проверяются memcmp; однобайтовый шаблон — memchr. Без SSE2 — memchr по
+// первому байту. Таблиц нет: состояние между листьями держит вызывающий.
+// Вариант без учёта регистра ASCII сравнивает (байт | 0x20) там, где в шаблоне буква.
+struct SearchKernel {
+    // Первое вхождение needle в hay, начинающееся в [start, hayLen - needleLen]; -1 — нет
+    static int find(const char* hay, int hayLen, int start, const char* needle, int needleLen); // O(hayLen - start)
+    // То же без учёта регистра ASCII: needle уже в нижнем регистре (см. asciiLower)
+    static int findAsciiFolded(const char* hay, int hayLen, int start, const char* needle, int needleLen); // O(hayLen - start)
+    static char asciiLower(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c | 0x20) : c; }
+    // Число '\n' в [p, p + len)
+    static int countNewlines(const char* p, int len); // O(len)
+};
+
+#endif // SEARCH_KERNEL_H
@@ -0,0 +1,254 @@
+#include "TaskPool.h"
+
+namespace {
+    // Рабочий поток знает свой пул и индекс своей деки
+    thread_local const TaskPool* t_pool = nullptr;
+    thread_local int t_index = -1;
+}
+
+double TaskProgress::fraction() const {
+    long long t = total.load(std::memory_order_relaxed);
+    if (t <= 0) return 1.0;
+    long long d = done.load(std::memory_order_relaxed);
+    return d >= t ? 1.0 : static_cast<double>(d) / static_cast<double>(t);
+}
+
+// ==========================================
+// TaskPool
+// ==========================================
+
+TaskPool::TaskPool(unsigned threads) {
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    for (unsigned i = 0; i < threads; ++i) m_workers.push_back(std::make_unique<Worker>());
+    for (unsigned i = 0; i < threads; ++i) {
+        m_threads.emplace_back(&TaskPool::workerLoop, this, static_cast<int>(i));
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (std::thread& t : m_threads) {
+        if (t.joinable()) t.join();
+    }
+}
+
+TaskPool& TaskPool::instance() {
+    static TaskPool pool;
+    return pool;
+}
+
+unsigned TaskPool::size() const { return static_cast<unsigned>(m_threads.size()); }
+
+int TaskPool::currentWorker() const {
+    return t_pool == this ? t_index : -1;
+}
+
+bool TaskPool::isWorkerThread() const { return currentWorker() >= 0; }
+
+void TaskPool::post(Task task) {
+    if (int self = currentWorker(); self >= 0) {
+        // fork из задачи — в свою деку, без общей блокировки
+        {
+            std::lock_guard<std::mutex> lock(m_workers[self]->mutex);
+            m_workers[self]->tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_injected.push_back(std::move(task));
+        m_queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_wake.notify_one();
+}
+
+void TaskPool::postBackground(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_background.push_back(std::move(task));
+        m_queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_wake.notify_one();
+}
+
+bool TaskPool::pop(Task& out, int self, bool background) {
+    // Своя дека с хвоста
+    if (self >= 0) {
+        Worker& w = *m_workers[self];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (!w.tasks.empty()) {
+            out = std::move(w.tasks.back());
+            w.tasks.pop_back();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // Общая очередь
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_injected.empty()) {
+            out = std::move(m_injected.front());
+            m_injected.pop_front();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // Кража с головы чужих дек, начиная с соседа
+    auto n = static_cast<int>(m_workers.size());
+    for (int k = 1; k <= n; ++k) {
+        int victim = ((self < 0 ? 0 : self) + k) % n;
+        if (victim == self) continue;
+        Worker& w = *m_workers[victim];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (!w.tasks.empty()) {
+            out = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // Фоновые — только когда больше нечего делать
+    if (background) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_background.empty()) {
+            out = std::move(m_background.front());
+            m_background.pop_front();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskPool::runTask(Task& task) {
+    try {
+        task();
+    } catch (...) { //NOSONAR
+        // post(): результат и ошибки — забота TaskGroup
+    }
+}
+
+bool TaskPool::runOne() {
+    Task task;
+    if (!pop(task, currentWorker(), false)) return false;
+    runTask(task);
+    return true;
+}
+
+void TaskPool::workerLoop(int index) {
+    t_pool = this;
+    t_index = index;
+    for (;;) {
+        Task task;
+        if (pop(task, index, true)) {
+            runTask(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [this]() { return m_stop || m_queued.load(std::memory_order_relaxed) > 0; });
+        if (m_stop) break;
+    }
+}
+
+// ==========================================
+// TaskGroup
+// ==========================================
+
+bool TaskGroup::State::runQueued() {
+    std::function<void()> fn;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.empty()) return false;
+        fn = std::move(queue.front());
+        queue.pop_front();
+    }
+    fn(); // обёртка из enqueue() исключений не выпускает
+    complete();
+    return true;
+}
+
+void TaskGroup::State::complete() {
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // Под замком: ожидающий либо ещё не проверил pending, либо уже спит
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.notify_all();
+    }
+}
+
+TaskGroup::TaskGroup(TaskPool& pool, CancelToken token)
+    : m_pool(pool), m_token(std::move(token)), m_state(std::make_shared<State>()) {}
+
+TaskGroup::~TaskGroup() {
+    waitQuietly();
+}
+
+void TaskGroup::run(std::function<void()> fn) {
+    enqueue(std::move(fn), false);
+}
+
+void TaskGroup::runBackground(std::function<void()> fn) {
+    enqueue(std::move(fn), true);
+}
+
+void TaskGroup::enqueue(std::function<void()> fn, bool background) {
+    // Сырой указатель: задача лежит в самом State, shared_ptr дал бы цикл
+    State* state = m_state.get();
+    CancelToken token = m_token;
+    std::function<void()> task = [state, token, fn = std::move(fn)]() {
+        if (token.cancelled()) return;
+        try {
+            fn();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (!state->error) state->error = std::current_exception();
+        }
+    };
+    m_state->pending.fetch_add(1, std::memory_order_acq_rel);
+    try {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->queue.push_back(std::move(task));
+    } catch (...) {
+        m_state->pending.fetch_sub(1, std::memory_order_acq_rel);
+        throw;
+    }
+
+    std::shared_ptr<State> shared = m_state;
+    TaskPool::Task ticket = [shared]() { shared->runQueued(); };
+    try {
+        if (background) m_pool.postBackground(std::move(ticket));
+        else m_pool.post(std::move(ticket));
+    } catch (...) { //NOSONAR
+        // Талон не поставлен — задача остаётся в queue и выполнится в wait()
+    }
+}
+
+bool TaskGroup::done() const {
+    return m_state->pending.load(std::memory_order_acquire) == 0;
+}
+
+void TaskGroup::waitQuietly() {
+    bool worker = m_pool.isWorkerThread();
+    while (!done()) {
+        if (m_state->runQueued()) continue;
+        // Вложенный join в рабочем помогает пулу; GTK-поток чужих задач не берёт
+        if (worker && m_pool.runOne()) continue;
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->finished.wait(lock, [this]() { return done() || !m_state->queue.empty(); });
+    }
+}
+
+void TaskGroup::wait() {
+    waitQuietly();
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        error = m_state->error;
+        m_state->error = nullptr;
+    }
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,125 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Флаг отмены, общий для GTK-потока и задач. Копии разделяют один флаг.
+class CancelToken {
+public:
+    CancelToken() : m_flag(std::make_shared<std::atomic<bool>>(false)) {}
+    void cancel() const { m_flag->store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return m_flag->load(std::memory_order_relaxed); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> m_flag;
+};
+
+// Прогресс длинной операции: задачи добавляют сделанное, GTK-поток опрашивает
+struct TaskProgress {
+    std::atomic<long long> done{0};
+    std::atomic<long long> total{0};
+
+    void add(long long n) { done.fetch_add(n, std::memory_order_relaxed); }
+    double fraction() const; // 0..1; 1 — если total == 0
+};
+
+// Планировщик задач с перехватом работы (work stealing). У каждого рабочего
+// потока своя дека: свои задачи берутся с хвоста (LIFO — горячий кэш при
+// fork/join по поддеревьям), чужие воруются с головы. Задачи извне пула
+// попадают в общую очередь. Долгие фоновые задачи — в отдельную очередь, её
+// разбирают только простаивающие рабочие. Размер — число аппаратных потоков.
+class TaskPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit TaskPool(unsigned threads = 0); // 0 — std::thread::hardware_concurrency()
+    ~TaskPool();                             // невыполненные задачи отбрасываются
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    static TaskPool& instance();
+
+    unsigned size() const;
+    // Поставить задачу; исключения из неё глотаются (для результата — TaskGroup)
+    void post(Task task); // O(1)
+    // Фоновая задача (перестройка дерева): её берёт только рабочий из своего цикла,
+    // никогда — поток, помогающий пулу в ожидании join
+    void postBackground(Task task); // O(1)
+    // Выполнить одну готовую задачу (не фоновую) в текущем потоке; false — нечего.
+    // Так рабочий, ждущий вложенный join, помогает пулу вместо того, чтобы спать.
+    bool runOne();
+    bool isWorkerThread() const; // текущий поток — рабочий этого пула
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;               // общая очередь и сон рабочих
+    std::condition_variable m_wake;
+    std::deque<Task> m_injected;
+    std::deque<Task> m_background;
+    std::atomic<long> m_queued{0};    // поставлено, но ещё не взято (вместе с фоновыми)
+    bool m_stop = false;
+
+    int currentWorker() const; // индекс рабочего этого пула в текущем потоке или -1
+    bool pop(Task& out, int self, bool background);
+    static void runTask(Task& task);
+    void workerLoop(int index);
+};
+
+// Fork/join: run() раздаёт задачи в пул, wait() ждёт их, сам выполняя ещё не
+// начатые задачи своей группы. Чужие задачи берёт только рабочий пула (вложенный
+// join); поток извне пула — GTK — чужого не трогает и, когда своего не осталось,
+// спит на условной переменной. Первое исключение из задач перебрасывается из
+// wait(). Отменённый токен пропускает ещё не начатые задачи. done() — неблокирующий
+// опрос для GTK-потока.
+class TaskGroup {
+public:
+    explicit TaskGroup(TaskPool& pool = TaskPool::instance(), CancelToken token = CancelToken());
+    ~TaskGroup(); // ждёт незавершённые задачи (исключение не перебрасывается)
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> fn);
+    void runBackground(std::function<void()> fn); // через TaskPool::postBackground
+    void wait();
+    bool done() const;
+    const CancelToken& token() const { return m_token; }
+
+private:
+    // В пул уходит не сама задача, а «талон»: он берёт из queue первую ещё не
+    // начатую задачу группы. Ожидающий берёт оттуда же, лишние талоны пусты.
+    struct State {
+        std::atomic<int> pending{0};
+        std::mutex mutex;                // queue, error и сон ожидающего
+        std::condition_variable finished;
+        std::deque<std::function<void()>> queue;
+        std::exception_ptr error;
+
+        bool runQueued(); // выполнить одну задачу из queue; false — пусто
+        void complete();  // задача группы завершена
+    };
+
+    TaskPool& m_pool;
+    CancelToken m_token;
+    std::shared_ptr<State> m_state;
+
+    void enqueue(std::function<void()> fn, bool background);
+    void waitQuietly();
+};
+
+#endif // TASK_POOL_H
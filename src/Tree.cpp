@@ -1,9 +1,173 @@
 #include "Tree.h"
+#include "NodeReclaimer.h"
+#include "TreeCounters.h"
+#include "TreeRebuild.h"
+#include "TaskPool.h"
+#include "SearchKernel.h"
+#include "Regex.h"
+#include "PatternSet.h"
+#include "TrigramIndex.h"
+#include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <stdexcept>
 #include <sstream>
 
+// ==========================================
+// Реализация TextStats
+// ==========================================
+
+namespace {
+    // Пробельные символы в смысле std::isspace для локали "C"
+    inline bool isSpaceByte(unsigned char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    // Высота поддерева: лист — 0, пустое — -1
+    inline int nodeHeight(const Node* node) {
+        if (!node) return -1;
+        return node->getType() == NodeType::NODE_LEAF ? 0 : static_cast<const InternalNode*>(node)->height;
+    }
+}
+
+TextStats TextStats::ofBytes(const char* data, int len) {
+    TextStats st;
+    st.bytes = len;
+    if (len <= 0 || !data) return st;
+
+    bool inWord = false;
+    for (int i = 0; i < len; ++i) {
+        auto c = static_cast<unsigned char>(data[i]);
+        bool space = isSpaceByte(c);
+        if ((c & 0xC0) != 0x80) {
+            ++st.chars;
+            if (!space) ++st.nonSpace;
+        }
+        if (!space && !inWord) ++st.words;
+        inWord = !space;
+    }
+    st.startsInWord = !isSpaceByte(static_cast<unsigned char>(data[0]));
+    st.endsInWord = inWord;
+    return st;
+}
+
+TextStats TextStats::combine(const TextStats& a, const TextStats& b) {
+    if (a.bytes == 0) return b;
+    if (b.bytes == 0) return a;
+    TextStats st;
+    st.bytes = a.bytes + b.bytes;
+    st.chars = a.chars + b.chars;
+    st.nonSpace = a.nonSpace + b.nonSpace;
+    // Слово, разрезанное границей листов, считается один раз
+    st.words = a.words + b.words - ((a.endsInWord && b.startsInWord) ? 1 : 0);
+    st.startsInWord = a.startsInWord;
+    st.endsInWord = b.endsInWord;
+    return st;
+}
+
+// ==========================================
+// Реализация ByteSet
+// ==========================================
+
+ByteSet ByteSet::ofBytes(const char* data, int len) {
+    ByteSet set;
+    if (len <= 0 || !data) return set;
+    // Отметки в таблицы байт, а не OR в четыре слова: соседние байты не ждут друг
+    // друга. Четыре таблицы — повтор одного байта подряд не упирается в одну запись.
+    unsigned char seen[4][256] = {};
+    const auto* p = reinterpret_cast<const unsigned char*>(data);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        seen[0][p[i]] = 1;
+        seen[1][p[i + 1]] = 1;
+        seen[2][p[i + 2]] = 1;
+        seen[3][p[i + 3]] = 1;
+    }
+    for (; i < len; ++i) seen[0][p[i]] = 1;
+    for (int b = 0; b < 256; ++b) {
+        if (seen[0][b] | seen[1][b] | seen[2][b] | seen[3][b]) set.add(static_cast<unsigned char>(b));
+    }
+    return set;
+}
+
+ByteSet ByteSet::foldAscii() const {
+    // 'A'..'Z' — биты 1..26 второго слова, 'a'..'z' — биты 33..58 того же слова
+    const std::uint64_t upper = ((std::uint64_t(1) << 26) - 1) << 1;
+    ByteSet set = *this;
+    set.bits[1] |= (bits[1] & upper) << 32;
+    return set;
+}
+
+// ==========================================
+// Реализация ContentHash
+// ==========================================
+
+namespace {
+    const unsigned long long HASH_MOD = (1ULL << 61) - 1;
+    // Основание фиксировано: хэши живого буфера и загруженного .bin сравнимы между собой
+    const unsigned long long HASH_BASE = 0x1f3a5b7c9d2e4f1ULL;
+
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 HashWide;
+
+    inline unsigned long long mulMod(unsigned long long a, unsigned long long b) {
+        HashWide p = static_cast<HashWide>(a) * b;
+        unsigned long long r = static_cast<unsigned long long>(p & HASH_MOD) + static_cast<unsigned long long>(p >> 61);
+        return r >= HASH_MOD ? r - HASH_MOD : r;
+    }
+#else
+    // Без 128-битного типа: перемножаем половинки по 31/30 бит
+    inline unsigned long long mulMod(unsigned long long a, unsigned long long b) {
+        const unsigned long long MASK30 = (1ULL << 30) - 1;
+        const unsigned long long MASK31 = (1ULL << 31) - 1;
+        unsigned long long aHi = a >> 31;
+        unsigned long long aLo = a & MASK31;
+        unsigned long long bHi = b >> 31;
+        unsigned long long bLo = b & MASK31;
+        unsigned long long mid = aLo * bHi + aHi * bLo;
+        unsigned long long r = ((aHi * bHi) << 1) + (mid >> 30) + ((mid & MASK30) << 31) + aLo * bLo;
+        r = (r & HASH_MOD) + (r >> 61);
+        return r >= HASH_MOD ? r - HASH_MOD : r;
+    }
+#endif
+
+    inline unsigned long long addMod(unsigned long long a, unsigned long long b) {
+        unsigned long long r = a + b;
+        return r >= HASH_MOD ? r - HASH_MOD : r;
+    }
+
+    unsigned long long powMod(unsigned long long base, int exp) {
+        unsigned long long result = 1;
+        while (exp > 0) {
+            if (exp & 1) result = mulMod(result, base);
+            base = mulMod(base, base);
+            exp >>= 1;
+        }
+        return result;
+    }
+}
+
+ContentHash ContentHash::ofBytes(const char* data, int len) {
+    ContentHash h;
+    if (len <= 0 || !data) return h;
+    for (int i = 0; i < len; ++i) {
+        // +1: нулевой байт тоже меняет хэш
+        h.value = addMod(mulMod(h.value, HASH_BASE), static_cast<unsigned char>(data[i]) + 1ULL);
+    }
+    h.power = powMod(HASH_BASE, len);
+    return h;
+}
+
+ContentHash ContentHash::combine(const ContentHash& a, const ContentHash& b) {
+    ContentHash h;
+    h.value = addMod(mulMod(a.value, b.power), b.value);
+    h.power = mulMod(a.power, b.power);
+    return h;
+}
+
 // ==========================================
 // Реализация LeafNode
 // ==========================================
@@ -11,33 +175,57 @@
 LeafNode::LeafNode(const char* str, int len) {
     this->length = len;
     this->data = new char[len]; // NOSONAR
-    this->lineCount = 1;
+    this->lineCount = 0;
+    TREE_COUNT(LEAVES_CREATED, 1);
+    TREE_COUNT(ALLOCATIONS, 2); // узел + данные
     
-    // Инициализируем всю выделенную память нулями, чтобы избежать чтения "мусора".
-    if (len > 0) {
-        std::memset(this->data, 0, len);
-    }
-
-    // Копируем фактические данные, если str валиден.
+    // Копируем фактические данные, если str валиден; иначе — нули, чтобы избежать чтения "мусора".
     if (len > 0 && str) { 
         std::memcpy(this->data, str, len);
+        TREE_COUNT(BYTES_COPIED, len);
+    } else if (len > 0) {
+        std::memset(this->data, 0, len);
     }
 
-    // Расчет теперь безопасен, т.к. this->data инициализирован.
-    for (int i = 0; i < len; i++) {
-        if (this->data[i] == '\n') {
-            this->lineCount++;
-        }
+    // '\n' ищет memchr (векторизован в libc), а не побайтовый цикл
+    const char* p = this->data;
+    const char* end = p + len;
+    while (p < end && (p = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p))))) {
+        ++this->lineCount;
+        ++p;
+    }
+    this->stats = TextStats::ofBytes(this->data, len);
+    this->bytes = ByteSet::ofBytes(this->data, len);
+    if (len > 0) {
+        edges[0] = data[0];
+        edges[1] = data[len > 1 ? 1 : 0];
+        edges[2] = data[len > 1 ? len - 2 : 0];
+        edges[3] = data[len - 1];
     }
 }
 
+LeafNode::LeafNode(const LeafNode& raw, char* packedBytes, int packedLen)
+    : length(raw.length), lineCount(raw.lineCount), data(nullptr), stats(raw.stats), bytes(raw.bytes),
+      editStamp(raw.editStamp), packed(packedBytes), packedLength(packedLen),
+      packId(LeafCodec::nextPackId()) {
+    std::memcpy(edges, raw.edges, sizeof(edges));
+    TREE_COUNT(LEAVES_CREATED, 1);
+    TREE_COUNT(ALLOCATIONS, 2); // узел + сжатые данные
+}
+
 LeafNode::~LeafNode() {
+    TREE_COUNT(LEAVES_DESTROYED, 1);
     delete[] data; // NOSONAR
+    delete[] packed; // NOSONAR
 }
 
 NodeType LeafNode::getType() const { return NodeType::NODE_LEAF; }
 int LeafNode::getLength() const { return length; }
 int LeafNode::getLineCount() const { return lineCount; }
+int LeafNode::getVisibleLineCount() const { return folded ? 0 : lineCount; }
+bool LeafNode::hasFolds() const { return folded; }
+const TextStats& LeafNode::getStats() const { return stats; }
+const ByteSet& LeafNode::getBytes() const { return bytes; }
 
 // ==========================================
 // Реализация InternalNode
@@ -47,24 +235,34 @@ InternalNode::InternalNode(Node* l, Node* r) {
     this->left = l;
     this->right = r;
     
-    // Инициализируем нулями
-    this->totalLength = 0;
-    this->totalLineCount = 0;
-
     // Берем готовые данные из детей. Это O(1).
-    if (l) {
-        this->totalLength += l->getLength();
-        this->totalLineCount += l->getLineCount();
+    TREE_COUNT(ALLOCATIONS, 1);
+    recalc();
+}
+
+void InternalNode::recalc() {
+    recalcContent();
+    totalVisibleLineCount = 0;
+    anyFolded = false;
+    if (left) {
+        totalVisibleLineCount += left->getVisibleLineCount();
+        anyFolded = anyFolded || left->hasFolds();
     }
-    if (r) {
-        this->totalLength += r->getLength();
-        this->totalLineCount += r->getLineCount();
+    if (right) {
+        totalVisibleLineCount += right->getVisibleLineCount();
+        anyFolded = anyFolded || right->hasFolds();
     }
 }
 
-void InternalNode::recalc() {
+void InternalNode::recalcContent() {
     totalLength = 0;
     totalLineCount = 0;
+    hashValid = false; // дети могли смениться — хэш досчитается при запросе
+    totalStats = TextStats::combine(left ? left->getStats() : TextStats(),
+                                    right ? right->getStats() : TextStats());
+    totalBytes = ByteSet();
+    if (left) totalBytes.merge(left->getBytes());
+    if (right) totalBytes.merge(right->getBytes());
     if (left) {
         totalLength += left->getLength();
         totalLineCount += left->getLineCount();
@@ -73,12 +271,47 @@ void InternalNode::recalc() {
         totalLength += right->getLength();
         totalLineCount += right->getLineCount();
     }
+    height = 1 + std::max(nodeHeight(left), nodeHeight(right));
+    totalVisibleLineCount = totalLineCount;
+    anyFolded = false;
 }
 
 NodeType InternalNode::getType() const { return NodeType::NODE_INTERNAL; }
 int InternalNode::getLength() const { return totalLength; }
 int InternalNode::getLineCount() const { return totalLineCount; }
+int InternalNode::getVisibleLineCount() const { return folded ? 0 : totalVisibleLineCount; }
+bool InternalNode::hasFolds() const { return folded || anyFolded; }
+const TextStats& InternalNode::getStats() const { return totalStats; }
+const ByteSet& InternalNode::getBytes() const { return totalBytes; }
+
+
+// ==========================================
+// Реализация TreeFinger
+// ==========================================
 
+void TreeFinger::reset() {
+    path.clear();
+    pathOffset.clear();
+    pathLines.clear();
+    pathLeft.clear();
+    leaf = nullptr;
+    leafOffset = 0;
+    leafLines = 0;
+}
+
+void TreeFinger::push(InternalNode* node, int offset, int lines, bool left) {
+    path.push_back(node);
+    pathOffset.push_back(offset);
+    pathLines.push_back(lines);
+    pathLeft.push_back(left ? 1 : 0);
+}
+
+void TreeFinger::pop() {
+    path.pop_back();
+    pathOffset.pop_back();
+    pathLines.pop_back();
+    pathLeft.pop_back();
+}
 
 // ==========================================
 // Реализация Tree
@@ -99,88 +332,606 @@ LeafNode::LeafNode(LeafNode&& other) noexcept
 LeafNode& LeafNode::operator=(LeafNode&& other) noexcept {
     if (this != &other) {
         delete[] data; //NOSONAR  // Очищаем текущие данные
+        delete[] packed; //NOSONAR
         
         length = other.length;
         lineCount = other.lineCount;
         data = other.data;
+        folded = other.folded;
+        stats = other.stats;
+        bytes = other.bytes;
+        hash = other.hash;
+        hashValid = other.hashValid;
+        editStamp = other.editStamp;
+        packed = other.packed;
+        packedLength = other.packedLength;
+        packId = other.packId;
+        std::memcpy(edges, other.edges, sizeof(edges));
         
         other.length = 0;
         other.lineCount = 0;
         other.data = nullptr;
+        other.packed = nullptr;
+        other.packedLength = 0;
+        other.stats = TextStats();
+        other.bytes = ByteSet();
+        other.hashValid = false;
     }
     return *this;
 }
 
 
 void Tree::clear() {
-    clearRecursive(root);
+    // Отсоединяем дерево и отдаём его фоновому реклеймеру:
+    // GTK-поток не ждёт удаления миллионов узлов, а вырожденное дерево
+    // больше не переполняет стек (удаление итеративное).
+    discardRebuild();
+    Node* old = root;
     root = nullptr;
+    ++m_textVersion;
+    touch();
+    dropFolds();
+    m_markers.collapseAll();
+    NodeReclaimer::retire(old);
+    m_unpacked.clear();
+    if (m_trigrams) m_trigrams->clear();
 }
 
-void Tree::clearRecursive(Node* node) {
-    if (!node) return;
-    
-    if (node->getType() == NodeType::NODE_INTERNAL) {
-        auto inner = static_cast<InternalNode*>(node);
-        clearRecursive(inner->left);
-        clearRecursive(inner->right);
-    }
-    delete node; // NOSONAR // Виртуальный деструктор сработает корректно
+void Tree::touch() {
+    ++m_version;
 }
 
+unsigned long Tree::getVersion() const { return m_version; }
+
+unsigned long Tree::getTextVersion() const { return m_textVersion; }
+
 bool Tree::isEmpty() const { return root == nullptr; }
 Node* Tree::getRoot() const { return root; }
 
 void Tree::setRoot(Node* newRoot) {
+    discardRebuild();
     if (root && root != newRoot) clear();
     root = newRoot;
+    ++m_textVersion;
+    touch();
 }
 
-// --- Построение (Logic Update) ---
+// --- Маркеры ---
 
-Node* Tree::buildFromTextRecursive(const char* text, int len) {
-    if (len <= 0) return nullptr;
+int Tree::createMarker(int offset, MarkerGravity gravity) {
+    int total = root ? root->getLength() : 0;
+    if (offset < 0) offset = 0;
+    if (offset > total) offset = total;
+    return m_markers.create(offset, gravity);
+}
 
-    // УСЛОВИЕ ЛИСТА:
-    // Если текст влезает в лимит размера, делаем лист.
-    // Это гарантирует, что даже файл без \n будет разбит на куски.
-    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
-    if (len <= MAX_LEAF_SIZE) {
-        return new LeafNode(text, len); // NOSONAR
-    } 
+void Tree::removeMarker(int id) { m_markers.remove(id); }
 
-    // ПОИСК ТОЧКИ РАЗРЕЗА:
-    // Пытаемся найти \n рядом с серединой, чтобы не резать слова.
-    int half = len / 2;
-    int splitIndex = -1;
-    
-    // Ищем \n в диапазоне +/- 256 байт от середины (или меньше, если файл мал)
-    int searchRange = (len < 512) ? (len / 4) : 256;
+int Tree::getMarkerOffset(int id) const { return m_markers.offsetOf(id); }
+
+void Tree::setMarkerOffset(int id, int offset) {
+    int total = root ? root->getLength() : 0;
+    if (offset < 0) offset = 0;
+    if (offset > total) offset = total;
+    m_markers.move(id, offset);
+}
+
+int Tree::getMarkerCount() const { return m_markers.count(); }
+
+// --- Свёртки (folding) ---
+// Скрытость хранится флагом folded на узлах, покрывающих диапазон свёртки, а у каждого
+// InternalNode есть сводка totalVisibleLineCount. Свернуть 2M строк — пометить O(глубина)
+// узлов; перевод ряд <-> строка — один спуск по сводкам.
+
+void Tree::dropFolds() {
+    for (const FoldRange& fold : m_folds) {
+        if (fold.startMarker < 0) continue;
+        m_markers.remove(fold.startMarker);
+        m_markers.remove(fold.endMarker);
+    }
+    m_folds.clear();
+}
+
+// Разрезать лист так, чтобы offset пришёлся на границу листов
+Node* Tree::splitAtRecursive(Node* node, int offset) {
+    if (!node || offset <= 0 || offset >= node->getLength()) return node;
+    TREE_COUNT(NODES_VISITED, 1);
+
+    if (node->getType() == NodeType::NODE_LEAF) {
+        return splitLeafAtOffset(static_cast<LeafNode*>(node), offset);
+    }
+
+    auto inner = static_cast<InternalNode*>(node);
+    if (int leftLen = (inner->left ? inner->left->getLength() : 0); offset < leftLen) {
+        inner->left = splitAtRecursive(inner->left, offset);
+    } else {
+        inner->right = splitAtRecursive(inner->right, offset - leftLen);
+    }
+    inner->recalc();
+    return inner;
+}
+
+// Пометить folded максимальные узлы, целиком лежащие в [from, to)
+void Tree::setFoldedRecursive(Node* node, int from, int to) {
+    if (!node || node->folded) return;
+    int len = node->getLength();
+    if (from >= len || to <= 0) return;
+
+    if (from <= 0 && to >= len) {
+        node->folded = true;
+        return;
+    }
+    // Границы выровнены по листам заранее (splitAtRecursive)
+    if (node->getType() == NodeType::NODE_LEAF) return;
+
+    auto inner = static_cast<InternalNode*>(node);
+    int leftLen = inner->left ? inner->left->getLength() : 0;
+    setFoldedRecursive(inner->left, from, to);
+    setFoldedRecursive(inner->right, from - leftLen, to - leftLen);
+    inner->recalc();
+}
+
+// Снять folded со всех узлов внутри [from, to); узлы, выходящие за диапазон,
+// принадлежат более широкой свёртке и остаются свёрнутыми
+void Tree::clearFoldedRecursive(Node* node, int from, int to) {
+    if (!node || !node->hasFolds()) return;
+    int len = node->getLength();
+    if (from >= len || to <= 0) return;
+
+    if (from <= 0 && to >= len) node->folded = false;
+    if (node->getType() == NodeType::NODE_LEAF) return;
+
+    auto inner = static_cast<InternalNode*>(node);
+    int leftLen = inner->left ? inner->left->getLength() : 0;
+    clearFoldedRecursive(inner->left, from, to);
+    clearFoldedRecursive(inner->right, from - leftLen, to - leftLen);
+    inner->recalc();
+}
+
+void Tree::applyFold(const FoldRange& fold) {
+    int start = m_markers.offsetOf(fold.startMarker);
+    int end = m_markers.offsetOf(fold.endMarker);
+    if (!root || start >= end) return;
+
+    root = splitAtRecursive(root, start);
+    root = splitAtRecursive(root, end);
+    setFoldedRecursive(root, start, end);
+    touch();
+}
+
+int Tree::foldLines(int firstLine, int lastLine) {
+    int total = getTotalLineCount();
+    if (!root || firstLine < 0 || lastLine >= total || lastLine <= firstLine) return -1;
+
+    // Скрываем от '\n' заголовка до конца lastLine (её '\n' остаётся видимым)
+    int start = getOffsetForLine(firstLine + 1) - 1;
+    int end = (lastLine + 1 < total) ? getOffsetForLine(lastLine + 1) - 1 : root->getLength();
+
+    // LEFT-начало: текст, набранный в конце заголовка, попадает внутрь диапазона
+    // (но в видимый лист); RIGHT-конец: набранное в конце свёртки остаётся скрытым.
+    FoldRange fold;
+    fold.startMarker = m_markers.create(start, MarkerGravity::LEFT);
+    fold.endMarker = m_markers.create(end, MarkerGravity::RIGHT);
+    applyFold(fold);
+
+    for (size_t i = 0; i < m_folds.size(); ++i) {
+        if (m_folds[i].startMarker < 0) {
+            m_folds[i] = fold;
+            return static_cast<int>(i);
+        }
+    }
+    m_folds.push_back(fold);
+    return static_cast<int>(m_folds.size()) - 1;
+}
 
-    // Ищем вправо от середины
-    for (int i = 0; i < searchRange; i++) {
-        if (half + i < len && text[half + i] == '\n') {
-            splitIndex = half + i + 1; // Режем ПОСЛЕ \n
+void Tree::unfold(int foldId) {
+    if (foldId < 0 || foldId >= static_cast<int>(m_folds.size())) return;
+    FoldRange fold = m_folds[foldId];
+    if (fold.startMarker < 0) return;
+    m_folds[foldId] = FoldRange();
+
+    int start = m_markers.offsetOf(fold.startMarker);
+    int end = m_markers.offsetOf(fold.endMarker);
+    m_markers.remove(fold.startMarker);
+    m_markers.remove(fold.endMarker);
+    if (!root || start >= end) return;
+
+    clearFoldedRecursive(root, start, end);
+    touch();
+
+    // Вложенные и пересекающиеся свёртки снова скрывают свою часть
+    for (const FoldRange& other : m_folds) {
+        if (other.startMarker < 0) continue;
+        int s = m_markers.offsetOf(other.startMarker);
+        int e = m_markers.offsetOf(other.endMarker);
+        if (s < end && e > start) applyFold(other);
+    }
+}
+
+void Tree::unfoldAll() {
+    if (root) {
+        clearFoldedRecursive(root, 0, root->getLength());
+        touch();
+    }
+    dropFolds();
+}
+
+// Граница offset внутри свёртки (или на её конце) разорвала бы её при перестановке блоков
+void Tree::unfoldAcross(int offset) {
+    for (size_t i = 0; i < m_folds.size(); ++i) {
+        const FoldRange& fold = m_folds[i];
+        if (fold.startMarker < 0) continue;
+        int start = m_markers.offsetOf(fold.startMarker);
+        int end = m_markers.offsetOf(fold.endMarker);
+        if (start < offset && offset <= end) unfold(static_cast<int>(i));
+    }
+}
+
+int Tree::getFoldForLine(int line) const {
+    for (size_t i = 0; i < m_folds.size(); ++i) {
+        const FoldRange& fold = m_folds[i];
+        if (fold.startMarker < 0) continue;
+        int start = m_markers.offsetOf(fold.startMarker);
+        if (start >= m_markers.offsetOf(fold.endMarker)) continue;
+        // start — '\n' заголовка: до него ровно line переводов строк
+        if (getLineForOffset(start) == line) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+bool Tree::isLineHidden(int line) const {
+    if (!root || line <= 0 || line >= getTotalLineCount()) return false;
+
+    // Строка line скрыта, если скрыт '\n' номер line, с которого она начинается
+    const Node* node = root;
+    int lineBreak = line;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        if (node->folded) return true;
+        auto in = static_cast<const InternalNode*>(node);
+        int leftLines = in->left ? in->left->getLineCount() : 0;
+        if (in->left && (!in->right || lineBreak <= leftLines)) {
+            node = in->left;
+        } else {
+            lineBreak -= leftLines;
+            node = in->right;
+        }
+    }
+    return node->folded;
+}
+
+int Tree::getVisibleLineCount() const {
+    if (!root) return 0;
+    return root->getVisibleLineCount() + 1;
+}
+
+int Tree::visibleRowToLine(int row) const {
+    if (!root || row <= 0) return 0;
+    int visible = root->getVisibleLineCount();
+    if (row > visible) row = visible;
+    if (row == 0) return 0;
+
+    // Ряд row начинается после row-го видимого '\n'; в несвёрнутом листе видимы все '\n'
+    const Node* node = root;
+    int linesBefore = 0;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<const InternalNode*>(node);
+        int leftVisible = in->left ? in->left->getVisibleLineCount() : 0;
+        if (row <= leftVisible) {
+            node = in->left;
+        } else {
+            row -= leftVisible;
+            linesBefore += in->left ? in->left->getLineCount() : 0;
+            node = in->right;
+        }
+    }
+    return linesBefore + row;
+}
+
+int Tree::lineToVisibleRow(int line) const {
+    if (!root || line <= 0) return 0;
+    int total = getTotalLineCount();
+    if (line >= total) line = total - 1;
+
+    // Считаем видимые '\n' среди первых line переводов строк
+    const Node* node = root;
+    int lineBreaks = line;
+    int row = 0;
+    while (node && lineBreaks > 0 && !node->folded) {
+        if (node->getType() == NodeType::NODE_LEAF) {
+            row += lineBreaks;
             break;
         }
+        auto in = static_cast<const InternalNode*>(node);
+        int leftLines = in->left ? in->left->getLineCount() : 0;
+        if (lineBreaks <= leftLines) {
+            node = in->left;
+        } else {
+            row += in->left ? in->left->getVisibleLineCount() : 0;
+            lineBreaks -= leftLines;
+            node = in->right;
+        }
     }
-    
-    // Если не нашли, ищем влево
-    if (splitIndex == -1) {
-        for (int i = 0; i < searchRange; i++) {
-            if (half - i > 0 && text[half - i] == '\n') {
-                splitIndex = half - i + 1;
-                break;
+    return row;
+}
+
+// --- Построение (Logic Update) ---
+
+int LeafSplitPolicy::chooseSplit(const char* text, int len) const {
+    return chooseBoundary(text, len, len / 2, lineSlack);
+}
+
+int LeafSplitPolicy::chooseBoundary(const char* text, int len, int target, int slack) const {
+    if (target < 1) target = 1;
+    if (target > len - 1) target = len - 1;
+
+    // Ближайший к target '\n' (режем ПОСЛЕ него, обе части непустые); при равенстве — правый
+    for (int i = 0; i < slack; ++i) {
+        int right = target + i;
+        int left = target - i;
+        if (right >= len && left <= 0) break;
+        if (right < len && text[right - 1] == '\n') return right;
+        if (left > 0 && text[left - 1] == '\n') return left;
+    }
+
+    // ФОЛЛБЭК: '\n' рядом нет (minified файл) — режем у target,
+    // но не внутри многобайтового символа
+    if (keepUtf8) {
+        auto isContinuation = [text](int i) { return (static_cast<unsigned char>(text[i]) & 0xC0) == 0x80; };
+        int back = target;
+        while (back > 1 && target - back < 3 && isContinuation(back)) --back;
+        if (!isContinuation(back)) return back;
+        int forward = target;
+        while (forward < len - 1 && forward - target < 3 && isContinuation(forward)) ++forward;
+        if (!isContinuation(forward)) return forward;
+    }
+    return target;
+}
+
+void Tree::setLeafSplitPolicy(const LeafSplitPolicy& policy) {
+    m_splitPolicy = policy;
+}
+
+const LeafSplitPolicy& Tree::getLeafSplitPolicy() const {
+    return m_splitPolicy;
+}
+
+// --- Температура листьев и уплотнение ---
+
+bool Tree::isColdLeaf(const LeafNode* leaf, unsigned long editClock, const LeafSplitPolicy& policy) {
+    return leaf->editStamp == 0 || editClock - leaf->editStamp > policy.coolDownEdits;
+}
+
+Node* Tree::buildBalanced(const std::vector<Node*>& nodes, std::size_t from, std::size_t to) {
+    if (from >= to) return nullptr;
+    if (to - from == 1) return nodes[from];
+    std::size_t mid = from + (to - from) / 2;
+    Node* left = buildBalanced(nodes, from, mid);
+    Node* right = buildBalanced(nodes, mid, to);
+    auto node = new InternalNode(nullptr, nullptr); //NOSONAR
+    node->left = left;
+    node->right = right;
+    node->recalcContent(); // флаги свёрток ставятся после сборки
+    return node;
+}
+
+namespace {
+    // Сжатая копия несжатого листа; nullptr, если сжатие выигрывает меньше четверти
+    LeafNode* packedCopy(const LeafNode* leaf) {
+        int cap = leaf->length - leaf->length / 4;
+        char* tmp = new char[cap]; //NOSONAR
+        int n = LeafCodec::compress(leaf->data, leaf->length, tmp, cap);
+        if (n == 0) {
+            delete[] tmp; //NOSONAR
+            return nullptr;
+        }
+        char* bytes = nullptr;
+        try {
+            bytes = new char[n]; //NOSONAR
+            std::memcpy(bytes, tmp, static_cast<size_t>(n));
+            delete[] tmp; //NOSONAR
+            tmp = nullptr;
+            return new LeafNode(*leaf, bytes, n); //NOSONAR
+        } catch (...) {
+            delete[] tmp; //NOSONAR
+            delete[] bytes; //NOSONAR
+            throw;
+        }
+    }
+}
+
+bool Tree::packLeaves(const std::vector<LeafNode*>& leaves, const std::vector<char>* hashed,
+                      unsigned long editClock, const LeafSplitPolicy& policy, std::vector<Node*>& packed,
+                      std::vector<LeafNode*>& merged, std::vector<LeafNode*>& created,
+                      const CancelToken* cancel, TaskProgress* progress) {
+    // Серии соседних холодных листьев склеиваются до coldLeafSize, крупные холодные
+    // листья сжимаются (packMinSize). Новые листья создаются до того, как что-то
+    // удалено: при нехватке памяти дерево не тронуто. Сжатые листья не склеиваются —
+    // их data пуст, а распаковка в рабочем потоке не нужна.
+    const int target = policy.coldLeafSize;
+    packed.reserve(leaves.size());
+    std::size_t runStart = 0;
+    int runLen = 0;
+    // Хэш несжатого листа снимка: кэш, если он был готов, иначе по байтам
+    auto leafHash = [&](std::size_t i) {
+        const LeafNode* leaf = leaves[i];
+        bool known = hashed ? (*hashed)[i] != 0 : leaf->hashValid;
+        return known ? leaf->hash : ContentHash::ofBytes(leaf->data, leaf->length);
+    };
+    // owned — лист только что склеен (его хэш уже готов) и лежит последним в created;
+    // иначе index — его место в leaves
+    auto emit = [&](LeafNode* leaf, bool owned, std::size_t index) {
+        if (policy.packMinSize > 0 && !leaf->packed && leaf->length >= policy.packMinSize &&
+            isColdLeaf(leaf, editClock, policy)) {
+            if (LeafNode* copy = packedCopy(leaf)) {
+                copy->hash = owned ? leaf->hash : leafHash(index);
+                copy->hashValid = true;
+                if (owned) {
+                    delete leaf; //NOSONAR
+                    created.back() = copy;
+                } else {
+                    created.push_back(copy);
+                    merged.push_back(leaf);
+                }
+                packed.push_back(copy);
+                return;
+            }
+        }
+        packed.push_back(leaf);
+    };
+    auto flush = [&](std::size_t runEnd) {
+        if (runEnd - runStart == 1) {
+            emit(leaves[runStart], false, runStart);
+        } else if (runEnd - runStart > 1) {
+            char* buf = new char[runLen]; //NOSONAR
+            int pos = 0;
+            for (std::size_t i = runStart; i < runEnd; ++i) {
+                std::memcpy(buf + pos, leaves[i]->data, leaves[i]->length);
+                pos += leaves[i]->length;
+            }
+            LeafNode* leaf = nullptr;
+            try {
+                leaf = new LeafNode(buf, runLen); //NOSONAR
+            } catch (...) {
+                delete[] buf; //NOSONAR
+                throw;
             }
+            delete[] buf; //NOSONAR
+            created.push_back(leaf);
+            // Хэш склейки — из хэшей частей, без второго прохода по байтам
+            ContentHash hash;
+            for (std::size_t i = runStart; i < runEnd; ++i) hash = ContentHash::combine(hash, leafHash(i));
+            leaf->hash = hash;
+            leaf->hashValid = true;
+            merged.insert(merged.end(), leaves.begin() + static_cast<std::ptrdiff_t>(runStart),
+                          leaves.begin() + static_cast<std::ptrdiff_t>(runEnd));
+            emit(leaf, true, 0);
         }
+        runStart = runEnd;
+        runLen = 0;
+    };
+    try {
+        for (std::size_t i = 0; i < leaves.size(); ++i) {
+            if ((i & 1023) == 0 && i > 0) {
+                if (progress) progress->add(1024);
+                if (cancel && cancel->cancelled()) {
+                    for (LeafNode* leaf : created) delete leaf; //NOSONAR
+                    created.clear();
+                    return false;
+                }
+            }
+            const LeafNode* leaf = leaves[i];
+            if (leaf->packed || !isColdLeaf(leaf, editClock, policy) || leaf->length >= target / 2) {
+                flush(i);
+                emit(leaves[i], false, i);
+                runStart = i + 1;
+                continue;
+            }
+            if (runLen + leaf->length > target) flush(i);
+            runLen += leaf->length;
+        }
+        flush(leaves.size());
+        if (progress && !leaves.empty()) progress->add(static_cast<long long>((leaves.size() - 1) % 1024 + 1));
+    } catch (...) {
+        for (LeafNode* leaf : created) delete leaf; //NOSONAR
+        created.clear();
+        throw;
+    }
+    return true;
+}
+
+int Tree::compact() {
+    if (!root || m_rebuild || m_compactedVersion == m_version) return 0;
+
+    // Листья по порядку и внутренние узлы (последние пересоздаются заново)
+    std::vector<LeafNode*> leaves;
+    std::vector<InternalNode*> inners;
+    std::vector<Node*> stack;
+    stack.push_back(root);
+    while (!stack.empty()) {
+        Node* n = stack.back();
+        stack.pop_back();
+        TREE_COUNT(NODES_VISITED, 1);
+        if (n->getType() == NodeType::NODE_LEAF) {
+            leaves.push_back(static_cast<LeafNode*>(n));
+            continue;
+        }
+        auto inner = static_cast<InternalNode*>(n);
+        inners.push_back(inner);
+        if (inner->right) stack.push_back(inner->right);
+        if (inner->left) stack.push_back(inner->left);
+    }
+
+    std::vector<Node*> packed;
+    std::vector<LeafNode*> merged;  // листья, ушедшие в склейку
+    std::vector<LeafNode*> created; // склеенные листья
+    packLeaves(leaves, nullptr, m_editClock, m_splitPolicy, packed, merged, created, nullptr, nullptr);
+
+    // Старые внутренние узлы и склеенные листья больше не нужны; флаги свёрток ставятся заново
+    for (InternalNode* inner : inners) delete inner; //NOSONAR
+    for (LeafNode* leaf : merged) delete leaf; //NOSONAR
+    for (Node* node : packed) node->folded = false;
+
+    root = buildBalanced(packed, 0, packed.size());
+    touch();
+    for (const FoldRange& fold : m_folds) {
+        if (fold.startMarker >= 0) applyFold(fold);
     }
+    m_compactedVersion = m_version;
+    return static_cast<int>(leaves.size() - packed.size());
+}
+
+TreeMemoryUsage Tree::getMemoryUsage() const {
+    TreeMemoryUsage usage;
+    usage.unpackedCache = m_unpacked.residentBytes();
+    if (m_trigrams) usage.trigramIndex = m_trigrams->memoryBytes();
+    std::vector<const Node*> stack;
+    if (root) stack.push_back(root);
+    while (!stack.empty()) {
+        const Node* n = stack.back();
+        stack.pop_back();
+        if (n->getType() == NodeType::NODE_LEAF) {
+            auto leaf = static_cast<const LeafNode*>(n);
+            usage.nodes += sizeof(LeafNode);
+            if (leaf->packed) usage.packedBytes += static_cast<std::size_t>(leaf->packedLength);
+            else usage.rawBytes += static_cast<std::size_t>(leaf->length);
+            continue;
+        }
+        auto inner = static_cast<const InternalNode*>(n);
+        usage.nodes += sizeof(InternalNode);
+        if (inner->left) stack.push_back(inner->left);
+        if (inner->right) stack.push_back(inner->right);
+    }
+    return usage;
+}
 
-    // ФОЛЛБЭК (Fallback):
-    // Если \n нет (minified файл) или он далеко — режем жестко пополам.
-    if (splitIndex == -1) {
-        splitIndex = half;
+void Tree::releaseCaches() {
+    m_unpacked.clear();
+    if (m_trigrams) {
+        m_trigrams->clear();
+        m_trigramVersion = 0; // пересоберётся при следующем поиске
     }
+}
+
+void Tree::releaseMemory() {
+    releaseCaches();
+    if (m_rebuild) return; // листья сожмёт идущая перестройка
+    m_compactedVersion = 0; // уплотнить, даже если правок с прошлого раза не было
+    compact();
+}
+
+Node* Tree::buildFromTextRecursive(const char* text, int len) {
+    if (len <= 0) return nullptr;
+
+    // УСЛОВИЕ ЛИСТА:
+    // Если текст влезает в лимит размера, делаем лист.
+    // Это гарантирует, что даже файл без \n будет разбит на куски.
+    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
+    if (len <= MAX_LEAF_SIZE) {
+        return new LeafNode(text, len); // NOSONAR
+    } 
 
+    // ПОИСК ТОЧКИ РАЗРЕЗА: по политике границ (рядом с серединой, по возможности после '\n')
+    int splitIndex = m_splitPolicy.chooseSplit(text, len);
 
     Node* left = nullptr;
     Node* right = nullptr;
@@ -196,8 +947,46 @@ Node* Tree::buildFromTextRecursive(const char* text, int len) {
         return node;
     } catch (...) {
         // Удаляем уже созданных потомков во избежание утечек.
-        if (left)  clearRecursive(left);
-        if (right) clearRecursive(right);
+        NodeReclaimer::destroySubtree(left);
+        NodeReclaimer::destroySubtree(right);
+        throw;
+    }
+}
+
+namespace {
+    // Меньше этого строить в одном потоке дешевле, чем раздавать задачи
+    const int PARALLEL_BUILD_GRAIN = 1 << 20;
+}
+
+Node* Tree::buildFromTextParallel(const char* text, int len) {
+    if (len <= PARALLEL_BUILD_GRAIN) {
+        return buildFromTextRecursive(text, len);
+    }
+
+    // Левая половина — задача пула, правая строится здесь же
+    int splitIndex = m_splitPolicy.chooseSplit(text, len);
+    Node* left = nullptr;
+    Node* right = nullptr;
+    std::exception_ptr error;
+    TaskGroup group;
+    group.run([this, text, splitIndex, &left]() { left = buildFromTextParallel(text, splitIndex); });
+    try {
+        right = buildFromTextParallel(text + splitIndex, len - splitIndex);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    try {
+        group.wait();
+    } catch (...) {
+        if (!error) error = std::current_exception();
+    }
+
+    try {
+        if (error) std::rethrow_exception(error);
+        return new InternalNode(left, right); //NOSONAR
+    } catch (...) {
+        NodeReclaimer::destroySubtree(left);
+        NodeReclaimer::destroySubtree(right);
         throw;
     }
 }
@@ -205,19 +994,27 @@ Node* Tree::buildFromTextRecursive(const char* text, int len) {
 void Tree::fromText(const char* text, int len) {
     clear();
     if (!text || len <= 0) return;
-    root = buildFromTextRecursive(text, len);
+    root = buildFromTextParallel(text, len);
+    touch();
 }
 
 // --- Экспорт в текст ---
 
+const char* Tree::leafBytes(const LeafNode* leaf) const {
+    if (!leaf->packed) return leaf->data;
+    return m_unpacked.get(leaf);
+}
+
+std::size_t Tree::unpackedCacheBytes() const { return m_unpacked.residentBytes(); }
+
 void Tree::collectTextRecursive(Node* node, char* buffer, int& pos) {
     if (!node) return;
     
     if (node->getType() == NodeType::NODE_LEAF) {
         auto leaf = static_cast<LeafNode*>(node);
         // memcpy быстрее цикла
-        if (leaf->length > 0 && leaf->data) {
-            std::memcpy(buffer + pos, leaf->data, leaf->length);
+        if (leaf->length > 0) {
+            std::memcpy(buffer + pos, leafBytes(leaf), leaf->length);
             pos += leaf->length;
         }
     } else {
@@ -245,150 +1042,181 @@ char* Tree::toText() {
     return buffer;
 }
 
-// --- Получение строки (Get Line) ---
-
-LeafNode* Tree::findLeafByLineRecursive(Node* node, int& localLineIndex) {
-    if (!node) return nullptr;
-
-    if (node->getType() == NodeType::NODE_LEAF) {
-        return static_cast<LeafNode*>(node);
+// --- Палец (finger) ---
+
+void Tree::seekOffset(int offset, bool insertBias) const {
+    TreeFinger& f = m_finger;
+    if (f.version != m_version) {
+        f.reset();
+        f.version = m_version;
+    } else if (f.leaf) {
+        // Быстрый путь: позиция внутри листа последнего обращения — спуска нет вовсе.
+        // Начало листа при insertBias принадлежит предыдущему листу (как в insertRecursive).
+        int end = f.leafOffset + f.leaf->length;
+        bool fromStart = offset > f.leafOffset ||
+                         (offset == f.leafOffset && (!insertBias || f.leafOffset == 0));
+        if (fromStart &&
+            (offset < end || (offset == end && (insertBias || end == root->getLength())))) {
+            return;
+        }
     }
-
-    auto inner = static_cast<InternalNode*>(node);
-    
-    // Ключевой момент оптимизации:
-    // Мы спрашиваем у левого ребенка, сколько в нем строк. Это O(1) операция.
-    int leftLines = 0;
-    if (inner->left) {
-        leftLines = inner->left->getLineCount();
+    f.leaf = nullptr;
+
+    // Поднимаемся до ближайшего предка, покрывающего offset (корень покрывает всё)
+    while (!f.path.empty()) {
+        int start = f.pathOffset.back();
+        int end = start + f.path.back()->getLength();
+        if (f.path.size() == 1 ||
+            (offset >= start && (offset < end || (offset == end && insertBias)))) {
+            break;
+        }
+        f.pop();
     }
 
-    if (localLineIndex < leftLines) {
-        // Искомая строка слева
-        return findLeafByLineRecursive(inner->left, localLineIndex);
-    } else {
-        // Искомая строка справа. Корректируем индекс.
-        localLineIndex -= leftLines;
-        return findLeafByLineRecursive(inner->right, localLineIndex);
+    Node* node = root;
+    int off = 0;
+    int lines = 0;
+    if (!f.path.empty()) {
+        node = f.path.back();
+        off = f.pathOffset.back();
+        lines = f.pathLines.back();
+        f.pop();
     }
-}
 
-char* Tree::getLine(int lineNumber) {
-    if (!root || lineNumber < 0) return nullptr;
-    
-    // Проверка: а есть ли такая строка вообще
-    if (lineNumber < 0) return nullptr;
-    if (lineNumber >= root->getLineCount()) return nullptr;
-
-
-    int localIndex = lineNumber;
-    // Этот метод спустится по дереву за O(log N) и вернет Лист.
-    // localIndex станет номером строки ВНУТРИ этого листа.
-    auto leaf = findLeafByLineRecursive(root, localIndex);
-
-    if (!leaf) return nullptr;
-
-    // Дальше логика поиска внутри листа (почти как у тебя было)
-    int currentLine = 0;
-    int startPos = 0;
-    int endPos = -1;
-    bool foundStart = false;
-
-    // Если localIndex == 0, значит строка начинается с начала листа
-    if (localIndex == 0) foundStart = true;
+    while (node && node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<InternalNode*>(node);
+        int leftLen = in->left ? in->left->getLength() : 0;
+        bool goLeft = in->left &&
+            (!in->right || offset < off + leftLen || (insertBias && offset == off + leftLen));
+        TREE_COUNT(NODES_VISITED, 1);
+        f.push(in, off, lines, goLeft);
+        if (goLeft) {
+            node = in->left;
+        } else {
+            off += leftLen;
+            lines += in->left ? in->left->getLineCount() : 0;
+            node = in->right;
+        }
+    }
 
+    TREE_COUNT(NODES_VISITED, 1);
+    f.leaf = static_cast<LeafNode*>(node);
+    f.leafOffset = off;
+    f.leafLines = lines;
+}
 
-    for (int i = 0; i < leaf->length; i++) {
-        // Поиск конца строки (выполняется, если начало уже найдено)
-        if (foundStart) { // Уровень 2
-            if (leaf->data[i] == '\n') { // Уровень 3
-                endPos = i;
-                break;
-            }
-            continue; // Если не нашли конец, продолжаем сканирование
-        }
-        
-        // Поиск начала строки (выполняется, если !foundStart)
-        
-        // Если это не перенос строки, пропускаем (Level 2)
-        if (leaf->data[i] != '\n') {
-            continue;
-        }
+void Tree::seekLineBreak(int lineBreak) const {
+    TreeFinger& f = m_finger;
+    if (f.version != m_version) {
+        f.reset();
+        f.version = m_version;
+    } else if (f.leaf && lineBreak > f.leafLines && lineBreak <= f.leafLines + f.leaf->lineCount) {
+        return;
+    }
+    f.leaf = nullptr;
 
-        // Это перенос строки, увеличиваем счетчик
-        currentLine++;
-        
-        // Проверяем, достигли ли мы нужной строки (Level 2)
-        if (currentLine == localIndex) {
-            startPos = i + 1; // Начало сразу после \n
-            foundStart = true;
+    while (!f.path.empty()) {
+        int before = f.pathLines.back();
+        if (f.path.size() == 1 ||
+            (lineBreak > before && lineBreak <= before + f.path.back()->getLineCount())) {
+            break;
         }
-        
-        // После нахождения начала, продолжаем итерацию, чтобы следующий символ
-        // был обработан блоком 'if (foundStart)' для поиска конца.
+        f.pop();
     }
 
-    // Если дошли до конца листа, а \n не встретили — значит строка идет до конца блока
-    if (foundStart && endPos == -1) {
-        endPos = leaf->length;
+    Node* node = root;
+    int off = 0;
+    int lines = 0;
+    if (!f.path.empty()) {
+        node = f.path.back();
+        off = f.pathOffset.back();
+        lines = f.pathLines.back();
+        f.pop();
     }
 
-    if (!foundStart) return nullptr; // Что-то пошло не так
-
-    int lineLen = endPos - startPos;
-    // Защита от отрицательной длины
-    if (lineLen < 0) lineLen = 0; 
-
-    auto result = new char[lineLen + 1]; // NOSONAR
-    if (lineLen > 0) {
-        std::memcpy(result, leaf->data + startPos, lineLen);
+    while (node && node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<InternalNode*>(node);
+        int leftLines = in->left ? in->left->getLineCount() : 0;
+        bool goLeft = in->left && (!in->right || lineBreak <= lines + leftLines);
+        TREE_COUNT(NODES_VISITED, 1);
+        f.push(in, off, lines, goLeft);
+        if (goLeft) {
+            node = in->left;
+        } else {
+            off += in->left ? in->left->getLength() : 0;
+            lines += leftLines;
+            node = in->right;
+        }
     }
-    result[lineLen] = '\0';
 
-    return result;
+    TREE_COUNT(NODES_VISITED, 1);
+    f.leaf = static_cast<LeafNode*>(node);
+    f.leafOffset = off;
+    f.leafLines = lines;
 }
 
-// Tree.cpp
-int Tree::getTotalLineCount() const {
-    if (!root) return 0;
-    return root->getLineCount();
+// Подвесить repl на место листа пальца и пересчитать кэши вверх по пути: O(глубина)
+// дешёвых сложений вместо повторного спуска от корня.
+void Tree::replaceFingerLeaf(Node* repl) {
+    TreeFinger& f = m_finger;
+    Node* child = repl;
+    bool collapsed = false;
+    for (size_t i = f.path.size(); i-- > 0;) {
+        InternalNode* parent = f.path[i];
+        if (f.pathLeft[i]) parent->left = child;
+        else parent->right = child;
+        child = collapseInternalIfNeeded(parent);
+        if (child != parent) collapsed = true;
+    }
+    root = child;
+    touch();
+
+    // Если структура пути сохранилась — палец остаётся валидным
+    if (collapsed) return;
+    f.version = m_version;
+    if (repl && repl->getType() == NodeType::NODE_LEAF) {
+        f.leaf = static_cast<LeafNode*>(repl);
+    } else {
+        f.leaf = nullptr; // лист разделился — следующий seek спустится от родителя
+    }
 }
 
-// static helper: вычислить байтовое смещение для начала указанной строки внутри поддерева.
-// Предполагается: node != nullptr и lineIndex корректен для этого поддерева.
-// При нарушении инвариантов — assertion в debug.
-static int getOffsetForLineRecursive(Node* node, int lineIndex) {
-    assert(node != nullptr);
-
-    if (node->getType() == NodeType::NODE_LEAF) {
-        // Т.к. мы проверили getType, static_cast безопасен и быстрее dynamic_cast.
-        auto leaf = static_cast<LeafNode*>(node);
-        // Защита на случай нарушения инварианта (только debug)
-        assert(leaf != nullptr);
-
-        int linesSeen = 0;
-        for (int i = 0; i < leaf->length; ++i) {
-            if (linesSeen == lineIndex) return i; // offset внутри листа
-            if (leaf->data[i] == '\n') ++linesSeen;
-        }
-        if (linesSeen == lineIndex) return leaf->length;
-        // Если индекс оказался некорректным — бросим понятное исключение в релизе.
-        throw std::out_of_range("Line index out of range inside leaf");
-    } else {
-        // internal node
-        auto in = static_cast<InternalNode*>(node);
-        assert(in != nullptr);
+// --- Получение строки (Get Line) ---
 
-        int leftLines = in->left ? in->left->getLineCount() : 0;
-        if (lineIndex < leftLines) {
-            return getOffsetForLineRecursive(in->left, lineIndex);
-        } else {
-            int leftLen = in->left ? in->left->getLength() : 0;
-            return leftLen + getOffsetForLineRecursive(in->right, lineIndex - leftLines);
+char* Tree::getLine(int lineNumber) {
+    if (!root || lineNumber < 0) return nullptr;
+    if (lineNumber >= getTotalLineCount()) return nullptr;
+
+    int start = getOffsetForLine(lineNumber);
+
+    // Быстрый путь: строка целиком лежит в одном листе
+    seekOffset(start, false);
+    const TreeFinger& f = m_finger;
+    if (f.leaf) {
+        int local = start - f.leafOffset;
+        const char* from = leafBytes(f.leaf) + local;
+        auto nl = static_cast<const char*>(std::memchr(from, '\n', static_cast<size_t>(f.leaf->length - local)));
+        if (nl) {
+            auto lineLen = static_cast<int>(nl - from);
+            auto result = new char[lineLen + 1]; // NOSONAR
+            if (lineLen > 0) std::memcpy(result, from, lineLen);
+            result[lineLen] = '\0';
+            return result;
         }
     }
+
+    // Строка продолжается в следующих листьях
+    int end = (lineNumber + 1 < getTotalLineCount())
+                  ? getOffsetForLine(lineNumber + 1) - 1
+                  : root->getLength();
+    return getTextRange(start, end - start);
 }
 
+// Tree.cpp
+int Tree::getTotalLineCount() const {
+    if (!root) return 0;
+    return root->getLineCount() + 1;
+}
 
 int Tree::getOffsetForLine(int lineIndex0Based) const {
     if (!root) throw std::out_of_range("Tree is empty");
@@ -397,7 +1225,43 @@ int Tree::getOffsetForLine(int lineIndex0Based) const {
         oss << "Line index out of range (0.." << (getTotalLineCount()-1) << ")";
         throw std::out_of_range(oss.str());
     }
-    return getOffsetForLineRecursive(root, lineIndex0Based);
+    if (lineIndex0Based == 0) return 0;
+
+    // Строка N начинается сразу после N-го '\n'
+    seekLineBreak(lineIndex0Based);
+    const TreeFinger& f = m_finger;
+    assert(f.leaf != nullptr);
+
+    int need = lineIndex0Based - f.leafLines;
+    const char* bytes = leafBytes(f.leaf);
+    const char* p = bytes;
+    const char* end = p + f.leaf->length;
+    while (p < end) {
+        auto nl = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+        if (!nl) break;
+        if (--need == 0) return f.leafOffset + static_cast<int>(nl - bytes) + 1;
+        p = nl + 1;
+    }
+    // Кэш lineCount не совпал с данными листа
+    throw std::out_of_range("Line index out of range inside leaf");
+}
+
+int Tree::getLineForOffset(int offset) const {
+    if (!root) return 0;
+    if (offset <= 0) return 0;
+    if (offset > root->getLength()) offset = root->getLength();
+
+    seekOffset(offset, false);
+    const TreeFinger& f = m_finger;
+    if (!f.leaf) return 0;
+
+    int local = offset - f.leafOffset;
+    int lines = f.leafLines;
+    const char* bytes = leafBytes(f.leaf);
+    for (int i = 0; i < local; ++i) {
+        if (bytes[i] == '\n') ++lines;
+    }
+    return lines;
 }
 
 
@@ -429,14 +1293,15 @@ Node* Tree::splitLeafAtOffset(LeafNode* leaf, int offset) { //NOSONAR
 
     LeafNode* leftLeaf = nullptr;
     LeafNode* rightLeaf = nullptr;
+    const char* bytes = leafBytes(leaf);
 
     // Попытка создать левый лист (если нужен)
     if (leftLen > 0) {
         try {
-            leftLeaf = new LeafNode(leaf->data, leftLen); //NOSONAR
+            leftLeaf = new LeafNode(bytes, leftLen); //NOSONAR
         } catch (...) {
-            if (leftLeaf)  clearRecursive(leftLeaf);
-            if (rightLeaf) clearRecursive(rightLeaf);
+            NodeReclaimer::destroySubtree(leftLeaf);
+            NodeReclaimer::destroySubtree(rightLeaf);
             throw;
         }
     }
@@ -444,7 +1309,7 @@ Node* Tree::splitLeafAtOffset(LeafNode* leaf, int offset) { //NOSONAR
     // Попытка создать правый лист (если нужен)
     if (rightLen > 0) {
         try {
-            rightLeaf = new LeafNode(leaf->data + offset, rightLen); //NOSONAR
+            rightLeaf = new LeafNode(bytes + offset, rightLen); //NOSONAR
         } catch (...) {
             // если левый уже создан — удалить его, чтобы не было утечки
             if (leftLeaf) { delete leftLeaf; leftLeaf = nullptr; }//NOSONAR
@@ -475,37 +1340,23 @@ Node* Tree::splitLeafAtOffset(LeafNode* leaf, int offset) { //NOSONAR
         throw;
     }
 
+    // Части свёрнутого листа остаются свёрнутыми
+    if (result) result->folded = leaf->folded;
+
     // Теперь безопасно удалить оригинал — ownership перенесён.
-    delete leaf;//NOSONAR
+    disposeNode(leaf);
     return result;
 }
 
 
 
-// Вспомогательная: вычислить индекс разреза (поведение как в buildFromTextRecursive)
-int Tree::findSplitIndexForLeaf(const LeafNode* leaf) const {
-    if (!leaf || !leaf->data) return 0;
-    int half = leaf->length / 2;
-    int searchRange = (leaf->length < 512) ? (leaf->length / 4) : 256;
-
-    // вправо
-    for (int i = 0; i < searchRange; ++i) {
-        int idx = half + i;
-        if (idx < leaf->length && leaf->data[idx] == '\n') return idx + 1;
-    }
-    // влево
-    for (int i = 0; i < searchRange; ++i) {
-        int idx = half - i;
-        if (idx > 0 && idx < leaf->length && leaf->data[idx] == '\n') return idx + 1;
-    }
-    return half;
-}
-
 // ------------------ insertIntoLeaf (защита временного буфера) ------------------
 Node* Tree::insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len) {
     if (!leaf) {
-        // Прямо создаём лист; если бросит — ничего не утекает здесь.
-        return new LeafNode(data, len);//NOSONAR
+        // Прямо строим листья; если бросит — ничего не утекает здесь.
+        Node* built = buildFromTextParallel(data, len);
+        if (trigramsTracking()) indexSubtree(built);
+        return built;
     }
 
     if (pos < 0) pos = 0;
@@ -513,6 +1364,7 @@ Node* Tree::insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len) {
 
     int leafLen = leaf->length;
     int newLen = leafLen + len;
+    const char* bytes = leafBytes(leaf); // до выделения буфера: распаковка тоже может бросить
 
     // Временный буфер
     char* buf = nullptr;
@@ -522,58 +1374,101 @@ Node* Tree::insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len) {
         throw; // если не выделилось — просто пробросим
     }
 
-    if (pos > 0 && leaf->data) {
-        std::memcpy(buf, leaf->data, pos);
+    if (pos > 0) {
+        std::memcpy(buf, bytes, pos);
     }
     if (len > 0 && data) {
         std::memcpy(buf + pos, data, len);
     }
-    if (pos < leafLen && leaf->data) {
-        std::memcpy(buf + pos + len, leaf->data + pos, leafLen - pos);
+    if (pos < leafLen) {
+        std::memcpy(buf + pos + len, bytes + pos, leafLen - pos);
     }
+    TREE_COUNT(BYTES_COPIED, newLen);
+    TREE_COUNT(ALLOCATIONS, 1); // временный буфер
 
-    // Создаём новый лист; если бросит — освободим buf
-    LeafNode* newLeaf = nullptr;
+    // Новый лист (или поддерево по политике размеров); если бросит — освободим buf
+    Node* result = nullptr;
     try {
-        newLeaf = new LeafNode(buf, newLen);//NOSONAR
+        result = buildEditedLeaf(leaf, buf, newLen, pos, len);
     } catch (...) {
         delete[] buf;//NOSONAR
         throw;
     }
-    // newLeaf создан успешно — временный buf больше не нужен
+    // result создан успешно — временный buf больше не нужен
     delete[] buf;//NOSONAR
 
+    if (trigramsTracking()) {
+        unindexSubtree(leaf);
+        indexSubtree(result);
+    }
     // Удаляем исходный лист (ownership перенесён)
-    delete leaf;//NOSONAR
+    disposeNode(leaf);
+    return result;
+}
 
-    // Если слишком большой — разбиваем; splitLeafAtOffset берёт владение newLeaf или удалит его при ошибке.
-    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
-    if (newLeaf->length > MAX_LEAF_SIZE) {
-        int splitIndex = findSplitIndexForLeaf(newLeaf);
-        Node* splitted = nullptr;
-        try {
-            splitted = splitLeafAtOffset(newLeaf, splitIndex);
-            return splitted;
-        } catch (...) {
-            // split упал — newLeaf может быть удалён внутри splitLeafAtOffset при ошибке,
-            // либо если split выбросил до удаления newLeaf — удалим его здесь, но проверить на nullptr.
-            // В нашем splitLeafAtOffset newLeaf не удаляется при исключении (мы защитились), поэтому:
-            if (newLeaf) delete newLeaf;//NOSONAR
-            throw;
+Node* Tree::buildEditedLeaf(const LeafNode* old, const char* buf, int newLen, int editPos, int editLen) {
+    const LeafSplitPolicy& policy = m_splitPolicy;
+    Node* result = nullptr;
+
+    if (policy.hotLeafSize > 0 && editLen < policy.hotLeafSize && newLen > 2 * policy.hotLeafSize) {
+        // Горячий кусок ~hotLeafSize вокруг правки; края сохраняют возраст старого листа
+        int center = editPos + editLen / 2;
+        int half = policy.hotLeafSize / 2;
+        int slack = policy.hotLeafSize / 4;
+        int a = (center - half <= 0) ? 0 : policy.chooseBoundary(buf, newLen, center - half, slack);
+        int b = (center + half >= newLen) ? newLen : policy.chooseBoundary(buf, newLen, center + half, slack);
+        if (a < b) {
+            LeafNode* left = nullptr;
+            LeafNode* hot = nullptr;
+            LeafNode* right = nullptr;
+            try {
+                if (a > 0) {
+                    left = new LeafNode(buf, a); //NOSONAR
+                    left->editStamp = old->editStamp;
+                }
+                hot = new LeafNode(buf + a, b - a); //NOSONAR
+                hot->editStamp = m_editClock;
+                if (b < newLen) {
+                    right = new LeafNode(buf + b, newLen - b); //NOSONAR
+                    right->editStamp = old->editStamp;
+                }
+                result = hot;
+                if (left) result = new InternalNode(left, result); //NOSONAR
+                left = nullptr;
+                if (right) result = new InternalNode(result, right); //NOSONAR
+                right = nullptr;
+            } catch (...) {
+                NodeReclaimer::destroySubtree(result ? result : hot);
+                delete left; //NOSONAR
+                delete right; //NOSONAR
+                throw;
+            }
         }
     }
 
-    return newLeaf;
+    if (!result) {
+        //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
+        if (newLen > MAX_LEAF_SIZE) {
+            result = buildFromTextRecursive(buf, newLen);
+        } else {
+            auto leaf = new LeafNode(buf, newLen); //NOSONAR
+            leaf->editStamp = m_editClock;
+            result = leaf;
+        }
+    }
+    result->folded = old->folded; // текст, набранный внутри свёртки, тоже скрыт
+    return result;
 }
 
-
-
 // Вставляет [data, data+len) в позицию pos внутри node и возвращает новый Node* для замены.
 Node* Tree::insertRecursive(Node* node, int pos, const char* data, int len) {
     if (len <= 0) return node;
+    TREE_COUNT(NODES_VISITED, 1);
 
     if (!node) {
-        return new LeafNode(data, len); // NOSONAR
+        Node* built = buildFromTextParallel(data, len);
+        if (trigramsTracking()) indexSubtree(built);
+        return built;
     }
 
     if (node->getType() == NodeType::NODE_LEAF) {
@@ -606,9 +1501,11 @@ Node* Tree::eraseFromLeaf(LeafNode* leaf, int pos, int len) {
 
     int newLen = leaf->length - delLen;
     if (newLen <= 0) {
-        delete leaf; //NOSONAR
+        if (trigramsTracking()) unindexSubtree(leaf);
+        disposeNode(leaf);
         return nullptr;
     }
+    const char* bytes = leafBytes(leaf);
 
     char* buf = nullptr;
     try {
@@ -617,24 +1514,30 @@ Node* Tree::eraseFromLeaf(LeafNode* leaf, int pos, int len) {
         throw;
     }
 
-    if (pos > 0 && leaf->data) {
-        std::memcpy(buf, leaf->data, pos);
+    if (pos > 0) {
+        std::memcpy(buf, bytes, pos);
     }
-    if (pos + delLen < leaf->length && leaf->data) {
+    if (pos + delLen < leaf->length) {
         int tail = leaf->length - (pos + delLen);
-        std::memcpy(buf + pos, leaf->data + pos + delLen, tail);
+        std::memcpy(buf + pos, bytes + pos + delLen, tail);
     }
+    TREE_COUNT(BYTES_COPIED, newLen);
+    TREE_COUNT(ALLOCATIONS, 1); // временный буфер
 
-    LeafNode* newLeaf = nullptr;
+    Node* result = nullptr;
     try {
-        newLeaf = new LeafNode(buf, newLen); //NOSONAR
+        result = buildEditedLeaf(leaf, buf, newLen, pos, 0);
     } catch (...) {
         delete[] buf; //NOSONAR
         throw;
     }
     delete[] buf; //NOSONAR
-    delete leaf; //NOSONAR
-    return newLeaf;
+    if (trigramsTracking()) {
+        unindexSubtree(leaf);
+        indexSubtree(result);
+    }
+    disposeNode(leaf);
+    return result;
 }
 
 
@@ -644,17 +1547,20 @@ Node* Tree::collapseInternalIfNeeded(InternalNode* inner) {
     if (!inner) return nullptr;
 
     if (!inner->left && !inner->right) {
-        delete inner; // NOSONAR
+        disposeNode(inner);
         return nullptr;
     }
+    // Единственный ребёнок занимает место узла — вместе с его свёрткой
     if (!inner->left) {
         Node* r = inner->right;
-        delete inner; // NOSONAR
+        r->folded = r->folded || inner->folded;
+        disposeNode(inner);
         return r;
     }
     if (!inner->right) {
         Node* l = inner->left;
-        delete inner; // NOSONAR
+        l->folded = l->folded || inner->folded;
+        disposeNode(inner);
         return l;
     }
 
@@ -666,12 +1572,21 @@ Node* Tree::collapseInternalIfNeeded(InternalNode* inner) {
 // Удалить len байт, начиная с pos. Возвращает новое поддерево.
 Node* Tree::eraseRecursive(Node* node, int pos, int len) {
     if (!node || len <= 0) return node;
+    TREE_COUNT(NODES_VISITED, 1);
 
     // Если лист — делегируем в отдельную функцию
     if (node->getType() == NodeType::NODE_LEAF) {
         return eraseFromLeaf(static_cast<LeafNode*>(node), pos, len);
     }
 
+    // Поддерево удаляется целиком — не спускаемся в каждый лист,
+    // а отдаём его реклеймеру (удаление огромного диапазона возвращается сразу)
+    if (pos <= 0 && len >= node->getLength()) {
+        if (trigramsTracking()) unindexSubtree(node);
+        disposeSubtree(node);
+        return nullptr;
+    }
+
     // Internal node
     auto inner = static_cast<InternalNode*>(node);
 
@@ -703,7 +1618,28 @@ void Tree::insert(int pos, const char* data, int len) {
     if (pos < 0) pos = 0;
     if (pos > total) pos = total;
 
+    ++m_editClock;
+    ++m_textVersion;
+    m_markers.onInsert(pos, len);
+    if (m_rebuild) recordRebuildEdit({RebuildEdit::Kind::INSERT, pos, len, 0, std::string(data, static_cast<size_t>(len))});
+    bool tracked = trigramsTracking();
+    insertText(pos, data, len);
+    if (tracked) m_trigramVersion = m_version; // заменённые листья уже в индексе
+}
+
+void Tree::insertText(int pos, const char* data, int len) {
+    if (root) {
+        // Палец: при наборе на месте лист уже найден, спуска от корня нет
+        seekOffset(pos, true);
+        if (LeafNode* leaf = m_finger.leaf) {
+            Node* repl = insertIntoLeaf(leaf, pos - m_finger.leafOffset, data, len);
+            replaceFingerLeaf(repl);
+            return;
+        }
+    }
+
     root = insertRecursive(root, pos, data, len);
+    touch();
 }
 
 void Tree::erase(int pos, int len) {
@@ -714,12 +1650,33 @@ void Tree::erase(int pos, int len) {
 
     if (pos + len > total) len = total - pos;
 
+    ++m_editClock;
+    ++m_textVersion;
+    m_markers.onErase(pos, len);
+    if (m_rebuild) recordRebuildEdit({RebuildEdit::Kind::ERASE, pos, len, 0, std::string()});
+    bool tracked = trigramsTracking();
+    eraseText(pos, len);
+    if (tracked) m_trigramVersion = m_version;
+}
+
+void Tree::eraseText(int pos, int len) {
+    // Удаление внутри одного листа (Backspace/Delete) — через палец
+    seekOffset(pos, false);
+    if (LeafNode* leaf = m_finger.leaf;
+        leaf && pos + len <= m_finger.leafOffset + leaf->length) {
+        Node* repl = eraseFromLeaf(leaf, pos - m_finger.leafOffset, len);
+        replaceFingerLeaf(repl);
+        return;
+    }
+
     root = eraseRecursive(root, pos, len);
+    touch();
 }
 
 
 void Tree::getTextRangeRecursive(Node* node, int& offset, int& len, char* out, int& outPos) const {
     if (!node || len <= 0) return;
+    TREE_COUNT(NODES_VISITED, 1);
 
     if (node->getType() == NodeType::NODE_LEAF) {
         auto leaf = static_cast<LeafNode*>(node); // у тебя уже проверка через getType
@@ -731,7 +1688,7 @@ void Tree::getTextRangeRecursive(Node* node, int& offset, int& len, char* out, i
         int copyFrom = offset;
         int toCopy = (len < leaf->length - copyFrom) ? len : (leaf->length - copyFrom);
 
-        std::memcpy(out + outPos, leaf->data + copyFrom, static_cast<size_t>(toCopy));
+        std::memcpy(out + outPos, leafBytes(leaf) + copyFrom, static_cast<size_t>(toCopy));
 
         outPos += toCopy;
         len -= toCopy;
@@ -771,174 +1728,1285 @@ char* Tree::getTextRange(int offset, int len) const {
 
     return out;
 }
-// --- вспомогательная функция: строим lps (longest prefix suffix) для KMP вручную ---
-void Tree::buildKMPTable(const char* pattern, int patternLen, int* lps) const {
-    int len = 0;
-    lps[0] = 0;
-    int i = 1;
-    while (i < patternLen) {
-        if (pattern[i] == pattern[len]) {
-            len++;
-            lps[i] = len;
-            i++;
-        } else {
-            if (len != 0) {
-                len = lps[len - 1];
-            } else {
-                lps[i] = 0;
-                i++;
-            }
-        }
-    }
+
+// --- Блоки строк ---
+
+int Tree::lineStartOffset(int line) const {
+    if (line <= 0) return 0;
+    if (line >= getTotalLineCount()) return root ? root->getLength() : 0;
+    return getOffsetForLine(line);
 }
 
-// --- рекурсивный обход листов с поиском ---
-int Tree::findSubstringRecursive(Node* node, const char* pattern, int patternLen, const int* lps, int& j, int& processed) const {
-    if (!node) return -1;
+void Tree::splitTree(Node* node, int offset, Node*& left, Node*& right) {
+    left = nullptr;
+    right = nullptr;
+    if (!node) return;
+    if (offset <= 0) {
+        right = node;
+        return;
+    }
+    if (offset >= node->getLength()) {
+        left = node;
+        return;
+    }
+    TREE_COUNT(NODES_VISITED, 1);
 
     if (node->getType() == NodeType::NODE_LEAF) {
-        // static_cast безопасен, т.к. проверили тип
-        auto leaf = static_cast<LeafNode*>(node);
-        assert(leaf != nullptr);
-
-        for (int i = 0; i < leaf->length; ++i) {
-            auto c = static_cast<unsigned char>(leaf->data[i]);
-            while (j > 0 && c != static_cast<unsigned char>(pattern[j])) j = lps[j - 1];
-            if (c == static_cast<unsigned char>(pattern[j])) j++;
-            if (j == patternLen) {
-                int matchEnd = processed + i;
-                int matchStart = matchEnd - patternLen + 1;
-                return matchStart;
-            }
+        // splitLeafAtOffset вернёт InternalNode(левый, правый) — разбираем его
+        auto pair = static_cast<InternalNode*>(splitLeafAtOffset(static_cast<LeafNode*>(node), offset));
+        left = pair->left;
+        right = pair->right;
+        left->folded = left->folded || pair->folded;
+        right->folded = right->folded || pair->folded;
+        delete pair; // NOSONAR
+        return;
+    }
+
+    auto inner = static_cast<InternalNode*>(node);
+    Node* a = nullptr;
+    Node* b = nullptr;
+    int leftLen = inner->left ? inner->left->getLength() : 0;
+    if (inner->folded) {
+        // Свёрнутый узел остаётся узлом: он и задаёт границы свёртки
+        if (offset <= leftLen) {
+            splitTree(inner->left, offset, a, b);
+            if (a) a->folded = true; // уходит из-под свёрнутого узла
+            inner->left = b;
+            left = a;
+            right = collapseInternalIfNeeded(inner);
+        } else {
+            splitTree(inner->right, offset - leftLen, a, b);
+            if (b) b->folded = true;
+            inner->right = a;
+            left = collapseInternalIfNeeded(inner);
+            right = b;
         }
-        processed += leaf->length;
-        return -1;
+        return;
+    }
+
+    // Узел пути разбирается, половины склеиваются с соседями по высотам:
+    // из сбалансированного дерева выходят сбалансированные части
+    Node* l = inner->left;
+    Node* r = inner->right;
+    disposeNode(inner);
+    if (offset <= leftLen) {
+        splitTree(l, offset, a, b);
+        left = a;
+        right = joinTrees(b, r);
     } else {
-        // internal node — static_cast после проверки типа
-        auto in = static_cast<InternalNode*>(node);
-        assert(in != nullptr);
+        splitTree(r, offset - leftLen, a, b);
+        left = joinTrees(l, a);
+        right = b;
+    }
+}
 
-        int r = -1;
-        if (in->left) { r = findSubstringRecursive(in->left, pattern, patternLen, lps, j, processed); if (r != -1) return r; }
-        if (in->right) { r = findSubstringRecursive(in->right, pattern, patternLen, lps, j, processed); if (r != -1) return r; }
-        return -1;
+Node* Tree::joinTrees(Node* left, Node* right) {
+    if (!left) return right;
+    if (!right) return left;
+    int hl = nodeHeight(left);
+    int hr = nodeHeight(right);
+    // Спуск по правому краю левого дерева (или левому краю правого) до высоты меньшего
+    if (hl > hr + 1 && left->getType() == NodeType::NODE_INTERNAL && !left->folded) {
+        auto inner = static_cast<InternalNode*>(left);
+        inner->right = joinTrees(inner->right, right);
+        inner->recalc();
+        return rebalanceNode(inner);
+    }
+    if (hr > hl + 1 && right->getType() == NodeType::NODE_INTERNAL && !right->folded) {
+        auto inner = static_cast<InternalNode*>(right);
+        inner->left = joinTrees(left, inner->left);
+        inner->recalc();
+        return rebalanceNode(inner);
     }
+    return new InternalNode(left, right); // NOSONAR
 }
 
+// Малый или большой поворот, если высоты детей разошлись больше чем на 1.
+// Повороты переставляют покрытие узлов, поэтому свёрнутые узлы в них не участвуют.
+Node* Tree::rebalanceNode(InternalNode* node) {
+    auto open = [](const Node* n) { return n && n->getType() == NodeType::NODE_INTERNAL && !n->folded; };
+    auto rotateLeft = [](InternalNode* x) {
+        auto y = static_cast<InternalNode*>(x->right);
+        x->right = y->left;
+        x->recalc();
+        y->left = x;
+        y->recalc();
+        return y;
+    };
+    auto rotateRight = [](InternalNode* x) {
+        auto y = static_cast<InternalNode*>(x->left);
+        x->left = y->right;
+        x->recalc();
+        y->right = x;
+        y->recalc();
+        return y;
+    };
+
+    if (node->folded) return node;
+    int hl = nodeHeight(node->left);
+    int hr = nodeHeight(node->right);
+    if (hr > hl + 1 && open(node->right)) {
+        auto r = static_cast<InternalNode*>(node->right);
+        if (nodeHeight(r->left) > nodeHeight(r->right)) {
+            if (!open(r->left)) return node;
+            node->right = rotateRight(r);
+        }
+        return rotateLeft(node);
+    }
+    if (hl > hr + 1 && open(node->left)) {
+        auto l = static_cast<InternalNode*>(node->left);
+        if (nodeHeight(l->right) > nodeHeight(l->left)) {
+            if (!open(l->right)) return node;
+            node->left = rotateLeft(l);
+        }
+        return rotateRight(node);
+    }
+    return node;
+}
 
-int Tree::findSubstring(const char* pattern, int patternLen) const {
-    if (!root || !pattern || patternLen <= 0) return -1;
+void Tree::swapAdjacent(int p, int q, int r) {
+    if (!root || p >= q || q >= r) return;
+    unfoldAcross(p);
+    unfoldAcross(q);
+    unfoldAcross(r);
+    if (m_rebuild) recordRebuildEdit({RebuildEdit::Kind::SWAP, p, q, r, std::string()});
+    ++m_textVersion;
+    swapRanges(p, q, r);
+    m_markers.onSwap(p, q, r);
+}
 
-    int* lps = nullptr;
+void Tree::swapRanges(int p, int q, int r) {
+    Node* head = nullptr;
+    Node* tail = nullptr;
+    Node* a = nullptr;
+    Node* u = nullptr;
+    Node* v = nullptr;
+    splitTree(root, r, head, tail);
+    splitTree(head, q, head, v);
+    splitTree(head, p, a, u);
+    root = joinTrees(joinTrees(a, v), joinTrees(u, tail));
+    touch();
+}
+
+void Tree::deleteLines(int first, int last) {
+    int total = getTotalLineCount();
+    if (first < 0 || last > total || first > last) throw std::out_of_range("Line range out of range");
+    if (first == last) return;
+
+    int start = lineStartOffset(first);
+    int end = lineStartOffset(last);
+    // У последней строки нет '\n' — забираем перевод строки перед блоком,
+    // иначе в конце документа останется пустая строка
+    if (last == total && first > 0) --start;
+    erase(start, end - start);
+}
+
+void Tree::duplicateLines(int first, int last) {
+    int total = getTotalLineCount();
+    if (first < 0 || last > total || first > last) throw std::out_of_range("Line range out of range");
+    if (first == last) return;
+
+    int start = lineStartOffset(first);
+    int end = lineStartOffset(last);
+    int len = end - start;
+    char* block = getTextRange(start, len);
     try {
-        lps = new int[patternLen]; //NOSONAR
+        if (last < total) {
+            insert(end, block, len);
+        } else {
+            // Блок в конце документа без '\n': копия отделяется переводом строки
+            insert(end, "\n", 1);
+            insert(end + 1, block, len);
+        }
     } catch (...) {
-        delete[] lps; //NOSONAR
+        delete[] block; // NOSONAR
         throw;
     }
+    delete[] block; // NOSONAR
+}
 
-    try {
-        buildKMPTable(pattern, patternLen, lps);
+void Tree::moveLines(int first, int last, int target) {
+    int total = getTotalLineCount();
+    if (first < 0 || last > total || first > last || target < 0 || target > total) {
+        throw std::out_of_range("Line range out of range");
+    }
+    // Пустой блок или цель внутри блока — перестановки нет
+    if (first == last || (target >= first && target <= last)) return;
 
-        int j = 0;
-        int processed = 0;
-        int result = findSubstringRecursive(root, pattern, patternLen, lps, j, processed);
+    int start = lineStartOffset(first);
+    int end = lineStartOffset(last);
+    int to = lineStartOffset(target);
 
-        delete[] lps; //NOSONAR
-        return result;
-    } catch (...) {
-        delete[] lps; //NOSONAR
-        throw;
+    if (target < first) {
+        if (last < total) {
+            swapAdjacent(to, start, end);
+            return;
+        }
+        // Блок — хвост документа без '\n': T nl X -> nl X T -> X nl T
+        swapAdjacent(to, start - 1, end);
+        swapAdjacent(to, to + 1, to + 1 + (end - start));
+    } else {
+        if (target < total) {
+            swapAdjacent(start, end, to);
+            return;
+        }
+        // Перенос в конец документа: X nl T -> nl T X -> T nl X
+        swapAdjacent(start, end - 1, to);
+        swapAdjacent(start, start + 1, start + 1 + (to - end));
+    }
+}
+
+std::vector<LineSpan> Tree::getLineSpans(int first, int count) const {
+    std::vector<LineSpan> spans;
+    int total = getTotalLineCount();
+    if (!root || count <= 0 || first < 0 || first >= total) return spans;
+    if (count > total - first) count = total - first;
+    spans.reserve(static_cast<size_t>(count));
+
+    // Один спуск к первой строке, дальше — по листам подряд через палец
+    int docLen = root->getLength();
+    int lineStart = getOffsetForLine(first);
+    int pos = lineStart;
+    while (static_cast<int>(spans.size()) < count) {
+        if (pos >= docLen) {
+            spans.push_back({lineStart, docLen - lineStart}); // последняя строка без '\n'
+            break;
+        }
+        seekOffset(pos, false);
+        const TreeFinger& f = m_finger;
+        const char* data = leafBytes(f.leaf);
+        int local = pos - f.leafOffset;
+        while (local < f.leaf->length && static_cast<int>(spans.size()) < count) {
+            auto nl = static_cast<const char*>(
+                std::memchr(data + local, '\n', static_cast<size_t>(f.leaf->length - local)));
+            if (!nl) break;
+            int at = f.leafOffset + static_cast<int>(nl - data);
+            spans.push_back({lineStart, at - lineStart});
+            lineStart = at + 1;
+            local = at + 1 - f.leafOffset;
+        }
+        pos = f.leafOffset + f.leaf->length;
     }
+    return spans;
 }
 
-// Рекурсивный KMP-по-листам, но аккумулирует количество строк (processedLines).
-// Возвращает номер строки (0-based) если найдено, иначе -1.
-// Параметры:
-//  - node: текущий узел
-//  - pattern, patternLen: шаблон и его длина
-//  - lps: предвычисленная таблица KMP
-//  - j: текущее состояние автомата KMP (сохраняется между листами)
-//  - processedLines: сколько строк ( '\n' ) уже полностью пройдены раньше (в предыдущих листьях)
-static int findSubstringLineRecursive(Node* node,
-                                      const char* pattern, int patternLen,
-                                      const int* lps,
-                                      int& j,
-                                      int& processedLines) {
-    if (!node) return -1;
+// --- Статистика текста ---
+
+TextStats Tree::getStatsRecursive(const Node* node, int from, int to) const {
+    if (!node) return TextStats();
+    TREE_COUNT(NODES_VISITED, 1);
+    int len = node->getLength();
+    if (from < 0) from = 0;
+    if (to > len) to = len;
+    if (from >= to) return TextStats();
+    if (from == 0 && to == len) return node->getStats();
 
     if (node->getType() == NodeType::NODE_LEAF) {
-        auto leaf = static_cast<LeafNode*>(node);
-        // Проходим байты листа, применяем KMP.
-        for (int i = 0; i < leaf->length; ++i) {
-            auto c = static_cast<unsigned char>(leaf->data[i]);
-            while (j > 0 && c != static_cast<unsigned char>(pattern[j])) {
-                j = lps[j - 1];
+        auto leaf = static_cast<const LeafNode*>(node);
+        return TextStats::ofBytes(leafBytes(leaf) + from, to - from);
+    }
+
+    auto inner = static_cast<const InternalNode*>(node);
+    int leftLen = inner->left ? inner->left->getLength() : 0;
+    return TextStats::combine(getStatsRecursive(inner->left, from, to),
+                              getStatsRecursive(inner->right, from - leftLen, to - leftLen));
+}
+
+TextStats Tree::getStats() const {
+    return root ? root->getStats() : TextStats();
+}
+
+TextStats Tree::getStatsForRange(int offset, int len) const {
+    if (!root || len <= 0) return TextStats();
+    if (offset < 0) offset = 0;
+    return getStatsRecursive(root, offset, offset + len);
+}
+
+// --- Хэши содержимого и сравнение документов ---
+
+const ContentHash& Tree::nodeHash(const Node* node) const {
+    if (!node->hashValid) fillHashes(node, -1);
+    return node->hash;
+}
+
+bool Tree::fillHashes(const Node* node, long long budget) const {
+    // Обход в обратном порядке: сначала дети со сброшенным хэшем, затем сам узел.
+    // Готовые хэши остаются в узлах — прерванный по бюджету обход продолжится с них.
+    long long spent = 0;
+    std::vector<const Node*> stack;
+    stack.push_back(node);
+    while (!stack.empty()) {
+        const Node* n = stack.back();
+        if (n->hashValid) {
+            stack.pop_back();
+            continue;
+        }
+        if (n->getType() == NodeType::NODE_LEAF) {
+            auto leaf = static_cast<const LeafNode*>(n);
+            if (budget >= 0 && spent > 0 && spent + leaf->length > budget) return false;
+            leaf->hash = ContentHash::ofBytes(leafBytes(leaf), leaf->length);
+            leaf->hashValid = true;
+            spent += leaf->length;
+            stack.pop_back();
+            continue;
+        }
+        auto inner = static_cast<const InternalNode*>(n);
+        bool ready = true;
+        for (const Node* child : {inner->left, inner->right}) {
+            if (child && !child->hashValid) {
+                stack.push_back(child);
+                ready = false;
             }
-            if (c == static_cast<unsigned char>(pattern[j])) ++j;
-            if (j == patternLen) {
-                // Нашли совпадение: вычислим номер строки внутри leaf до начала совпадения.
-                int matchEndIndex = i;
-                int matchStartIndex = matchEndIndex - patternLen + 1;
-                if (matchStartIndex < 0) matchStartIndex = 0; // безопасность
-
-                int localNewlines = 0;
-                // считаем number of '\n' в leaf->data[0 .. matchStartIndex-1]
-                for (int k = 0; k < matchStartIndex && k < leaf->length; ++k) {
-                    if (leaf->data[k] == '\n') ++localNewlines;
+        }
+        if (!ready) continue;
+        TREE_COUNT(NODES_VISITED, 1);
+        inner->hash = ContentHash::combine(inner->left ? inner->left->hash : ContentHash(),
+                                           inner->right ? inner->right->hash : ContentHash());
+        inner->hashValid = true;
+        stack.pop_back();
+    }
+    return true;
+}
+
+ContentHash Tree::getRangeHashRecursive(const Node* node, int from, int to) const {
+    if (!node) return ContentHash();
+    TREE_COUNT(NODES_VISITED, 1);
+    int len = node->getLength();
+    if (from < 0) from = 0;
+    if (to > len) to = len;
+    if (from >= to) return ContentHash();
+    if (from == 0 && to == len) return nodeHash(node);
+
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<const LeafNode*>(node);
+        return ContentHash::ofBytes(leafBytes(leaf) + from, to - from);
+    }
+
+    auto inner = static_cast<const InternalNode*>(node);
+    int leftLen = inner->left ? inner->left->getLength() : 0;
+    return ContentHash::combine(getRangeHashRecursive(inner->left, from, to),
+                                getRangeHashRecursive(inner->right, from - leftLen, to - leftLen));
+}
+
+ContentHash Tree::getContentHash() const {
+    return root ? nodeHash(root) : ContentHash();
+}
+
+bool Tree::prepareContentHash(int budgetBytes) const {
+    if (!root || root->hashValid) return true;
+    return fillHashes(root, budgetBytes < 0 ? 0 : budgetBytes);
+}
+
+bool Tree::isContentHashReady() const {
+    return !root || root->hashValid;
+}
+
+ContentHash Tree::getRangeHash(int offset, int len) const {
+    if (!root || len <= 0) return ContentHash();
+    if (offset < 0) offset = 0;
+    return getRangeHashRecursive(root, offset, offset + len);
+}
+
+int Tree::lineStartAtOrBefore(int offset) const {
+    return lineStartOffset(getLineForOffset(offset));
+}
+
+int Tree::lineStartAtOrAfter(int offset) const {
+    if (offset <= 0) return 0;
+    // строка, в которой лежит байт offset-1, заканчивается своим '\n'
+    return lineStartOffset(getLineForOffset(offset - 1) + 1);
+}
+
+namespace {
+    // Окна не длиннее этого сравниваются побайтно
+    const int DIFF_BYTE_COMPARE = 256;
+    // Сколько строк от середины расхождения пробовать как опорные
+    const int DIFF_ANCHOR_TRIES = 8;
+    // Короткие строки ("}", пустые) встречаются везде и плохо выравнивают
+    const int DIFF_ANCHOR_MIN_LEN = 8;
+    // Окно побайтового поиска опорной строки, если известные сдвиги не подошли
+    const int DIFF_ANCHOR_WINDOW = 1 << 20;
+}
+
+int Tree::commonRun(const Tree& a, int aPos, const Tree& b, int bPos, int maxLen, bool backward) {
+    // Окно [k, k + s) от начала (или от конца при backward)
+    auto windowStart = [backward](int pos, int k, int s) { return backward ? pos - k - s : pos + k; };
+    auto equalByHash = [&](int k, int s) {
+        return a.getRangeHash(windowStart(aPos, k, s), s) == b.getRangeHash(windowStart(bPos, k, s), s);
+    };
+    // Количество совпадающих байт окна, считая от ближнего к k края
+    auto matchingBytes = [&](int k, int s) {
+        char* x = a.getTextRange(windowStart(aPos, k, s), s);
+        char* y = b.getTextRange(windowStart(bPos, k, s), s);
+        int i = 0;
+        while (i < s && (backward ? x[s - 1 - i] == y[s - 1 - i] : x[i] == y[i])) ++i;
+        delete[] x; // NOSONAR
+        delete[] y; // NOSONAR
+        return i;
+    };
+
+    // Разгон: удваиваем окно, пока хэши совпадают
+    int k = 0;
+    int step = MAX_LEAF_SIZE;
+    int s = 0;
+    while (k < maxLen) {
+        s = std::min(step, maxLen - k);
+        if (!equalByHash(k, s)) break;
+        k += s;
+        if (step < INT_MAX / 2) step *= 2;
+    }
+    if (k >= maxLen) return maxLen;
+
+    // Расхождение внутри [k, k + s): делим пополам, спускаясь только в несовпавшую половину
+    while (s > DIFF_BYTE_COMPARE) {
+        int half = s / 2;
+        if (equalByHash(k, half)) {
+            k += half;
+            s -= half;
+        } else {
+            s = half;
+        }
+    }
+    return k + matchingBytes(k, s);
+}
+
+bool Tree::findDiffAnchor(const Tree& a, int aS, int aE, const Tree& b, int bS, int bE,
+                          int& anchorA, int& anchorB) {
+    // Сдвиги, известные на краях расхождения: участок между правками обычно сдвинут на один из них
+    const int shifts[2] = {bS - aS, bE - aE};
+    int fallback = -1;
+    int fallbackEnd = -1;
+
+    int m = a.lineStartAtOrAfter(aS + (aE - aS) / 2);
+    for (int tries = 0; tries < DIFF_ANCHOR_TRIES && m > aS && m < aE; ++tries) {
+        int mEnd = std::min(aE, a.lineStartAtOrAfter(m + 1));
+        if (mEnd - m >= DIFF_ANCHOR_MIN_LEN) {
+            // Сравниваем вместе с предыдущим '\n': опора во втором документе тоже начинает строку
+            int pieceLen = mEnd - m + 1;
+            ContentHash piece = a.getRangeHash(m - 1, pieceLen);
+            for (int shift : shifts) {
+                int p = m + shift;
+                if (p > bS && p + (mEnd - m) <= bE && b.getRangeHash(p - 1, pieceLen) == piece) {
+                    anchorA = m;
+                    anchorB = p;
+                    return true;
                 }
+            }
+            if (fallback < 0) {
+                fallback = m;
+                fallbackEnd = mEnd;
+            }
+        }
+        m = mEnd;
+    }
+    if (fallback < 0) return false;
+
+    // Побайтовый поиск строки в окне вокруг левого сдвига; берём ближайшее к ожидаемому место
+    int pieceLen = fallbackEnd - fallback + 1;
+    int center = fallback + shifts[0];
+    int lo = std::max(bS, center - DIFF_ANCHOR_WINDOW);
+    int hi = std::min(bE, center + DIFF_ANCHOR_WINDOW + pieceLen);
+    if (hi - lo < pieceLen) return false;
+
+    char* piece = a.getTextRange(fallback - 1, pieceLen);
+    char* window = b.getTextRange(lo, hi - lo);
+    int best = -1;
+    const char* it = window;
+    const char* end = window + (hi - lo);
+    while ((it = std::search(it, end, piece, piece + pieceLen)) != end) {
+        int p = lo + static_cast<int>(it - window) + 1;
+        if (p > bS && (best < 0 || std::abs(p - center) < std::abs(best - center))) best = p;
+        ++it;
+    }
+    delete[] piece; // NOSONAR
+    delete[] window; // NOSONAR
+    if (best < 0) return false;
+    anchorA = fallback;
+    anchorB = best;
+    return true;
+}
 
-                // итоговый номер строки (0-based)
-                return processedLines + localNewlines;
+std::vector<DiffHunk> Tree::diff(const Tree& a, const Tree& b) {
+    std::vector<DiffHunk> hunks;
+    int lenA = a.root ? a.root->getLength() : 0;
+    int lenB = b.root ? b.root->getLength() : 0;
+    if (lenA == lenB && a.getContentHash() == b.getContentHash()) return hunks;
+
+    // Участки [a0, a1) и [b0, b1), которые ещё предстоит сравнить; левые — на вершине стека
+    struct Region {
+        int a0;
+        int a1;
+        int b0;
+        int b1;
+    };
+    std::vector<Region> work;
+    work.push_back({0, lenA, 0, lenB});
+    while (!work.empty()) {
+        Region r = work.back();
+        work.pop_back();
+
+        // Общий префикс, откатанный к началу строки (в обоих документах он одинаковый)
+        int prefix = commonRun(a, r.a0, b, r.b0, std::min(r.a1 - r.a0, r.b1 - r.b0), false);
+        int aS = std::max(r.a0, a.lineStartAtOrBefore(r.a0 + prefix));
+        int bS = r.b0 + (aS - r.a0);
+
+        // Общий суффикс остатка; конец расхождения дотягиваем до конца строки
+        int suffix = commonRun(a, r.a1, b, r.b1, std::min(r.a1 - aS, r.b1 - bS), true);
+        int aE = r.a1 - suffix;
+        if (aE > aS) aE = std::min(r.a1, a.lineStartAtOrAfter(aE));
+        int bE = r.b1 - (r.a1 - aE);
+        if (aS == aE && bS == bE) continue;
+
+        int anchorA = 0;
+        int anchorB = 0;
+        if (aE > aS && bE > bS && findDiffAnchor(a, aS, aE, b, bS, bE, anchorA, anchorB)) {
+            work.push_back({anchorA, aE, anchorB, bE});
+            work.push_back({aS, anchorA, bS, anchorB});
+            continue;
+        }
+        hunks.push_back({aS, aE - aS, bS, bE - bS});
+    }
+    return hunks;
+}
+
+// --- Поиск ---
+
+void Tree::forEachLeafInRange(int from, int to, const std::function<bool(const LeafNode*, int)>& fn,
+                              const std::function<bool(const Node*, int)>& skip) const {
+    if (!root) return;
+    std::vector<std::pair<const Node*, int>> stack;
+    stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+        auto [node, start] = stack.back();
+        stack.pop_back();
+        int end = start + node->getLength();
+        if (end <= from || start >= to) continue;
+        TREE_COUNT(NODES_VISITED, 1);
+        if (skip && skip(node, start)) continue;
+        if (node->getType() == NodeType::NODE_INTERNAL) {
+            auto inner = static_cast<const InternalNode*>(node);
+            int mid = start + (inner->left ? inner->left->getLength() : 0);
+            if (inner->right) stack.emplace_back(inner->right, mid);
+            if (inner->left) stack.emplace_back(inner->left, start);
+            continue;
+        }
+        if (!fn(static_cast<const LeafNode*>(node), start)) return;
+    }
+}
+
+void Tree::appendSubtreeBytes(const Node* node, int offset, int len, std::string& out,
+                              std::vector<char>* scratch) const {
+    while (len > 0) {
+        const Node* cur = node;
+        int local = offset;
+        while (cur->getType() == NodeType::NODE_INTERNAL) {
+            auto inner = static_cast<const InternalNode*>(cur);
+            int leftLen = inner->left ? inner->left->getLength() : 0;
+            if (local < leftLen) {
+                cur = inner->left;
+            } else {
+                local -= leftLen;
+                cur = inner->right;
             }
         }
+        auto leaf = static_cast<const LeafNode*>(cur);
+        int take = std::min(len, leaf->length - local);
+        out.append(searchBytes(leaf, scratch) + local, static_cast<size_t>(take));
+        offset += take;
+        len -= take;
+    }
+}
 
-        // Если не нашли в этом листе — аккумулируем все строки из листа и идём дальше.
-        processedLines += leaf->getLineCount();
-        return -1;
-    } else {
-        auto in = static_cast<InternalNode*>(node);
-        int r = -1;
-        if (in->left) {
-            r = findSubstringLineRecursive(in->left, pattern, patternLen, lps, j, processedLines);
-            if (r != -1) return r;
+const char* Tree::searchBytes(const LeafNode* leaf, std::vector<char>* scratch) const {
+    if (!leaf->packed) return leaf->data;
+    if (!scratch) return leafBytes(leaf);
+    scratch->resize(static_cast<size_t>(leaf->length > 0 ? leaf->length : 1));
+    if (!LeafCodec::decompress(leaf->packed, leaf->packedLength, scratch->data(), leaf->length)) {
+        throw std::runtime_error("Corrupted packed leaf");
+    }
+    return scratch->data();
+}
+
+int Tree::scanMatches(const char* pattern, int patternLen, int from, int to, int line,
+                      bool overlapping, bool foldAscii, const CancelToken* cancel, std::vector<char>* scratch,
+                      const SearchCallback& onMatch) const {
+    auto find = foldAscii ? &SearchKernel::findAsciiFolded : &SearchKernel::find;
+    // Совпадение на стыке листьев начинается в последних patternLen - 1 байтах
+    // пройденного: они копятся в carry и проверяются вместе с началом следующего листа.
+    // Строки считаются лениво: line — номер строки в позиции counted.
+    const int keep = patternLen - 1;
+    const ByteSet need = ByteSet::ofBytes(pattern, patternLen);
+    std::string carry;
+    std::string window;
+    int carryStart = from;
+    int next = from; // ближайшее допустимое начало совпадения
+    int counted = from;
+    int count = 0;
+    bool stopped = false;
+
+    // Совпадения, начатые в carry и продолженные head (counted — начало head)
+    auto matchCarry = [&](const char* head, int headLen) {
+        if (carry.empty()) return true;
+        window.assign(carry);
+        window.append(head, static_cast<size_t>(std::min(keep, headLen)));
+        auto carryLen = static_cast<int>(carry.size());
+        int k = std::max(next - carryStart, 0);
+        while ((k = find(window.data(), static_cast<int>(window.size()), k, pattern, patternLen)) >= 0 &&
+               k < carryLen) {
+            int offset = carryStart + k;
+            ++count;
+            if (!onMatch({offset, line - SearchKernel::countNewlines(carry.data() + k, carryLen - k), patternLen})) return false;
+            next = overlapping ? offset + 1 : offset + patternLen;
+            k = next - carryStart;
         }
-        if (in->right) {
-            r = findSubstringLineRecursive(in->right, pattern, patternLen, lps, j, processedLines);
-            if (r != -1) return r;
+        return true;
+    };
+
+    // Поддерево целиком внутри диапазона, где нет какого-то байта шаблона, не содержит
+    // совпадения целиком. Не длиннее 2 * keep — совпадение может пройти его насквозь,
+    // такое читается как обычно. Иначе проверяются только стыки: carry с первыми keep
+    // байтами и последние keep байтов как новый carry.
+    auto skip = [&](const Node* node, int start) {
+        if (stopped) return true;
+        int len = node->getLength();
+        if (start < from || start + len > to || len < 2 * keep || len == 0) return false;
+        const ByteSet& has = node->getBytes();
+        if ((foldAscii ? has.foldAscii() : has).containsAll(need)) return false;
+        if (keep > 0) {
+            std::string head;
+            appendSubtreeBytes(node, 0, keep, head, scratch);
+            if (!matchCarry(head.data(), keep)) {
+                stopped = true;
+                return true;
+            }
+            carry.clear();
+            appendSubtreeBytes(node, len - keep, keep, carry, scratch);
+            carryStart = start + len - keep;
+        }
+        line += node->getLineCount();
+        counted = start + len;
+        return true;
+    };
+
+    forEachLeafInRange(from, to, [&](const LeafNode* leaf, int start) {
+        if (stopped || (cancel && cancel->cancelled())) return false;
+        int end = start + leaf->length;
+        const char* bytes = searchBytes(leaf, scratch);
+        int segStart = from > start ? from : start;
+        int segEnd = to < end ? to : end;
+        const char* seg = bytes + (segStart - start);
+        int segLen = segEnd - segStart;
+
+        // Совпадения, начатые в прошлых листьях (counted == segStart)
+        if (!matchCarry(seg, segLen)) return false;
+
+        int k = std::max(next, segStart) - segStart;
+        while ((k = find(seg, segLen, k, pattern, patternLen)) >= 0) {
+            int offset = segStart + k;
+            line += SearchKernel::countNewlines(seg + (counted - segStart), offset - counted);
+            counted = offset;
+            ++count;
+            if (!onMatch({offset, line, patternLen})) return false;
+            next = overlapping ? offset + 1 : offset + patternLen;
+            k = next - segStart;
         }
-        return -1;
+        if (counted == start && segLen == leaf->length) {
+            line += leaf->lineCount;
+        } else {
+            line += SearchKernel::countNewlines(seg + (counted - segStart), segEnd - counted);
+        }
+        counted = segEnd;
+
+        if (keep > 0) {
+            if (segLen >= keep) {
+                carry.assign(seg + segLen - keep, static_cast<size_t>(keep));
+            } else {
+                carry.append(seg, static_cast<size_t>(segLen));
+                if (static_cast<int>(carry.size()) > keep) carry.erase(0, carry.size() - static_cast<size_t>(keep));
+            }
+            carryStart = segEnd - static_cast<int>(carry.size());
+        }
+        return true;
+    }, skip);
+    return count;
+}
+
+namespace {
+    // Меньше этого искать в одном потоке дешевле, чем раздавать задачи
+    const int PARALLEL_SEARCH_GRAIN = 4 << 20;
+    // Кусков на поток: запас на неравномерность (сжатые листья, ранняя отмена)
+    const int SEARCH_CHUNKS_PER_THREAD = 4;
+}
+
+int Tree::findMatches(const char* pattern, int patternLen, int from, int to, bool firstOnly,
+                      SearchCase mode, const SearchCallback& onMatch) const {
+    if (!root || !pattern || patternLen <= 0) return 0;
+    if (mode == SearchCase::UNICODE) {
+        // Свёртка меняет длину в байтах (K Кельвина — 3 байта, k — 1): ищет Regex
+        try {
+            Regex re(Regex::escape(std::string(pattern, static_cast<size_t>(patternLen))), true);
+            return findAllRegex(re, from, to, onMatch);
+        } catch (const std::invalid_argument&) {
+            mode = SearchCase::ASCII; // шаблон не UTF-8: сворачивается только ASCII
+        }
+    }
+    std::string folded;
+    if (mode == SearchCase::ASCII) {
+        folded.assign(pattern, static_cast<size_t>(patternLen));
+        for (char& c : folded) c = SearchKernel::asciiLower(c);
+        pattern = folded.data();
+    }
+    bool foldAscii = mode == SearchCase::ASCII;
+    int docLen = root->getLength();
+    if (from < 0) from = 0;
+    if (to > docLen) to = docLen;
+    if (to - from < patternLen) return 0;
+    if (m_trigrams && mode == SearchCase::EXACT && patternLen >= 3) {
+        return findIndexed(pattern, patternLen, from, to, firstOnly, onMatch);
     }
+
+    TaskPool& pool = TaskPool::instance();
+    int chunks = std::min((to - from) / PARALLEL_SEARCH_GRAIN,
+                          SEARCH_CHUNKS_PER_THREAD * static_cast<int>(pool.size()));
+    if (chunks < 2) {
+        return scanMatches(pattern, patternLen, from, to, getLineForOffset(from),
+                           false, foldAscii, nullptr, nullptr, onMatch);
+    }
+
+    // Кусок [begin, end) ищется в [begin, end + patternLen - 1): совпадения на стыке
+    // находит левый кусок. Номера строк начала кусков — здесь, палец не потокобезопасен.
+    struct Chunk {
+        int begin = 0;
+        int end = 0;
+        int line = 0;
+        CancelToken cancel;
+        std::vector<SearchMatch> hits;
+    };
+    std::vector<Chunk> parts(static_cast<size_t>(chunks));
+    long long span = to - from;
+    for (int k = 0; k < chunks; ++k) {
+        Chunk& part = parts[static_cast<size_t>(k)];
+        part.begin = from + static_cast<int>(span * k / chunks);
+        part.end = from + static_cast<int>(span * (k + 1) / chunks);
+        part.line = getLineForOffset(part.begin);
+    }
+
+    TaskGroup group(pool);
+    for (int k = 0; k < chunks; ++k) {
+        group.run([this, pattern, patternLen, &parts, k, to, firstOnly, foldAscii]() {
+            Chunk& part = parts[static_cast<size_t>(k)];
+            std::vector<char> scratch;
+            int scanEnd = std::min(part.end + patternLen - 1, to);
+            scanMatches(pattern, patternLen, part.begin, scanEnd, part.line, false, foldAscii,
+                        &part.cancel, &scratch, [&](const SearchMatch& m) {
+                part.hits.push_back(m);
+                if (!firstOnly) return true;
+                // Первое совпадение документа левее или здесь: куски правее не нужны
+                for (size_t r = static_cast<size_t>(k) + 1; r < parts.size(); ++r) parts[r].cancel.cancel();
+                return false;
+            });
+        });
+    }
+    group.wait();
+
+    // Слияние по порядку. Каждый кусок жадно отбирает неперекрывающиеся совпадения
+    // от своего начала; если последнее совпадение левого куска заходит в этот,
+    // правильная цепочка дочитывается последовательно до первого общего смещения —
+    // дальше жадный выбор совпадает с найденным куском.
+    int count = 0;
+    int lastEnd = from;
+    bool stopped = false;
+    auto report = [&](const SearchMatch& m) {
+        ++count;
+        lastEnd = m.offset + patternLen;
+        if (!onMatch(m)) stopped = true;
+        return !stopped;
+    };
+    for (const Chunk& part : parts) {
+        size_t next = 0;
+        if (lastEnd > part.begin) {
+            int scanEnd = std::min(part.end + patternLen - 1, to);
+            bool synced = false;
+            scanMatches(pattern, patternLen, lastEnd, scanEnd, getLineForOffset(lastEnd), false, foldAscii,
+                        nullptr, nullptr, [&](const SearchMatch& m) {
+                while (next < part.hits.size() && part.hits[next].offset < m.offset) ++next;
+                if (next < part.hits.size() && part.hits[next].offset == m.offset) {
+                    synced = true;
+                    return false;
+                }
+                return report(m);
+            });
+            if (stopped) return count;
+            if (!synced) next = part.hits.size();
+        }
+        for (; next < part.hits.size(); ++next) {
+            if (!report(part.hits[next])) return count;
+        }
+    }
+    return count;
 }
 
-// Публичная обёртка: возвращает номер строки (0-based) где начинается совпадение,
-// или -1 если не найдено.
-int Tree::findSubstringLine(const char* pattern, int patternLen) const {
+// --- Триграммный индекс ---
+
+void Tree::setTrigramIndex(bool enabled) {
+    if (!enabled) {
+        m_trigrams.reset();
+    } else if (!m_trigrams) {
+        m_trigrams = std::make_unique<TrigramIndex>();
+        m_trigramVersion = 0; // соберётся при первом поиске
+    }
+}
+
+bool Tree::hasTrigramIndex() const { return m_trigrams != nullptr; }
+
+void Tree::indexSubtree(const Node* node) const {
+    if (!node) return;
+    std::vector<const Node*> stack{node};
+    while (!stack.empty()) {
+        const Node* n = stack.back();
+        stack.pop_back();
+        if (n->getType() == NodeType::NODE_LEAF) {
+            auto leaf = static_cast<const LeafNode*>(n);
+            m_trigrams->addLeaf(leaf, leafBytes(leaf), leaf->length);
+            continue;
+        }
+        auto inner = static_cast<const InternalNode*>(n);
+        if (inner->right) stack.push_back(inner->right);
+        if (inner->left) stack.push_back(inner->left);
+    }
+}
+
+void Tree::unindexSubtree(const Node* node) const {
+    if (!node) return;
+    std::vector<const Node*> stack{node};
+    while (!stack.empty()) {
+        const Node* n = stack.back();
+        stack.pop_back();
+        if (n->getType() == NodeType::NODE_LEAF) {
+            m_trigrams->removeLeaf(static_cast<const LeafNode*>(n));
+            continue;
+        }
+        auto inner = static_cast<const InternalNode*>(n);
+        if (inner->right) stack.push_back(inner->right);
+        if (inner->left) stack.push_back(inner->left);
+    }
+}
+
+void Tree::ensureTrigramIndex() const {
+    if (trigramsTracking() && !m_trigrams->needsRebuild()) return;
+    m_trigrams->clear();
+    indexSubtree(root);
+    m_trigramVersion = m_version;
+}
+
+int Tree::findIndexed(const char* pattern, int patternLen, int from, int to, bool firstOnly,
+                      const SearchCallback& onMatch) const {
+    ensureTrigramIndex();
+    std::vector<const LeafNode*> inside;
+    m_trigrams->candidates(pattern, patternLen, inside);
+    std::sort(inside.begin(), inside.end());
+    std::vector<std::uint32_t> grams;
+    for (int i = 0; i + 3 <= patternLen; ++i) grams.push_back(TrigramIndex::trigram(pattern + i));
+    std::sort(grams.begin(), grams.end());
+
+    // Участки проверки. Совпадение внутри листа — лист-кандидат целиком. Совпадение через
+    // стык содержит триграмму, лежащую на стыке; стыки восстанавливаются по краям листов
+    // (LeafNode::edges, текст не читается): ctx — последние байты перед текущим листом.
+    std::vector<std::pair<int, int>> regions;
+    char ctx[2];
+    int ctxLen = 0;
+    forEachLeafInRange(from, to, [&](const LeafNode* leaf, int start) {
+        if (leaf->length == 0) return true;
+        if (std::binary_search(inside.begin(), inside.end(), leaf)) {
+            regions.emplace_back(start, start + leaf->length);
+        }
+        char w[4];
+        std::memcpy(w, ctx, static_cast<size_t>(ctxLen));
+        int headLen = std::min(leaf->length, 2);
+        for (int i = 0; i < headLen; ++i) w[ctxLen + i] = leaf->edges[i];
+        for (int j = 0; j < ctxLen && j + 3 <= ctxLen + headLen; ++j) {
+            if (std::binary_search(grams.begin(), grams.end(), TrigramIndex::trigram(w + j))) {
+                // Триграмма с p входит в совпадения, начатые в [p - patternLen + 3, p]
+                int p = start - ctxLen + j;
+                regions.emplace_back(p - patternLen + 3, p + patternLen);
+            }
+        }
+        if (leaf->length >= 2) {
+            ctx[0] = leaf->edges[2];
+            ctx[1] = leaf->edges[3];
+            ctxLen = 2;
+        } else if (ctxLen < 2) {
+            ctx[ctxLen++] = leaf->edges[3];
+        } else {
+            ctx[0] = ctx[1];
+            ctx[1] = leaf->edges[3];
+        }
+        return true;
+    });
+
+    // Пересекающиеся участки склеиваются: каждое совпадение целиком в одном участке,
+    // поэтому жадный выбор по участкам тот же, что при сплошном проходе
+    std::sort(regions.begin(), regions.end());
+    int count = 0;
+    bool stopped = false;
+    const SearchCallback report = [&](const SearchMatch& m) {
+        ++count;
+        stopped = !onMatch(m) || firstOnly;
+        return !stopped;
+    };
+    for (size_t i = 0; i < regions.size() && !stopped;) {
+        int begin = std::max(regions[i].first, from);
+        int end = regions[i].second;
+        for (++i; i < regions.size() && regions[i].first < end; ++i) end = std::max(end, regions[i].second);
+        end = std::min(end, to);
+        if (end - begin < patternLen) continue;
+        scanMatches(pattern, patternLen, begin, end, getLineForOffset(begin), false, false, nullptr, nullptr, report);
+    }
+    return count;
+}
+
+int Tree::findAll(const char* pattern, int patternLen, int from, int to, const SearchCallback& onMatch,
+                  SearchCase mode) const {
+    return findMatches(pattern, patternLen, from, to, false, mode, onMatch);
+}
+
+int Tree::findAllMulti(const PatternSet& patterns, int from, int to, const MultiSearchCallback& onMatch) const {
+    if (!root) return 0;
+    if (from < 0) from = 0;
+    if (to > root->getLength()) to = root->getLength();
+    if (from >= to) return 0;
+
+    // Строки считаются лениво, как в scanMatches: line — номер строки в позиции counted.
+    // Конец совпадения всегда в текущем листе; строка начала — строка конца минус '\n' шаблона.
+    int line = getLineForOffset(from);
+    int counted = from;
+    int count = 0;
+    int state = PatternSet::START;
+    bool stopped = false;
+    const char* seg = nullptr;
+    int segStart = from;
+    // Один std::function на весь поиск, как в findAllRegex
+    const std::function<bool(int, int)> onPieceMatch = [&](int pattern, int e) {
+        int end = segStart + e;
+        line += SearchKernel::countNewlines(seg + (counted - segStart), end - counted);
+        counted = end;
+        ++count;
+        stopped = !onMatch(pattern, {end - patterns.length(pattern), line - patterns.newlines(pattern),
+                                     patterns.length(pattern)});
+        return !stopped;
+    };
+
+    forEachLeafInRange(from, to, [&](const LeafNode* leaf, int start) {
+        int end = start + leaf->length;
+        segStart = from > start ? from : start;
+        int segEnd = to < end ? to : end;
+        seg = leafBytes(leaf) + (segStart - start);
+        if (!patterns.feed(state, seg, segEnd - segStart, onPieceMatch)) return false;
+        if (counted == start && segEnd - segStart == leaf->length) {
+            line += leaf->lineCount;
+        } else {
+            line += SearchKernel::countNewlines(seg + (counted - segStart), segEnd - counted);
+        }
+        counted = segEnd;
+        return true;
+    });
+    return count;
+}
+
+int Tree::findAllRegex(const Regex& re, int from, int to, const SearchCallback& onMatch) const {
+    if (!root) return 0;
+    int docLen = root->getLength();
+    if (from < 0) from = 0;
+    if (to > docLen) to = docLen;
+    if (from >= to) return 0;
+
+    // Границы диапазона — настоящие края строк, только если рядом '\n' или край документа
+    auto byteIs = [this](int offset, char c) {
+        char* b = getTextRange(offset, 1);
+        bool same = b && b[0] == c;
+        delete[] b; // NOSONAR
+        return same;
+    };
+    bool atLineStart = from == 0 || byteIs(from - 1, '\n');
+    bool rangeEndsLine = to == docLen || byteIs(to, '\n');
+
+    int line = getLineForOffset(from);
+    int count = 0;
+    bool stopped = false;
+    std::string pending; // начало строки из прошлых листов
+    int pendingStart = from;
+    int pieceStart = from;
+    // Один std::function на весь поиск: лямбда со ссылками не влезает в малый буфер
+    const std::function<bool(int, int)> onLineMatch = [&](int s, int e) {
+        ++count;
+        stopped = !onMatch({pieceStart + s, line, e - s});
+        return !stopped;
+    };
+    auto runLine = [&](const char* text, int len, int start, bool atEnd) {
+        pieceStart = start;
+        re.forEachInLine(text, len, atLineStart, atEnd, onLineMatch);
+    };
+
+    forEachLeafInRange(from, to, [&](const LeafNode* leaf, int start) {
+        int end = start + leaf->length;
+        int segStart = from > start ? from : start;
+        int segEnd = to < end ? to : end;
+        const char* p = leafBytes(leaf) + (segStart - start);
+        int pos = segStart;
+        while (pos < segEnd && !stopped) {
+            auto nl = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(segEnd - pos)));
+            if (!nl) {
+                if (pending.empty()) pendingStart = pos;
+                pending.append(p, static_cast<size_t>(segEnd - pos));
+                break;
+            }
+            auto pieceLen = static_cast<int>(nl - p);
+            if (pending.empty()) {
+                runLine(p, pieceLen, pos, true);
+            } else {
+                pending.append(p, static_cast<size_t>(pieceLen));
+                runLine(pending.data(), static_cast<int>(pending.size()), pendingStart, true);
+                pending.clear();
+            }
+            ++line;
+            atLineStart = true;
+            pos += pieceLen + 1;
+            p = nl + 1;
+        }
+        return !stopped;
+    });
+    if (!stopped && !pending.empty()) {
+        runLine(pending.data(), static_cast<int>(pending.size()), pendingStart, rangeEndsLine);
+    }
+    return count;
+}
+
+int Tree::countAll(const char* pattern, int patternLen, int from, int to, SearchCase mode) const {
+    return findAll(pattern, patternLen, from, to, [](const SearchMatch&) { return true; }, mode);
+}
+
+int Tree::findNext(const char* pattern, int patternLen, int from, SearchCase mode) const {
+    int found = -1;
+    findMatches(pattern, patternLen, from, INT_MAX, true, mode, [&found](const SearchMatch& m) {
+        found = m.offset;
+        return false;
+    });
+    return found;
+}
+
+namespace {
+    // Первое окно поиска назад; каждое следующее вдвое больше
+    const int FIND_LAST_WINDOW = 64 * 1024;
+}
+
+int Tree::findLast(const char* pattern, int patternLen, int from, int to, SearchCase mode,
+                   SearchMatch* match) const {
     if (!root || !pattern || patternLen <= 0) return -1;
+    int docLen = root->getLength();
+    if (from < 0) from = 0;
+    if (to > docLen) to = docLen;
+    if (to - from < 1) return -1;
 
-    // выделяем lps
-    int* lps = nullptr;
-    try {
-        lps = new int[patternLen]; // NOSONAR
-    } catch (...) {
-        // если не удалось выделить память — возвратим ошибку
-        if (lps) delete[] lps; // NOSONAR
-        throw;
+    std::unique_ptr<Regex> re;
+    if (mode == SearchCase::UNICODE) {
+        try {
+            re = std::make_unique<Regex>(Regex::escape(std::string(pattern, static_cast<size_t>(patternLen))), true);
+        } catch (const std::invalid_argument&) {
+            mode = SearchCase::ASCII; // шаблон не UTF-8: сворачивается только ASCII
+        }
+    }
+    std::string folded;
+    if (mode == SearchCase::ASCII) {
+        folded.assign(pattern, static_cast<size_t>(patternLen));
+        for (char& c : folded) c = SearchKernel::asciiLower(c);
+        pattern = folded.data();
     }
 
-    try {
-        // построим KMP-таблицу (у тебя есть buildKMPTable)
-        buildKMPTable(pattern, patternLen, lps);
+    SearchMatch last{-1, -1, 0};
+    auto keepLast = [&last](const SearchMatch& m) {
+        last = m;
+        return true;
+    };
+    // Окно [lo, hi) ищется до hi + patternLen - 1: совпадение через hi правое окно не видело.
+    // Regex — с начала строки: его совпадения не пересекают '\n', стык окон не режет их.
+    int hi = to;
+    int window = FIND_LAST_WINDOW;
+    while (hi > from && last.offset < 0) {
+        int lo = hi - from > window ? hi - window : from;
+        if (re) {
+            lo = std::max(from, getOffsetForLine(getLineForOffset(lo)));
+            findAllRegex(*re, lo, hi, keepLast);
+        } else {
+            scanMatches(pattern, patternLen, lo, std::min(to, hi + patternLen - 1), getLineForOffset(lo),
+                        true, mode == SearchCase::ASCII, nullptr, nullptr, keepLast);
+        }
+        hi = lo;
+        if (window < INT_MAX / 2) window *= 2;
+    }
+    if (last.offset >= 0 && match) *match = last;
+    return last.offset;
+}
+
+int Tree::findSubstring(const char* pattern, int patternLen) const {
+    return findNext(pattern, patternLen, 0);
+}
 
-        int j = 0;
-        int processedLines = 0;
-        int res = findSubstringLineRecursive(root, pattern, patternLen, lps, j, processedLines);
+int Tree::findSubstringLine(const char* pattern, int patternLen) const {
+    int line = -1;
+    findMatches(pattern, patternLen, 0, INT_MAX, true, SearchCase::EXACT, [&line](const SearchMatch& m) {
+        line = m.line;
+        return false;
+    });
+    return line;
+}
+
+
+// --- Замена ---
+
+int Tree::replaceNext(const char* pattern, int patternLen, const char* replacement, int replacementLen,
+                      int from, SearchCase mode) {
+    if (replacementLen < 0) throw std::invalid_argument("replaceNext: negative replacement length");
+    SearchMatch found{-1, -1, 0};
+    findMatches(pattern, patternLen, from, INT_MAX, true, mode, [&found](const SearchMatch& m) {
+        found = m;
+        return false;
+    });
+    if (found.offset < 0) return -1;
+    erase(found.offset, found.length);
+    insert(found.offset, replacement, replacementLen);
+    return found.offset;
+}
 
-        delete[] lps; // NOSONAR
-        return res;
+int Tree::replaceAll(const char* pattern, int patternLen, const char* replacement, int replacementLen,
+                     int from, int to, SearchCase mode) {
+    if (replacementLen < 0) throw std::invalid_argument("replaceAll: negative replacement length");
+    std::vector<SearchMatch> matches;
+    findMatches(pattern, patternLen, from, to, false, mode, [&matches](const SearchMatch& m) {
+        matches.push_back(m);
+        return true;
+    });
+    // Всегда одна правка: одна версия и один тик часов правок, а при нехватке памяти
+    // документ остаётся прежним (правки по одной оставили бы его заменённым наполовину)
+    if (!matches.empty()) replaceBatch(matches, replacement, replacementLen);
+    return static_cast<int>(matches.size());
+}
+
+void Tree::replaceBatch(const std::vector<SearchMatch>& matches, const char* replacement, int replacementLen) {
+    // Журнал фоновой сборки вырос бы на две правки на совпадение: сборка отменяется
+    discardRebuild();
+
+    std::vector<LeafNode*> leaves;
+    std::vector<InternalNode*> inners;
+    std::vector<Node*> stack{root};
+    while (!stack.empty()) {
+        Node* n = stack.back();
+        stack.pop_back();
+        TREE_COUNT(NODES_VISITED, 1);
+        if (n->getType() == NodeType::NODE_LEAF) {
+            leaves.push_back(static_cast<LeafNode*>(n));
+            continue;
+        }
+        auto inner = static_cast<InternalNode*>(n);
+        inners.push_back(inner);
+        if (inner->right) stack.push_back(inner->right);
+        if (inner->left) stack.push_back(inner->left);
+    }
+
+    // Один проход по листьям. Лист без совпадений входит в новое дерево как есть; серия
+    // листьев с совпадениями (совпадение может идти через стык) копируется с заменами
+    // в text и режется на новые листья, как только стык не внутри совпадения.
+    std::vector<Node*> nodes;        // последовательность нового дерева
+    std::vector<LeafNode*> replaced; // старые листья, ушедшие в копию
+    std::vector<Node*> built;        // новые поддеревья (для отката)
+    std::string text;
+    std::size_t next = 0;
+    int pos = 0; // скопировано до этого смещения (пока серия открыта)
+    bool open = false;
+    try {
+        int start = 0;
+        for (LeafNode* leaf : leaves) {
+            int end = start + leaf->length;
+            if (!open && (next == matches.size() || matches[next].offset >= end)) {
+                nodes.push_back(leaf);
+                start = end;
+                continue;
+            }
+            if (!open) {
+                open = true;
+                pos = start;
+            }
+            const char* bytes = leafBytes(leaf);
+            while (pos < end) {
+                if (next < matches.size() && matches[next].offset < end) {
+                    const SearchMatch& m = matches[next++];
+                    text.append(bytes + (pos - start), static_cast<size_t>(m.offset - pos));
+                    text.append(replacement, static_cast<size_t>(replacementLen));
+                    pos = m.offset + m.length;
+                } else {
+                    text.append(bytes + (pos - start), static_cast<size_t>(end - pos));
+                    pos = end;
+                }
+            }
+            replaced.push_back(leaf);
+            if (pos == end) {
+                if (Node* sub = buildFromTextRecursive(text.data(), static_cast<int>(text.size()))) {
+                    built.push_back(sub);
+                    nodes.push_back(sub);
+                }
+                text.clear();
+                open = false;
+            }
+            start = end;
+        }
     } catch (...) {
-        if (lps) delete[] lps; // NOSONAR
+        for (Node* sub : built) NodeReclaimer::destroySubtree(sub);
         throw;
     }
-}
 
+    // Дерево не тронуто до этого места; дальше только подмена
+    ++m_editClock;
+    ++m_textVersion;
+    bool tracked = trigramsTracking();
+    if (tracked) {
+        for (LeafNode* leaf : replaced) m_trigrams->removeLeaf(leaf);
+        for (Node* sub : built) indexSubtree(sub);
+    }
+    for (InternalNode* inner : inners) delete inner; //NOSONAR
+    for (LeafNode* leaf : replaced) delete leaf; //NOSONAR
+    for (Node* node : nodes) node->folded = false;
+    root = nodes.empty() ? nullptr : buildBalanced(nodes, 0, nodes.size());
+    touch();
+    if (tracked) m_trigramVersion = m_version;
+
+    // Маркеры — как при erase + insert на каждом совпадении: внутри и на краях
+    // совпадения LEFT встаёт в начало замены, RIGHT — в её конец
+    if (m_markers.count() > 0) {
+        std::vector<long long> shift(matches.size() + 1, 0); // сдвиг перед совпадением i
+        for (std::size_t i = 0; i < matches.size(); ++i) {
+            shift[i + 1] = shift[i] + replacementLen - matches[i].length;
+        }
+        m_markers.remap([&](int p, MarkerGravity gravity) {
+            if (gravity == MarkerGravity::LEFT) {
+                // первое совпадение, кончающееся не раньше p
+                auto it = std::lower_bound(matches.begin(), matches.end(), p, [](const SearchMatch& m, int v) {
+                    return m.offset + m.length < v;
+                });
+                auto i = static_cast<std::size_t>(it - matches.begin());
+                if (it != matches.end() && it->offset <= p) return static_cast<int>(it->offset + shift[i]);
+                return static_cast<int>(p + shift[i]);
+            }
+            // последнее совпадение, начатое не позже p
+            auto it = std::upper_bound(matches.begin(), matches.end(), p, [](int v, const SearchMatch& m) {
+                return v < m.offset;
+            });
+            auto i = static_cast<std::size_t>(it - matches.begin());
+            if (i > 0 && p <= matches[i - 1].offset + matches[i - 1].length) {
+                return static_cast<int>(matches[i - 1].offset + shift[i - 1] + replacementLen);
+            }
+            return static_cast<int>(p + shift[i]);
+        });
+    }
+    for (const FoldRange& fold : m_folds) {
+        if (fold.startMarker >= 0) applyFold(fold);
+    }
+}
@@ -1,32 +1,136 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include "MarkerSet.h"
+#include "LeafCodec.h"
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ ПОКА ЧТО ПРОСТО ЗАГЛУШКА НЕ ВАЖНО
 //! ПОСЛЕ ПОКА ЧТО ПРОСТО ЗАГЛУШКА НЕ ВАЖНО
 const int MAX_LEAF_SIZE = 4096; //TODO: фикс
 
+// Статистика текста фрагмента. Слово — максимальная серия байт без пробельных
+// символов (как у istringstream >> std::string); символы — кодовые точки UTF-8.
+// Сводки соседних фрагментов склеиваются за O(1): слово на стыке считается один раз.
+struct TextStats {
+    int bytes = 0;
+    int chars = 0;              // кодовые точки (не считая байты продолжения UTF-8)
+    int nonSpace = 0;           // кодовые точки, не являющиеся пробельными
+    int words = 0;
+    bool startsInWord = false;  // первый байт — не пробельный
+    bool endsInWord = false;    // последний байт — не пробельный
+
+    static TextStats ofBytes(const char* data, int len); // O(len)
+    static TextStats combine(const TextStats& a, const TextStats& b); // O(1)
+};
+
+// Какие байты встречаются во фрагменте: 256 бит. Сводка узла — объединение
+// сводок детей, поэтому поиск пропускает поддерево, где нет какого-то байта
+// шаблона, не читая его текст (редкие идентификаторы, не-ASCII, скобки).
+struct ByteSet {
+    std::uint64_t bits[4] = {0, 0, 0, 0};
+
+    void add(unsigned char b) { bits[b >> 6] |= std::uint64_t(1) << (b & 63); }
+    bool has(unsigned char b) const { return (bits[b >> 6] >> (b & 63)) & 1; }
+    void merge(const ByteSet& other) {
+        for (int i = 0; i < 4; ++i) bits[i] |= other.bits[i];
+    }
+    bool containsAll(const ByteSet& other) const {
+        for (int i = 0; i < 4; ++i) {
+            if (other.bits[i] & ~bits[i]) return false;
+        }
+        return true;
+    }
+    ByteSet foldAscii() const; // O(1) - A-Z отмечены и как a-z
+
+    static ByteSet ofBytes(const char* data, int len); // O(len)
+};
+
+// Хэш содержимого: полином от байт по модулю 2^61-1 с фиксированным основанием.
+// Зависит только от текста, а не от формы дерева: H(ab) = H(a) * B^|b| + H(b),
+// поэтому хэш узла склеивается из хэшей детей, а деревья разной формы сравнимы.
+struct ContentHash {
+    unsigned long long value = 0;
+    unsigned long long power = 1; // B^(длина фрагмента)
+
+    static ContentHash ofBytes(const char* data, int len); // O(len)
+    static ContentHash combine(const ContentHash& a, const ContentHash& b); // O(1)
+
+    bool operator==(const ContentHash& other) const { return value == other.value && power == other.power; }
+    bool operator!=(const ContentHash& other) const { return !(*this == other); }
+};
+
+// Политика границ и размеров листов: где резать текст, не влезающий в один лист
+// (построение из текста и переполнение листа при вставке), и какого размера
+// держать листья. По умолчанию лист заканчивается на '\n' рядом с серединой,
+// поэтому почти каждая строка лежит в одном листе, а разрез без '\n' не рвёт
+// последовательность UTF-8.
+// Размер по "температуре": правка режет большой лист на холодные края и маленький
+// горячий кусок вокруг себя (следующие нажатия копируют только его), а compact()
+// склеивает остывшие листья в крупные — меньше узлов и быстрее сплошной проход.
+struct LeafSplitPolicy {
+    int lineSlack = MAX_LEAF_SIZE / 4; // как далеко от середины искать '\n' (0 — не искать)
+    bool keepUtf8 = true;              // не начинать лист с байта продолжения UTF-8
+    int hotLeafSize = 1024;            // размер горячего куска вокруг правки (0 — не резать)
+    int coldLeafSize = 64 * 1024;      // до какого размера compact() склеивает холодные листья
+    unsigned long coolDownEdits = 256; // лист остывает через столько правок документа
+    int packMinSize = 16 * 1024;       // холодные листья от этого размера уплотнение сжимает (0 — не сжимать)
+
+    // Индекс разреза в (0, len) для len >= 2
+    int chooseSplit(const char* text, int len) const; // O(lineSlack)
+    // Граница в [1, len - 1] рядом с target: после ближайшего '\n' в пределах slack
+    int chooseBoundary(const char* text, int len, int target, int slack) const; // O(slack)
+};
+
 enum class NodeType : char {
     NODE_INTERNAL = 0,
     NODE_LEAF = 1
 };
 
 struct Node {
+    bool folded = false; // поддерево целиком скрыто свёрткой
+
+    // Хэш поддерева считается лениво: правка сбрасывает hashValid только на своём пути
+    mutable ContentHash hash;
+    mutable bool hashValid = false;
+
     virtual NodeType getType() const = 0;
 
     // Быстрый доступ к статистике
     virtual int getLength() const = 0; // Вес в байтах
-    virtual int getLineCount() const = 0; // Вес в строках (\n)
+    virtual int getLineCount() const = 0; // Вес в переводах строк (количество '\n')
+    virtual int getVisibleLineCount() const = 0; // '\n' вне свёрток
+    virtual bool hasFolds() const = 0; // есть ли в поддереве свёрнутые узлы
+    virtual const TextStats& getStats() const = 0; // слова/символы поддерева
+    virtual const ByteSet& getBytes() const = 0; // байты, встречающиеся в поддереве
 
     virtual ~Node() = default;
 };
 
 struct LeafNode : public Node {
     int length;
-    int lineCount; // Количество строк-1 (\n)
-    char* data; // Указатель на строку в памяти (кучи)
+    int lineCount; // Количество строк-1 (число '\n' в листе)
+    char* data; // Указатель на строку в памяти (кучи); nullptr у сжатого листа
+    TextStats stats; // считается в конструкторе вместе с lineCount
+    ByteSet bytes;   // тоже
+    // Первые и последние два байта (у листа из одного байта — он же): стыки листов для
+    // триграммного индекса без чтения текста и распаковки
+    char edges[4] = {0, 0, 0, 0};
+    unsigned long editStamp = 0; // часы правок дерева при создании правкой (0 — холодный с рождения)
+    // Сжатый холодный лист (LeafCodec): текст читается через Tree::leafBytes()
+    char* packed = nullptr;
+    int packedLength = 0;
+    unsigned long packId = 0; // ключ в кэше распакованных листьев
 
     LeafNode(const char* str, int len);
+    // Сжатая копия raw: забирает packedBytes во владение
+    LeafNode(const LeafNode& raw, char* packedBytes, int packedLen);
     ~LeafNode() override;
 
     // Запрет копирования (от утечек)
@@ -41,6 +145,10 @@ struct LeafNode : public Node {
     NodeType getType() const override;
     int getLength() const override;
     int getLineCount() const override;
+    int getVisibleLineCount() const override;
+    bool hasFolds() const override;
+    const TextStats& getStats() const override;
+    const ByteSet& getBytes() const override;
 };
 
 struct InternalNode : public Node {
@@ -50,6 +158,11 @@ struct InternalNode : public Node {
     // Суммы детей
     int totalLength;
     int totalLineCount;
+    int totalVisibleLineCount; // '\n' детей, не скрытые свёртками
+    bool anyFolded;            // у кого-то из потомков стоит folded
+    TextStats totalStats;      // склейка статистики детей
+    ByteSet totalBytes;        // объединение байтов детей
+    int height = 1;            // рёбер до самого глубокого листа (у листа было бы 0)
 
     InternalNode(Node* l, Node* r);
     ~InternalNode() override = default;
@@ -57,29 +170,168 @@ struct InternalNode : public Node {
     NodeType getType() const override;
     int getLength() const override;
     int getLineCount() const override;
+    int getVisibleLineCount() const override;
+    bool hasFolds() const override;
+    const TextStats& getStats() const override;
+    const ByteSet& getBytes() const override;
 
-    void recalc(); // пересчитать totalLength и totalLineCount
+    void recalc(); // пересчитать totalLength, totalLineCount и сводку свёрток
+    // Пересчитать длину, '\n' и статистику, считая поддерево развёрнутым. Флаги свёрток
+    // детей не читаются — безопасно в фоновой сборке, пока GTK-поток сворачивает строки.
+    void recalcContent();
+};
+
+// Палец (finger): кэшированный путь корень→лист последнего обращения.
+// Правки и запросы рядом с предыдущей позицией начинают спуск не от корня,
+// а от ближайшего общего предка. Валиден, пока version совпадает с версией дерева.
+struct TreeFinger {
+    std::vector<InternalNode*> path; // внутренние узлы от корня до родителя листа
+    std::vector<int> pathOffset;     // байтовое смещение начала каждого узла пути
+    std::vector<int> pathLines;      // количество '\n' до начала каждого узла пути
+    std::vector<char> pathLeft;      // 1 — из этого узла спустились влево
+    LeafNode* leaf = nullptr;
+    int leafOffset = 0;              // смещение начала листа в документе
+    int leafLines = 0;               // количество '\n' до начала листа
+    unsigned long version = 0;
+
+    void reset();
+    void push(InternalNode* node, int offset, int lines, bool left);
+    void pop();
+};
+
+// Участок строки в документе: смещение начала и длина без '\n'
+struct LineSpan {
+    int offset;
+    int length;
+};
+
+// Расхождение документов: [offsetA, offsetA + lengthA) первого заменён на
+// [offsetB, offsetB + lengthB) второго. Границы выровнены по началам строк.
+struct DiffHunk {
+    int offsetA;
+    int lengthA;
+    int offsetB;
+    int lengthB;
+};
+
+// Свёртка: скрытый диапазон [startMarker, endMarker) — от '\n' строки-заголовка
+// до конца последней скрытой строки. Границы — маркеры, поэтому правки их сдвигают.
+struct FoldRange {
+    int startMarker = -1; // -1 — слот свободен
+    int endMarker = -1;
+};
+
+// Память, занятая деревом (для MemoryGovernor)
+struct TreeMemoryUsage {
+    std::size_t nodes = 0;         // сами узлы (внутренние и листья)
+    std::size_t rawBytes = 0;      // текст несжатых листьев
+    std::size_t packedBytes = 0;   // текст сжатых листьев
+    std::size_t unpackedCache = 0; // распакованные копии сжатых листьев
+    std::size_t trigramIndex = 0;  // триграммный индекс поиска (перестраивается по требованию)
+    std::size_t total() const { return nodes + rawBytes + packedBytes + unpackedCache + trigramIndex; }
+};
+
+// Совпадение поиска: смещение начала, номер строки (0-based), в которой оно начинается, и длина
+struct SearchMatch {
+    int offset;
+    int line;
+    int length;
 };
+using SearchCallback = std::function<bool(const SearchMatch&)>; // false — остановить поиск
+// Совпадение набора шаблонов: номер шаблона в PatternSet и где он найден
+using MultiSearchCallback = std::function<bool(int pattern, const SearchMatch&)>; // false — остановить поиск
+
+// Сравнение регистра при поиске
+enum class SearchCase : char {
+    EXACT = 0,  // побайтно
+    ASCII = 1,  // A-Z == a-z, остальные байты точно
+    UNICODE = 2 // простая свёртка регистра UTF-8 (CaseFold): латиница, кириллица, греческий
+};
+
+class Regex;        // Regex.h
+class PatternSet;   // PatternSet.h
+class TrigramIndex; // TrigramIndex.h
+class CancelToken;  // TaskPool.h
+struct TaskProgress;
+struct RebuildJob;  // фоновая перестройка (TreeRebuild.h)
+struct RebuildEdit;
 
 class Tree {
+    friend struct RebuildJob; // рабочий поток собирает дерево теми же packLeaves/buildBalanced
+
 private:
     Node* root;
 
-    void clearRecursive(Node* node);
+    // Версия структуры: увеличивается при любом изменении дерева
+    unsigned long m_version = 1;
+    unsigned long m_textVersion = 1; // только правки текста (свёртки и уплотнение не в счёт)
+    mutable TreeFinger m_finger;
+
+    // Маркеры (курсор, якоря выделения, закладки) — сдвигаются правками сами
+    MarkerSet m_markers;
+
+    // Свёртки; id свёртки — индекс в векторе
+    std::vector<FoldRange> m_folds;
+
+    LeafSplitPolicy m_splitPolicy;
+    unsigned long m_editClock = 0;        // счётчик правок (для "температуры" листьев)
+    unsigned long m_compactedVersion = 0; // версия после последнего compact()
+    mutable UnpackedLeafCache m_unpacked; // последние распакованные сжатые листья
+    // Триграммный индекс поиска (nullptr — выключен). Вставка и удаление правят его по
+    // заменённым листьям; любая другая перестройка оставляет m_trigramVersion позади
+    // m_version, и индекс пересобирается при следующем поиске.
+    mutable std::unique_ptr<TrigramIndex> m_trigrams;
+    mutable unsigned long m_trigramVersion = 0;
+
+    void touch(); // изменить версию (инвалидирует палец)
+
+    // Поставить палец на лист, содержащий offset. insertBias: на границе листов
+    // выбирать левый лист (вставка в конец листа, как делает insertRecursive).
+    void seekOffset(int offset, bool insertBias) const;
+    // Поставить палец на лист, содержащий '\n' номер lineBreak (1-based)
+    void seekLineBreak(int lineBreak) const;
+    // Заменить лист пальца на repl и поправить кэши вверх по пути
+    void replaceFingerLeaf(Node* repl);
+
     Node* buildFromTextRecursive(const char* text, int len);
+    // То же на TaskPool: половины крупнее PARALLEL_BUILD_GRAIN строятся параллельно.
+    // Разрезы те же (политика границ), поэтому форма дерева не зависит от числа потоков.
+    Node* buildFromTextParallel(const char* text, int len);
     
     // Вспомогательная рекурсия для сбора текста (теперь проще)
     void collectTextRecursive(Node* node, char* buffer, int& pos);
 
-    // Вспомогательная функция для поиска листа по номеру строки
-    // Изменяет localLineIndex, приводя его к индексу внутри найденного листа
-    LeafNode* findLeafByLineRecursive(Node* node, int& localLineIndex);
-
     LeafNode* findLeafByOffsetRecursive(Node* node, int& localOffset);
     Node* splitLeafAtOffset(LeafNode* leaf, int offset);
 
     Node* insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len);
-    int findSplitIndexForLeaf(const LeafNode* leaf) const;
+    // Узел на место правленного листа old с новым текстом buf; правка — [editPos, editPos + editLen).
+    // Большой лист режется на холодные края и горячий кусок вокруг правки.
+    Node* buildEditedLeaf(const LeafNode* old, const char* buf, int newLen, int editPos, int editLen);
+    static bool isColdLeaf(const LeafNode* leaf, unsigned long editClock, const LeafSplitPolicy& policy);
+    // Склеить серии холодных листьев (общая часть compact() и фоновой перестройки).
+    // Читает только неизменяемые поля листьев; false — прервано токеном cancel.
+    // progress (может быть nullptr) получает по единице на лист.
+    // Новые листья получают готовый хэш: из кэша исходных листьев, где он был (hashed[i] —
+    // снимок hashValid для рабочего потока; nullptr — тот же поток, читается hashValid),
+    // иначе по их байтам. Первый getContentHash() после уплотнения не распаковывает листья.
+    static bool packLeaves(const std::vector<LeafNode*>& leaves, const std::vector<char>* hashed,
+                           unsigned long editClock, const LeafSplitPolicy& policy, std::vector<Node*>& packed,
+                           std::vector<LeafNode*>& merged, std::vector<LeafNode*>& created,
+                           const CancelToken* cancel, TaskProgress* progress);
+    static Node* buildBalanced(const std::vector<Node*>& nodes, std::size_t from, std::size_t to);
+
+    // Фоновая перестройка: пока она идёт, узлы живого дерева не удаляются, а
+    // откладываются до подмены корня (рабочий поток читает листья снимка)
+    RebuildJob* m_rebuild = nullptr;
+    void disposeNode(Node* node);       // удалить отсоединённый узел (без детей)
+    void disposeSubtree(Node* subtree); // отдать поддерево реклеймеру
+    void discardRebuild();              // остановить перестройку и выбросить её результат
+    void recordRebuildEdit(RebuildEdit edit); // журнал правок; при переполнении сборка отменяется
+    // Правки самого дерева без маркеров и журнала (используются и при проигрывании журнала)
+    void insertText(int pos, const char* data, int len);
+    void eraseText(int pos, int len);
+    void swapRanges(int p, int q, int r);
     // Рекурсивные реализации вставки/удаления (возвращают новый Node* для замены в родителе)
     Node* insertRecursive(Node* node, int pos, const char* data, int len);
 
@@ -92,50 +344,242 @@ private:
 
     Node* eraseRecursive(Node* node, int pos, int len);
 
+    // Свёртки: граница листа в offset, пометка/снятие folded на покрытии диапазона
+    Node* splitAtRecursive(Node* node, int offset);
+    void setFoldedRecursive(Node* node, int from, int to);
+    void clearFoldedRecursive(Node* node, int from, int to);
+    void applyFold(const FoldRange& fold);
+    void dropFolds(); // забыть все свёртки (документ заменён)
+    void unfoldAcross(int offset); // раскрыть свёртки, которые режет граница offset
+
+    // Блоки строк: начало строки line (line == getTotalLineCount() — конец документа)
+    int lineStartOffset(int line) const;
+    // Разрезать поддерево по offset: узлы пути переиспользуются, поддеревья вне пути не копируются
+    void splitTree(Node* node, int offset, Node*& left, Node*& right);
+    // Склейка с учётом высот (как в AVL): меньшее дерево подвешивается на край большего
+    // на своей высоте, путь выравнивается поворотами. Свёрнутые узлы не разбираются.
+    static Node* joinTrees(Node* left, Node* right); // O(|h(left) - h(right)| + 1)
+    static Node* rebalanceNode(InternalNode* node);
+    // Поменять местами соседние диапазоны [p, q) и [q, r) перевешиванием поддеревьев
+    void swapAdjacent(int p, int q, int r);
+
     void getTextRangeRecursive(Node* node, int& offset, int& len, char* out, int& outPos) const;
+    TextStats getStatsRecursive(const Node* node, int from, int to) const;
+
+    // Хэши: досчитать сброшенные хэши поддерева (итеративно — вырожденное дерево не переполнит стек)
+    const ContentHash& nodeHash(const Node* node) const;
+    // Досчитать хэши поддерева снизу вверх; budget — сколько байт листьев хэшировать
+    // (хотя бы один лист), < 0 — без ограничения. true — хэш node готов.
+    bool fillHashes(const Node* node, long long budget) const;
+    ContentHash getRangeHashRecursive(const Node* node, int from, int to) const;
+    // Границы строк для выравнивания расхождений
+    int lineStartAtOrBefore(int offset) const;
+    int lineStartAtOrAfter(int offset) const;
+    // Длина общего префикса (backward: суффикса, позиции — концы диапазонов) двух документов.
+    // Окна удваиваются, пока хэши совпадают, затем расхождение ищется делением пополам.
+    static int commonRun(const Tree& a, int aPos, const Tree& b, int bPos, int maxLen, bool backward);
+    // Опорная строка для разбиения расхождения: строка первого документа и её место во втором
+    static bool findDiffAnchor(const Tree& a, int aS, int aE, const Tree& b, int bS, int bE,
+                               int& anchorA, int& anchorB);
 
-    void buildKMPTable(const char* pattern, int patternLen, int* lps) const;
+    // Индекс актуален: правки листьев нужно переносить в него
+    bool trigramsTracking() const { return m_trigrams && m_trigramVersion == m_version; }
+    void indexSubtree(const Node* node) const;   // O(S log L) - S - байты поддерева
+    void unindexSubtree(const Node* node) const; // O(листья поддерева)
+    void ensureTrigramIndex() const;             // O(1) если актуален, иначе O(N log L)
+    // Поиск по индексу: кандидаты — листья со всеми триграммами шаблона и стыки листов,
+    // на которых лежит одна из них; SearchKernel проверяет только эти участки
+    int findIndexed(const char* pattern, int patternLen, int from, int to, bool firstOnly,
+                    const SearchCallback& onMatch) const;
+    // Листья, пересекающие [from, to), слева направо со смещением начала; fn == false — стоп.
+    // skip(node, start) == true — поддерево не обходится (вызывающий учёл его сам).
+    void forEachLeafInRange(int from, int to, const std::function<bool(const LeafNode*, int)>& fn,
+                            const std::function<bool(const Node*, int)>& skip = nullptr) const; // O(log M + K)
+    // Байты [offset, offset + len) поддерева node (смещение от его начала) в конец out
+    // без пальца: scratch — как у scanMatches
+    void appendSubtreeBytes(const Node* node, int offset, int len, std::string& out,
+                            std::vector<char>* scratch) const; // O((log M + L) * листья)
+    // Текст листа для поиска: сжатый распаковывается в scratch или через m_unpacked
+    const char* searchBytes(const LeafNode* leaf, std::vector<char>* scratch) const; // O(1); O(length) у сжатого
+    // SearchKernel по листам, пересекающим [from, to), с хвостом на стыках; line — номер строки в from.
+    // Поддерево без какого-то байта шаблона (ByteSet) не читается: проверяются только его
+    // края — стыки с соседями.
+    // overlapping — сообщать и перекрывающиеся вхождения. scratch != nullptr —
+    // вызов из задачи пула: сжатые листья распаковываются в него, а не в m_unpacked.
+    // foldAscii — pattern в нижнем регистре, текст сравнивается без учёта регистра ASCII.
+    int scanMatches(const char* pattern, int patternLen, int from, int to, int line,
+                    bool overlapping, bool foldAscii, const CancelToken* cancel, std::vector<char>* scratch,
+                    const SearchCallback& onMatch) const;
+    // Диапазон крупнее PARALLEL_SEARCH_GRAIN режется на куски равного веса для TaskPool;
+    // firstOnly — куски правее первого найденного совпадения отменяются
+    int findMatches(const char* pattern, int patternLen, int from, int to, bool firstOnly,
+                    SearchCase mode, const SearchCallback& onMatch) const;
+    // Замена совпадений одним проходом по листьям: листья без совпадений
+    // переиспользуются, остальные копируются с заменами, дерево собирается сбалансированным
+    void replaceBatch(const std::vector<SearchMatch>& matches, const char* replacement, int replacementLen);
 
-    int findSubstringRecursive(Node* node, const char* pattern, int patternLen, const int* lps, int& j, int& processed) const;
 
 public:
     Tree(); // O(1) - Простая инициализация
-    ~Tree(); // O(N) - Вызывает clear(), где N - количество узлов в дереве
+    ~Tree(); // O(1) - Вызывает clear()
     
-    void clear(); // O(N) - Рекурсивно удаляет все узлы дерева
+    void clear(); // O(1) - Отсоединяет корень; узлы удаляются итеративно в фоне (NodeReclaimer)
     bool isEmpty() const; // O(1) - Простая проверка указателя root
     
     // Построить дерево из текста
-    void fromText(const char* text, int len); // O(N) - где N - длина текста. Рекурсивно делит текст пополам
+    void fromText(const char* text, int len); // O(N) - где N - длина текста. Рекурсивно делит текст пополам (по политике границ)
+
+    // Политика границ новых листов; существующие листья не перестраиваются
+    void setLeafSplitPolicy(const LeafSplitPolicy& policy); // O(1)
+    const LeafSplitPolicy& getLeafSplitPolicy() const;      // O(1)
+
+    // Уплотнение: соседние холодные листья склеиваются до coldLeafSize, горячие остаются,
+    // дерево перестраивается сбалансированным. Текст, маркеры и свёртки не меняются.
+    // Вызывается в простое (без правок с прошлого вызова — сразу 0).
+    int compact(); // O(L + S) - L - количество листьев, S - байты склеенных листьев; возвращает, на сколько листьев стало меньше
+    // Память дерева и её сброс под давлением: кэш распакованных листьев, затем
+    // (deep) уплотнение со сжатием холодных листьев, даже если правок не было
+    TreeMemoryUsage getMemoryUsage() const;  // O(M) - M - количество узлов
+    void releaseCaches();                     // O(T) - T - размер триграммного индекса
+    void releaseMemory();                     // O(L + S); во время фоновой перестройки — только кэши
+
+    // То же уплотнение в рабочем потоке: снимок последовательности листьев, сборка
+    // сбалансированного дерева вне GTK-потока, затем finishRebuild() проигрывает
+    // правки, сделанные за время сборки, и подменяет корень.
+    bool startRebuild();        // O(L) - снимок листьев; false — нечего делать или уже идёт
+    bool finishRebuild();       // O(L + E) - E - правки за время сборки; false — сборка ещё не готова
+    bool isRebuilding() const;  // O(1)
+    double rebuildProgress() const; // O(1) - 0..1; 1 — перестройки нет
     
     // Вытащить дерево в текст
+    // Текст листа: сжатый лист распаковывается в кэш (указатель живёт до нескольких следующих промахов)
+    const char* leafBytes(const LeafNode* leaf) const; // O(1); O(length) при промахе кэша
+    std::size_t unpackedCacheBytes() const;            // O(1) - память под распакованные листья
+
     char* toText(); // O(N) - где N - общая длина текста. Выделяет память и рекурсивно собирает текст
     
-    // Получить строку по номеру
-    char* getLine(int lineNumber); // O(log M + L) - где M - количество узлов, L - максимальная длина листа
+    // Получить строку по номеру (без '\n'; строка может продолжаться в следующих листьях)
+    char* getLine(int lineNumber); // O(log M + L) - где M - количество узлов, L - длина строки; O(L) рядом с пальцем
     
-    // Получить количество строк в дереве
+    // Получить количество строк в дереве ('\n' + 1; 0 для пустого дерева)
     int getTotalLineCount() const; // O(1) - Просто возвращает кэшированное значение из корня
     
     // Вычислить байтовое смещение для начала указанной строки внутри поддерева
     int getOffsetForLine(int lineIndex0Based) const; // O(log M + L) - где M - количество узлов, L - максимальная длина листа
+
+    // Номер строки (0-based), в которой находится байтовое смещение
+    int getLineForOffset(int offset) const; // O(log M + L); O(L) рядом с пальцем
+
+    unsigned long getVersion() const; // O(1) - версия структуры (меняется при каждой правке)
+    unsigned long getTextVersion() const; // O(1) - меняется только при правке текста (не свёртками, уплотнением, перестройкой)
     
     // возвращает новый буфер длиной len (или nullptr, если len==0).
     // Владелец вызывающий код должен вызвать delete[]
     char* getTextRange(int offset, int len) const; // O(log M + len) - где M - количество узлов
 
-    int findSubstring(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста. Использует алгоритм Кнута-Морриса-Пратта
+    // Блоки строк [first, last) (0-based, last не включается). Каждая граница — один спуск
+    // по кэшированным счётчикам '\n'; блок в конце документа забирает '\n' перед собой.
+    void deleteLines(int first, int last);              // O(log M + L) - L - длина листов на границах
+    void duplicateLines(int first, int last);           // O(log M + B) - B - размер блока (копия вставляется после него)
+    void moveLines(int first, int last, int target);    // O(log M + L) - блок встаёт перед строкой target, текст не копируется
+    std::vector<LineSpan> getLineSpans(int first, int count) const; // O(log M + S) - S - длина просмотренного текста
+
+    // Статистика (слова, символы, непробельные символы) всего документа и диапазона.
+    // Полностью покрытые поддеревья берутся из кэша, сканируются только два крайних листа.
+    TextStats getStats() const; // O(1)
+    TextStats getStatsForRange(int offset, int len) const; // O(log M + L) - L - максимальная длина листа
+
+    // Хэш содержимого (дерево Меркла): сравнение документов и "изменён с сохранения" —
+    // сравнение двух чисел. После правки пересчитывается только изменённый путь.
+    ContentHash getContentHash() const; // O(1); после правки O(log M + L); первый вызов O(N)
+    // Первый полный хэш по частям — в простое GTK, а не одним проходом при загрузке.
+    // Хэширует не больше budgetBytes байт листьев; true — хэш корня готов.
+    bool prepareContentHash(int budgetBytes) const; // O(budgetBytes + log M)
+    bool isContentHashReady() const;                // O(1)
+    ContentHash getRangeHash(int offset, int len) const; // O(log M + L) - L - максимальная длина листа
+
+    // Построчные расхождения a → b. Совпадающие участки пропускаются по хэшам поддеревьев,
+    // байты читаются только вокруг расхождений.
+    static std::vector<DiffHunk> diff(const Tree& a, const Tree& b); // O(H * log N * (log M + L)) - H - число расхождений
+
+    int findSubstring(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста. SIMD-фильтр SearchKernel
     
     // Возвращает номер строки (0-based), в которой начинается совпадение шаблона,
     // или -1 если не найдено.
     int findSubstringLine(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста
+
+    // Все неперекрывающиеся вхождения, целиком лежащие в [from, to), по порядку за один проход;
+    // onMatch получает смещение и строку, false из него останавливает поиск. Возвращает число сообщённых.
+    // Большие диапазоны ищутся параллельно на TaskPool; onMatch всё равно зовётся в вызывающем потоке.
+    // mode: ASCII — векторное сравнение без учёта регистра; UNICODE — через Regex со свёрткой,
+    // длина совпадения в байтах может отличаться от patternLen, '\n' в шаблоне не совпадает.
+    int findAll(const char* pattern, int patternLen, int from, int to, const SearchCallback& onMatch,
+                SearchCase mode = SearchCase::EXACT) const; // O(log M + (to - from))
+    int countAll(const char* pattern, int patternLen, int from = 0, int to = INT_MAX,
+                 SearchCase mode = SearchCase::EXACT) const; // O(log M + (to - from))
+    int findNext(const char* pattern, int patternLen, int from,
+                 SearchCase mode = SearchCase::EXACT) const; // O(log M + D) - D - расстояние до совпадения; -1 — нет
+    // Последнее совпадение, целиком лежащее в [from, to): поиск назад окнами от to с удвоением,
+    // без прохода от начала. EXACT/ASCII — наибольшее начало среди всех (и перекрывающихся)
+    // вхождений. match (может быть nullptr) получает строку и длину. -1 — нет.
+    int findLast(const char* pattern, int patternLen, int from, int to, SearchCase mode = SearchCase::EXACT,
+                 SearchMatch* match = nullptr) const; // O(log M * log D + D) - D - расстояние от to до совпадения
+    // Поиск регулярного выражения по строкам [from, to) без сборки текста: куски листов
+    // идут прямо в DFA, строка копируется, только если её режет граница листа.
+    // ^ и $ — края строк документа; совпадения не пересекают '\n'.
+    int findAllRegex(const Regex& re, int from, int to, const SearchCallback& onMatch) const; // O(log M + (to - from))
+    // Триграммный индекс для частых поисков в больших документах: точный поиск (EXACT)
+    // шаблонов от 3 байт проверяет только листья-кандидаты и стыки с триграммами шаблона.
+    // Строится при первом поиске; правки пересчитывают только заменённые листья,
+    // прочие перестройки (уплотнение, свёртки, блоки строк) — весь индекс при следующем поиске.
+    void setTrigramIndex(bool enabled); // O(1)
+    bool hasTrigramIndex() const;       // O(1)
+    // Все вхождения всех шаблонов набора, целиком лежащие в [from, to), за один проход
+    // автоматом по листам (состояние переносится через стыки). Перекрывающиеся вхождения
+    // сообщаются все, по порядку концов. Возвращает число сообщённых.
+    int findAllMulti(const PatternSet& patterns, int from, int to,
+                     const MultiSearchCallback& onMatch) const; // O(log M + (to - from) + совпадения)
     
-    // Вставка в дерево
-    void insert(int pos, const char* data, int len); // O(log M + L) - где M - количество узлов, L - длина вставляемых данных
+    // Замена первого совпадения, начатого не раньше from (как findNext): erase + insert.
+    // Возвращает смещение заменённого совпадения или -1.
+    int replaceNext(const char* pattern, int patternLen, const char* replacement, int replacementLen,
+                    int from, SearchCase mode = SearchCase::EXACT); // O(log M + D + R) - D - расстояние до совпадения, R - длина замены
+    // Замена всех совпадений findAll в [from, to) одной правкой (одна версия, один тик
+    // часов правок; при нехватке памяти документ не тронут); возвращает их число.
+    // Один проход по листьям и сборка сбалансированного дерева, а не спуск
+    // с перевыделением листа на каждое совпадение.
+    // Маркеры и свёртки — как после erase + insert на каждом совпадении.
+    int replaceAll(const char* pattern, int patternLen, const char* replacement, int replacementLen,
+                   int from = 0, int to = INT_MAX, SearchCase mode = SearchCase::EXACT); // O(M + S + K * R) - S - длина листьев с совпадениями, K - число совпадений
+
+    // Вставка в дерево (спуск от ближайшего к пальцу предка)
+    void insert(int pos, const char* data, int len); // O(log M + L) - где M - количество узлов, L - длина вставляемых данных; спуск O(1) при наборе на месте
 
     // Удалить len байт, начиная с pos
-    void erase(int pos, int len); // O(log M + L) - где M - количество узлов, L - длина удаляемых данных
+    void erase(int pos, int len); // O(log M + L) - где M - количество узлов, L - длина удаляемых данных (целые поддеревья уходят в фон)
     
+    // Маркеры: позиции, которые автоматически следуют за текстом при insert/erase.
+    // Хранятся относительно соседних маркеров, поэтому правка стоит O(log K)
+    // независимо от количества маркеров K. При замене документа — все в 0.
+    int createMarker(int offset, MarkerGravity gravity); // O(log K) - возвращает id
+    void removeMarker(int id);                           // O(log K)
+    int getMarkerOffset(int id) const;                   // O(log K); -1 для неизвестного id
+    void setMarkerOffset(int id, int offset);            // O(log K)
+    int getMarkerCount() const;                          // O(1)
+
+    // Сворачивание строк firstLine+1..lastLine (firstLine остаётся видимой как заголовок).
+    // Работа — O(глубина) узлов покрытия, а не O(строк) в диапазоне.
+    int foldLines(int firstLine, int lastLine); // O(log M + F) - id свёртки или -1
+    void unfold(int foldId);                    // O(F * log M) - F - количество свёрток
+    void unfoldAll();                           // O(F * log M)
+    int getFoldForLine(int line) const;         // O(F * log M) - id свёртки с заголовком line или -1
+    bool isLineHidden(int line) const;          // O(log M)
+
+    // Видимые строки (визуальные ряды) — строки, не скрытые свёртками
+    int getVisibleLineCount() const;        // O(1); 0 для пустого дерева
+    int visibleRowToLine(int row) const;    // O(log M) - документная строка ряда row
+    int lineToVisibleRow(int line) const;   // O(log M) - ряд строки (скрытая — ряд её заголовка)
+
     Node* getRoot() const; // O(1) - Простое получение указателя
     void setRoot(Node* newRoot); // O(1) - Простая установка указателя
 };
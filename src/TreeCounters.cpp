@@ -0,0 +1,49 @@
+#include "TreeCounters.h"
+
+#ifdef TREE_ENABLE_COUNTERS
+std::atomic<unsigned long long> tree_counters::g_values[static_cast<int>(TreeCounter::COUNT)] = {};
+
+namespace {
+    unsigned long long load(TreeCounter c) {
+        return tree_counters::g_values[static_cast<int>(c)].load(std::memory_order_relaxed);
+    }
+}
+#endif
+
+TreeCounters TreeCounters::snapshot() {
+    TreeCounters c;
+#ifdef TREE_ENABLE_COUNTERS
+    c.nodesVisited = load(TreeCounter::NODES_VISITED);
+    c.bytesCopied = load(TreeCounter::BYTES_COPIED);
+    c.leavesCreated = load(TreeCounter::LEAVES_CREATED);
+    c.leavesDestroyed = load(TreeCounter::LEAVES_DESTROYED);
+    c.allocations = load(TreeCounter::ALLOCATIONS);
+    c.dfaSteps = load(TreeCounter::DFA_STEPS);
+#endif
+    return c;
+}
+
+void TreeCounters::reset() {
+#ifdef TREE_ENABLE_COUNTERS
+    for (auto& v : tree_counters::g_values) v.store(0, std::memory_order_relaxed);
+#endif
+}
+
+bool TreeCounters::enabled() {
+#ifdef TREE_ENABLE_COUNTERS
+    return true;
+#else
+    return false;
+#endif
+}
+
+TreeCounters TreeCounters::operator-(const TreeCounters& before) const {
+    TreeCounters d;
+    d.nodesVisited = nodesVisited - before.nodesVisited;
+    d.bytesCopied = bytesCopied - before.bytesCopied;
+    d.leavesCreated = leavesCreated - before.leavesCreated;
+    d.leavesDestroyed = leavesDestroyed - before.leavesDestroyed;
+    d.allocations = allocations - before.allocations;
+    d.dfaSteps = dfaSteps - before.dfaSteps;
+    return d;
+}
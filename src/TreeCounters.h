@@ -0,0 +1,52 @@
+#ifndef TREE_COUNTERS_H
+#define TREE_COUNTERS_H
+
+// Счётчики горячих путей Tree: узлы на спусках, скопированные байты,
+// созданные/удалённые листья, аллокации, шаги DFA регулярных выражений. По умолчанию вырезаны препроцессором —
+// TREE_COUNT(...) раскрывается в ((void)0), и в релизной сборке их нет вовсе.
+// Включаются определением TREE_ENABLE_COUNTERS (цель tree_lib_counters):
+// тесты проверяют границы сложности по счётчикам, а не по времени.
+
+enum class TreeCounter : int {
+    NODES_VISITED = 0,
+    BYTES_COPIED,
+    LEAVES_CREATED,
+    LEAVES_DESTROYED,
+    ALLOCATIONS,
+    DFA_STEPS,
+    COUNT
+};
+
+struct TreeCounters {
+    unsigned long long nodesVisited = 0;
+    unsigned long long bytesCopied = 0;
+    unsigned long long leavesCreated = 0;
+    unsigned long long leavesDestroyed = 0;
+    unsigned long long allocations = 0;
+    unsigned long long dfaSteps = 0; // байты, пройденные DFA Regex
+
+    // Снимок текущих значений (нули, если счётчики вырезаны)
+    static TreeCounters snapshot();
+    static void reset();
+    static bool enabled();
+
+    // Разница снимков — стоимость одной операции
+    TreeCounters operator-(const TreeCounters& before) const;
+};
+
+#ifdef TREE_ENABLE_COUNTERS
+#include <atomic>
+
+namespace tree_counters {
+    // Атомарные: листья удаляются и в потоке NodeReclaimer
+    extern std::atomic<unsigned long long> g_values[static_cast<int>(TreeCounter::COUNT)];
+}
+
+#define TREE_COUNT(counter, n) \
+    ::tree_counters::g_values[static_cast<int>(TreeCounter::counter)].fetch_add( \
+        static_cast<unsigned long long>(n), std::memory_order_relaxed)
+#else
+#define TREE_COUNT(counter, n) ((void)0)
+#endif
+
+#endif // TREE_COUNTERS_H
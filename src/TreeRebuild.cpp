@@ -0,0 +1,207 @@
+#include "TreeRebuild.h"
+#include "NodeReclaimer.h"
+#include "TreeCounters.h"
+#include <unordered_set>
+
+namespace {
+    // Журнал правок за время сборки. Если правок так много, проще собрать заново
+    // в следующем простое, чем проигрывать их на новом дереве.
+    const std::size_t REBUILD_LOG_LIMIT = 16u * 1024u * 1024u;
+
+    // Удалить внутренние узлы собранного дерева; листья принадлежат другим владельцам
+    void deleteInternalNodes(Node* root) {
+        std::vector<Node*> stack;
+        if (root) stack.push_back(root);
+        while (!stack.empty()) {
+            Node* n = stack.back();
+            stack.pop_back();
+            if (n->getType() == NodeType::NODE_LEAF) continue;
+            auto inner = static_cast<InternalNode*>(n);
+            if (inner->left) stack.push_back(inner->left);
+            if (inner->right) stack.push_back(inner->right);
+            delete inner; //NOSONAR
+        }
+    }
+}
+
+// ==========================================
+// Задача в пуле
+// ==========================================
+
+void RebuildJob::run() {
+    try {
+        std::vector<Node*> packed;
+        std::vector<LeafNode*> merged;
+        if (Tree::packLeaves(leaves, &hashed, editClock, policy, packed, merged, created, &cancel, &progress)) {
+            root = Tree::buildBalanced(packed, 0, packed.size());
+            // created идут в packed в том же порядке — остальное взято из снимка как есть
+            std::size_t next = 0;
+            for (Node* n : packed) {
+                if (next < created.size() && n == created[next]) ++next;
+                else reused.push_back(static_cast<LeafNode*>(n));
+            }
+        }
+    } catch (...) {
+        // Нехватка памяти: живое дерево не тронуто, просто отказываемся от сборки
+        deleteInternalNodes(root);
+        root = nullptr;
+        for (LeafNode* leaf : created) delete leaf; //NOSONAR
+        created.clear();
+        reused.clear();
+    }
+    if (cancel.cancelled() && root) {
+        deleteInternalNodes(root);
+        root = nullptr;
+        for (LeafNode* leaf : created) delete leaf; //NOSONAR
+        created.clear();
+        reused.clear();
+    }
+}
+
+// ==========================================
+// GTK-поток
+// ==========================================
+
+bool Tree::startRebuild() {
+    if (m_rebuild || !root || m_compactedVersion == m_version) return false;
+
+    auto job = new RebuildJob(); //NOSONAR
+    std::vector<Node*> stack;
+    stack.push_back(root);
+    while (!stack.empty()) {
+        Node* n = stack.back();
+        stack.pop_back();
+        TREE_COUNT(NODES_VISITED, 1);
+        if (n->getType() == NodeType::NODE_LEAF) {
+            job->leaves.push_back(static_cast<LeafNode*>(n));
+            job->hashed.push_back(n->hashValid ? 1 : 0);
+            continue;
+        }
+        auto inner = static_cast<InternalNode*>(n);
+        if (inner->right) stack.push_back(inner->right);
+        if (inner->left) stack.push_back(inner->left);
+    }
+    job->editClock = m_editClock;
+    job->policy = m_splitPolicy;
+    job->progress.total.store(static_cast<long long>(job->leaves.size()), std::memory_order_relaxed);
+
+    try {
+        // Фоновая очередь: ни GTK-поток, ни рабочий во вложенном join эту задачу не возьмут
+        job->task.runBackground([job]() { job->run(); });
+    } catch (...) {
+        delete job; //NOSONAR
+        return false;
+    }
+    m_rebuild = job;
+    return true;
+}
+
+bool Tree::isRebuilding() const { return m_rebuild != nullptr; }
+
+double Tree::rebuildProgress() const {
+    return m_rebuild ? m_rebuild->progress.fraction() : 1.0;
+}
+
+bool Tree::finishRebuild() {
+    RebuildJob* job = m_rebuild;
+    if (!job) return true;
+    if (!job->task.done()) return false;
+    if (!job->root) {
+        discardRebuild(); // сборка не удалась — остаёмся на живом дереве
+        return true;
+    }
+
+    // Всё, что было в живом дереве или отложено за время сборки и не перешло
+    // в новое дерево, удаляется. Отложенные одиночные узлы — без обхода: их
+    // указатели на детей могут вести в живое дерево.
+    std::unordered_set<const Node*> keep(job->reused.begin(), job->reused.end());
+    std::vector<Node*> doomed;
+    auto collect = [&](Node* top) {
+        std::vector<Node*> stack;
+        if (top) stack.push_back(top);
+        while (!stack.empty()) {
+            Node* n = stack.back();
+            stack.pop_back();
+            if (n->getType() == NodeType::NODE_INTERNAL) {
+                auto inner = static_cast<InternalNode*>(n);
+                if (inner->left) stack.push_back(inner->left);
+                if (inner->right) stack.push_back(inner->right);
+                doomed.push_back(n);
+            } else if (!keep.count(n)) {
+                doomed.push_back(n);
+            }
+        }
+    };
+    collect(root);
+    for (Node* n : job->graveyard) {
+        if (n->getType() == NodeType::NODE_INTERNAL || !keep.count(n)) doomed.push_back(n);
+    }
+    for (Node* n : job->graveyardSubtrees) collect(n);
+
+    // Подмена корня: на новом дереве свёрток нет, они ставятся заново по маркерам
+    root = job->root;
+    for (LeafNode* leaf : job->reused) leaf->folded = false;
+    std::vector<RebuildEdit> log;
+    log.swap(job->log);
+    m_rebuild = nullptr;
+    delete job; //NOSONAR
+    NodeReclaimer::retireNodes(std::move(doomed));
+    touch();
+
+    // Маркеры уже сдвинуты этими правками — проигрываем только текст
+    for (const RebuildEdit& edit : log) {
+        switch (edit.kind) {
+        case RebuildEdit::Kind::INSERT:
+            insertText(edit.a, edit.data.data(), edit.b);
+            break;
+        case RebuildEdit::Kind::ERASE:
+            eraseText(edit.a, edit.b);
+            break;
+        case RebuildEdit::Kind::SWAP:
+            swapRanges(edit.a, edit.b, edit.c);
+            break;
+        }
+    }
+
+    for (const FoldRange& fold : m_folds) {
+        if (fold.startMarker >= 0) applyFold(fold);
+    }
+    m_compactedVersion = m_version;
+    return true;
+}
+
+void Tree::discardRebuild() {
+    RebuildJob* job = m_rebuild;
+    if (!job) return;
+    m_rebuild = nullptr;
+    job->cancel.cancel();
+    job->task.wait(); // задача ещё не начата — пропустится; начатая проверяет токен
+
+    // Новое дерево: свои внутренние узлы и склеенные листья; листья снимка остаются живым
+    deleteInternalNodes(job->root);
+    for (LeafNode* leaf : job->created) delete leaf; //NOSONAR
+    // Отложенное за время сборки больше никто не читает
+    for (Node* n : job->graveyard) delete n; //NOSONAR
+    for (Node* n : job->graveyardSubtrees) NodeReclaimer::retire(n);
+    delete job; //NOSONAR
+}
+
+void Tree::disposeNode(Node* node) {
+    if (m_rebuild) m_rebuild->graveyard.push_back(node);
+    else delete node; //NOSONAR
+}
+
+void Tree::disposeSubtree(Node* subtree) {
+    if (!subtree) return;
+    if (m_rebuild) m_rebuild->graveyardSubtrees.push_back(subtree);
+    else NodeReclaimer::retire(subtree);
+}
+
+void Tree::recordRebuildEdit(RebuildEdit edit) {
+    m_rebuild->logBytes += sizeof(RebuildEdit) + edit.data.size();
+    if (m_rebuild->logBytes > REBUILD_LOG_LIMIT) {
+        discardRebuild();
+        return;
+    }
+    m_rebuild->log.push_back(std::move(edit));
+}
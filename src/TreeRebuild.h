@@ -0,0 +1,50 @@
+#ifndef TREE_REBUILD_H
+#define TREE_REBUILD_H
+
+#include "Tree.h"
+#include "TaskPool.h"
+#include <string>
+#include <vector>
+
+// Правка, сделанная во время фоновой сборки: проигрывается на новом дереве
+struct RebuildEdit {
+    enum class Kind : char {
+        INSERT = 0, // a — позиция, data — текст
+        ERASE = 1,  // a — позиция, b — длина
+        SWAP = 2    // [a, b) и [b, c) поменялись местами
+    };
+    Kind kind;
+    int a;
+    int b;
+    int c;
+    std::string data;
+};
+
+// Фоновая перестройка дерева. Задача в пуле видит только снимок: листья по порядку
+// (их data/length/lineCount/stats не меняются после создания) и параметры политики.
+// Всё остальное трогает только GTK-поток.
+struct RebuildJob {
+    // Вход (снимок)
+    std::vector<LeafNode*> leaves;
+    std::vector<char> hashed;       // 1 — хэш листа был готов при снимке и больше не пишется
+    unsigned long editClock = 0;
+    LeafSplitPolicy policy;
+
+    // Выход задачи (читается после task.done())
+    Node* root = nullptr;
+    std::vector<LeafNode*> reused;  // листья снимка, вошедшие в новое дерево как есть
+    std::vector<LeafNode*> created; // склеенные листья
+    CancelToken cancel;
+    TaskProgress progress;          // листья снимка, пройденные сборкой
+    TaskGroup task{TaskPool::instance(), cancel}; // последним: деструктор дождётся задачи
+
+    // GTK-поток, пока идёт сборка
+    std::vector<Node*> graveyard;         // отсоединённые узлы (без детей)
+    std::vector<Node*> graveyardSubtrees; // отсоединённые поддеревья
+    std::vector<RebuildEdit> log;
+    std::size_t logBytes = 0;
+
+    void run(); // тело фоновой задачи в TaskPool (TaskGroup::runBackground)
+};
+
+#endif // TREE_REBUILD_H
@@ -0,0 +1,103 @@
+#include "TrigramIndex.h"
+#include <algorithm>
+
+void TrigramIndex::clear() {
+    m_seen.clear();
+    m_seen.shrink_to_fit();
+    m_slots.clear();
+    m_slotOf.clear();
+    m_postings.clear();
+    m_livePostings = 0;
+    m_deadPostings = 0;
+}
+
+void TrigramIndex::addLeaf(const LeafNode* leaf, const char* bytes, int len) {
+    // Адрес мог достаться новому листу от удалённого мимо индекса: старый слот мёртв
+    removeLeaf(leaf);
+    auto slot = static_cast<int>(m_slots.size());
+    // Повторы триграмм в листе отсекает битовая карта на все 2^24 триграммы (2 МБ,
+    // одна на индекс): сортировка каждого листа стоила бы больше самого индекса
+    if (m_seen.empty()) m_seen.assign(size_t(1) << 24 >> 6, 0);
+    std::vector<std::uint32_t>& grams = m_grams;
+    grams.clear();
+    for (int i = 0; i + 3 <= len; ++i) {
+        std::uint32_t g = trigram(bytes + i);
+        std::uint64_t bit = std::uint64_t(1) << (g & 63);
+        if (m_seen[g >> 6] & bit) continue;
+        m_seen[g >> 6] |= bit;
+        grams.push_back(g);
+    }
+    for (std::uint32_t g : grams) {
+        m_seen[g >> 6] = 0;
+        m_postings[g].push_back(slot);
+    }
+
+    Slot s;
+    s.leaf = leaf;
+    s.trigrams = static_cast<int>(grams.size());
+    m_slots.push_back(s);
+    m_slotOf[leaf] = slot;
+    m_livePostings += grams.size();
+}
+
+void TrigramIndex::removeLeaf(const LeafNode* leaf) {
+    auto it = m_slotOf.find(leaf);
+    if (it == m_slotOf.end()) return;
+    Slot& s = m_slots[static_cast<size_t>(it->second)];
+    s.leaf = nullptr;
+    m_livePostings -= static_cast<size_t>(s.trigrams);
+    m_deadPostings += static_cast<size_t>(s.trigrams);
+    m_slotOf.erase(it);
+}
+
+void TrigramIndex::candidates(const char* pattern, int len, std::vector<const LeafNode*>& out) const {
+    out.clear();
+    if (len < 3) return;
+    std::vector<const std::vector<int>*> lists;
+    for (int i = 0; i + 3 <= len; ++i) {
+        auto it = m_postings.find(trigram(pattern + i));
+        if (it == m_postings.end()) return; // триграммы нет ни в одном листе
+        lists.push_back(&it->second);
+    }
+    std::sort(lists.begin(), lists.end(), [](const std::vector<int>* a, const std::vector<int>* b) {
+        return a->size() < b->size();
+    });
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+
+    // От самого короткого списка: в остальных — галоп от прошлой позиции (шаги 1, 2, 4, ...),
+    // затем двоичный поиск в последнем шаге. Списки читаются почти подряд, а не вразброс.
+    std::vector<int> slots;
+    for (int slot : *lists[0]) {
+        if (m_slots[static_cast<size_t>(slot)].leaf) slots.push_back(slot);
+    }
+    for (size_t k = 1; k < lists.size() && !slots.empty(); ++k) {
+        const std::vector<int>& list = *lists[k];
+        size_t pos = 0;
+        size_t kept = 0;
+        for (int slot : slots) {
+            size_t step = 1;
+            size_t hi = pos;
+            while (hi < list.size() && list[hi] < slot) {
+                pos = hi + 1;
+                hi += step;
+                step *= 2;
+            }
+            hi = std::min(hi, list.size());
+            pos = static_cast<size_t>(std::lower_bound(list.begin() + static_cast<std::ptrdiff_t>(pos),
+                                                       list.begin() + static_cast<std::ptrdiff_t>(hi), slot) - list.begin());
+            if (pos == list.size()) break;
+            if (list[pos] == slot) slots[kept++] = slot;
+        }
+        slots.resize(kept);
+    }
+    for (int slot : slots) out.push_back(m_slots[static_cast<size_t>(slot)].leaf);
+}
+
+std::size_t TrigramIndex::memoryBytes() const {
+    std::size_t bytes = m_seen.capacity() * sizeof(std::uint64_t) + m_slots.capacity() * sizeof(Slot) +
+                        m_slotOf.size() * (sizeof(const LeafNode*) + sizeof(int) + 2 * sizeof(void*));
+    for (const auto& [gram, list] : m_postings) {
+        bytes += sizeof(gram) + sizeof(list) + 2 * sizeof(void*) + list.capacity() * sizeof(int);
+    }
+    return bytes;
+}
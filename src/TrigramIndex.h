@@ -0,0 +1,52 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct LeafNode;
+
+// Триграммный индекс листьев: триграмма -> список листьев, внутри которых она есть.
+// Поиск пересекает списки триграмм шаблона и проверяет только листья-кандидаты.
+// Ведётся по листам: правка заменяет лист — из индекса уходит старый, приходят новые.
+// Удаление ленивое: запись в списках помечается мёртвой через слот листа, списки
+// чистит полная перестройка, когда мёртвых записей становится больше живых.
+//
+// Слоты выдаются по возрастанию, поэтому каждый список отсортирован без сортировки.
+// Триграммы на стыках листов в списки не попадают: их проверяет Tree при обходе
+// по краям листов (LeafNode::edges), так правка не трогает записи соседей.
+class TrigramIndex {
+public:
+    static std::uint32_t trigram(const char* p) {
+        return static_cast<std::uint32_t>(static_cast<unsigned char>(p[0])) << 16 |
+               static_cast<std::uint32_t>(static_cast<unsigned char>(p[1])) << 8 |
+               static_cast<unsigned char>(p[2]);
+    }
+
+    void clear();                                                    // O(T)
+    void addLeaf(const LeafNode* leaf, const char* bytes, int len);  // O(len log len)
+    void removeLeaf(const LeafNode* leaf);                           // O(1)
+
+    // Живые листья, внутри которых есть все триграммы шаблона (len >= 3)
+    void candidates(const char* pattern, int len, std::vector<const LeafNode*>& out) const; // O(K log P) - K - самый короткий список
+    bool needsRebuild() const { return m_deadPostings > m_livePostings + 4096; }
+    std::size_t memoryBytes() const; // O(T) - T - различные триграммы
+
+private:
+    struct Slot {
+        const LeafNode* leaf = nullptr; // nullptr — лист удалён
+        int trigrams = 0; // записей слота в списках
+    };
+
+    std::vector<Slot> m_slots;
+    std::unordered_map<const LeafNode*, int> m_slotOf;
+    std::unordered_map<std::uint32_t, std::vector<int>> m_postings;
+    std::vector<std::uint64_t> m_seen;  // addLeaf: триграммы текущего листа
+    std::vector<std::uint32_t> m_grams;
+    std::size_t m_livePostings = 0;
+    std::size_t m_deadPostings = 0;
+};
+
+#endif // TRIGRAM_INDEX_H
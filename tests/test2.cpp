@@ -1,8 +1,22 @@
 #include <iostream>
 #include <cstring>
 #include <string>
+#include <algorithm>
+#include <vector>
 #include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <regex>
+#include <climits>
+#include <cmath>
 #include "Tree.h"
+#include "NodeReclaimer.h"
+#include "MemoryGovernor.h"
+#include "TaskPool.h"
+#include "SearchKernel.h"
+#include "Regex.h"
+#include "CaseFold.h"
+#include "PatternSet.h"
 
 // Глобальные счетчики для статистики
 int total_tests = 0;
@@ -361,7 +375,1936 @@ bool testStressWithCyrillic() {
     return true;
 }
 
+// Тест 10: Фоновое освобождение узлов и вырожденные деревья
+bool testDeferredReclaim() {
+    // Вырожденная цепочка (как после старого цикла insert в on_load_text):
+    // рекурсивное удаление переполнило бы стек
+    const int depth = 200000;
+    Node* chain = new LeafNode("x", 1);
+    for (int i = 1; i < depth; ++i) {
+        chain = new InternalNode(chain, new LeafNode("y", 1));
+    }
+    Tree deep;
+    deep.setRoot(chain);
+    ASSERT_EQUAL(deep.getRoot()->getLength(), depth, "Deep chain length mismatch");
+    deep.clear();
+    ASSERT(deep.isEmpty(), "Tree should be empty right after clear()");
+
+    // Удаление огромного диапазона: целые поддеревья уходят в фон
+    std::string big(1 << 20, 'a');
+    for (size_t i = 0; i < big.size(); i += 64) big[i] = '\n';
+    Tree tree;
+    tree.fromText(big.c_str(), big.size());
+    tree.erase(10, static_cast<int>(big.size()) - 20);
+    big.erase(10, big.size() - 20);
+    char* rest = tree.toText();
+    ASSERT(compareText(big.c_str(), rest, big.size()), "Text mismatch after huge erase");
+    ASSERT_EQUAL(tree.getRoot()->getLength(), 20, "Length mismatch after huge erase");
+    delete[] rest;
+
+    // fromText поверх непустого дерева отдаёт старое дерево реклеймеру
+    tree.fromText("abc", 3);
+    NodeReclaimer::instance().drain();
+    ASSERT_EQUAL(tree.getRoot()->getLength(), 3, "fromText after clear mismatch");
+
+    return true;
+}
+
+// Эталонные номер строки / начало строки для std::string
+static int refLineForOffset(const std::string& s, int offset) {
+    int lines = 0;
+    for (int i = 0; i < offset; ++i) if (s[i] == '\n') ++lines;
+    return lines;
+}
+
+// Тест 11: Правки рядом с пальцем (finger) и запросы строк после них
+bool testFingerLocalEdits() {
+    std::string text;
+    for (int i = 0; i < 2000; ++i) text += "line " + std::to_string(i) + " текст\n";
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+
+    // Печатаем на месте: курсор сдвигается вперёд, иногда Enter и Backspace
+    int cursor = static_cast<int>(text.size()) / 3;
+    unsigned seed = 12345;
+    for (int step = 0; step < 20000; ++step) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned r = (seed >> 16) % 100;
+        if (r < 70) {
+            const char ch = (r % 10 == 0) ? '\n' : static_cast<char>('a' + r % 26);
+            tree.insert(cursor, &ch, 1);
+            text.insert(text.begin() + cursor, ch);
+            ++cursor;
+        } else if (r < 90 && cursor > 0) {
+            tree.erase(cursor - 1, 1);
+            text.erase(cursor - 1, 1);
+            --cursor;
+        } else {
+            // прыжок курсора в другое место документа
+            cursor = static_cast<int>((seed >> 8) % (text.size() + 1));
+        }
+
+        if (step % 997 == 0) {
+            ASSERT_EQUAL(tree.getRoot()->getLength(), static_cast<int>(text.size()), "Length mismatch during finger edits");
+            int line = refLineForOffset(text, cursor);
+            ASSERT_EQUAL(tree.getLineForOffset(cursor), line, "getLineForOffset mismatch near finger");
+            size_t ls = text.rfind('\n', cursor > 0 ? cursor - 1 : 0);
+            int lineStart = (cursor == 0 || ls == std::string::npos) ? 0 : static_cast<int>(ls) + 1;
+            ASSERT_EQUAL(tree.getOffsetForLine(line), lineStart, "getOffsetForLine mismatch near finger");
+            size_t le = text.find('\n', lineStart);
+            std::string expected = text.substr(lineStart, (le == std::string::npos ? text.size() : le) - lineStart);
+            char* got = tree.getLine(line);
+            ASSERT(got != nullptr && expected == got, "getLine mismatch near finger");
+            delete[] got;
+        }
+    }
+
+    char* all = tree.toText();
+    ASSERT(compareText(text.c_str(), all, text.size()), "Text mismatch after finger edits");
+    delete[] all;
+
+    int newlines = 0;
+    for (char c : text) if (c == '\n') ++newlines;
+    ASSERT_EQUAL(tree.getTotalLineCount(), newlines + 1, "Total line count mismatch after finger edits");
+
+    // Строка, пересекающая границу листов, возвращается целиком
+    std::string longLine(3 * MAX_LEAF_SIZE, 'z');
+    std::string doc = "head\n" + longLine + "\ntail";
+    Tree t2;
+    t2.fromText(doc.c_str(), doc.size());
+    char* mid = t2.getLine(1);
+    ASSERT(mid != nullptr && longLine == mid, "Line spanning several leaves should not be truncated");
+    delete[] mid;
+    return true;
+}
+
+// Тест 12: Маркеры сдвигаются правками сами (сравнение с наивным пересчётом)
+bool testMarkersFollowEdits() {
+    std::string text(5000, '.');
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+
+    struct Ref { int id; int offset; MarkerGravity gravity; };
+    std::vector<Ref> refs;
+    unsigned seed = 777;
+    auto rnd = [&seed](unsigned mod) {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % mod);
+    };
+    for (int i = 0; i < 3000; ++i) {
+        auto g = (i % 2) ? MarkerGravity::RIGHT : MarkerGravity::LEFT;
+        int off = rnd(static_cast<unsigned>(text.size()) + 1);
+        refs.push_back({tree.createMarker(off, g), off, g});
+    }
+    ASSERT_EQUAL(tree.getMarkerCount(), 3000, "Marker count mismatch");
+
+    for (int step = 0; step < 2000; ++step) {
+        int total = static_cast<int>(text.size());
+        if (rnd(3) != 0 || total < 100) {
+            int pos = rnd(static_cast<unsigned>(total) + 1);
+            int len = 1 + rnd(40);
+            std::string ins(static_cast<size_t>(len), 'i');
+            tree.insert(pos, ins.c_str(), len);
+            text.insert(static_cast<size_t>(pos), ins);
+            for (auto& r : refs) {
+                if (r.offset > pos || (r.offset == pos && r.gravity == MarkerGravity::RIGHT)) r.offset += len;
+            }
+        } else {
+            int pos = rnd(static_cast<unsigned>(total));
+            int len = 1 + rnd(200);
+            if (pos + len > total) len = total - pos;
+            tree.erase(pos, len);
+            text.erase(static_cast<size_t>(pos), static_cast<size_t>(len));
+            for (auto& r : refs) {
+                if (r.offset >= pos + len) r.offset -= len;
+                else if (r.offset > pos) r.offset = pos;
+            }
+        }
+        if (step % 50 == 0) {
+            // перемещение и пересоздание маркеров между правками
+            Ref& r = refs[static_cast<size_t>(rnd(static_cast<unsigned>(refs.size())))];
+            r.offset = rnd(static_cast<unsigned>(text.size()) + 1);
+            tree.setMarkerOffset(r.id, r.offset);
+            Ref& d = refs[static_cast<size_t>(rnd(static_cast<unsigned>(refs.size())))];
+            tree.removeMarker(d.id);
+            d.offset = rnd(static_cast<unsigned>(text.size()) + 1);
+            d.id = tree.createMarker(d.offset, d.gravity);
+        }
+    }
+
+    for (const auto& r : refs) {
+        ASSERT_EQUAL(tree.getMarkerOffset(r.id), r.offset, "Marker offset mismatch after edits");
+    }
+
+    // Замена документа целиком: маркеры уходят в 0
+    tree.fromText("new", 3);
+    ASSERT_EQUAL(tree.getMarkerOffset(refs[0].id), 0, "Marker should collapse to 0 on fromText");
+    ASSERT_EQUAL(tree.getMarkerOffset(-5), -1, "Unknown marker id should give -1");
+    return true;
+}
+
+bool testFoldingVisibleRows() {
+    const int lines = 20000;
+    std::string text;
+    for (int i = 0; i < lines; ++i) {
+        text += "line " + std::to_string(i);
+        if (i + 1 < lines) text += '\n';
+    }
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines, "Without folds every line is visible");
+
+    int outer = tree.foldLines(100, 15000);
+    ASSERT(outer >= 0, "foldLines should return fold id");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 14900, "Visible count after fold");
+    ASSERT_EQUAL(tree.visibleRowToLine(100), 100, "Header row maps to header line");
+    ASSERT_EQUAL(tree.visibleRowToLine(101), 15001, "Row after fold maps past hidden lines");
+    ASSERT_EQUAL(tree.lineToVisibleRow(15001), 101, "Line after fold maps to next row");
+    ASSERT_EQUAL(tree.lineToVisibleRow(5000), 100, "Hidden line maps to header row");
+    ASSERT(!tree.isLineHidden(100), "Header must stay visible");
+    ASSERT(tree.isLineHidden(101), "First folded line must be hidden");
+    ASSERT(tree.isLineHidden(15000), "Last folded line must be hidden");
+    ASSERT(!tree.isLineHidden(15001), "Line after fold must be visible");
+    ASSERT_EQUAL(tree.getFoldForLine(100), outer, "Fold lookup by header line");
+    ASSERT_EQUAL(tree.foldLines(5, 5), -1, "Empty fold must be rejected");
+
+    // Вложенная свёртка переживает раскрытие внешней
+    int inner = tree.foldLines(20, 30);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 14910, "Visible count with two folds");
+    tree.unfold(outer);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 10, "Inner fold must survive unfold of outer");
+    ASSERT_EQUAL(tree.getFoldForLine(20), inner, "Inner fold lookup");
+    int wrap = tree.foldLines(10, 50);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 40, "Outer fold hides inner one");
+    tree.unfold(inner);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 40, "Unfolding inner keeps outer hidden");
+    tree.unfold(wrap);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines, "All lines visible after unfolding");
+
+    // Правки внутри и вокруг свёртки
+    int fold = tree.foldLines(1000, 2000);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 1000, "Visible count before edits");
+    int inside = tree.getOffsetForLine(1500);
+    tree.insert(inside, "x\ny\n", 4);
+    text.insert(static_cast<size_t>(inside), "x\ny\n");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 1000, "Lines typed inside fold stay hidden");
+    int outside = tree.getOffsetForLine(5000);
+    tree.insert(outside, "\n", 1);
+    text.insert(static_cast<size_t>(outside), "\n");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 999, "Lines typed outside fold are visible");
+    int cut = tree.getOffsetForLine(10);
+    tree.erase(0, cut);
+    text.erase(0, static_cast<size_t>(cut));
+    ASSERT_EQUAL(tree.getFoldForLine(990), fold, "Fold header follows erase above it");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 1009, "Visible count after erase above fold");
+
+    // Enter в конце заголовка: палец стоит на свёрнутом листе справа от границы
+    int headerEnd = tree.getOffsetForLine(991) - 1;
+    ASSERT_EQUAL(tree.getLineForOffset(headerEnd + 1), 991, "Line lookup inside fold");
+    tree.insert(headerEnd, "\n", 1);
+    text.insert(static_cast<size_t>(headerEnd), "\n");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), lines - 1008, "Enter at header end adds a visible row");
+
+    for (int line = 0; line < tree.getTotalLineCount(); line += 7) {
+        if (tree.isLineHidden(line)) continue;
+        ASSERT_EQUAL(tree.visibleRowToLine(tree.lineToVisibleRow(line)), line, "Row/line round trip");
+    }
+
+    tree.unfoldAll();
+    ASSERT_EQUAL(tree.getVisibleLineCount(), tree.getTotalLineCount(), "unfoldAll shows every line");
+    char* all = tree.toText();
+    bool same = (text == all);
+    delete[] all;
+    ASSERT(same, "Folding must not change text");
+    return true;
+}
+
+// Эталон: istringstream-подобный подсчёт по строке
+TextStats refStats(const std::string& s) {
+    TextStats st;
+    st.bytes = static_cast<int>(s.size());
+    bool inWord = false;
+    for (unsigned char c : s) {
+        bool space = (c == ' ' || (c >= '\t' && c <= '\r'));
+        if ((c & 0xC0) != 0x80) {
+            ++st.chars;
+            if (!space) ++st.nonSpace;
+        }
+        if (!space && !inWord) ++st.words;
+        inWord = !space;
+    }
+    return st;
+}
+
+bool testIncrementalStats() {
+    const char* pieces[] = {"word ", "слово ", "\n", "\t", "ab", "  ", "длинное_слово", "x\n\n"};
+    std::string text;
+    unsigned seed = 4242;
+    auto rnd = [&seed](unsigned mod) {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % mod);
+    };
+    while (text.size() < 60000) text += pieces[rnd(8)];
+
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+    TextStats ref = refStats(text);
+    ASSERT_EQUAL(tree.getStats().words, ref.words, "Word count after fromText");
+    ASSERT_EQUAL(tree.getStats().chars, ref.chars, "Char count after fromText");
+    ASSERT_EQUAL(tree.getStats().nonSpace, ref.nonSpace, "Non-space count after fromText");
+
+    for (int step = 0; step < 600; ++step) {
+        int total = static_cast<int>(text.size());
+        if (rnd(3) != 0 || total < 1000) {
+            // вставка посреди слова разрезает его и сращивает заново
+            int pos = rnd(static_cast<unsigned>(total) + 1);
+            std::string ins = pieces[rnd(8)];
+            tree.insert(pos, ins.c_str(), static_cast<int>(ins.size()));
+            text.insert(static_cast<size_t>(pos), ins);
+        } else {
+            int pos = rnd(static_cast<unsigned>(total));
+            int len = 1 + rnd(3000);
+            if (pos + len > total) len = total - pos;
+            tree.erase(pos, len);
+            text.erase(static_cast<size_t>(pos), static_cast<size_t>(len));
+        }
+        if (step % 20 == 0) {
+            ref = refStats(text);
+            ASSERT_EQUAL(tree.getStats().words, ref.words, "Word count after edits");
+            ASSERT_EQUAL(tree.getStats().chars, ref.chars, "Char count after edits");
+
+            int from = rnd(static_cast<unsigned>(text.size()));
+            int len = rnd(20000);
+            if (from + len > static_cast<int>(text.size())) len = static_cast<int>(text.size()) - from;
+            TextStats part = tree.getStatsForRange(from, len);
+            TextStats refPart = refStats(text.substr(static_cast<size_t>(from), static_cast<size_t>(len)));
+            ASSERT_EQUAL(part.words, refPart.words, "Word count of range");
+            ASSERT_EQUAL(part.nonSpace, refPart.nonSpace, "Non-space count of range");
+        }
+    }
+
+    tree.clear();
+    ASSERT_EQUAL(tree.getStats().words, 0, "Empty tree has no words");
+    return true;
+}
+
+// Модель документа как список строк для проверки операций над блоками строк
+std::string joinLines(const std::vector<std::string>& lines) {
+    std::string out;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (i) out += '\n';
+        out += lines[i];
+    }
+    return out;
+}
+
+bool testLineBlockOperations() {
+    std::vector<std::string> model;
+    for (int i = 0; i < 3000; ++i) model.push_back("row " + std::to_string(i) + std::string(static_cast<size_t>(i % 37), '-'));
+    std::string text = joinLines(model);
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+
+    unsigned seed = 99;
+    auto rnd = [&seed](unsigned mod) {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % mod);
+    };
+
+    for (int step = 0; step < 300; ++step) {
+        auto total = static_cast<int>(model.size());
+        int first = rnd(static_cast<unsigned>(total));
+        int last = first + 1 + rnd(static_cast<unsigned>(std::min(200, total - first)));
+        int op = rnd(3);
+        if (op == 0 && total > 400) {
+            tree.deleteLines(first, last);
+            model.erase(model.begin() + first, model.begin() + last);
+        } else if (op == 1 && total < 6000) {
+            tree.duplicateLines(first, last);
+            std::vector<std::string> block(model.begin() + first, model.begin() + last);
+            model.insert(model.begin() + last, block.begin(), block.end());
+        } else {
+            int target = rnd(static_cast<unsigned>(total) + 1);
+            if (target > first && target < last) target = last;
+            // маркер в начале второй строки блока едет вместе с ней
+            int probe = (last - first > 1) ? tree.getOffsetForLine(first + 1) : -1;
+            int marker = (probe >= 0) ? tree.createMarker(probe, MarkerGravity::RIGHT) : -1;
+
+            tree.moveLines(first, last, target);
+            std::vector<std::string> block(model.begin() + first, model.begin() + last);
+            model.erase(model.begin() + first, model.begin() + last);
+            int at = (target > first) ? target - (last - first) : target;
+            model.insert(model.begin() + at, block.begin(), block.end());
+
+            if (marker >= 0) {
+                int movedLine = at + 1;
+                ASSERT_EQUAL(tree.getMarkerOffset(marker), tree.getOffsetForLine(movedLine), "Marker must move with its line");
+                tree.removeMarker(marker);
+            }
+        }
+        ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<int>(model.size()), "Line count after block operation");
+        if (step % 25 == 0) {
+            std::string expected = joinLines(model);
+            char* actual = tree.toText();
+            bool same = (expected == actual);
+            delete[] actual;
+            ASSERT(same, "Text mismatch after block operation");
+        }
+    }
+
+    // Блоки на краях документа: у последней строки нет '\n'
+    auto total = static_cast<int>(model.size());
+    tree.moveLines(total - 3, total, 0);
+    std::rotate(model.begin(), model.end() - 3, model.end());
+    tree.moveLines(0, 2, total);
+    std::rotate(model.begin(), model.begin() + 2, model.end());
+    tree.duplicateLines(total - 1, total);
+    model.push_back(model.back());
+    {
+        std::string edges = joinLines(model);
+        char* actual = tree.toText();
+        bool same = (edges == actual);
+        delete[] actual;
+        ASSERT(same, "Text mismatch after moving blocks at document edges");
+    }
+
+    std::vector<LineSpan> spans = tree.getLineSpans(0, tree.getTotalLineCount());
+    ASSERT_EQUAL(static_cast<int>(spans.size()), static_cast<int>(model.size()), "Span count mismatch");
+    std::string expected = joinLines(model);
+    for (size_t i = 0; i < spans.size(); i += 13) {
+        ASSERT_EQUAL(spans[i].offset, tree.getOffsetForLine(static_cast<int>(i)), "Span offset mismatch");
+        ASSERT(expected.compare(static_cast<size_t>(spans[i].offset), static_cast<size_t>(spans[i].length), model[i]) == 0,
+               "Span text mismatch");
+    }
+    ASSERT_EQUAL(static_cast<int>(tree.getLineSpans(static_cast<int>(model.size()) - 2, 10).size()), 2, "Spans clamp to document end");
+
+    // Свёрнутый блок переезжает вместе со своей свёрткой
+    int fold = tree.foldLines(10, 20);
+    int hiddenBefore = tree.getTotalLineCount() - tree.getVisibleLineCount();
+    tree.moveLines(10, 21, 100);
+    ASSERT_EQUAL(tree.getTotalLineCount() - tree.getVisibleLineCount(), hiddenBefore, "Fold must survive block move");
+    ASSERT_EQUAL(tree.getFoldForLine(89), fold, "Fold header follows moved block");
+    tree.unfold(fold);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), tree.getTotalLineCount(), "Unfold after move shows all lines");
+
+    ASSERT_THROW(tree.deleteLines(5, 2), std::out_of_range, "Reversed line range must throw");
+    return true;
+}
+
+// Применить расхождения к тексту a и проверить, что получился b
+bool applyHunks(const std::string& a, const std::string& b, const std::vector<DiffHunk>& hunks) {
+    std::string rebuilt;
+    int pos = 0;
+    for (const DiffHunk& h : hunks) {
+        if (h.offsetA < pos) return false;
+        rebuilt.append(a, static_cast<size_t>(pos), static_cast<size_t>(h.offsetA - pos));
+        if (static_cast<int>(rebuilt.size()) != h.offsetB) return false;
+        rebuilt.append(b, static_cast<size_t>(h.offsetB), static_cast<size_t>(h.lengthB));
+        pos = h.offsetA + h.lengthA;
+    }
+    rebuilt.append(a, static_cast<size_t>(pos), std::string::npos);
+    return rebuilt == b;
+}
+
+bool testContentHashAndDiff() {
+    std::vector<std::string> model;
+    for (int i = 0; i < 20000; ++i) model.push_back("key_" + std::to_string(i) + " = value " + std::to_string(i * 7));
+    std::string text = joinLines(model);
+
+    // Одинаковый текст в деревьях разной формы — одинаковый хэш
+    Tree bulk;
+    bulk.fromText(text.c_str(), text.size());
+    Tree typed;
+    for (size_t pos = 0; pos < text.size(); pos += 1000) {
+        typed.insert(static_cast<int>(pos), text.c_str() + pos, static_cast<int>(std::min<size_t>(1000, text.size() - pos)));
+    }
+    ASSERT(bulk.getContentHash() == typed.getContentHash(), "Hash must not depend on tree shape");
+    ASSERT(Tree().getContentHash() == ContentHash(), "Empty tree has the empty hash");
+
+    // Первый полный хэш по частям: каждый вызов хэширует не больше бюджета
+    Tree sliced;
+    sliced.fromText(text.c_str(), text.size());
+    ASSERT(!sliced.isContentHashReady(), "A fresh tree has no hash yet");
+    unsigned long textVersion = sliced.getTextVersion();
+    int slices = 1;
+    while (!sliced.prepareContentHash(64 * 1024)) ++slices;
+    ASSERT(slices >= static_cast<int>(text.size() / (64 * 1024)), "Each slice stays within the budget");
+    ASSERT(sliced.isContentHashReady(), "The hash is ready after the last slice");
+    ASSERT(sliced.getContentHash() == ContentHash::ofBytes(text.c_str(), static_cast<int>(text.size())),
+           "Sliced hash equals the hash of the text");
+    sliced.insert(500, "y", 1);
+    ASSERT(!sliced.isContentHashReady(), "An edit resets the root hash");
+    ASSERT(sliced.prepareContentHash(3 * MAX_LEAF_SIZE), "Only the edited path is rehashed after an edit");
+
+    // Версия текста: правки меняют, свёртки и уплотнение — нет
+    ASSERT(sliced.getTextVersion() != textVersion, "An edit changes the text version");
+    textVersion = sliced.getTextVersion();
+    int foldId = sliced.foldLines(10, 20);
+    sliced.unfold(foldId);
+    sliced.compact();
+    ASSERT_EQUAL(sliced.getTextVersion(), textVersion, "Folds and compaction keep the text version");
+    sliced.moveLines(0, 1, 5);
+    ASSERT(sliced.getTextVersion() != textVersion, "Moving lines changes the text version");
+
+    // Правка и её откат возвращают хэш; промежуточное состояние отличается
+    ContentHash saved = bulk.getContentHash();
+    bulk.insert(12345, "x", 1);
+    ASSERT(bulk.getContentHash() != saved, "Edit must change the hash");
+    bulk.erase(12345, 1);
+    ASSERT(bulk.getContentHash() == saved, "Undoing the edit restores the hash");
+    ASSERT(bulk.getRangeHash(100, 5000) == ContentHash::ofBytes(text.c_str() + 100, 5000), "Range hash mismatch");
+
+    ASSERT(Tree::diff(bulk, typed).empty(), "Equal documents have no hunks");
+
+    // Разнесённые правки разной длины: каждая — отдельное расхождение
+    std::vector<std::string> edited = model;
+    edited[150] = "key_150 = changed";
+    edited.insert(edited.begin() + 4000, {"added line one", "added line two"});
+    edited.erase(edited.begin() + 9000, edited.begin() + 9003);
+    edited[15000] += " and a much longer tail to shift everything after it";
+    edited.push_back("appended at the end");
+    std::string editedText = joinLines(edited);
+    Tree other;
+    other.fromText(editedText.c_str(), editedText.size());
+
+    std::vector<DiffHunk> hunks = Tree::diff(bulk, other);
+    ASSERT_EQUAL(static_cast<int>(hunks.size()), 5, "One hunk per separated edit");
+    ASSERT(applyHunks(text, editedText, hunks), "Hunks must turn the first text into the second");
+    for (const DiffHunk& h : hunks) {
+        ASSERT(h.offsetA == 0 || text[h.offsetA - 1] == '\n', "Hunk must start at a line start");
+    }
+    ASSERT_EQUAL(bulk.getLineForOffset(hunks[0].offsetA), 150, "First hunk is on the changed line");
+    ASSERT(applyHunks(editedText, text, Tree::diff(other, bulk)), "Reverse diff must restore the text");
+
+    // Случайные правки: расхождения всегда корректны
+    unsigned seed = 7;
+    auto rnd = [&seed](unsigned mod) {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % mod);
+    };
+    for (int round = 0; round < 20; ++round) {
+        std::string changed = text;
+        for (int e = 0; e < 1 + rnd(6); ++e) {
+            auto at = static_cast<size_t>(rnd(static_cast<unsigned>(changed.size())));
+            auto len = static_cast<size_t>(rnd(300));
+            if (rnd(2)) changed.erase(at, len);
+            else changed.insert(at, std::string(len, static_cast<char>('a' + rnd(26))));
+        }
+        Tree t;
+        t.fromText(changed.c_str(), changed.size());
+        ASSERT(applyHunks(text, changed, Tree::diff(bulk, t)), "Random hunks must reproduce the text");
+    }
+    Tree empty;
+    ASSERT(applyHunks(text, "", Tree::diff(bulk, empty)), "Diff against empty document");
+    ASSERT(applyHunks("", text, Tree::diff(empty, bulk)), "Diff from empty document");
+    return true;
+}
+
+// Листья дерева слева направо
+void collectLeaves(Node* node, std::vector<const LeafNode*>& out) {
+    std::vector<Node*> stack;
+    if (node) stack.push_back(node);
+    while (!stack.empty()) {
+        Node* n = stack.back();
+        stack.pop_back();
+        if (n->getType() == NodeType::NODE_LEAF) {
+            out.push_back(static_cast<const LeafNode*>(n));
+            continue;
+        }
+        auto inner = static_cast<InternalNode*>(n);
+        if (inner->right) stack.push_back(inner->right);
+        if (inner->left) stack.push_back(inner->left);
+    }
+}
+
+bool testLeafSplitPolicy() {
+    // Строки разной длины с кириллицей (2 байта на символ)
+    std::vector<std::string> model;
+    for (int i = 0; i < 5000; ++i) {
+        model.push_back("строка " + std::to_string(i) + std::string(static_cast<size_t>(i % 200), 'z'));
+    }
+    std::string text = joinLines(model);
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    ASSERT(leaves.size() > 10, "Document must span many leaves");
+    for (size_t i = 0; i + 1 < leaves.size(); ++i) {
+        ASSERT(leaves[i]->data[leaves[i]->length - 1] == '\n', "Leaf must end on a line break");
+        ASSERT(leaves[i]->length <= MAX_LEAF_SIZE, "Leaf must respect the size limit");
+    }
+
+    // Переполнение листа при вставке режется так же
+    std::string block;
+    for (int i = 0; i < 200; ++i) block += "вставка " + std::to_string(i) + "\n";
+    int at = tree.getOffsetForLine(2500);
+    tree.insert(at, block.c_str(), block.size());
+    text.insert(static_cast<size_t>(at), block);
+    leaves.clear();
+    collectLeaves(tree.getRoot(), leaves);
+    int crossing = 0;
+    for (size_t i = 0; i + 1 < leaves.size(); ++i) {
+        if (leaves[i]->data[leaves[i]->length - 1] != '\n') ++crossing;
+        ASSERT(leaves[i]->length <= MAX_LEAF_SIZE, "Big insert must be split into bounded leaves");
+    }
+    ASSERT(crossing <= 1, "At most the leaf at the insertion point may end mid-line");
+    char* actual = tree.toText();
+    bool same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Text mismatch after policy split");
+
+    // Без '\n' (minified) разрез не попадает внутрь символа UTF-8
+    std::string minified;
+    while (minified.size() < 100000) minified += "ёжик";
+    Tree flat;
+    flat.fromText(minified.c_str(), minified.size());
+    flat.insert(5001, minified.c_str(), 9000);
+    leaves.clear();
+    collectLeaves(flat.getRoot(), leaves);
+    for (const LeafNode* leaf : leaves) {
+        auto first = static_cast<unsigned char>(leaf->data[0]);
+        ASSERT((first & 0xC0) != 0x80 || leaf == leaves.front(), "Leaf must not start inside a UTF-8 sequence");
+    }
+
+    // Старое поведение: узкое окно поиска '\n'
+    LeafSplitPolicy legacy;
+    legacy.lineSlack = 0;
+    legacy.keepUtf8 = false;
+    Tree halves;
+    halves.setLeafSplitPolicy(legacy);
+    halves.fromText(text.c_str(), text.size());
+    ASSERT_EQUAL(halves.getLeafSplitPolicy().lineSlack, 0, "Policy getter mismatch");
+    ASSERT(halves.getContentHash() == tree.getContentHash(), "Policy must not change the text");
+    return true;
+}
+
+bool testCompactionPreservesDocument() {
+    std::vector<std::string> model;
+    for (int i = 0; i < 8000; ++i) model.push_back("item " + std::to_string(i) + " слово");
+    std::string text = joinLines(model);
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+
+    // Правки в нескольких местах оставляют мелкие горячие листья
+    for (int i = 0; i < 300; ++i) {
+        int pos = (i * 7919) % static_cast<int>(text.size());
+        tree.insert(pos, "+", 1);
+        text.insert(static_cast<size_t>(pos), "+");
+    }
+    int marker = tree.createMarker(50000, MarkerGravity::LEFT);
+    int fold = tree.foldLines(100, 400);
+    int visible = tree.getVisibleLineCount();
+    TextStats stats = tree.getStats();
+    ContentHash hash = tree.getContentHash();
+
+    int removed = tree.compact();
+    ASSERT(removed > 0, "Compaction must remove leaves");
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    for (const LeafNode* leaf : leaves) {
+        ASSERT(leaf->length <= tree.getLeafSplitPolicy().coldLeafSize, "Merged leaf exceeds the cold size");
+    }
+
+    char* actual = tree.toText();
+    bool same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Compaction must not change the text");
+    ASSERT(tree.getContentHash() == hash, "Compaction must not change the hash");
+    ASSERT_EQUAL(tree.getStats().words, stats.words, "Compaction must keep word stats");
+    ASSERT_EQUAL(tree.getMarkerOffset(marker), 50000, "Compaction must keep markers");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), visible, "Compaction must keep folds");
+    ASSERT_EQUAL(tree.getFoldForLine(100), fold, "Fold header survives compaction");
+    ASSERT(tree.isLineHidden(250), "Folded line stays hidden");
+
+    // Дальнейшие правки работают поверх крупных листьев
+    int at = tree.getOffsetForLine(5000);
+    tree.insert(at, "новая строка\n", static_cast<int>(std::strlen("новая строка\n")));
+    text.insert(static_cast<size_t>(at), "новая строка\n");
+    tree.erase(at + 3, 40);
+    text.erase(static_cast<size_t>(at + 3), 40);
+    actual = tree.toText();
+    same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Text mismatch after editing a compacted tree");
+    tree.unfold(fold);
+    ASSERT_EQUAL(tree.getVisibleLineCount(), tree.getTotalLineCount(), "Unfold after compaction");
+    return true;
+}
+
 // Основная функция запуска тестов
+static int treeDepth(const Node* node) {
+    if (!node || node->getType() == NodeType::NODE_LEAF) return node ? 1 : 0;
+    auto inner = static_cast<const InternalNode*>(node);
+    return 1 + std::max(treeDepth(inner->left), treeDepth(inner->right));
+}
+
+static bool waitRebuild(Tree& tree) {
+    for (int i = 0; i < 2000; ++i) {
+        if (tree.finishRebuild()) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+bool testBackgroundRebuild() {
+    std::vector<std::string> model;
+    for (int i = 0; i < 6000; ++i) model.push_back("row " + std::to_string(i) + " текст");
+    std::string text = joinLines(model);
+
+    // Вырожденное дерево: много мелких листьев подряд справа
+    Tree tree;
+    for (size_t pos = 0; pos < text.size(); pos += 97) {
+        std::string piece = text.substr(pos, 97);
+        tree.insert(tree.getRoot() ? tree.getRoot()->getLength() : 0, piece.c_str(), static_cast<int>(piece.size()));
+    }
+    int fold = tree.foldLines(200, 300);
+    int marker = tree.createMarker(40000, MarkerGravity::RIGHT);
+    int depthBefore = treeDepth(tree.getRoot());
+
+    ASSERT(tree.startRebuild(), "Rebuild must start on an edited tree");
+    ASSERT(!tree.startRebuild(), "Only one rebuild at a time");
+    ASSERT_EQUAL(tree.compact(), 0, "compact() waits for the background rebuild");
+
+    // Правки, пока рабочий поток собирает дерево
+    int markerPos = 40000;
+    for (int i = 0; i < 50; ++i) {
+        int pos = (i * 104729) % static_cast<int>(text.size());
+        tree.insert(pos, "ab\n", 3);
+        text.insert(static_cast<size_t>(pos), "ab\n");
+        if (pos < markerPos) markerPos += 3;
+        int at = (i * 7717) % static_cast<int>(text.size() - 20);
+        tree.erase(at, 5);
+        text.erase(static_cast<size_t>(at), 5);
+        if (at + 5 <= markerPos) markerPos -= 5;
+        else if (at < markerPos) markerPos = at;
+    }
+    // Перестановка блока строк (журналируется как обмен диапазонов)
+    tree.moveLines(3000, 3100, 50);
+    std::vector<std::string> lines;
+    for (size_t from = 0;;) {
+        size_t nl = text.find('\n', from);
+        lines.push_back(text.substr(from, nl == std::string::npos ? std::string::npos : nl - from));
+        if (nl == std::string::npos) break;
+        from = nl + 1;
+    }
+    int blockStart = 0;
+    for (int i = 0; i < 3000; ++i) blockStart += static_cast<int>(lines[i].size()) + 1;
+    int blockLen = 0;
+    for (int i = 3000; i < 3100; ++i) blockLen += static_cast<int>(lines[i].size()) + 1;
+    int target = 0;
+    for (int i = 0; i < 50; ++i) target += static_cast<int>(lines[i].size()) + 1;
+    if (markerPos >= target && markerPos < blockStart) markerPos += blockLen;
+    std::rotate(lines.begin() + 50, lines.begin() + 3000, lines.begin() + 3100);
+    text = joinLines(lines);
+    int header = 0;
+    while (header < tree.getTotalLineCount() && tree.getFoldForLine(header) != fold) ++header;
+    ASSERT(header < tree.getTotalLineCount(), "Fold survives edits during the rebuild");
+    int visible = tree.getVisibleLineCount();
+    ContentHash hash = tree.getContentHash();
+    unsigned long textVersion = tree.getTextVersion();
+
+    ASSERT(waitRebuild(tree), "Rebuild must finish");
+    ASSERT(!tree.isRebuilding(), "Rebuild state cleared after swap");
+    ASSERT_EQUAL(tree.getTextVersion(), textVersion, "Replaying logged edits keeps the text version");
+    char* actual = tree.toText();
+    bool same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Edits made during the rebuild must survive the swap");
+    ASSERT(tree.getContentHash() == hash, "Hash unchanged by the swap");
+    ASSERT_EQUAL(tree.getMarkerOffset(marker), markerPos, "Markers unchanged by the swap");
+    ASSERT_EQUAL(tree.getVisibleLineCount(), visible, "Folds reapplied after the swap");
+    ASSERT_EQUAL(tree.getFoldForLine(header), fold, "Fold header survives the swap");
+    ASSERT(treeDepth(tree.getRoot()) < depthBefore / 4, "Rebuilt tree must be shallow");
+    ASSERT(!tree.startRebuild(), "Nothing to rebuild right after a swap");
+
+    // Отмена: новый документ, разрушение дерева и переполнение журнала
+    tree.insert(0, "x", 1);
+    ASSERT(tree.startRebuild(), "Rebuild restarts after an edit");
+    tree.fromText("short", 5);
+    ASSERT(!tree.isRebuilding(), "fromText cancels the rebuild");
+    actual = tree.toText();
+    same = (std::string(actual) == "short");
+    delete[] actual;
+    ASSERT(same, "Cancelled rebuild leaves the new document intact");
+    {
+        Tree doomed;
+        doomed.fromText(text.c_str(), static_cast<int>(text.size()));
+        doomed.insert(10, "y", 1);
+        ASSERT(doomed.startRebuild(), "Rebuild of a tree about to be destroyed");
+    }
+    Tree big;
+    big.fromText(text.c_str(), static_cast<int>(text.size()));
+    big.insert(0, "z", 1);
+    ASSERT(big.startRebuild(), "Rebuild before a huge edit");
+    std::string chunk(1 << 20, 'q');
+    for (int i = 0; i < 17 && big.isRebuilding(); ++i) {
+        big.insert(0, chunk.c_str(), static_cast<int>(chunk.size()));
+        big.erase(0, static_cast<int>(chunk.size()));
+    }
+    ASSERT(!big.isRebuilding(), "An overflowing edit log cancels the rebuild");
+    ASSERT_EQUAL(big.getRoot()->getLength(), static_cast<int>(text.size()) + 1, "Text intact after the cancel");
+    NodeReclaimer::instance().drain();
+    return true;
+}
+bool testPackedColdLeaves() {
+    // Кодек: сжатие/распаковка на краевых входах
+    std::string samples[] = {std::string(), "a", "abcabcabcabcabcabc", std::string(70000, 'x'),
+                             createCyrillicText(200)};
+    unsigned seed = 7;
+    std::string noise;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        noise.push_back(static_cast<char>(seed >> 16));
+    }
+    for (const std::string& src : samples) {
+        auto len = static_cast<int>(src.size());
+        std::vector<char> packed(static_cast<size_t>(len) * 2 + 16);
+        int n = LeafCodec::compress(src.data(), len, packed.data(), static_cast<int>(packed.size()));
+        ASSERT(n > 0, "Compression must fit into a generous buffer");
+        std::vector<char> back(static_cast<size_t>(len) + 1);
+        ASSERT(LeafCodec::decompress(packed.data(), n, back.data(), len), "Round trip must decode");
+        ASSERT(std::string(back.data(), static_cast<size_t>(len)) == src, "Round trip must restore the bytes");
+    }
+    std::vector<char> small(noise.size() / 2);
+    ASSERT_EQUAL(LeafCodec::compress(noise.data(), static_cast<int>(noise.size()), small.data(),
+                                     static_cast<int>(small.size())), 0, "Noise does not compress");
+    const char bad[] = {static_cast<char>(0x0F), 'a', 5, 0};
+    char out[32];
+    ASSERT(!LeafCodec::decompress(bad, 4, out, 32), "Match before any output is rejected");
+
+    // Документ-лог: холодные листья после уплотнения хранятся сжатыми
+    std::string text;
+    for (int i = 0; i < 20000; ++i) {
+        text += "2024-05-01 12:00:" + std::to_string(i % 60) + " INFO request id=" + std::to_string(i) +
+                " status=200 path=/api/items\n";
+    }
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    tree.insert(0, "#", 1);
+    text.insert(0, "#");
+    ContentHash hash = tree.getContentHash();
+    tree.compact();
+
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    long long packedBytes = 0;
+    int packedLeaves = 0;
+    for (const LeafNode* leaf : leaves) {
+        if (!leaf->packed) continue;
+        ++packedLeaves;
+        packedBytes += leaf->packedLength;
+        ASSERT(leaf->data == nullptr, "Packed leaf keeps no raw copy");
+    }
+    ASSERT(packedLeaves > 0, "Cold leaves must be packed");
+    ASSERT(packedBytes * 3 < static_cast<long long>(text.size()), "Logs compress at least 3x");
+
+    // Хэши переносятся в сжатые и склеенные листья: первый хэш после уплотнения не распаковывает
+    ASSERT(std::all_of(leaves.begin(), leaves.end(), [](const LeafNode* l) { return l->hashValid; }),
+           "Packed and merged leaves keep their hash");
+    std::size_t cacheBefore = tree.unpackedCacheBytes();
+
+    // Чтение через листья: строки, диапазоны, поиск, хэш
+    ASSERT(tree.getContentHash() == hash, "Packing must not change the hash");
+    ASSERT(tree.unpackedCacheBytes() == cacheBefore, "Hashing packed leaves must not unpack them");
+    for (int line = 0; line < 20000; line += 1999) {
+        char* got = tree.getLine(line);
+        int start = tree.getOffsetForLine(line);
+        size_t nl = text.find('\n', static_cast<size_t>(start));
+        bool same = (text.substr(static_cast<size_t>(start), nl - static_cast<size_t>(start)) == got);
+        delete[] got;
+        ASSERT(same, "getLine reads packed leaves");
+    }
+    ASSERT_EQUAL(tree.findSubstring("id=15000 ", 9), static_cast<int>(text.find("id=15000 ")), "Search reads packed leaves");
+    ASSERT(tree.unpackedCacheBytes() <= static_cast<size_t>(UnpackedLeafCache::CAPACITY) *
+                                            static_cast<size_t>(tree.getLeafSplitPolicy().coldLeafSize),
+           "Unpacked cache is bounded");
+
+    // Правка внутри сжатого листа распаковывает только его
+    int at = tree.getOffsetForLine(12345);
+    tree.insert(at, "inserted\n", 9);
+    text.insert(static_cast<size_t>(at), "inserted\n");
+    tree.erase(at + 20, 30);
+    text.erase(static_cast<size_t>(at + 20), 30);
+    char* actual = tree.toText();
+    bool same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Edits over packed leaves keep the text");
+
+    // Фоновая перестройка тоже сжимает
+    Tree bg;
+    bg.fromText(text.c_str(), static_cast<int>(text.size()));
+    bg.insert(0, "!", 1);
+    text.insert(0, "!");
+    ASSERT(bg.startRebuild(), "Background rebuild starts");
+    ASSERT(waitRebuild(bg), "Background rebuild finishes");
+    leaves.clear();
+    collectLeaves(bg.getRoot(), leaves);
+    ASSERT(std::any_of(leaves.begin(), leaves.end(), [](const LeafNode* l) { return l->packed != nullptr; }),
+           "Background rebuild packs cold leaves");
+    // Хэшей в снимке не было — рабочий поток считает их по байтам
+    ASSERT(std::all_of(leaves.begin(), leaves.end(), [](const LeafNode* l) { return !l->packed || l->hashValid; }),
+           "Background packing hashes packed leaves");
+    {
+        Tree plain;
+        plain.fromText(text.c_str(), static_cast<int>(text.size()));
+        cacheBefore = bg.unpackedCacheBytes();
+        ASSERT(bg.getContentHash() == plain.getContentHash(), "Background packing keeps the hash");
+        ASSERT(bg.unpackedCacheBytes() == cacheBefore, "Hashing after background packing must not unpack");
+    }
+    actual = bg.toText();
+    same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Background packing keeps the text");
+    return true;
+}
+
+bool testMemoryGovernor() {
+    // Сброс по приоритету и только до бюджета
+    std::size_t cache = 400;
+    std::size_t pack = 1000;
+    std::size_t history = 500;
+    std::vector<std::string> order;
+    MemoryGovernor gov(1200);
+    gov.addConsumer("history", MemoryGovernor::SHED_HISTORY, [&]() { return history; },
+                    [&]() { order.push_back("history"); history = 0; });
+    gov.addConsumer("tree", MemoryGovernor::SHED_TREE_PACK, [&]() { return pack; },
+                    [&]() { order.push_back("tree"); pack /= 4; });
+    int viewId = gov.addConsumer("view", MemoryGovernor::SHED_VIEW_CACHES, [&]() { return cache; },
+                                 [&]() { order.push_back("view"); cache = 0; });
+    ASSERT_EQUAL(gov.usage(), static_cast<std::size_t>(1900), "Usage is the sum of consumers");
+    ASSERT_EQUAL(gov.enforce(), 2, "Two consumers are enough to fit the budget");
+    ASSERT(order.size() == 2 && order[0] == "view" && order[1] == "tree", "Cheapest caches go first");
+    ASSERT_EQUAL(gov.enforce(), 0, "Nothing to shed within the budget");
+
+    cache = 300;
+    order.clear();
+    ASSERT_EQUAL(gov.onLowMemory(MemoryGovernor::LOW_MEMORY_MEDIUM), 2, "Medium pressure sheds to half the budget");
+    ASSERT(order[0] == "view" && gov.usage() <= gov.budget() / 2, "Medium pressure starts with the view");
+    ASSERT(history > 0, "History survives medium pressure");
+    gov.removeConsumer(viewId);
+    ASSERT_EQUAL(gov.usageOf("view"), static_cast<std::size_t>(0), "Removed consumer is gone");
+    gov.onLowMemory(MemoryGovernor::LOW_MEMORY_CRITICAL);
+    ASSERT_EQUAL(history, static_cast<std::size_t>(0), "Critical pressure sheds everything");
+
+    // Настоящее дерево: сброс кэша и сжатие холодных листьев без новых правок
+    std::string text;
+    for (int i = 0; i < 20000; ++i) text += "line " + std::to_string(i % 100) + " of a repetitive log\n";
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    TreeMemoryUsage before = tree.getMemoryUsage();
+    ASSERT_EQUAL(before.rawBytes, text.size(), "Fresh tree stores raw text");
+    MemoryGovernor treeGov(before.total() / 2);
+    treeGov.addConsumer("tree-cache", MemoryGovernor::SHED_TREE_CACHES,
+                        [&]() { return tree.getMemoryUsage().unpackedCache; }, [&]() { tree.releaseCaches(); });
+    treeGov.addConsumer("tree", MemoryGovernor::SHED_TREE_PACK,
+                        [&]() { return tree.getMemoryUsage().total(); }, [&]() { tree.releaseMemory(); });
+    treeGov.enforce();
+    TreeMemoryUsage after = tree.getMemoryUsage();
+    ASSERT(after.total() <= treeGov.budget(), "Packing brings the tree under budget");
+    ASSERT(after.packedBytes > 0, "Cold leaves are packed under pressure");
+
+    char* got = tree.getLine(12345);
+    ASSERT(std::string(got) == "line 45 of a repetitive log", "Packed tree still reads");
+    delete[] got;
+    ASSERT(tree.getMemoryUsage().unpackedCache > 0, "Reading fills the unpacked cache");
+    tree.releaseCaches();
+    ASSERT_EQUAL(tree.getMemoryUsage().unpackedCache, static_cast<std::size_t>(0), "Caches released");
+    return true;
+}
+
+// Fork/join по поддеревьям: длина документа суммой по листьям
+static long long parallelLength(TaskPool& pool, const Node* node) {
+    if (!node) return 0;
+    if (node->getType() == NodeType::NODE_LEAF) return node->getLength();
+    auto inner = static_cast<const InternalNode*>(node);
+    long long left = 0;
+    TaskGroup group(pool);
+    group.run([&]() { left = parallelLength(pool, inner->left); });
+    long long right = parallelLength(pool, inner->right);
+    group.wait();
+    return left + right;
+}
+
+bool testTaskPool() {
+    TaskPool pool(4);
+    ASSERT_EQUAL(pool.size(), 4u, "Pool has the requested size");
+
+    std::string text = createCyrillicText(3000);
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    ASSERT_EQUAL(parallelLength(pool, tree.getRoot()), static_cast<long long>(text.size()),
+                 "Fork/join over subtrees sums the document");
+
+    // Много мелких задач, поставленных извне пула, выполняются все
+    std::atomic<int> counter{0};
+    TaskProgress progress;
+    progress.total = 1000;
+    {
+        TaskGroup group(pool);
+        for (int i = 0; i < 1000; ++i) {
+            group.run([&]() {
+                counter.fetch_add(1);
+                progress.add(1);
+            });
+        }
+        group.wait();
+        ASSERT(group.done(), "Group is done after wait");
+    }
+    ASSERT_EQUAL(counter.load(), 1000, "Every task runs exactly once");
+    ASSERT(progress.fraction() == 1.0, "Progress reaches 1");
+
+    // Исключение задачи перебрасывается из wait()
+    TaskGroup failing(pool);
+    failing.run([]() { throw std::out_of_range("task failed"); });
+    ASSERT_THROW(failing.wait(), std::out_of_range, "wait() rethrows a task exception");
+
+    // Отменённый токен пропускает ещё не начатые задачи
+    CancelToken token;
+    token.cancel();
+    std::atomic<int> ran{0};
+    TaskGroup cancelled(pool, token);
+    for (int i = 0; i < 100; ++i) cancelled.run([&]() { ran.fetch_add(1); });
+    cancelled.wait();
+    ASSERT_EQUAL(ran.load(), 0, "Cancelled tasks are skipped");
+
+    // Поток извне пула в wait() выполняет только свои задачи: рабочие заняты,
+    // чужая задача стоит в очереди, а своя группа всё равно завершается
+    {
+        std::atomic<bool> release{false};
+        std::atomic<unsigned> busy{0};
+        TaskGroup gate(pool);
+        for (unsigned i = 0; i < pool.size(); ++i) {
+            gate.run([&]() {
+                busy.fetch_add(1);
+                while (!release.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            });
+        }
+        while (busy.load() < pool.size()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        std::atomic<bool> foreignRan{false};
+        TaskGroup foreign(pool);
+        foreign.run([&]() { foreignRan.store(true); });
+        std::atomic<int> own{0};
+        bool onCaller = true;
+        std::thread::id caller = std::this_thread::get_id();
+        TaskGroup group(pool);
+        for (int i = 0; i < 10; ++i) {
+            group.run([&, caller]() {
+                if (std::this_thread::get_id() != caller) onCaller = false;
+                own.fetch_add(1);
+            });
+        }
+        group.wait();
+        bool foreignEarly = foreignRan.load();
+        release.store(true); // до проверок: иначе провал повесил бы деструктор gate
+        gate.wait();
+        foreign.wait();
+        ASSERT_EQUAL(own.load(), 10, "Own tasks finish while workers are busy");
+        ASSERT(onCaller, "Own tasks ran on the waiting thread");
+        ASSERT(!foreignEarly, "A waiter outside the pool leaves other groups' tasks alone");
+        ASSERT(foreignRan.load(), "The foreign task runs on the pool later");
+    }
+
+    // Перестройка стоит в фоновой очереди общего пула, пока все рабочие заняты:
+    // wait() из GTK-потока выполняет свою группу, но сборку не берёт
+    {
+        TaskPool& shared = TaskPool::instance();
+        std::atomic<bool> release{false};
+        std::atomic<unsigned> busy{0};
+        TaskGroup gate(shared);
+        for (unsigned i = 0; i < shared.size(); ++i) {
+            gate.run([&]() {
+                busy.fetch_add(1);
+                while (!release.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            });
+        }
+        while (busy.load() < shared.size()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        tree.insert(0, "x", 1);
+        bool started = tree.startRebuild();
+        std::atomic<int> own{0};
+        TaskGroup group(shared);
+        for (int i = 0; i < 10; ++i) group.run([&]() { own.fetch_add(1); });
+        group.wait();
+        bool untouched = tree.rebuildProgress() == 0.0 && !tree.finishRebuild();
+        release.store(true); // до проверок: иначе провал повесил бы деструктор gate
+        gate.wait();
+        ASSERT(started, "Rebuild starts on the shared pool");
+        ASSERT_EQUAL(own.load(), 10, "The waiter's own group finishes");
+        ASSERT(untouched, "wait() outside the pool never runs a queued rebuild");
+    }
+    ASSERT(tree.rebuildProgress() >= 0.0 && tree.rebuildProgress() <= 1.0, "Progress is a fraction");
+    ASSERT(waitRebuild(tree), "Rebuild finishes on the shared pool");
+    ASSERT(tree.rebuildProgress() == 1.0, "No rebuild — full progress");
+    return true;
+}
+
+bool testParallelFromText() {
+    // Несколько мегабайт: половины строятся в пуле, форма как у последовательной сборки
+    std::string text;
+    for (int i = 0; i < 200000; ++i) {
+        text += "строка " + std::to_string(i) + (i % 7 == 0 ? " длинная-длинная строка журнала" : "") + "\n";
+    }
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    ASSERT_EQUAL(tree.getRoot()->getLength(), static_cast<int>(text.size()), "Parallel build keeps the length");
+    ASSERT_EQUAL(tree.getTotalLineCount(), 200001, "Parallel build counts lines");
+    char* actual = tree.toText();
+    bool same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Parallel build keeps the text");
+    ASSERT(treeDepth(tree.getRoot()) <= 24, "Parallel build is balanced");
+
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    size_t aligned = 0;
+    for (const LeafNode* leaf : leaves) {
+        ASSERT(leaf->length <= MAX_LEAF_SIZE, "Leaf within size limit");
+        if (leaf->data[leaf->length - 1] == '\n') ++aligned;
+    }
+    ASSERT(aligned + 1 >= leaves.size(), "Parallel split points are line-aligned");
+
+    // Вставка большого текста в пустое дерево идёт тем же путём
+    Tree pasted;
+    pasted.insert(0, text.c_str(), static_cast<int>(text.size()));
+    ASSERT(pasted.getContentHash() == tree.getContentHash(), "Paste into an empty tree builds the same text");
+    char* line = pasted.getLine(150000);
+    bool found = line && std::string(line) == "строка 150000";
+    delete[] line;
+    ASSERT(found, "Lines are addressable after a paste");
+    return true;
+}
+
+bool testFindAll() {
+    // Эталон: неперекрывающиеся вхождения в [from, to) и номер строки по началам строк
+    std::string text;
+    for (int i = 0; i < 20000; ++i) {
+        text += (i % 5 == 0 ? "abab needle ab\n" : "line " + std::to_string(i) + "\n");
+    }
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    int len = static_cast<int>(text.size());
+    std::vector<int> lineStarts{0};
+    for (int i = 0; i < len; ++i) {
+        if (text[static_cast<size_t>(i)] == '\n') lineStarts.push_back(i + 1);
+    }
+    auto lineOf = [&lineStarts](int offset) {
+        return static_cast<int>(std::upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin()) - 1;
+    };
+
+    auto reference = [&text](const std::string& pat, int from, int to) {
+        std::vector<int> hits;
+        size_t pos = text.find(pat, static_cast<size_t>(from));
+        while (pos != std::string::npos && static_cast<int>(pos + pat.size()) <= to) {
+            hits.push_back(static_cast<int>(pos));
+            pos = text.find(pat, pos + pat.size());
+        }
+        return hits;
+    };
+
+    const char* patterns[] = {"needle", "ab", "ab\nline", "\nabab", "aba"};
+    const int ranges[][2] = {{0, len}, {1000, 50000}, {len / 2, len}, {7, 8}, {-5, 100}};
+    for (const char* p : patterns) {
+        auto plen = static_cast<int>(std::strlen(p));
+        for (const auto& r : ranges) {
+            std::vector<int> expected = reference(p, r[0] < 0 ? 0 : r[0], r[1]);
+            std::vector<int> offsets;
+            bool linesOk = true;
+            int reported = tree.findAll(p, plen, r[0], r[1], [&](const SearchMatch& m) {
+                offsets.push_back(m.offset);
+                if (m.line != lineOf(m.offset)) linesOk = false;
+                return true;
+            });
+            ASSERT(offsets == expected, "findAll reports every match in the range in order");
+            ASSERT_EQUAL(reported, static_cast<int>(expected.size()), "findAll returns the match count");
+            ASSERT(linesOk, "findAll reports the line of each match");
+            ASSERT_EQUAL(tree.countAll(p, plen, r[0], r[1]), static_cast<int>(expected.size()), "countAll matches findAll");
+        }
+    }
+
+    // Остановка из callback и поиск следующего
+    int seen = 0;
+    int stopped = tree.findAll("needle", 6, 0, len, [&seen](const SearchMatch&) { return ++seen < 3; });
+    ASSERT_EQUAL(stopped, 3, "Returning false stops the scan");
+    int first = tree.findNext("needle", 6, 0);
+    ASSERT_EQUAL(first, static_cast<int>(text.find("needle")), "findNext finds the first match");
+    ASSERT_EQUAL(tree.findNext("needle", 6, first + 1), static_cast<int>(text.find("needle", first + 1)), "findNext skips to the next match");
+    ASSERT_EQUAL(tree.findNext("missing", 7, 0), -1, "findNext returns -1 without a match");
+    ASSERT_EQUAL(tree.findSubstringLine("line 9999\n", 10), 9999, "findSubstringLine reports the line");
+    return true;
+}
+
+bool testParallelSearch() {
+    // > 2 * PARALLEL_SEARCH_GRAIN: поиск режется на куски для пула. Строки из нечётного
+    // числа 'a' с шаблоном "aa" дают разную жадную цепочку в зависимости от
+    // стартовой чётности — слияние на стыках кусков обязано её восстановить.
+    std::string text;
+    while (text.size() < (10u << 20)) {
+        text += (text.size() % 977 < 40 ? "aaaaaaa needle\n" : "aaaaa log record, nothing else here\n");
+    }
+    text += "tail-marker\n";
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    int len = static_cast<int>(text.size());
+
+    std::vector<int> lineStarts{0};
+    for (int i = 0; i < len; ++i) {
+        if (text[i] == '\n') lineStarts.push_back(i + 1);
+    }
+    auto lineOf = [&lineStarts](int offset) {
+        return static_cast<int>(std::upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin()) - 1;
+    };
+
+    const char* patterns[] = {"aa", "needle\naaa", "a log"};
+    const int ranges[][2] = {{0, len}, {1, len}, {3, len - 5}, {len / 3 + 1, len}};
+    for (const char* p : patterns) {
+        auto plen = static_cast<int>(std::strlen(p));
+        for (const auto& r : ranges) {
+            std::vector<int> expected;
+            size_t pos = text.find(p, static_cast<size_t>(r[0]));
+            while (pos != std::string::npos && static_cast<int>(pos) + plen <= r[1]) {
+                expected.push_back(static_cast<int>(pos));
+                pos = text.find(p, pos + static_cast<size_t>(plen));
+            }
+            std::vector<int> offsets;
+            bool linesOk = true;
+            size_t line = 0; // совпадения идут по возрастанию — курсор по началам строк
+            int reported = tree.findAll(p, plen, r[0], r[1], [&](const SearchMatch& m) {
+                offsets.push_back(m.offset);
+                while (line + 1 < lineStarts.size() && lineStarts[line + 1] <= m.offset) ++line;
+                if (m.line != static_cast<int>(line)) linesOk = false;
+                return true;
+            });
+            ASSERT(offsets == expected, "Parallel findAll matches the sequential reference");
+            ASSERT_EQUAL(reported, static_cast<int>(expected.size()), "Parallel findAll counts every match");
+            ASSERT(linesOk, "Parallel findAll reports lines across chunks");
+        }
+    }
+
+    // Первое совпадение: ранняя отмена кусков правее не должна его терять
+    ASSERT_EQUAL(tree.findNext("tail-marker", 11, 0), len - 12, "findNext finds a match in the last chunk");
+    ASSERT_EQUAL(tree.findNext("needle", 6, 5), static_cast<int>(text.find("needle", 5)), "findNext finds the earliest match");
+    ASSERT_EQUAL(tree.findSubstringLine("tail-marker", 11), lineOf(len - 12), "findSubstringLine in a large document");
+    ASSERT_EQUAL(tree.findNext("absent", 6, 0), -1, "Parallel findNext without a match");
+
+    // Сжатые листья распаковываются задачами пула, мимо общего кэша
+    int needles = 0;
+    for (size_t at = text.find("needle"); at != std::string::npos; at = text.find("needle", at + 6)) ++needles;
+    tree.releaseMemory();
+    ASSERT(tree.getMemoryUsage().packedBytes > 0, "Cold leaves are packed");
+    ASSERT_EQUAL(tree.countAll("needle", 6), needles, "countAll over packed leaves");
+    return true;
+}
+
+bool testSearchKernel() {
+    // Ядро против std::string::find: случайный текст из малого алфавита, шаблоны 1..40 байт
+    unsigned seed = 12345;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    std::string hay;
+    for (int i = 0; i < 5000; ++i) hay += "ab\ncd"[rnd() % 5];
+    for (int trial = 0; trial < 400; ++trial) {
+        int plen = 1 + static_cast<int>(rnd() % 40);
+        int at = static_cast<int>(rnd() % (hay.size() - static_cast<size_t>(plen)));
+        std::string needle = hay.substr(static_cast<size_t>(at), static_cast<size_t>(plen));
+        int start = static_cast<int>(rnd() % hay.size());
+        size_t expected = hay.find(needle, static_cast<size_t>(start));
+        int found = SearchKernel::find(hay.data(), static_cast<int>(hay.size()), start, needle.data(), plen);
+        ASSERT_EQUAL(found, expected == std::string::npos ? -1 : static_cast<int>(expected), "SearchKernel::find matches std::string::find");
+    }
+    ASSERT_EQUAL(SearchKernel::countNewlines(hay.data(), static_cast<int>(hay.size())),
+                 static_cast<int>(std::count(hay.begin(), hay.end(), '\n')), "SearchKernel::countNewlines");
+
+    // Дерево из множества мелких листьев: совпадения тянутся через несколько стыков
+    Tree tree;
+    LeafSplitPolicy policy;
+    policy.hotLeafSize = 4;
+    tree.setLeafSplitPolicy(policy);
+    std::string text;
+    for (int i = 0; i < 3000; ++i) {
+        std::string piece = hay.substr(static_cast<size_t>(i), 1 + static_cast<size_t>(rnd() % 7));
+        auto at = text.empty() ? 0 : static_cast<size_t>(rnd()) % text.size();
+        tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+        text.insert(at, piece);
+    }
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    ASSERT(leaves.size() > 500, "Edits leave many small leaves");
+    std::vector<int> lineStarts{0};
+    for (int i = 0; i < static_cast<int>(text.size()); ++i) {
+        if (text[static_cast<size_t>(i)] == '\n') lineStarts.push_back(i + 1);
+    }
+    for (int trial = 0; trial < 60; ++trial) {
+        int plen = 1 + static_cast<int>(rnd() % 32);
+        int at = static_cast<int>(rnd() % (text.size() - static_cast<size_t>(plen)));
+        std::string needle = text.substr(static_cast<size_t>(at), static_cast<size_t>(plen));
+        std::vector<int> expected;
+        for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + needle.size())) {
+            expected.push_back(static_cast<int>(pos));
+        }
+        std::vector<int> offsets;
+        bool linesOk = true;
+        tree.findAll(needle.c_str(), plen, 0, INT_MAX, [&](const SearchMatch& m) {
+            offsets.push_back(m.offset);
+            int line = static_cast<int>(std::upper_bound(lineStarts.begin(), lineStarts.end(), m.offset) - lineStarts.begin()) - 1;
+            if (m.line != line) linesOk = false;
+            return true;
+        });
+        ASSERT(offsets == expected, "Matches across many small leaves");
+        ASSERT(linesOk, "Lines of matches across many small leaves");
+    }
+    return true;
+}
+
+bool testRegexSearch() {
+    // Дерево из мелких листьев: строки режутся границами листов
+    const char* tokens[] = {"ERROR ", "INFO ", "GET ", "POST ", "/api/users ", "id=", "42", "7",
+                            "timeout", " ok", "ABC-12 ", "tak", "teek ", "bob@mail.com ", "ms", "\n", "\n"};
+    unsigned seed = 777;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    Tree tree;
+    LeafSplitPolicy policy;
+    policy.hotLeafSize = 4;
+    tree.setLeafSplitPolicy(policy);
+    std::string text;
+    for (int i = 0; i < 4000; ++i) {
+        std::string piece = tokens[rnd() % (sizeof(tokens) / sizeof(tokens[0]))];
+        // Токен дописывается в конец случайной строки
+        size_t at = text.empty() ? 0 : text.find('\n', static_cast<size_t>(rnd()) % text.size());
+        if (at == std::string::npos) at = text.size();
+        tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+        text.insert(at, piece);
+    }
+
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    ASSERT(leaves.size() > 200, "Lines are split across many leaves");
+
+    // Эталон — std::regex построчно; шаблоны без неоднозначности «первое/самое длинное»
+    const char* patterns[] = {"id=[0-9]+", "(GET|POST) /api/[a-z]+", "^[A-Z]+ .*(timeout|ok)$", "[A-Z]{3,5}-\\d+",
+                              "t[aeiou]+k", "\\w+@\\w+\\.com", "ms$", "^[^ ]+ ok"};
+    for (const char* pattern : patterns) {
+        std::regex ref(pattern);
+        std::vector<std::pair<int, int>> expected;
+        std::vector<int> expectedLines;
+        int lineNo = 0;
+        for (size_t lineStart = 0; lineStart <= text.size();) {
+            size_t nl = text.find('\n', lineStart);
+            size_t lineEnd = nl == std::string::npos ? text.size() : nl;
+            std::string line = text.substr(lineStart, lineEnd - lineStart);
+            for (auto it = std::sregex_iterator(line.begin(), line.end(), ref); it != std::sregex_iterator(); ++it) {
+                expected.emplace_back(static_cast<int>(lineStart) + static_cast<int>(it->position()), static_cast<int>(it->length()));
+                expectedLines.push_back(lineNo);
+            }
+            if (nl == std::string::npos) break;
+            lineStart = nl + 1;
+            ++lineNo;
+        }
+
+        Regex re(pattern);
+        std::vector<std::pair<int, int>> actual;
+        std::vector<int> lines;
+        int reported = tree.findAllRegex(re, 0, INT_MAX, [&](const SearchMatch& m) {
+            actual.emplace_back(m.offset, m.length);
+            lines.push_back(m.line);
+            return true;
+        });
+        ASSERT(!expected.empty(), "Regex test data has matches");
+        ASSERT(actual == expected, "findAllRegex matches std::regex line by line");
+        ASSERT(lines == expectedLines, "findAllRegex reports match lines");
+        ASSERT_EQUAL(reported, static_cast<int>(expected.size()), "findAllRegex returns the match count");
+    }
+
+    // Самое левое, затем самое длинное; якоря — края строк, не границы диапазона
+    Tree small;
+    const std::string doc = "ab abc\nпривет, мир!\nкод 2026 ok\nxx";
+    small.fromText(doc.c_str(), static_cast<int>(doc.size()));
+    auto collect = [&small](const char* pattern, int from, int to) {
+        Regex re(pattern);
+        std::vector<std::string> out;
+        small.findAllRegex(re, from, to, [&](const SearchMatch& m) {
+            char* t = small.getTextRange(m.offset, m.length);
+            out.emplace_back(t, static_cast<size_t>(m.length));
+            delete[] t;
+            return true;
+        });
+        return out;
+    };
+    ASSERT(collect("a|ab|abc", 0, INT_MAX) == std::vector<std::string>({"ab", "abc"}), "Longest alternative wins");
+    ASSERT(collect("[а-я]+", 0, INT_MAX) == std::vector<std::string>({"привет", "мир", "код"}), "Cyrillic class range");
+    ASSERT(collect("^...", 0, INT_MAX) == std::vector<std::string>({"ab ", "при", "код"}), "Short line has no three characters");
+    ASSERT(collect("^..", 0, INT_MAX) == std::vector<std::string>({"ab", "пр", "ко", "xx"}), "Dot takes a whole UTF-8 character");
+    ASSERT(collect("[^ ,!]+!", 0, INT_MAX) == std::vector<std::string>({"мир!"}), "Negated class over UTF-8");
+    ASSERT(collect("\\d{4}", 0, INT_MAX) == std::vector<std::string>({"2026"}), "Counted repetition");
+    ASSERT(collect("^abc", 3, INT_MAX).empty(), "Range start is not a line start");
+    ASSERT(collect("ab$", 0, 5).empty(), "Range end is not a line end");
+    ASSERT(collect("x+$", 0, INT_MAX) == std::vector<std::string>({"xx"}), "Document end is a line end");
+    ASSERT(collect("b a", 1, 4) == std::vector<std::string>({"b a"}), "Match inside a range");
+
+    int stops = 0;
+    Regex any("[a-z]+");
+    ASSERT_EQUAL(small.findAllRegex(any, 0, INT_MAX, [&stops](const SearchMatch&) { return ++stops < 2; }), 2, "Callback stops regex search");
+    ASSERT_THROW(Regex("(ab"), std::invalid_argument, "Unclosed group is rejected");
+    ASSERT_THROW(Regex("*a"), std::invalid_argument, "Dangling repeat is rejected");
+    ASSERT_THROW(Regex("[z-a]"), std::invalid_argument, "Reversed class range is rejected");
+    ASSERT_THROW(Regex("a\\q"), std::invalid_argument, "Unknown escape is rejected");
+    return true;
+}
+
+bool testCaseFoldedSearch() {
+    // Ядро ASCII без учёта регистра против эталона на строках в нижнем регистре
+    unsigned seed = 4242;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    auto lower = [](std::string v) {
+        for (char& c : v) c = SearchKernel::asciiLower(c);
+        return v;
+    };
+    std::string hay;
+    for (int i = 0; i < 5000; ++i) hay += "aAbB@`\n1"[rnd() % 8];
+    std::string hayLower = lower(hay);
+    for (int trial = 0; trial < 400; ++trial) {
+        int plen = 1 + static_cast<int>(rnd() % 24);
+        int at = static_cast<int>(rnd() % (hay.size() - static_cast<size_t>(plen)));
+        std::string needle = lower(hay.substr(static_cast<size_t>(at), static_cast<size_t>(plen)));
+        int start = static_cast<int>(rnd() % hay.size());
+        size_t expected = hayLower.find(needle, static_cast<size_t>(start));
+        int found = SearchKernel::findAsciiFolded(hay.data(), static_cast<int>(hay.size()), start, needle.data(), plen);
+        ASSERT_EQUAL(found, expected == std::string::npos ? -1 : static_cast<int>(expected), "findAsciiFolded matches a lowercase reference");
+    }
+
+    // ASCII-режим по дереву: стыки листьев, параллельные куски и строки как у точного поиска
+    std::string text;
+    while (text.size() < (9u << 20)) {
+        text += (text.size() % 1013 < 60 ? "Error: Request TimeOut\n" : "info: request ok, ERROR=0\n");
+    }
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    std::string textLower = lower(text);
+    Tree lowered;
+    lowered.fromText(textLower.c_str(), static_cast<int>(textLower.size()));
+    for (const char* p : {"error", "REQUEST TIMEOUT", "Ok, eRRor=0\nINFO"}) {
+        auto plen = static_cast<int>(std::strlen(p));
+        std::string key = lower(p);
+        std::vector<SearchMatch> expected;
+        lowered.findAll(key.c_str(), plen, 0, INT_MAX, [&expected](const SearchMatch& m) {
+            expected.push_back(m);
+            return true;
+        });
+        std::vector<SearchMatch> actual;
+        tree.findAll(p, plen, 0, INT_MAX, [&actual](const SearchMatch& m) {
+            actual.push_back(m);
+            return true;
+        }, SearchCase::ASCII);
+        bool same = actual.size() == expected.size() && !expected.empty();
+        for (size_t i = 0; same && i < actual.size(); ++i) {
+            same = actual[i].offset == expected[i].offset && actual[i].line == expected[i].line &&
+                   actual[i].length == plen;
+        }
+        ASSERT(same, "ASCII case-insensitive findAll matches search over lowercased text");
+    }
+    ASSERT_EQUAL(tree.countAll("ERROR", 5), tree.countAll("ERROR", 5, 0, INT_MAX, SearchCase::EXACT), "Exact mode is the default");
+    ASSERT(tree.countAll("ERROR", 5, 0, INT_MAX, SearchCase::ASCII) > tree.countAll("ERROR", 5), "ASCII mode finds more");
+
+    // Unicode: кириллица, ё, греческая сигма и знак Кельвина разной длины в байтах
+    Tree doc;
+    const std::string sample = "ПРИВЕТ мир\nПривет, Мир! ЁЛКА ёлка\nΣΊΣΥΦΟΣ σίσυφος\n5 \xE2\x84\xAA = 5 k";
+    doc.fromText(sample.c_str(), static_cast<int>(sample.size()));
+    auto folded = [&doc](const std::string& q) {
+        std::vector<std::string> out;
+        doc.findAll(q.c_str(), static_cast<int>(q.size()), 0, INT_MAX, [&](const SearchMatch& m) {
+            char* t = doc.getTextRange(m.offset, m.length);
+            out.emplace_back(t, static_cast<size_t>(m.length));
+            delete[] t;
+            return true;
+        }, SearchCase::UNICODE);
+        return out;
+    };
+    ASSERT(folded("привет") == std::vector<std::string>({"ПРИВЕТ", "Привет"}), "Cyrillic case folding");
+    ASSERT(folded("МИР") == std::vector<std::string>({"мир", "Мир"}), "Cyrillic upper pattern");
+    ASSERT(folded("ёлка") == std::vector<std::string>({"ЁЛКА", "ёлка"}), "Yo folds with its capital");
+    ASSERT(folded("σίσυφος") == std::vector<std::string>({"ΣΊΣΥΦΟΣ", "σίσυφος"}), "Greek folding");
+    ASSERT(folded("K") == std::vector<std::string>({"\xE2\x84\xAA", "k"}), "Kelvin sign folds to k");
+    ASSERT_EQUAL(doc.findNext("ЁЛКА", 8, 0, SearchCase::UNICODE), static_cast<int>(sample.find("ЁЛКА")), "findNext with folding");
+    Regex ci("[а-я]+!", true);
+    int hits = doc.findAllRegex(ci, 0, INT_MAX, [](const SearchMatch&) { return true; });
+    ASSERT_EQUAL(hits, 1, "Case-insensitive regex class");
+    ASSERT_EQUAL(CaseFold::fold(0x0401), 0x0451u, "CaseFold maps Yo");
+    ASSERT_EQUAL(CaseFold::fold('Q'), static_cast<std::uint32_t>('q'), "CaseFold maps ASCII");
+    return true;
+}
+
+bool testMultiPatternSearch() {
+    // Классический пример: вложенные и перекрывающиеся шаблоны
+    PatternSet words({"he", "she", "his", "hers"});
+    std::vector<std::pair<int, int>> hits;
+    int state = PatternSet::START;
+    const std::string ushers = "ushers";
+    words.feed(state, ushers.data(), static_cast<int>(ushers.size()), [&](int p, int end) {
+        hits.emplace_back(p, end);
+        return true;
+    });
+    const std::vector<std::pair<int, int>> ushersHits{{1, 4}, {0, 4}, {3, 6}};
+    ASSERT(hits == ushersHits, "she, he and hers in ushers");
+    ASSERT_THROW(PatternSet({"a", ""}), std::invalid_argument, "Empty pattern rejected");
+    ASSERT_THROW(PatternSet(std::vector<std::string>{}), std::invalid_argument, "Empty set rejected");
+
+    // Дерево из мелких листьев против std::string::find по каждому шаблону
+    unsigned seed = 777;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    Tree tree;
+    LeafSplitPolicy policy;
+    policy.hotLeafSize = 4;
+    tree.setLeafSplitPolicy(policy);
+    std::string text;
+    for (int i = 0; i < 3000; ++i) {
+        std::string piece;
+        for (int k = 1 + static_cast<int>(rnd() % 6); k > 0; --k) piece += "abAB\nc"[rnd() % 6];
+        auto at = text.empty() ? 0 : static_cast<size_t>(rnd()) % text.size();
+        tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+        text.insert(at, piece);
+    }
+    std::vector<int> lineStarts{0};
+    for (int i = 0; i < static_cast<int>(text.size()); ++i) {
+        if (text[static_cast<size_t>(i)] == '\n') lineStarts.push_back(i + 1);
+    }
+    auto lower = [](std::string s) {
+        for (auto& c : s) c = SearchKernel::asciiLower(c);
+        return s;
+    };
+    for (bool ignoreCase : {false, true}) {
+        for (int trial = 0; trial < 20; ++trial) {
+            std::vector<std::string> pats;
+            for (int k = 1 + static_cast<int>(rnd() % 6); k > 0; --k) {
+                int plen = 1 + static_cast<int>(rnd() % 12);
+                int at = static_cast<int>(rnd() % (text.size() - static_cast<size_t>(plen)));
+                pats.push_back(text.substr(static_cast<size_t>(at), static_cast<size_t>(plen)));
+            }
+            PatternSet set(pats, ignoreCase);
+            int from = static_cast<int>(rnd() % 2000);
+            int to = from + static_cast<int>(rnd() % 10000);
+            int clampedTo = std::min(to, static_cast<int>(text.size()));
+            std::string hay = ignoreCase ? lower(text) : text;
+            // Ожидаемые (шаблон, смещение) для всех вхождений, в т.ч. перекрывающихся
+            std::vector<std::pair<int, int>> expected;
+            for (size_t p = 0; p < pats.size(); ++p) {
+                std::string needle = ignoreCase ? lower(pats[p]) : pats[p];
+                for (size_t pos = hay.find(needle, static_cast<size_t>(from));
+                     pos != std::string::npos && static_cast<int>(pos + needle.size()) <= clampedTo;
+                     pos = hay.find(needle, pos + 1)) {
+                    expected.emplace_back(static_cast<int>(p), static_cast<int>(pos));
+                }
+            }
+            std::vector<std::pair<int, int>> found;
+            bool linesOk = true;
+            bool orderOk = true;
+            int lastEnd = -1;
+            int n = tree.findAllMulti(set, from, to, [&](int p, const SearchMatch& m) {
+                found.emplace_back(p, m.offset);
+                int line = static_cast<int>(std::upper_bound(lineStarts.begin(), lineStarts.end(), m.offset) - lineStarts.begin()) - 1;
+                if (m.line != line || m.length != set.length(p)) linesOk = false;
+                if (m.offset + m.length < lastEnd) orderOk = false;
+                lastEnd = m.offset + m.length;
+                return true;
+            });
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT(found == expected, "findAllMulti matches per-pattern find");
+            ASSERT_EQUAL(n, static_cast<int>(found.size()), "findAllMulti count");
+            ASSERT(linesOk, "findAllMulti lines and lengths");
+            ASSERT(orderOk, "findAllMulti reports in order of match end");
+        }
+    }
+
+    // Остановка из колбэка
+    PatternSet ab({"a", "b"});
+    int seen = 0;
+    int reported = tree.findAllMulti(ab, 0, INT_MAX, [&seen](int, const SearchMatch&) { return ++seen < 5; });
+    ASSERT_EQUAL(reported, 5, "findAllMulti stops on false");
+    return true;
+}
+
+bool testTrigramIndex() {
+    // Мелкие листья и малый алфавит: много совпадений через стыки, в т.ч. через несколько листьев
+    unsigned seed = 4242;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    Tree tree;
+    LeafSplitPolicy policy;
+    policy.hotLeafSize = 4;
+    tree.setLeafSplitPolicy(policy);
+    std::string text;
+    auto randomPiece = [&rnd]() {
+        std::string piece;
+        for (int k = 1 + static_cast<int>(rnd() % 6); k > 0; --k) piece += "abcab\nd"[rnd() % 7];
+        return piece;
+    };
+    for (int i = 0; i < 2000; ++i) {
+        std::string piece = randomPiece();
+        auto at = text.empty() ? 0 : static_cast<size_t>(rnd()) % text.size();
+        tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+        text.insert(at, piece);
+    }
+    tree.setTrigramIndex(true);
+    ASSERT(tree.hasTrigramIndex(), "Index enabled");
+
+    auto check = [&](const char* what) {
+        std::vector<int> lineStarts{0};
+        for (int i = 0; i < static_cast<int>(text.size()); ++i) {
+            if (text[static_cast<size_t>(i)] == '\n') lineStarts.push_back(i + 1);
+        }
+        for (int trial = 0; trial < 40; ++trial) {
+            int plen = 3 + static_cast<int>(rnd() % 14);
+            int at = static_cast<int>(rnd() % (text.size() - static_cast<size_t>(plen)));
+            std::string needle = trial == 0 ? std::string("zzz") : text.substr(static_cast<size_t>(at), static_cast<size_t>(plen));
+            int from = trial % 2 ? static_cast<int>(rnd() % 1000) : 0;
+            int to = trial % 3 ? INT_MAX : from + static_cast<int>(rnd() % 4000);
+            int clampedTo = std::min(to, static_cast<int>(text.size()));
+            std::vector<int> expected;
+            for (size_t pos = text.find(needle, static_cast<size_t>(from));
+                 pos != std::string::npos && static_cast<int>(pos + needle.size()) <= clampedTo;
+                 pos = text.find(needle, pos + needle.size())) {
+                expected.push_back(static_cast<int>(pos));
+            }
+            std::vector<int> offsets;
+            bool linesOk = true;
+            int n = tree.findAll(needle.c_str(), static_cast<int>(needle.size()), from, to, [&](const SearchMatch& m) {
+                offsets.push_back(m.offset);
+                int line = static_cast<int>(std::upper_bound(lineStarts.begin(), lineStarts.end(), m.offset) - lineStarts.begin()) - 1;
+                if (m.line != line) linesOk = false;
+                return true;
+            });
+            if (offsets != expected || n != static_cast<int>(expected.size()) || !linesOk) {
+                std::cout << "[" << what << "] pattern \"" << needle << "\" ";
+            }
+            ASSERT(offsets == expected, "Indexed findAll matches std::string::find");
+            ASSERT(linesOk, "Indexed findAll lines");
+            if (to == INT_MAX) {
+                ASSERT_EQUAL(tree.findNext(needle.c_str(), static_cast<int>(needle.size()), from),
+                             expected.empty() ? -1 : expected[0], "Indexed findNext");
+            }
+        }
+        return true;
+    };
+    if (!check("built")) return false;
+    ASSERT(tree.getMemoryUsage().trigramIndex > 0, "Index memory is reported");
+
+    // Правки набором и удалением: индекс правится по заменённым листьям
+    for (int i = 0; i < 300; ++i) {
+        auto at = static_cast<size_t>(rnd()) % text.size();
+        if (rnd() % 3 == 0) {
+            size_t len = std::min<size_t>(1 + rnd() % 40, text.size() - at);
+            tree.erase(static_cast<int>(at), static_cast<int>(len));
+            text.erase(at, len);
+        } else {
+            std::string piece = randomPiece();
+            tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+            text.insert(at, piece);
+        }
+    }
+    if (!check("edited")) return false;
+
+    // Перестройки мимо вставки/удаления: индекс пересобирается при следующем поиске
+    tree.compact();
+    tree.moveLines(1, 3, 10);
+    char* moved = tree.toText();
+    text.assign(moved, static_cast<size_t>(tree.getRoot()->getLength()));
+    delete[] moved;
+    if (!check("rebuilt")) return false;
+
+    std::size_t indexBytes = tree.getMemoryUsage().trigramIndex;
+    tree.releaseCaches();
+    ASSERT(tree.getMemoryUsage().trigramIndex < indexBytes, "Index released under memory pressure");
+    if (!check("released")) return false;
+    tree.setTrigramIndex(false);
+    ASSERT_EQUAL(tree.getMemoryUsage().trigramIndex, static_cast<std::size_t>(0), "Index disabled");
+    return true;
+}
+
+bool testByteSetSkipping() {
+    // Редкие байты ('#', 'Q', 'q') в мелких листьях: поддеревья без них пропускаются,
+    // а совпадения, заходящие в такое поддерево краем, всё равно находятся
+    unsigned seed = 777;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    Tree tree;
+    LeafSplitPolicy policy;
+    policy.hotLeafSize = 4;
+    tree.setLeafSplitPolicy(policy);
+    std::string text;
+    for (int i = 0; i < 3000; ++i) {
+        std::string piece;
+        for (int k = 1 + static_cast<int>(rnd() % 6); k > 0; --k) piece += "abab\nc"[rnd() % 6];
+        if (rnd() % 40 == 0) piece += "#Qq"[rnd() % 3];
+        auto at = text.empty() ? 0 : static_cast<size_t>(rnd()) % text.size();
+        tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+        text.insert(at, piece);
+    }
+    ASSERT(tree.getRoot()->getBytes().has('#'), "Root summary has rare byte");
+    ASSERT(!tree.getRoot()->getBytes().has('z'), "Root summary lacks absent byte");
+
+    std::vector<int> lineStarts{0};
+    for (int i = 0; i < static_cast<int>(text.size()); ++i) {
+        if (text[static_cast<size_t>(i)] == '\n') lineStarts.push_back(i + 1);
+    }
+    std::string lower = text;
+    for (char& c : lower) c = SearchKernel::asciiLower(c);
+    for (int trial = 0; trial < 200; ++trial) {
+        // Шаблон вокруг редкого байта, чтобы он выходил за края листьев
+        size_t rare = text.find_first_of("#Qq", static_cast<size_t>(rnd()) % text.size());
+        if (rare == std::string::npos) rare = text.find_first_of("#Qq");
+        int plen = 1 + static_cast<int>(rnd() % 12);
+        int at = std::max(0, static_cast<int>(rare) - static_cast<int>(rnd() % static_cast<unsigned>(plen)));
+        plen = std::min(plen, static_cast<int>(text.size()) - at);
+        std::string needle = text.substr(static_cast<size_t>(at), static_cast<size_t>(plen));
+        bool folded = trial % 4 == 3;
+        SearchCase mode = folded ? SearchCase::ASCII : SearchCase::EXACT;
+        const std::string& hay = folded ? lower : text;
+        std::string key = needle;
+        if (folded) {
+            for (char& c : key) c = SearchKernel::asciiLower(c);
+        }
+        int from = trial % 2 ? static_cast<int>(rnd() % 2000) : 0;
+        std::vector<int> expected;
+        for (size_t pos = hay.find(key, static_cast<size_t>(from)); pos != std::string::npos;
+             pos = hay.find(key, pos + key.size())) {
+            expected.push_back(static_cast<int>(pos));
+        }
+        std::vector<int> offsets;
+        bool linesOk = true;
+        int n = tree.findAll(needle.c_str(), plen, from, INT_MAX, [&](const SearchMatch& m) {
+            offsets.push_back(m.offset);
+            int line = static_cast<int>(std::upper_bound(lineStarts.begin(), lineStarts.end(), m.offset) - lineStarts.begin()) - 1;
+            if (m.line != line) linesOk = false;
+            return true;
+        }, mode);
+        ASSERT(offsets == expected, "Pruned findAll matches std::string::find");
+        ASSERT_EQUAL(n, static_cast<int>(expected.size()), "Pruned findAll count");
+        ASSERT(linesOk, "Pruned findAll lines");
+    }
+    ASSERT_EQUAL(tree.countAll("z", 1), 0, "Absent byte");
+
+    // Сводка следует за правками
+    tree.erase(0, tree.getRoot()->getLength() / 2);
+    tree.insert(0, "zz", 2);
+    ASSERT(tree.getRoot()->getBytes().has('z'), "Summary updated by insert");
+    ASSERT_EQUAL(tree.countAll("z", 1), 2, "Inserted byte is found");
+    return true;
+}
+
+bool testReplace() {
+    unsigned seed = 4711;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    auto replaced = [](std::string text, const std::string& what, const std::string& with) {
+        for (size_t pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + with.size())) {
+            text.replace(pos, what.size(), with);
+        }
+        return text;
+    };
+    auto textOf = [](Tree& tree) {
+        if (tree.isEmpty()) return std::string();
+        char* raw = tree.toText();
+        std::string text(raw, static_cast<size_t>(tree.getRoot()->getLength()));
+        delete[] raw;
+        return text;
+    };
+    // Мелкие листья: совпадения через стыки; эталон — те же замены правками по одной
+    LeafSplitPolicy policy;
+    policy.hotLeafSize = 4;
+    const char* cases[][2] = {{"ab", "XYZ"}, {"b\nc", ""}, {"ca", "c"}, {"abab", "-\n-"}};
+    for (auto& c : cases) {
+        Tree tree;
+        Tree ref;
+        tree.setLeafSplitPolicy(policy);
+        ref.setLeafSplitPolicy(policy);
+        std::string text;
+        for (int i = 0; i < 3000; ++i) {
+            std::string piece;
+            for (int k = 1 + static_cast<int>(rnd() % 6); k > 0; --k) piece += "abab\nc"[rnd() % 6];
+            auto at = text.empty() ? 0 : static_cast<size_t>(rnd()) % text.size();
+            tree.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+            ref.insert(static_cast<int>(at), piece.c_str(), static_cast<int>(piece.size()));
+            text.insert(at, piece);
+        }
+        std::vector<int> ids;
+        std::vector<int> refIds;
+        for (int i = 0; i < 60; ++i) {
+            int at = static_cast<int>(rnd() % (text.size() + 1));
+            MarkerGravity g = rnd() % 2 ? MarkerGravity::LEFT : MarkerGravity::RIGHT;
+            ids.push_back(tree.createMarker(at, g));
+            refIds.push_back(ref.createMarker(at, g));
+        }
+        ASSERT(tree.foldLines(10, 20) >= 0, "Fold before replace");
+        ref.foldLines(10, 20);
+        tree.setTrigramIndex(true);
+        ASSERT(tree.countAll("zzz", 3) == 0, "Index built before replace");
+
+        std::string what = c[0];
+        std::string with = c[1];
+        std::vector<SearchMatch> found;
+        ref.findAll(what.c_str(), static_cast<int>(what.size()), 0, INT_MAX, [&found](const SearchMatch& m) {
+            found.push_back(m);
+            return true;
+        });
+        for (auto it = found.rbegin(); it != found.rend(); ++it) {
+            ref.erase(it->offset, it->length);
+            ref.insert(it->offset, with.c_str(), static_cast<int>(with.size()));
+        }
+        int n = tree.replaceAll(what.c_str(), static_cast<int>(what.size()), with.c_str(), static_cast<int>(with.size()));
+        ASSERT(found.size() > 64, "Batch path is exercised");
+        ASSERT_EQUAL(n, static_cast<int>(found.size()), "replaceAll count");
+        text = replaced(text, what, with);
+        ASSERT(textOf(tree) == text, "replaceAll text");
+        ASSERT(textOf(ref) == text, "Reference text");
+        bool markersOk = true;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (tree.getMarkerOffset(ids[i]) != ref.getMarkerOffset(refIds[i])) markersOk = false;
+        }
+        ASSERT(markersOk, "Markers move as with per-match edits");
+        ASSERT_EQUAL(tree.getVisibleLineCount(), ref.getVisibleLineCount(), "Fold survives replaceAll");
+        ASSERT_EQUAL(tree.getTotalLineCount(), ref.getTotalLineCount(), "Line count after replaceAll");
+        ASSERT(tree.getContentHash() == ref.getContentHash(), "Content hash after replaceAll");
+
+        // Индекс правится по заменённым листьям
+        std::string needle = text.substr(text.size() / 2, 5);
+        int expected = 0;
+        for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + needle.size())) ++expected;
+        ASSERT_EQUAL(tree.countAll(needle.c_str(), 5), expected, "Indexed search after replaceAll");
+    }
+
+    // Немного совпадений: replaceAll всё равно одна правка
+    Tree tree;
+    tree.fromText("one two one three one", 21);
+    ASSERT_EQUAL(tree.replaceNext("one", 3, "1", 1, 1), 8, "replaceNext from offset");
+    ASSERT(textOf(tree) == "one two 1 three one", "replaceNext text");
+    ASSERT_EQUAL(tree.replaceNext("zzz", 3, "1", 1, 0), -1, "replaceNext without match");
+    unsigned long version = tree.getVersion();
+    ASSERT_EQUAL(tree.replaceAll("ONE", 3, "#", 1, 0, INT_MAX, SearchCase::ASCII), 2, "replaceAll ASCII");
+    ASSERT(textOf(tree) == "# two 1 three #", "replaceAll ASCII text");
+    ASSERT_EQUAL(tree.getVersion(), version + 1, "Few matches replaced in one edit");
+    ASSERT_EQUAL(tree.replaceAll("zzz", 3, "#", 1), 0, "replaceAll without match");
+    ASSERT_EQUAL(tree.getVersion(), version + 1, "No edit without matches");
+    ASSERT_THROW(tree.replaceAll("#", 1, "x", -1), std::invalid_argument, "Negative replacement length");
+
+    // Документ целиком из совпадений
+    std::string all;
+    for (int i = 0; i < 200; ++i) all += "ab";
+    tree.fromText(all.c_str(), static_cast<int>(all.size()));
+    int cursor = tree.createMarker(100, MarkerGravity::RIGHT);
+    ASSERT_EQUAL(tree.replaceAll("ab", 2, "", 0), 200, "Replace everything");
+    ASSERT(tree.isEmpty(), "Document emptied");
+    ASSERT_EQUAL(tree.getMarkerOffset(cursor), 0, "Marker collapsed");
+    return true;
+}
+
+bool testFindLast() {
+    unsigned seed = 99;
+    auto rnd = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+    // Больше окна первого шага: поиск назад проходит несколько окон и их стыки
+    std::string text;
+    while (text.size() < 300000) text += "abAB\nbaa"[rnd() % 8];
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    std::string lower = text;
+    for (char& c : lower) c = SearchKernel::asciiLower(c);
+
+    for (int trial = 0; trial < 60; ++trial) {
+        int plen = 1 + static_cast<int>(rnd() % 6);
+        std::string needle = text.substr(rnd() % (text.size() - 8), static_cast<size_t>(plen));
+        if (trial % 10 == 0) needle = "abba\nABBA";
+        bool folded = trial % 3 == 2;
+        const std::string& hay = folded ? lower : text;
+        std::string key = needle;
+        if (folded) {
+            for (char& c : key) c = SearchKernel::asciiLower(c);
+        }
+        int from = trial % 2 ? static_cast<int>(rnd() % 1000) : 0;
+        int to = trial % 4 ? static_cast<int>(text.size()) - static_cast<int>(rnd() * 7 % 200000) : INT_MAX;
+        int clampedTo = std::min(to, static_cast<int>(text.size()));
+        int expected = -1;
+        if (clampedTo - static_cast<int>(key.size()) >= from) {
+            size_t pos = hay.rfind(key, static_cast<size_t>(clampedTo) - key.size());
+            if (pos != std::string::npos && static_cast<int>(pos) >= from) expected = static_cast<int>(pos);
+        }
+        SearchMatch m{-1, -1, 0};
+        int found = tree.findLast(needle.c_str(), static_cast<int>(needle.size()), from, to,
+                                  folded ? SearchCase::ASCII : SearchCase::EXACT, &m);
+        ASSERT_EQUAL(found, expected, "findLast matches std::string::rfind");
+        if (found >= 0) {
+            ASSERT_EQUAL(m.line, static_cast<int>(std::count(text.begin(), text.begin() + found, '\n')), "findLast line");
+            ASSERT_EQUAL(m.length, static_cast<int>(needle.size()), "findLast length");
+        }
+    }
+
+    // Свёртка Unicode: длина совпадения в байтах своя
+    Tree cyr;
+    std::string doc = "Привет мир\nпривет\nПРИВЕТ всем\nпока";
+    cyr.fromText(doc.c_str(), static_cast<int>(doc.size()));
+    std::string hello = "привет";
+    SearchMatch m{-1, -1, 0};
+    int at = cyr.findLast(hello.c_str(), static_cast<int>(hello.size()), 0, INT_MAX, SearchCase::UNICODE, &m);
+    ASSERT_EQUAL(at, static_cast<int>(doc.find("ПРИВЕТ")), "findLast Unicode case-folded");
+    ASSERT_EQUAL(m.line, 2, "findLast Unicode line");
+    at = cyr.findLast(hello.c_str(), static_cast<int>(hello.size()), 0, at, SearchCase::UNICODE);
+    ASSERT_EQUAL(at, static_cast<int>(doc.find("привет")), "findLast before previous match");
+    ASSERT_EQUAL(cyr.findLast("zzz", 3, 0, INT_MAX), -1, "findLast without match");
+    return true;
+}
+
+// Перенос блоков строк не должен наращивать глубину: склейка частей идёт по высотам
+bool testMoveLinesKeepsBalance() {
+    std::vector<std::string> model;
+    for (int i = 0; i < 20000; ++i) model.push_back("line " + std::to_string(i));
+    std::string text = joinLines(model);
+    Tree tree;
+    tree.fromText(text.c_str(), text.size());
+    // Перенос режет листья по строкам: граница — от числа листьев на момент проверки
+    auto balanced = [&tree]() {
+        std::vector<const LeafNode*> leaves;
+        collectLeaves(tree.getRoot(), leaves);
+        return treeDepth(tree.getRoot()) <= 2 * static_cast<int>(std::log2(static_cast<double>(leaves.size()))) + 2;
+    };
+    int fold = tree.foldLines(9000, 9050);
+
+    auto total = static_cast<int>(model.size());
+    const int steps = 5000;
+    for (int step = 0; step < steps; ++step) {
+        tree.moveLines(0, 1, total - 1);
+        if (step % 500 == 0) ASSERT(balanced(), "Depth must stay logarithmic while moving lines");
+    }
+    // Каждый перенос — сдвиг первых total - 1 строк на одну влево
+    std::rotate(model.begin(), model.begin() + steps % (total - 1), model.end() - 1);
+    ASSERT(balanced(), "Depth must stay logarithmic after moving lines");
+    ASSERT_EQUAL(tree.getTotalLineCount() - tree.getVisibleLineCount(), 50, "Fold must survive rebalancing");
+    ASSERT_EQUAL(tree.getFoldForLine(9000 - 5000), fold, "Fold header follows shifted lines");
+
+    char* actual = tree.toText();
+    bool same = (joinLines(model) == actual);
+    delete[] actual;
+    ASSERT(same, "Text mismatch after moving lines");
+    return true;
+}
+
 int main() {
     std::cout << "=== Starting Tree Unit Tests ===" << std::endl;
     
@@ -373,7 +2316,32 @@ int main() {
         testGetOffsetForLine,
         testFindSubstring,
         testGetTextRange,
-        testStressWithCyrillic
+        testStressWithCyrillic,
+        testDeferredReclaim,
+        testFingerLocalEdits,
+        testMarkersFollowEdits,
+        testFoldingVisibleRows,
+        testIncrementalStats,
+        testLineBlockOperations,
+        testContentHashAndDiff,
+        testLeafSplitPolicy,
+        testCompactionPreservesDocument,
+        testBackgroundRebuild,
+        testPackedColdLeaves,
+        testMemoryGovernor,
+        testTaskPool,
+        testParallelFromText,
+        testFindAll,
+        testParallelSearch,
+        testSearchKernel,
+        testRegexSearch,
+        testCaseFoldedSearch,
+        testMultiPatternSearch,
+        testTrigramIndex,
+        testByteSetSkipping,
+        testReplace,
+        testFindLast,
+        testMoveLinesKeepsBalance
     };
     
     int numTests = sizeof(testFunctions) / sizeof(testFunctions[0]);
@@ -0,0 +1,304 @@
+#include <iostream>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "Tree.h"
+#include "NodeReclaimer.h"
+#include "TreeCounters.h"
+#include "Regex.h"
+
+// Тесты границ сложности: вместо замеров времени проверяем счётчики
+// tree_lib_counters (узлы на спуске, скопированные байты, листья, шаги DFA)
+
+// Глобальные счетчики для статистики
+int total_tests = 0;
+int failed_tests = 0;
+
+// Макросы для упрощения проверок
+#define ASSERT(condition, message) do { \
+    total_tests++; \
+    if (!(condition)) { \
+        std::cerr << "[FAIL] " << message << " (" << __FILE__ << ":" << __LINE__ << ")" << std::endl; \
+        failed_tests++; \
+        return false; \
+    } \
+} while(0)
+
+#define ASSERT_EQUAL(actual, expected, message) do { \
+    total_tests++; \
+    if ((actual) != (expected)) { \
+        std::cerr << "[FAIL] " << message << " - Expected: " << (expected) << ", Actual: " << (actual) \
+                  << " (" << __FILE__ << ":" << __LINE__ << ")" << std::endl; \
+        failed_tests++; \
+        return false; \
+    } \
+} while(0)
+
+#define ASSERT_LE(actual, bound, message) do { \
+    total_tests++; \
+    if (!((actual) <= (bound))) { \
+        std::cerr << "[FAIL] " << message << " - Bound: " << (bound) << ", Actual: " << (actual) \
+                  << " (" << __FILE__ << ":" << __LINE__ << ")" << std::endl; \
+        failed_tests++; \
+        return false; \
+    } \
+} while(0)
+
+// Документ из строк ~60 байт: fromText строит сбалансированное дерево
+std::string makeDocument(int bytes) {
+    std::string text;
+    text.reserve(static_cast<size_t>(bytes) + 64);
+    for (int i = 0; static_cast<int>(text.size()) < bytes; ++i) {
+        text += "line " + std::to_string(i) + " lorem ipsum dolor sit amet consectetur\n";
+    }
+    return text;
+}
+
+// 2 * log2(число листьев) — допустимая глубина спуска
+unsigned long long descentBound(int bytes) {
+    double leaves = static_cast<double>(bytes) / (MAX_LEAF_SIZE / 2);
+    return static_cast<unsigned long long>(2.0 * std::ceil(std::log2(leaves))) + 2;
+}
+
+bool testCountersEnabled() {
+    ASSERT(TreeCounters::enabled(), "test3 must be linked against tree_lib_counters");
+    return true;
+}
+
+bool testSingleCharInsertBounds() {
+    std::string text = makeDocument(8 * 1024 * 1024);
+    auto size = static_cast<int>(text.size());
+    Tree tree;
+    tree.fromText(text.c_str(), size);
+
+    // Холодный спуск: палец стоит в другом конце документа
+    tree.getLineForOffset(0);
+    int pos = size / 2 + 17;
+    TreeCounters before = TreeCounters::snapshot();
+    tree.insert(pos, "x", 1);
+    TreeCounters cold = TreeCounters::snapshot() - before;
+    ASSERT_LE(cold.nodesVisited, descentBound(size), "Cold insert descent must be logarithmic");
+    ASSERT_LE(cold.bytesCopied, 3ull * (MAX_LEAF_SIZE + 1), "Insert copies at most one leaf (plus split)");
+    ASSERT_LE(cold.leavesCreated, 3ull, "Insert creates at most a hot piece and two edges");
+
+    // Набор на месте: спуск только внутри только что разрезанного листа
+    before = TreeCounters::snapshot();
+    tree.insert(pos + 1, "y", 1);
+    TreeCounters warm = TreeCounters::snapshot() - before;
+    ASSERT_LE(warm.nodesVisited, 3ull, "Warm insert must not descend from root");
+
+    before = TreeCounters::snapshot();
+    tree.erase(pos, 2);
+    TreeCounters backspace = TreeCounters::snapshot() - before;
+    ASSERT_LE(backspace.nodesVisited, 2ull, "Local erase must reuse the finger");
+    ASSERT_LE(backspace.bytesCopied, 2ull * MAX_LEAF_SIZE, "Local erase copies one leaf");
+    return true;
+}
+
+bool testRangeEraseBounds() {
+    std::string text = makeDocument(8 * 1024 * 1024);
+    auto size = static_cast<int>(text.size());
+    Tree tree;
+    tree.fromText(text.c_str(), size);
+
+    TreeCounters before = TreeCounters::snapshot();
+    tree.erase(size / 8, size / 2);
+    TreeCounters d = TreeCounters::snapshot() - before;
+    // Целые поддеревья уходят реклеймеру: посещаются только два граничных пути
+    ASSERT_LE(d.nodesVisited, 2 * descentBound(size), "Range erase visits two boundary paths");
+    ASSERT_LE(d.bytesCopied, 4ull * MAX_LEAF_SIZE, "Range erase copies only edge leaves");
+    return true;
+}
+
+bool testLineSpansBounds() {
+    std::string text = makeDocument(4 * 1024 * 1024);
+    auto size = static_cast<int>(text.size());
+    Tree tree;
+    tree.fromText(text.c_str(), size);
+
+    const int count = 5000;
+    TreeCounters before = TreeCounters::snapshot();
+    std::vector<LineSpan> spans = tree.getLineSpans(1000, count);
+    TreeCounters d = TreeCounters::snapshot() - before;
+    ASSERT_EQUAL(static_cast<int>(spans.size()), count, "Span count mismatch");
+
+    // Переход к соседнему листу — подъём к общему предку, в среднем O(1) узлов
+    int spannedBytes = spans.back().offset - spans.front().offset;
+    auto leaves = static_cast<unsigned long long>(spannedBytes / (MAX_LEAF_SIZE / 2) + 2);
+    ASSERT_LE(d.nodesVisited, 2 * descentBound(size) + 4 * leaves, "Spans must walk leaves, not descend per line");
+    return true;
+}
+
+bool testSearchSkipsSubtreesBounds() {
+    // Меньше PARALLEL_SEARCH_GRAIN: поиск идёт одним обходом
+    std::string text = makeDocument(2 * 1024 * 1024);
+    auto size = static_cast<int>(text.size());
+    Tree tree;
+    tree.fromText(text.c_str(), size);
+    const std::string needle = "#tag_42";
+    tree.insert(size / 2, needle.c_str(), static_cast<int>(needle.size()));
+
+    // '#' есть в одном листе: остальные поддеревья отсекает сводка байтов
+    TreeCounters before = TreeCounters::snapshot();
+    int found = tree.findNext(needle.c_str(), static_cast<int>(needle.size()), 0);
+    TreeCounters d = TreeCounters::snapshot() - before;
+    ASSERT_EQUAL(found, size / 2, "Rare pattern found");
+    ASSERT_LE(d.nodesVisited, 4 * descentBound(size), "Search must skip subtrees without pattern bytes");
+
+    before = TreeCounters::snapshot();
+    int count = tree.countAll("Lorem", 5);
+    d = TreeCounters::snapshot() - before;
+    ASSERT_EQUAL(count, 0, "Absent byte: no matches");
+    ASSERT_LE(d.nodesVisited, 1ull, "Root summary answers alone");
+    return true;
+}
+
+bool testReplaceAllBounds() {
+    std::string text = makeDocument(2 * 1024 * 1024);
+    auto size = static_cast<int>(text.size());
+    Tree tree;
+    tree.fromText(text.c_str(), size);
+
+    // Совпадение в каждой строке: правками по одной это копия листа на каждое
+    TreeCounters before = TreeCounters::snapshot();
+    int n = tree.replaceAll("ipsum", 5, "IPSUM!", 6);
+    TreeCounters d = TreeCounters::snapshot() - before;
+    ASSERT_LE(static_cast<unsigned long long>(size / 80), static_cast<unsigned long long>(n), "Match in every line");
+    ASSERT_LE(d.bytesCopied, 2ull * static_cast<unsigned long long>(size), "replaceAll copies the text once");
+    ASSERT_EQUAL(tree.getRoot()->getLength(), size + n, "Length after replaceAll");
+    return true;
+}
+
+bool testRegexLongLineBounds() {
+    // Одна длинная строка без '\n' (минифицированный код, base64): совпадение только в конце.
+    // Перебор начал с anchored-прогоном от каждого — O(len^2) шагов DFA
+    const int len = 80 * 1024;
+    std::string text(static_cast<size_t>(len), 'a');
+    text += " k=1";
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    Regex re("\\w+=");
+
+    std::vector<SearchMatch> found;
+    TreeCounters before = TreeCounters::snapshot();
+    tree.findAllRegex(re, 0, INT_MAX, [&found](const SearchMatch& m) {
+        found.push_back(m);
+        return true;
+    });
+    TreeCounters d = TreeCounters::snapshot() - before;
+    ASSERT_EQUAL(static_cast<int>(found.size()), 1, "One match at the end of the line");
+    ASSERT_EQUAL(found[0].offset, len + 1, "Match offset");
+    ASSERT_EQUAL(found[0].length, 2, "Match length");
+    ASSERT_LE(d.dfaSteps, 4ull * text.size(), "Leftmost start must be found in linear time");
+
+    // Совпадения по всей строке: каждый байт — константа шагов
+    std::string pairs;
+    for (int i = 0; i < 20000; ++i) pairs += "k" + std::to_string(i % 10) + "=v ";
+    Tree many;
+    many.fromText(pairs.c_str(), static_cast<int>(pairs.size()));
+    before = TreeCounters::snapshot();
+    int count = many.findAllRegex(re, 0, INT_MAX, [](const SearchMatch&) { return true; });
+    d = TreeCounters::snapshot() - before;
+    ASSERT_EQUAL(count, 20000, "Match in every pair");
+    ASSERT_LE(d.dfaSteps, 4ull * pairs.size(), "Many matches in one line stay linear");
+    return true;
+}
+
+bool testLeafLifetimeBalance() {
+    NodeReclaimer::instance().drain();
+    TreeCounters before = TreeCounters::snapshot();
+    {
+        std::string text = makeDocument(1024 * 1024);
+        Tree tree;
+        tree.fromText(text.c_str(), static_cast<int>(text.size()));
+        for (int i = 0; i < 2000; ++i) tree.insert((i * 7919) % 100000, "abc\n", 4);
+        tree.erase(1000, 300000);
+        tree.moveLines(10, 500, 4000);
+    }
+    NodeReclaimer::instance().drain();
+    TreeCounters d = TreeCounters::snapshot() - before;
+    ASSERT(d.leavesCreated > 0, "Leaves must be counted");
+    ASSERT_EQUAL(d.leavesCreated, d.leavesDestroyed, "Every created leaf must be destroyed");
+    return true;
+}
+
+bool testHeatAdaptiveLeaves() {
+    // Вырожденное дерево: документ набран кусками в конец
+    std::string text = makeDocument(4 * 1024 * 1024);
+    auto size = static_cast<int>(text.size());
+    Tree tree;
+    for (int pos = 0; pos < size; pos += 4000) {
+        tree.insert(pos, text.c_str() + pos, std::min(4000, size - pos));
+    }
+
+    // Уплотнение склеивает холодные листья и балансирует дерево
+    ASSERT(tree.compact() > 0, "Compaction must merge cold leaves");
+    ASSERT_EQUAL(tree.compact(), 0, "Second compaction without edits is a no-op");
+    const LeafSplitPolicy& policy = tree.getLeafSplitPolicy();
+    double bigLeaves = static_cast<double>(size) / (policy.coldLeafSize / 2);
+    auto bound = static_cast<unsigned long long>(2.0 * std::ceil(std::log2(bigLeaves))) + 4;
+
+    tree.getLineForOffset(0);
+    int pos = size / 3 + 5;
+    TreeCounters before = TreeCounters::snapshot();
+    tree.insert(pos, "x", 1);
+    TreeCounters first = TreeCounters::snapshot() - before;
+    ASSERT_LE(first.nodesVisited, bound, "Compacted tree must be balanced");
+    ASSERT_LE(first.bytesCopied, 2ull * (policy.coldLeafSize + 1), "First edit rewrites one cold leaf");
+
+    // Следующие нажатия переписывают только горячий кусок, а не 64 КБ лист
+    unsigned long long worst = 0;
+    for (int i = 1; i <= 200; ++i) {
+        before = TreeCounters::snapshot();
+        tree.insert(pos + i, "y", 1);
+        TreeCounters d = TreeCounters::snapshot() - before;
+        worst = std::max(worst, d.bytesCopied);
+    }
+    ASSERT_LE(worst, 4ull * (policy.hotLeafSize + 1), "Keystroke copies only the hot piece");
+
+    text.insert(static_cast<size_t>(pos), "x" + std::string(200, 'y'));
+    char* actual = tree.toText();
+    bool same = (text == actual);
+    delete[] actual;
+    ASSERT(same, "Text mismatch after hot edits");
+    return true;
+}
+
+int main() {
+    std::cout << "=== Starting Tree Counter Tests ===" << std::endl;
+
+    bool (*testFunctions[])() = {
+        testCountersEnabled,
+        testSingleCharInsertBounds,
+        testRangeEraseBounds,
+        testLineSpansBounds,
+        testSearchSkipsSubtreesBounds,
+        testReplaceAllBounds,
+        testRegexLongLineBounds,
+        testLeafLifetimeBalance,
+        testHeatAdaptiveLeaves
+    };
+
+    int numTests = sizeof(testFunctions) / sizeof(testFunctions[0]);
+    total_tests = 0;
+    failed_tests = 0;
+
+    for (int i = 0; i < numTests; i++) {
+        std::cout << "Running test " << (i+1) << "/" << numTests << ": ";
+        bool result = testFunctions[i]();
+        if (result) {
+            std::cout << "PASSED" << std::endl;
+        } else {
+            std::cout << "FAILED" << std::endl;
+        }
+    }
+
+    std::cout << "\n=== Test Results ===" << std::endl;
+    std::cout << "Total tests: " << total_tests << std::endl;
+    std::cout << "Passed: " << (total_tests - failed_tests) << std::endl;
+    std::cout << "Failed: " << failed_tests << std::endl;
+
+    return failed_tests == 0 ? 0 : 1;
+}